@@ -194,4 +194,104 @@ typedef struct matchpdict_buf {
 	MatchBuf matches;
 } MatchPDictBuf;
 
+
+/*
+ * The WFABuf struct holds the wavefronts computed by the wavefront alignment
+ * engine (see align_wfa.c) and the edit operations of the last alignment.
+ * Its memory is allocated with R_alloc() and is reused from one alignment to
+ * the next. When no traceback is needed, only the last 'nslot' wavefronts are
+ * kept: the wavefront of score s is in slot s % nslot.
+ */
+typedef struct wfa_buf {
+	int *offsets;     /* the M, I and D wavefronts of all the scores */
+	long offsets_maxlen;
+	long *base;       /* start of each wavefront in 'offsets' */
+	int *lo;          /* lowest diagonal of each wavefront */
+	int *hi;          /* highest diagonal of each wavefront */
+	int max_nscore;
+	int nslot;        /* 0 if the wavefronts of all the scores are kept */
+	long slot_len;    /* length of a slot in 'offsets' when 'nslot' != 0 */
+	char *ops;        /* 'M' (match/mismatch), 'I' (insertion), 'D' (deletion) */
+	int ops_maxlen;
+	int nops;
+} WFABuf;
+
+
+/*
+ * The LevenshteinBuf struct holds the pattern match masks and the DP column
+ * of the bit-parallel Levenshtein distance engine (see align_levenshtein.c).
+ */
+typedef struct levenshtein_buf {
+	int nclass;     /* nb of letter classes (letters that are equal) */
+	int max_nblock; /* max nb of blocks (i.e. of BitWords) per pattern */
+	BitWord *peq;   /* nclass x max_nblock pattern match masks */
+	BitWord *Pv;    /* positive vertical deltas (1 BitWord per block) */
+	BitWord *Mv;    /* negative vertical deltas (1 BitWord per block) */
+	int *score;     /* score of the last row of each block */
+
+	/* The current pattern. Set by _set_levenshtein_pattern(). */
+	int P_length;
+	int nblock;
+} LevenshteinBuf;
+
+
+/*
+ * The XStringSetArena struct is used to load strings of unknown lengths in
+ * a single pass (see XStringSet_class.c). The string data is appended to a
+ * list of chunks that are never moved or reallocated, and is copied only
+ * once to the final XStringSet object.
+ * The arena is grown with malloc()/realloc() and doesn't use the R API so
+ * several arenas can be filled concurrently by worker threads. It must be
+ * freed with _free_XStringSetArena(), including when an R error is raised
+ * while it's alive (see XStringSet_class.c).
+ */
+typedef struct xstringset_arena {
+	int nelt;              /* nb of strings */
+	int max_nelt;
+	int *width;            /* 1 elt per string */
+	int nchunk;
+	int max_nchunk;
+	char **chunk_ptr;
+	size_t *chunk_nelt;    /* nb of bytes used in each chunk */
+	size_t chunk_buflength; /* size of the last chunk */
+	const char *errmsg;    /* set when the arena cannot grow anymore */
+} XStringSetArena;
+
+/*
+ * The BGZFreader struct is used to read a BGZF file (i.e. a gzip file made
+ * of independent compressed blocks of at most 64 KB, like the files produced
+ * by bgzip) by batches of blocks that are inflated in parallel (see
+ * BGZF_utils.c). A position in the file is a virtual offset: the offset of
+ * a block in the compressed file shifted 16 bits to the left, plus the
+ * offset in the uncompressed block.
+ * Like XStringSetArena, the reader doesn't use the R API once opened and
+ * reports errors thru its 'errmsg' member.
+ */
+typedef struct bgzf_reader {
+	FILE *file;
+	int nthreads;          /* nb of threads used to inflate a batch */
+	int max_nblock;        /* max nb of blocks per batch */
+	int nblock;            /* nb of blocks in the current batch */
+	long long int *block_coffset; /* offset of each block in the file */
+	int *block_cstart;     /* start of the deflated data in 'cbuf' */
+	int *block_csize;      /* size of the deflated data */
+	int *block_uoffset;    /* nblock + 1 offsets in 'ubuf' */
+	long long int next_coffset; /* offset of the block after the batch */
+	unsigned char *cbuf;   /* compressed batch */
+	char *ubuf;            /* uncompressed batch */
+	int ubuf_nelt;
+	int pos;               /* current position in 'ubuf' */
+	int cur_block;         /* block containing 'pos' */
+	int at_eof;
+	const char *errmsg;
+} BGZFreader;
+
+/*
+ * The BGZFwriter struct is used to write a file by big batches, compressed
+ * in BGZF format or not. The batches are written by a background thread
+ * and their blocks are deflated in parallel. The struct is only defined in
+ * BGZF_utils.c.
+ */
+typedef struct bgzf_writer BGZFwriter;
+
 #endif
@@ -0,0 +1,783 @@
+/****************************************************************************
+ *                       Reading and writing BGZF files                     *
+ ****************************************************************************/
+#include "Biostrings.h"
+#include "XVector_interface.h"
+
+#include <stdlib.h>  /* for malloc(), free() */
+#include <stdio.h>   /* for fopen(), fwrite(), remove() */
+#include <zlib.h>
+#include <pthread.h>
+
+
+/*
+ * A BGZF file is a series of gzip members (blocks) of at most 64 KB each,
+ * compressed or uncompressed. Each block has a gzip header with a "BC" extra
+ * subfield giving the size of the compressed block (minus 1), and the gzip
+ * footer gives the size of the uncompressed block. So the blocks can be
+ * located without inflating them, and then inflated independently of each
+ * other. See the SAM/BAM format specification for the details.
+ *
+ * The BGZFreader reads the file by batches of 'max_nblock' consecutive
+ * blocks: the compressed batch is read in one go, then its blocks are
+ * inflated in parallel into a single buffer. The lines of the uncompressed
+ * data are returned by _BGZFreader_gets() like filexp_gets() would return
+ * them. _BGZFreader_tell() and _BGZFreader_seek() work with virtual offsets
+ * so, unlike filexp_seek() on a gzip file, seeking doesn't require to
+ * inflate the file from its beginning.
+ *
+ * The BGZFwriter works the other way around: the data written to it is
+ * accumulated in a batch of 'max_nblock' blocks, then the blocks of the
+ * batch are deflated in parallel and written by a background thread while
+ * the next batch is filled. A BGZF file being a valid gzip file, the output
+ * can be read by any gzip reader.
+ */
+
+#define BGZF_MAX_BLOCK_SIZE 65536
+#define BGZF_NBLOCK_PER_THREAD 16
+
+/* Sizes of the fixed part of the gzip header and of the gzip footer. */
+#define GZIP_HEADER_SIZE 12
+#define GZIP_FOOTER_SIZE 8
+
+static unsigned int get_le16(const unsigned char *p)
+{
+	return (unsigned int) p[0] | (unsigned int) p[1] << 8;
+}
+
+static unsigned long get_le32(const unsigned char *p)
+{
+	return (unsigned long) p[0] | (unsigned long) p[1] << 8 |
+	       (unsigned long) p[2] << 16 | (unsigned long) p[3] << 24;
+}
+
+/*
+ * Returns the size of the BGZF block starting at 'p', 0 if the 'n' bytes
+ * at 'p' don't contain the full header of the block, or -1 if 'p' doesn't
+ * point to a valid BGZF block header. The size of the extra field is
+ * stored in '*xlen'.
+ */
+static int get_BGZF_block_size(const unsigned char *p, size_t n, int *xlen)
+{
+	int i, slen, bsize;
+
+	if (n < GZIP_HEADER_SIZE)
+		return 0;
+	/* gzip magic, deflate method and FEXTRA flag */
+	if (p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || (p[3] & 4) == 0)
+		return -1;
+	*xlen = get_le16(p + 10);
+	if (n < (size_t) (GZIP_HEADER_SIZE + *xlen))
+		return 0;
+	for (i = 0; i + 4 <= *xlen; i += 4 + slen) {
+		slen = get_le16(p + GZIP_HEADER_SIZE + i + 2);
+		if (p[GZIP_HEADER_SIZE + i] != 'B'
+		 || p[GZIP_HEADER_SIZE + i + 1] != 'C')
+			continue;
+		if (slen != 2 || i + 6 > *xlen)
+			return -1;
+		bsize = get_le16(p + GZIP_HEADER_SIZE + i + 4) + 1;
+		if (bsize < GZIP_HEADER_SIZE + *xlen + GZIP_FOOTER_SIZE)
+			return -1;
+		return bsize;
+	}
+	return -1;
+}
+
+/* Returns 0 if the block was successfully inflated and checked. */
+static int inflate_BGZF_block(const unsigned char *src, int src_len,
+		char *dest, int dest_len, unsigned long crc)
+{
+	z_stream zs;
+	int ret;
+
+	memset(&zs, 0, sizeof(z_stream));
+	if (inflateInit2(&zs, -15) != Z_OK)  /* raw deflate data */
+		return -1;
+	zs.next_in = (Bytef *) src;
+	zs.avail_in = (uInt) src_len;
+	zs.next_out = (Bytef *) dest;
+	zs.avail_out = (uInt) dest_len;
+	ret = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+	if (ret != Z_STREAM_END || zs.total_out != (uLong) dest_len)
+		return -1;
+	if (crc32(0L, (const Bytef *) dest, (uInt) dest_len) != crc)
+		return -1;
+	return 0;
+}
+
+/*
+ * Reads and inflates the batch of blocks starting at offset 'coffset' in
+ * the file. Returns -1 on error (with 'reader->errmsg' set) and 0 otherwise.
+ * Reaching the end of the file is not an error: it sets 'reader->at_eof'
+ * and leaves the batch empty.
+ */
+static int load_BGZF_batch(BGZFreader *reader, long long int coffset)
+{
+	size_t n, off;
+	int k, bsize, xlen, nerror;
+	unsigned long isize;
+	const unsigned char *block;
+
+	reader->nblock = reader->ubuf_nelt = reader->pos = 0;
+	reader->cur_block = 0;
+	reader->block_uoffset[0] = 0;
+	reader->next_coffset = coffset;
+	if (_seek_file(reader->file, coffset) != 0) {
+		reader->errmsg = "seek error";
+		return -1;
+	}
+	n = fread(reader->cbuf, 1,
+		  (size_t) reader->max_nblock * BGZF_MAX_BLOCK_SIZE,
+		  reader->file);
+	if (ferror(reader->file)) {
+		reader->errmsg = "read error";
+		return -1;
+	}
+	if (n == 0) {
+		reader->at_eof = 1;
+		return 0;
+	}
+	reader->at_eof = 0;
+	for (k = off = 0; k < reader->max_nblock && off < n; k++) {
+		block = reader->cbuf + off;
+		bsize = get_BGZF_block_size(block, n - off, &xlen);
+		if (bsize == -1) {
+			reader->errmsg = "invalid BGZF block header";
+			return -1;
+		}
+		if (bsize == 0 || off + bsize > n) {
+			/* A batch is always big enough to hold a block so
+			   an incomplete 1st block means a truncated file. */
+			if (k == 0) {
+				reader->errmsg = "truncated BGZF file";
+				return -1;
+			}
+			break;
+		}
+		isize = get_le32(block + bsize - 4);
+		if (isize > BGZF_MAX_BLOCK_SIZE) {
+			reader->errmsg = "invalid BGZF block footer";
+			return -1;
+		}
+		reader->block_coffset[k] = coffset + (long long int) off;
+		reader->block_cstart[k] = (int) off + GZIP_HEADER_SIZE + xlen;
+		reader->block_csize[k] = bsize - GZIP_HEADER_SIZE - xlen -
+					 GZIP_FOOTER_SIZE;
+		reader->block_uoffset[k] = reader->ubuf_nelt;
+		reader->ubuf_nelt += (int) isize;
+		off += bsize;
+	}
+	reader->nblock = k;
+	reader->block_uoffset[k] = reader->ubuf_nelt;
+	reader->next_coffset = coffset + (long long int) off;
+	nerror = 0;
+	#pragma omp parallel for num_threads(reader->nthreads) \
+		schedule(static) reduction(+:nerror)
+	for (k = 0; k < reader->nblock; k++) {
+		const unsigned char *cdata;
+		int usize;
+
+		cdata = reader->cbuf + reader->block_cstart[k];
+		usize = reader->block_uoffset[k + 1] -
+			reader->block_uoffset[k];
+		nerror += inflate_BGZF_block(cdata, reader->block_csize[k],
+				reader->ubuf + reader->block_uoffset[k], usize,
+				get_le32(cdata + reader->block_csize[k])) != 0;
+	}
+	if (nerror != 0) {
+		reader->errmsg = "corrupted BGZF block";
+		return -1;
+	}
+	return 0;
+}
+
+
+/****************************************************************************
+ * The reader functions below don't use the R API so several readers can be
+ * used concurrently by worker threads (1 reader per thread). They never raise
+ * an error: they return -1 and set 'reader->errmsg' instead.
+ */
+
+/*
+ * Same interface as filexp_gets(): reads a line (or the first
+ * 'buf_size' - 1 bytes of a line) and returns 1, or returns 0 at the end of
+ * the file.
+ */
+int _BGZFreader_gets(BGZFreader *reader, char *buf, int buf_size,
+		int *EOL_in_buf)
+{
+	int n, m;
+	const char *src, *eol;
+
+	if (reader->errmsg != NULL)
+		return -1;
+	n = 0;
+	while (n < buf_size - 1) {
+		if (reader->pos == reader->ubuf_nelt) {
+			if (reader->at_eof)
+				break;
+			if (load_BGZF_batch(reader, reader->next_coffset) != 0)
+				return -1;
+			continue;
+		}
+		src = reader->ubuf + reader->pos;
+		m = reader->ubuf_nelt - reader->pos;
+		if (m > buf_size - 1 - n)
+			m = buf_size - 1 - n;
+		eol = memchr(src, '\n', m);
+		if (eol != NULL)
+			m = eol - src + 1;
+		memcpy(buf + n, src, m);
+		reader->pos += m;
+		n += m;
+		if (eol != NULL)
+			break;
+	}
+	buf[n] = '\0';
+	if (n == 0)
+		return 0;
+	*EOL_in_buf = n < buf_size - 1 || buf[n - 1] == '\n';
+	return 1;
+}
+
+/* Returns the virtual offset of the current position. */
+long long int _BGZFreader_tell(BGZFreader *reader)
+{
+	int k;
+
+	k = reader->cur_block;
+	while (k < reader->nblock && reader->pos >= reader->block_uoffset[k + 1])
+		k++;
+	reader->cur_block = k;
+	if (k == reader->nblock)
+		return reader->next_coffset << 16;
+	return reader->block_coffset[k] << 16 |
+	       (reader->pos - reader->block_uoffset[k]);
+}
+
+/* 'voffset' must be a virtual offset returned by _BGZFreader_tell(). */
+int _BGZFreader_seek(BGZFreader *reader, long long int voffset)
+{
+	long long int coffset;
+	int upos, k1, k2, k;
+
+	coffset = voffset >> 16;
+	upos = (int) (voffset & 0xffff);
+	/* Binary search of the block in the current batch. */
+	k1 = 0;
+	k2 = reader->nblock;
+	while (k1 < k2) {
+		k = (k1 + k2) / 2;
+		if (reader->block_coffset[k] < coffset)
+			k1 = k + 1;
+		else
+			k2 = k;
+	}
+	if (k1 == reader->nblock || reader->block_coffset[k1] != coffset) {
+		if (load_BGZF_batch(reader, coffset) != 0)
+			return -1;
+		k1 = 0;
+	}
+	if (reader->nblock == 0) {
+		if (upos == 0)
+			return 0;
+	} else if (upos <= reader->block_uoffset[k1 + 1] -
+			  reader->block_uoffset[k1]) {
+		reader->pos = reader->block_uoffset[k1] + upos;
+		reader->cur_block = k1;
+		return 0;
+	}
+	reader->errmsg = "invalid virtual offset";
+	return -1;
+}
+
+
+/****************************************************************************
+ * Opening/closing a BGZFreader on a "File External Pointer".
+ *
+ * These functions use the R API so they must be called by the main thread.
+ * The position of the reader is saved in the "bgzf_voffset" attribute of
+ * 'filexp' when the reader is closed, and restored when a reader is opened
+ * on the same 'filexp'. This allows reading a BGZF file by chunk without
+ * seeking the gzip stream behind 'filexp' (which is costly and gets costlier
+ * as we advance in the file).
+ */
+
+static SEXP bgzf_voffset_symbol = NULL;
+
+static const char *get_expath(SEXP filexp)
+{
+	SEXP expath;
+
+	expath = getAttrib(filexp, install("expath"));
+	if (!IS_CHARACTER(expath) || LENGTH(expath) != 1
+	 || STRING_ELT(expath, 0) == NA_STRING)
+		return NULL;
+	return CHAR(STRING_ELT(expath, 0));
+}
+
+static void free_BGZFreader(BGZFreader *reader)
+{
+	if (reader->file != NULL)
+		fclose(reader->file);
+	free(reader->block_coffset);
+	free(reader->block_cstart);
+	free(reader->block_csize);
+	free(reader->block_uoffset);
+	free(reader->cbuf);
+	free(reader->ubuf);
+	free(reader);
+	return;
+}
+
+static BGZFreader *new_BGZFreader(FILE *file, int nthreads)
+{
+	BGZFreader *reader;
+	size_t buflength;
+
+	reader = (BGZFreader *) calloc(1, sizeof(BGZFreader));
+	if (reader == NULL)
+		return NULL;
+	reader->nthreads = nthreads;
+	reader->max_nblock = BGZF_NBLOCK_PER_THREAD * nthreads;
+	buflength = (size_t) reader->max_nblock * BGZF_MAX_BLOCK_SIZE;
+	reader->block_coffset = (long long int *)
+		malloc(reader->max_nblock * sizeof(long long int));
+	reader->block_cstart = (int *) malloc(reader->max_nblock * sizeof(int));
+	reader->block_csize = (int *) malloc(reader->max_nblock * sizeof(int));
+	reader->block_uoffset = (int *)
+		malloc((reader->max_nblock + 1) * sizeof(int));
+	reader->cbuf = (unsigned char *) malloc(buflength);
+	reader->ubuf = (char *) malloc(buflength);
+	if (reader->block_coffset == NULL || reader->block_cstart == NULL
+	 || reader->block_csize == NULL || reader->block_uoffset == NULL
+	 || reader->cbuf == NULL || reader->ubuf == NULL) {
+		/* 'file' is closed by the caller */
+		free_BGZFreader(reader);
+		return NULL;
+	}
+	reader->file = file;
+	reader->block_uoffset[0] = 0;
+	return reader;
+}
+
+/*
+ * Returns NULL if the file behind 'filexp' is not a BGZF file, or if it has
+ * already been read with filexp_gets() (the virtual offset of the current
+ * position is unknown in that case).
+ */
+BGZFreader *_open_BGZFreader(SEXP filexp, int nthreads)
+{
+	const char *path;
+	FILE *file;
+	unsigned char header[GZIP_HEADER_SIZE + 256];
+	size_t n;
+	int xlen;
+	SEXP voffset;
+	BGZFreader *reader;
+
+	path = get_expath(filexp);
+	if (path == NULL)
+		return NULL;
+	file = fopen(path, "rb");
+	if (file == NULL)
+		return NULL;
+	n = fread(header, 1, sizeof(header), file);
+	if (get_BGZF_block_size(header, n, &xlen) <= 0) {
+		fclose(file);
+		return NULL;
+	}
+	INIT_STATIC_SYMBOL(bgzf_voffset)
+	voffset = getAttrib(filexp, bgzf_voffset_symbol);
+	if (voffset == R_NilValue && filexp_tell(filexp) != 0) {
+		fclose(file);
+		return NULL;
+	}
+	reader = new_BGZFreader(file, nthreads);
+	if (reader == NULL) {
+		fclose(file);
+		return NULL;
+	}
+	if (voffset != R_NilValue)
+		_BGZFreader_seek(reader, (long long int) REAL(voffset)[0]);
+	return reader;
+}
+
+/*
+ * Saves 'voffset' as the position to restore the next time a reader is
+ * opened on 'filexp'.
+ */
+void _close_BGZFreader(SEXP filexp, BGZFreader *reader, long long int voffset)
+{
+	INIT_STATIC_SYMBOL(bgzf_voffset)
+	setAttrib(filexp, bgzf_voffset_symbol, ScalarReal((double) voffset));
+	free_BGZFreader(reader);
+	return;
+}
+
+
+/****************************************************************************
+ * Writing BGZF files.
+ *
+ * Like the BGZFreader, the BGZFwriter doesn't use the R API once opened.
+ * A batch is written by a background thread (and its blocks are deflated
+ * by 'nthreads' OpenMP threads) while the main thread fills the next one.
+ * The main thread reports its errors thru 'errmsg' and the background
+ * thread thru 'batch_errmsg', which is only looked at after the thread was
+ * joined. Once an error occurred, the data written to the writer is
+ * discarded and the error is returned by _close_BGZFwriter().
+ */
+
+/* The uncompressed size of a full block. Leaves room for the header and
+   footer of the block if the data is not compressible. */
+#define BGZF_BLOCK_DATA_SIZE 0xff00
+
+/* Size of the gzip header of a BGZF block (i.e. with the "BC" subfield). */
+#define BGZF_HEADER_SIZE (GZIP_HEADER_SIZE + 6)
+
+struct bgzf_writer {
+	FILE *file;
+	int level;             /* compression level, or -1 for no compression */
+	int nthreads;          /* nb of threads used to deflate a batch */
+	int max_nblock;        /* max nb of blocks per batch */
+	size_t ubuf_size;      /* max_nblock * BGZF_BLOCK_DATA_SIZE */
+	char *ubuf;            /* batch being filled */
+	size_t ubuf_nelt;
+	char *ubuf2;           /* batch being written by the background thread */
+	size_t ubuf2_nelt;
+	unsigned char *cbuf;   /* compressed batch (1 slot of 64 KB per block) */
+	int *block_csize;
+	int thread_is_running;
+	pthread_t thread;
+	const char *errmsg;
+	const char *batch_errmsg;
+};
+
+static const unsigned char BGZF_EOF_block[28] = {
+	0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff,
+	0x06, 0x00, 0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+static void put_le16(unsigned char *p, unsigned int x)
+{
+	p[0] = (unsigned char) (x & 0xff);
+	p[1] = (unsigned char) (x >> 8 & 0xff);
+	return;
+}
+
+static void put_le32(unsigned char *p, unsigned long x)
+{
+	put_le16(p, (unsigned int) (x & 0xffff));
+	put_le16(p + 2, (unsigned int) (x >> 16 & 0xffff));
+	return;
+}
+
+/*
+ * Deflates the 'src_len' bytes at 'src' (src_len <= BGZF_BLOCK_DATA_SIZE)
+ * into a BGZF block of at most BGZF_MAX_BLOCK_SIZE bytes at 'dest'.
+ * Returns the size of the block or -1 on error.
+ */
+static int deflate_BGZF_block(const char *src, int src_len,
+		unsigned char *dest, int level)
+{
+	z_stream zs;
+	int ret, bsize;
+
+	memset(&zs, 0, sizeof(z_stream));
+	if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK)  /* raw deflate data */
+		return -1;
+	zs.next_in = (Bytef *) src;
+	zs.avail_in = (uInt) src_len;
+	zs.next_out = (Bytef *) dest + BGZF_HEADER_SIZE;
+	zs.avail_out = (uInt) (BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE -
+			       GZIP_FOOTER_SIZE);
+	ret = deflate(&zs, Z_FINISH);
+	deflateEnd(&zs);
+	if (ret != Z_STREAM_END)
+		return -1;
+	bsize = BGZF_HEADER_SIZE + (int) zs.total_out + GZIP_FOOTER_SIZE;
+	/* The header is the same as the header of the EOF block except
+	   for BSIZE. */
+	memcpy(dest, BGZF_EOF_block, BGZF_HEADER_SIZE);
+	put_le16(dest + BGZF_HEADER_SIZE - 2, (unsigned int) (bsize - 1));
+	put_le32(dest + bsize - GZIP_FOOTER_SIZE,
+		 crc32(0L, (const Bytef *) src, (uInt) src_len));
+	put_le32(dest + bsize - 4, (unsigned long) src_len);
+	return bsize;
+}
+
+/* Called by the background thread (or by the main thread if the background
+   thread could not be created). */
+static void write_BGZF_batch(BGZFwriter *writer)
+{
+	size_t n;
+	int nblock, k, nerror;
+
+	n = writer->ubuf2_nelt;
+	if (writer->level < 0) {
+		if (fwrite(writer->ubuf2, 1, n, writer->file) != n)
+			writer->batch_errmsg = "write error";
+		return;
+	}
+	nblock = (int) ((n + BGZF_BLOCK_DATA_SIZE - 1) / BGZF_BLOCK_DATA_SIZE);
+	nerror = 0;
+	#pragma omp parallel for num_threads(writer->nthreads) \
+		schedule(static) reduction(+:nerror)
+	for (k = 0; k < nblock; k++) {
+		size_t offset;
+		int usize;
+
+		offset = (size_t) k * BGZF_BLOCK_DATA_SIZE;
+		usize = n - offset < BGZF_BLOCK_DATA_SIZE ?
+			(int) (n - offset) : BGZF_BLOCK_DATA_SIZE;
+		writer->block_csize[k] = deflate_BGZF_block(
+				writer->ubuf2 + offset, usize,
+				writer->cbuf + (size_t) k * BGZF_MAX_BLOCK_SIZE,
+				writer->level);
+		nerror += writer->block_csize[k] < 0;
+	}
+	if (nerror != 0) {
+		writer->batch_errmsg = "compression error";
+		return;
+	}
+	for (k = 0; k < nblock; k++) {
+		if (fwrite(writer->cbuf + (size_t) k * BGZF_MAX_BLOCK_SIZE, 1,
+			   (size_t) writer->block_csize[k], writer->file)
+		    != (size_t) writer->block_csize[k])
+		{
+			writer->batch_errmsg = "write error";
+			return;
+		}
+	}
+	return;
+}
+
+static void *BGZF_write_thread(void *writer)
+{
+	write_BGZF_batch((BGZFwriter *) writer);
+	return NULL;
+}
+
+static void wait_for_BGZF_batch(BGZFwriter *writer)
+{
+	if (writer->thread_is_running) {
+		pthread_join(writer->thread, NULL);
+		writer->thread_is_running = 0;
+	}
+	if (writer->errmsg == NULL)
+		writer->errmsg = writer->batch_errmsg;
+	return;
+}
+
+/* Hands over the current batch to the background thread. Falls back to
+   writing it directly if the thread cannot be created. */
+static void flush_BGZFwriter(BGZFwriter *writer)
+{
+	char *tmp;
+
+	wait_for_BGZF_batch(writer);
+	if (writer->errmsg != NULL || writer->ubuf_nelt == 0)
+		return;
+	tmp = writer->ubuf2;
+	writer->ubuf2 = writer->ubuf;
+	writer->ubuf2_nelt = writer->ubuf_nelt;
+	writer->ubuf = tmp;
+	writer->ubuf_nelt = 0;
+	if (pthread_create(&(writer->thread), NULL,
+			   BGZF_write_thread, writer) == 0)
+		writer->thread_is_running = 1;
+	else
+		write_BGZF_batch(writer);
+	return;
+}
+
+/* Returns the room left in the current batch (flushing it if it's full),
+   or 0 after an error. */
+static size_t get_BGZFwriter_room(BGZFwriter *writer)
+{
+	if (writer->errmsg == NULL && writer->ubuf_nelt == writer->ubuf_size)
+		flush_BGZFwriter(writer);
+	if (writer->errmsg != NULL)
+		return 0;
+	return writer->ubuf_size - writer->ubuf_nelt;
+}
+
+void _BGZFwriter_write(BGZFwriter *writer, const char *src, size_t n)
+{
+	size_t m;
+
+	while (n != 0 && (m = get_BGZFwriter_room(writer)) != 0) {
+		if (m > n)
+			m = n;
+		memcpy(writer->ubuf + writer->ubuf_nelt, src, m);
+		writer->ubuf_nelt += m;
+		src += m;
+		n -= m;
+	}
+	return;
+}
+
+/* Like _BGZFwriter_write() but the bytes are translated thru 'lkup'. */
+void _BGZFwriter_write_with_lkup(BGZFwriter *writer,
+		const char *src, size_t n, const int *lkup, int lkup_len)
+{
+	size_t m, j;
+	char *dest;
+	unsigned int key;
+	int val;
+
+	if (lkup == NULL) {
+		_BGZFwriter_write(writer, src, n);
+		return;
+	}
+	while (n != 0 && (m = get_BGZFwriter_room(writer)) != 0) {
+		if (m > n)
+			m = n;
+		dest = writer->ubuf + writer->ubuf_nelt;
+		for (j = 0; j < m; j++) {
+			key = (unsigned char) src[j];
+			if (key >= (unsigned int) lkup_len
+			 || (val = lkup[key]) == NA_INTEGER)
+			{
+				writer->errmsg = "key not in lookup table";
+				return;
+			}
+			dest[j] = (char) val;
+		}
+		writer->ubuf_nelt += m;
+		src += m;
+		n -= m;
+	}
+	return;
+}
+
+void _BGZFwriter_puts(BGZFwriter *writer, const char *s)
+{
+	_BGZFwriter_write(writer, s, strlen(s));
+	return;
+}
+
+void _BGZFwriter_putc(BGZFwriter *writer, char c)
+{
+	if (get_BGZFwriter_room(writer) != 0)
+		writer->ubuf[writer->ubuf_nelt++] = c;
+	return;
+}
+
+static void free_BGZFwriter(BGZFwriter *writer)
+{
+	free(writer->ubuf);
+	free(writer->ubuf2);
+	free(writer->cbuf);
+	free(writer->block_csize);
+	free(writer);
+	return;
+}
+
+/*
+ * Opens 'path' for writing (or appending) and returns NULL if the file
+ * cannot be opened. 'level' is the compression level (0 to 9), or -1 to
+ * write the data as is (in which case the data is still written by big
+ * batches by a background thread).
+ */
+BGZFwriter *_open_BGZFwriter(const char *path, int append,
+		int level, int nthreads)
+{
+	BGZFwriter *writer;
+
+	writer = (BGZFwriter *) calloc(1, sizeof(BGZFwriter));
+	if (writer == NULL)
+		return NULL;
+	writer->level = level;
+	writer->nthreads = nthreads;
+	writer->max_nblock = BGZF_NBLOCK_PER_THREAD * nthreads;
+	writer->ubuf_size = (size_t) writer->max_nblock * BGZF_BLOCK_DATA_SIZE;
+	writer->ubuf = (char *) malloc(writer->ubuf_size);
+	writer->ubuf2 = (char *) malloc(writer->ubuf_size);
+	if (level >= 0) {
+		writer->cbuf = (unsigned char *)
+			malloc((size_t) writer->max_nblock *
+			       BGZF_MAX_BLOCK_SIZE);
+		writer->block_csize = (int *)
+			malloc(writer->max_nblock * sizeof(int));
+	}
+	if (writer->ubuf == NULL || writer->ubuf2 == NULL
+	 || (level >= 0 && (writer->cbuf == NULL
+			 || writer->block_csize == NULL))) {
+		free_BGZFwriter(writer);
+		return NULL;
+	}
+	writer->file = fopen(path, append ? "ab" : "wb");
+	if (writer->file == NULL) {
+		free_BGZFwriter(writer);
+		return NULL;
+	}
+	return writer;
+}
+
+/*
+ * Writes the data left in the current batch, then the BGZF end-of-file
+ * marker (if compressing), and closes the file. Returns NULL or the 1st
+ * error that occurred while using the writer.
+ */
+const char *_close_BGZFwriter(BGZFwriter *writer)
+{
+	const char *errmsg;
+
+	flush_BGZFwriter(writer);
+	wait_for_BGZF_batch(writer);
+	if (writer->errmsg == NULL && writer->level >= 0
+	 && fwrite(BGZF_EOF_block, 1, sizeof(BGZF_EOF_block), writer->file)
+	    != sizeof(BGZF_EOF_block))
+		writer->errmsg = "write error";
+	if (fclose(writer->file) != 0 && writer->errmsg == NULL)
+		writer->errmsg = "write error";
+	errmsg = writer->errmsg;
+	free_BGZFwriter(writer);
+	return errmsg;
+}
+
+
+/****************************************************************************
+ * Opening/closing a BGZFwriter from a .Call entry point.
+ *
+ * 'filepath' must be the expanded path to the file, 'append' TRUE or FALSE,
+ * 'compression_level' a single integer (NA for no compression) and
+ * 'nthreads' a single positive integer.
+ */
+
+BGZFwriter *_open_output_BGZFwriter(SEXP filepath, SEXP append,
+		SEXP compression_level, SEXP nthreads)
+{
+	int level;
+	BGZFwriter *writer;
+
+	level = INTEGER(compression_level)[0];
+	if (level == NA_INTEGER)
+		level = -1;
+	writer = _open_BGZFwriter(CHAR(STRING_ELT(filepath, 0)),
+				  LOGICAL(append)[0], level,
+				  INTEGER(nthreads)[0]);
+	if (writer == NULL)
+		error("cannot open file '%s'", CHAR(STRING_ELT(filepath, 0)));
+	return writer;
+}
+
+/* The file is removed if an error occurred while writing it, unless the
+   data was appended to it. */
+void _close_output_BGZFwriter(BGZFwriter *writer, SEXP filepath, SEXP append)
+{
+	const char *path, *errmsg;
+
+	errmsg = _close_BGZFwriter(writer);
+	if (errmsg == NULL)
+		return;
+	path = CHAR(STRING_ELT(filepath, 0));
+	if (!LOGICAL(append)[0])
+		remove(path);
+	error("writing file '%s': %s", path, errmsg);
+}
@@ -54,6 +54,58 @@ int _get_twobit_signature_at(
 	int at_length
 );
 
+int _get_twobit_nword(int seq_length);
+
+int _is_twobit_packable(
+	const ByteTrTable *eightbit2twobit,
+	const Chars_holder *seq
+);
+
+int _twobit_pack(
+	const ByteTrTable *eightbit2twobit,
+	const Chars_holder *seq,
+	BitWord *words
+);
+
+int _twobit_hamming(
+	const BitWord *x,
+	const BitWord *y,
+	int nword,
+	int max_dist
+);
+
+int _get_nthreads(SEXP nthreads);
+
+int _get_thread_num();
+
+int _get_upper_triangle_ntile(
+	int n,
+	int tile_size
+);
+
+void _get_upper_triangle_tile(
+	int n,
+	int tile_size,
+	int tile,
+	int *i1,
+	int *i2,
+	int *j1,
+	int *j2
+);
+
+R_xlen_t _get_dist_offset(
+	int n,
+	int i,
+	int j
+);
+
+int _seek_file(
+	FILE *file,
+	long long int offset
+);
+
+long long int _tell_file(FILE *file);
+
 
 /* RoSeqs_utils.c */
 
@@ -131,6 +183,59 @@ SEXP _alloc_XStringSet(
 	SEXP width
 );
 
+XStringSetArena _new_XStringSetArena();
+
+void _free_XStringSetArena(XStringSetArena *arena);
+
+int _get_XStringSetArena_length(const XStringSetArena *arena);
+
+void _XStringSetArena_add_elt(XStringSetArena *arena);
+
+char *_XStringSetArena_reserve(
+	XStringSetArena *arena,
+	int n
+);
+
+void _XStringSetArena_commit(
+	XStringSetArena *arena,
+	int n
+);
+
+void _XStringSetArena_append(
+	XStringSetArena *arena,
+	const Chars_holder *x
+);
+
+void _XStringSetArena_copy_last_elt(
+	const XStringSetArena *arena,
+	char *dest
+);
+
+void _XStringSetArena_shrink_last_elt(
+	XStringSetArena *arena,
+	int n
+);
+
+void _XStringSetArena_drop_last_elt(XStringSetArena *arena);
+
+SEXP _get_XStringSetArenas_width(
+	const XStringSetArena *arenas,
+	int narena
+);
+
+SEXP _new_XStringSet_from_XStringSetArenas(
+	const char *element_type,
+	const XStringSetArena *arenas,
+	int narena,
+	SEXP width,
+	SEXP names
+);
+
+SEXP _new_CHARACTER_from_XStringSetArenas(
+	const XStringSetArena *arenas,
+	int narena
+);
+
 SEXP new_XStringSet_from_CHARACTER(
 	SEXP classname,
 	SEXP elementType,
@@ -174,8 +279,84 @@ SEXP XString_xscat(SEXP args);
 SEXP XStringSet_xscat(SEXP args);
 
 
+/* BGZF_utils.c */
+
+int _BGZFreader_gets(
+	BGZFreader *reader,
+	char *buf,
+	int buf_size,
+	int *EOL_in_buf
+);
+
+long long int _BGZFreader_tell(BGZFreader *reader);
+
+int _BGZFreader_seek(
+	BGZFreader *reader,
+	long long int voffset
+);
+
+BGZFreader *_open_BGZFreader(
+	SEXP filexp,
+	int nthreads
+);
+
+void _close_BGZFreader(
+	SEXP filexp,
+	BGZFreader *reader,
+	long long int voffset
+);
+
+void _BGZFwriter_write(
+	BGZFwriter *writer,
+	const char *src,
+	size_t n
+);
+
+void _BGZFwriter_write_with_lkup(
+	BGZFwriter *writer,
+	const char *src,
+	size_t n,
+	const int *lkup,
+	int lkup_len
+);
+
+void _BGZFwriter_puts(
+	BGZFwriter *writer,
+	const char *s
+);
+
+void _BGZFwriter_putc(
+	BGZFwriter *writer,
+	char c
+);
+
+BGZFwriter *_open_BGZFwriter(
+	const char *path,
+	int append,
+	int level,
+	int nthreads
+);
+
+const char *_close_BGZFwriter(BGZFwriter *writer);
+
+BGZFwriter *_open_output_BGZFwriter(
+	SEXP filepath,
+	SEXP append,
+	SEXP compression_level,
+	SEXP nthreads
+);
+
+void _close_output_BGZFwriter(
+	BGZFwriter *writer,
+	SEXP filepath,
+	SEXP append
+);
+
+
 /* read_fasta_files.c */
 
+void _resolve_parser_stubs(SEXP filexp);
+
 SEXP read_fasta_files(
 	SEXP filexp_list,
 	SEXP nrec,
@@ -183,7 +364,8 @@ SEXP read_fasta_files(
 	SEXP seek_first_rec,
 	SEXP use_names,
 	SEXP elementType,
-	SEXP lkup
+	SEXP lkup,
+	SEXP nthreads
 );
 
 SEXP fasta_index(
@@ -191,7 +373,8 @@ SEXP fasta_index(
 	SEXP nrec,
 	SEXP skip,
 	SEXP seek_first_rec,
-	SEXP lkup
+	SEXP lkup,
+	SEXP nthreads
 );
 
 SEXP read_fasta_blocks(
@@ -200,17 +383,55 @@ SEXP read_fasta_blocks(
 	SEXP nrec_list,
 	SEXP offset_list,
 	SEXP elementType,
+	SEXP lkup,
+	SEXP nthreads
+);
+
+SEXP fasta_fai(SEXP filexp_list);
+
+SEXP read_fasta_regions(
+	SEXP filepath,
+	SEXP offset,
+	SEXP linebases,
+	SEXP linewidth,
+	SEXP start,
+	SEXP width,
+	SEXP elementType,
 	SEXP lkup
 );
 
 SEXP write_XStringSet_to_fasta(
 	SEXP x,
-	SEXP filexp_list,
+	SEXP filepath,
+	SEXP append,
+	SEXP compression_level,
+	SEXP nthreads,
 	SEXP width,
 	SEXP lkup
 );
 
 
+/* read_2bit_files.c */
+
+SEXP read_2bit_index(SEXP filepath);
+
+SEXP read_2bit_regions(
+	SEXP filepath,
+	SEXP fileno,
+	SEXP offset,
+	SEXP start,
+	SEXP width,
+	SEXP elementType,
+	SEXP lkup
+);
+
+SEXP write_XStringSet_to_2bit(
+	SEXP x,
+	SEXP filepath,
+	SEXP lkup
+);
+
+
 /* read_fastq_files.c */
 
 SEXP fastq_seqlengths(
@@ -228,17 +449,72 @@ SEXP read_fastq_files(
 	SEXP use_names,
 	SEXP elementType,
 	SEXP lkup,
-	SEXP with_qualities
+	SEXP with_qualities,
+	SEXP nthreads,
+	SEXP filter
+);
+
+SEXP fastq_stream_open(
+	SEXP filexp_list,
+	SEXP chunksize,
+	SEXP use_names,
+	SEXP elementType,
+	SEXP lkup,
+	SEXP with_qualities,
+	SEXP prefetch,
+	SEXP nthreads,
+	SEXP filter
+);
+
+SEXP fastq_stream_yield(SEXP stream_xp);
+
+SEXP fastq_stream_close(SEXP stream_xp);
+
+SEXP read_fastq_pairs(
+	SEXP filexp_list1,
+	SEXP filexp_list2,
+	SEXP nrec,
+	SEXP skip,
+	SEXP use_names,
+	SEXP elementType,
+	SEXP lkup,
+	SEXP nthreads,
+	SEXP filter
 );
 
 SEXP write_XStringSet_to_fastq(
 	SEXP x,
-	SEXP filexp_list,
+	SEXP filepath,
+	SEXP append,
+	SEXP compression_level,
+	SEXP nthreads,
 	SEXP qualities,
 	SEXP lkup
 );
 
 
+/* read_alignment_files.c */
+
+SEXP read_alignment_file(
+	SEXP filexp_list,
+	SEXP format,
+	SEXP elementType,
+	SEXP lkup
+);
+
+SEXP write_MultipleAlignment(
+	SEXP x,
+	SEXP rows,
+	SEXP cols,
+	SEXP names,
+	SEXP mask,
+	SEXP header,
+	SEXP show_row_names,
+	SEXP filexp_list,
+	SEXP lkup
+);
+
+
 /* letter_frequency.c */
 
 SEXP XString_letter_frequency(
@@ -311,6 +587,26 @@ SEXP XStringSet_consensus_matrix(
 	SEXP codes
 );
 
+SEXP MultipleAlignment_consensus_matrix(
+	SEXP x,
+	SEXP rowmask,
+	SEXP colmask,
+	SEXP width,
+	SEXP with_other,
+	SEXP codes,
+	SEXP nthreads
+);
+
+SEXP MultipleAlignment_consensus_string(
+	SEXP cmat,
+	SEXP code_rows,
+	SEXP gap_row,
+	SEXP weights,
+	SEXP threshold,
+	SEXP letters,
+	SEXP ambiguity_map
+);
+
 SEXP XString_two_way_letter_frequency(
         SEXP x,
         SEXP y,
@@ -601,7 +897,12 @@ SEXP XStringSet_vmatch_pattern_at(
 	SEXP auto_reduce_pattern
 );
 
-SEXP XStringSet_dist_hamming(SEXP x);
+SEXP XStringSet_dist_hamming(
+	SEXP x,
+	SEXP base_codes,
+	SEXP max_distance,
+	SEXP nthreads
+);
 
 
 /* match_pattern_boyermoore.c */
@@ -726,6 +1027,17 @@ SEXP XStringViews_match_PWM(
 );
 
 
+/* find_neighbors.c */
+
+SEXP XStringSet_find_neighbors(
+	SEXP x,
+	SEXP method,
+	SEXP max_distance,
+	SEXP base_codes,
+	SEXP nthreads
+);
+
+
 /* find_palindromes.c */
 
 SEXP find_palindromes(
@@ -1088,13 +1400,15 @@ SEXP AlignedXStringSet_nchar(SEXP alignedXStringSet);
 
 SEXP AlignedXStringSet_align_aligned(
 	SEXP alignedXStringSet,
-	SEXP gapCode
+	SEXP gapCode,
+	SEXP nthreads
 );
 
 SEXP PairwiseAlignmentsSingleSubject_align_aligned(
 	SEXP alignment,
 	SEXP gapCode,
-	SEXP endgapCode
+	SEXP endgapCode,
+	SEXP nthreads
 );
 
 SEXP align_compareStrings(
@@ -1144,7 +1458,10 @@ SEXP XStringSet_align_pairwiseAlignment(
 	SEXP substitutionLookupTable,
 	SEXP fuzzyMatrix,
 	SEXP fuzzyMatrixDim,
-	SEXP fuzzyLookupTable
+	SEXP fuzzyLookupTable,
+	SEXP wfaPenalties,
+	SEXP dropOff,
+	SEXP nthreads
 );
 
 SEXP XStringSet_align_distance(
@@ -1159,7 +1476,51 @@ SEXP XStringSet_align_distance(
 	SEXP substitutionLookupTable,
 	SEXP fuzzyMatrix,
 	SEXP fuzzyMatrixDim,
-	SEXP fuzzyLookupTable
+	SEXP fuzzyLookupTable,
+	SEXP nthreads
+);
+
+
+/* align_levenshtein.c */
+
+LevenshteinBuf _new_LevenshteinBuf(
+	int nclass,
+	int max_P_length
+);
+
+void _set_levenshtein_pattern(
+	LevenshteinBuf *buf,
+	const Chars_holder *P,
+	const ByteTrTable *byte2class
+);
+
+int _levenshtein_distance(
+	LevenshteinBuf *buf,
+	const Chars_holder *S,
+	const ByteTrTable *byte2class,
+	int max_dist
+);
+
+SEXP XStringSet_dist_levenshtein(
+	SEXP x,
+	SEXP lkup,
+	SEXP max_distance,
+	SEXP nthreads
+);
+
+
+/* align_wfa.c */
+
+void _init_WFABuf(WFABuf *buf);
+
+int _wfa_align(
+	WFABuf *buf,
+	const Chars_holder *P,
+	const Chars_holder *S,
+	const int *penalties,
+	int endGap1,
+	int endGap2,
+	int traceback
 );
 
 
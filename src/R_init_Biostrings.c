@@ -41,15 +41,30 @@ static const R_CallMethodDef callMethods[] = {
 	CALLMETHOD_DEF(XStringSet_xscat, 1),
 
 /* read_fasta_files.c */
-	CALLMETHOD_DEF(read_fasta_files, 7),
-	CALLMETHOD_DEF(fasta_index, 5),
-	CALLMETHOD_DEF(read_fasta_blocks, 6),
-	CALLMETHOD_DEF(write_XStringSet_to_fasta, 4),
+	CALLMETHOD_DEF(read_fasta_files, 8),
+	CALLMETHOD_DEF(fasta_index, 6),
+	CALLMETHOD_DEF(read_fasta_blocks, 7),
+	CALLMETHOD_DEF(fasta_fai, 1),
+	CALLMETHOD_DEF(read_fasta_regions, 8),
+	CALLMETHOD_DEF(write_XStringSet_to_fasta, 7),
+
+/* read_2bit_files.c */
+	CALLMETHOD_DEF(read_2bit_index, 1),
+	CALLMETHOD_DEF(read_2bit_regions, 7),
+	CALLMETHOD_DEF(write_XStringSet_to_2bit, 3),
 
 /* read_fastq_files.c */
 	CALLMETHOD_DEF(fastq_seqlengths, 4),
-	CALLMETHOD_DEF(read_fastq_files, 8),
-	CALLMETHOD_DEF(write_XStringSet_to_fastq, 4),
+	CALLMETHOD_DEF(read_fastq_files, 10),
+	CALLMETHOD_DEF(fastq_stream_open, 9),
+	CALLMETHOD_DEF(fastq_stream_yield, 1),
+	CALLMETHOD_DEF(fastq_stream_close, 1),
+	CALLMETHOD_DEF(read_fastq_pairs, 9),
+	CALLMETHOD_DEF(write_XStringSet_to_fastq, 7),
+
+/* read_alignment_files.c */
+	CALLMETHOD_DEF(read_alignment_file, 4),
+	CALLMETHOD_DEF(write_MultipleAlignment, 9),
 
 /* letter_frequency.c */
 	CALLMETHOD_DEF(XString_letter_frequency, 3),
@@ -60,6 +75,8 @@ static const R_CallMethodDef callMethods[] = {
 	CALLMETHOD_DEF(XStringSet_oligo_frequency, 9),
 	CALLMETHOD_DEF(XStringSet_nucleotide_frequency_at, 7),
 	CALLMETHOD_DEF(XStringSet_consensus_matrix, 5),
+	CALLMETHOD_DEF(MultipleAlignment_consensus_matrix, 7),
+	CALLMETHOD_DEF(MultipleAlignment_consensus_string, 7),
 	CALLMETHOD_DEF(XString_two_way_letter_frequency, 5),
 	CALLMETHOD_DEF(XStringSet_two_way_letter_frequency, 6),
 	CALLMETHOD_DEF(XStringSet_two_way_letter_frequency_by_quality, 7),
@@ -89,7 +106,7 @@ static const R_CallMethodDef callMethods[] = {
 /* lowlevel_matching.c */
 	CALLMETHOD_DEF(XString_match_pattern_at, 10),
 	CALLMETHOD_DEF(XStringSet_vmatch_pattern_at, 10),
-	CALLMETHOD_DEF(XStringSet_dist_hamming, 1),
+	CALLMETHOD_DEF(XStringSet_dist_hamming, 4),
 
 /* match_pattern_shiftor.c */
 	CALLMETHOD_DEF(bits_per_long, 0),
@@ -104,6 +121,9 @@ static const R_CallMethodDef callMethods[] = {
 	CALLMETHOD_DEF(XString_match_PWM, 5),
 	CALLMETHOD_DEF(XStringViews_match_PWM, 7),
 
+/* find_neighbors.c */
+	CALLMETHOD_DEF(XStringSet_find_neighbors, 5),
+
 /* find_palindromes.c */
 	CALLMETHOD_DEF(find_palindromes, 5),
 	CALLMETHOD_DEF(palindrome_arm_length, 3),
@@ -135,8 +155,8 @@ static const R_CallMethodDef callMethods[] = {
 /* align_utils.c */
 	CALLMETHOD_DEF(PairwiseAlignments_nmatch, 4),
 	CALLMETHOD_DEF(AlignedXStringSet_nchar, 1),
-	CALLMETHOD_DEF(AlignedXStringSet_align_aligned, 2),
-	CALLMETHOD_DEF(PairwiseAlignmentsSingleSubject_align_aligned, 3),
+	CALLMETHOD_DEF(AlignedXStringSet_align_aligned, 3),
+	CALLMETHOD_DEF(PairwiseAlignmentsSingleSubject_align_aligned, 4),
 	CALLMETHOD_DEF(align_compareStrings, 6),
 
 /* pmatchPattern.c */
@@ -144,8 +164,11 @@ static const R_CallMethodDef callMethods[] = {
 	CALLMETHOD_DEF(lcsuffix, 6),
 
 /* align_pairwiseAlignment.c */
-	CALLMETHOD_DEF(XStringSet_align_pairwiseAlignment, 14),
-	CALLMETHOD_DEF(XStringSet_align_distance, 12),
+	CALLMETHOD_DEF(XStringSet_align_pairwiseAlignment, 17),
+	CALLMETHOD_DEF(XStringSet_align_distance, 13),
+
+/* align_levenshtein.c */
+	CALLMETHOD_DEF(XStringSet_dist_levenshtein, 4),
 
 /* align_needwunsQS.c */
 	CALLMETHOD_DEF(align_needwunsQS, 7),
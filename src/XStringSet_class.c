@@ -7,6 +7,7 @@
 #include "IRanges_interface.h"
 #include "S4Vectors_interface.h"
 
+#include <stdlib.h>  /* for malloc(), realloc(), free() */
 #include <limits.h>  /* for INT_MAX */
 
 
@@ -89,6 +90,375 @@ SEXP _alloc_XStringSet(const char *element_type, SEXP width)
 }
 
 
+/****************************************************************************
+ * Loading strings of unknown lengths in a single pass.
+ *
+ * The string data is appended to an XStringSetArena. The arena is made of
+ * chunks allocated with malloc(). A chunk is never moved or reallocated: when
+ * the last chunk is full, a new chunk (twice as big, up to
+ * ARENA_MAX_CHUNK_SIZE) is added. The data of a string can span several
+ * chunks.
+ * None of the functions below uses the R API (except the functions that
+ * create the final R objects) so the arenas can be filled by worker threads
+ * (1 arena per thread). They never raise an error either: when the arena
+ * cannot grow anymore, 'arena->errmsg' is set and all the subsequent
+ * additions to the arena are ignored. It's the responsibility of the caller
+ * to check 'arena->errmsg'.
+ * Finally _new_XStringSet_from_XStringSetArenas() allocates the XStringSet
+ * object and copies the data of 1 or more arenas to it. This is the only
+ * copy of the data.
+ * The arenas are not allocated by R so they are not reclaimed if an R error
+ * is raised while they are alive (e.g. by the functions that create the
+ * final R objects). The caller must free them with _free_XStringSetArena()
+ * in all cases, typically by filling them and creating the final R objects
+ * thru R_UnwindProtect() (see read_fasta_files() in read_fasta_files.c).
+ */
+
+#define ARENA_MIN_CHUNK_SIZE ((size_t) 1 << 20)
+#define ARENA_MAX_CHUNK_SIZE ((size_t) 1 << 28)
+
+static const char *arena_alloc_errmsg =
+	"cannot allocate memory for the string data";
+
+XStringSetArena _new_XStringSetArena()
+{
+	XStringSetArena arena;
+
+	arena.nelt = 0;
+	arena.max_nelt = 0;
+	arena.width = NULL;
+	arena.nchunk = 0;
+	arena.max_nchunk = 0;
+	arena.chunk_ptr = NULL;
+	arena.chunk_nelt = NULL;
+	arena.chunk_buflength = 0;
+	arena.errmsg = NULL;
+	return arena;
+}
+
+void _free_XStringSetArena(XStringSetArena *arena)
+{
+	int i;
+
+	for (i = 0; i < arena->nchunk; i++)
+		free(arena->chunk_ptr[i]);
+	free(arena->chunk_ptr);
+	free(arena->chunk_nelt);
+	free(arena->width);
+	*arena = _new_XStringSetArena();
+	return;
+}
+
+int _get_XStringSetArena_length(const XStringSetArena *arena)
+{
+	return arena->nelt;
+}
+
+/* Starts a new (empty) string. */
+void _XStringSetArena_add_elt(XStringSetArena *arena)
+{
+	int new_max_nelt, *new_width;
+
+	if (arena->errmsg != NULL)
+		return;
+	if (arena->nelt == arena->max_nelt) {
+		if (arena->max_nelt == INT_MAX) {
+			arena->errmsg = "too many strings";
+			return;
+		}
+		new_max_nelt = arena->max_nelt == 0 ? 1024 :
+			       arena->max_nelt <= INT_MAX / 2 ?
+			       2 * arena->max_nelt : INT_MAX;
+		new_width = (int *) realloc(arena->width,
+					    (size_t) new_max_nelt * sizeof(int));
+		if (new_width == NULL) {
+			arena->errmsg = arena_alloc_errmsg;
+			return;
+		}
+		arena->width = new_width;
+		arena->max_nelt = new_max_nelt;
+	}
+	arena->width[arena->nelt++] = 0;
+	return;
+}
+
+/* Returns 0 on success and -1 if malloc() or realloc() failed. */
+static int add_arena_chunk(XStringSetArena *arena, size_t min_buflength)
+{
+	char **chunk_ptr, *chunk;
+	size_t *chunk_nelt, buflength;
+	int max_nchunk;
+
+	if (arena->nchunk == arena->max_nchunk) {
+		max_nchunk = arena->max_nchunk == 0 ?
+			     16 : 2 * arena->max_nchunk;
+		chunk_ptr = (char **) realloc(arena->chunk_ptr,
+					max_nchunk * sizeof(char *));
+		if (chunk_ptr == NULL)
+			return -1;
+		arena->chunk_ptr = chunk_ptr;
+		chunk_nelt = (size_t *) realloc(arena->chunk_nelt,
+					max_nchunk * sizeof(size_t));
+		if (chunk_nelt == NULL)
+			return -1;
+		arena->chunk_nelt = chunk_nelt;
+		arena->max_nchunk = max_nchunk;
+	}
+	buflength = 2 * arena->chunk_buflength;
+	if (buflength < ARENA_MIN_CHUNK_SIZE)
+		buflength = ARENA_MIN_CHUNK_SIZE;
+	if (buflength > ARENA_MAX_CHUNK_SIZE)
+		buflength = ARENA_MAX_CHUNK_SIZE;
+	if (buflength < min_buflength)
+		buflength = min_buflength;
+	chunk = (char *) malloc(buflength * sizeof(char));
+	if (chunk == NULL)
+		return -1;
+	arena->chunk_ptr[arena->nchunk] = chunk;
+	arena->chunk_nelt[arena->nchunk] = 0;
+	arena->chunk_buflength = buflength;
+	arena->nchunk++;
+	return 0;
+}
+
+/*
+ * Returns a pointer to at least 'n' contiguous bytes where the caller can
+ * write the next bytes of the current string. The bytes are added to the
+ * string by _XStringSetArena_commit().
+ * Returns NULL if the arena cannot grow anymore.
+ */
+char *_XStringSetArena_reserve(XStringSetArena *arena, int n)
+{
+	int last;
+
+	if (arena->errmsg != NULL)
+		return NULL;
+	last = arena->nchunk - 1;
+	if (last < 0 ||
+	    arena->chunk_buflength - arena->chunk_nelt[last] < (size_t) n)
+	{
+		if (add_arena_chunk(arena, (size_t) n) != 0) {
+			arena->errmsg = arena_alloc_errmsg;
+			return NULL;
+		}
+		last++;
+	}
+	return arena->chunk_ptr[last] + arena->chunk_nelt[last];
+}
+
+void _XStringSetArena_commit(XStringSetArena *arena, int n)
+{
+	int *width;
+
+	if (n == 0 || arena->errmsg != NULL)
+		return;
+	width = arena->width + arena->nelt - 1;
+	if (*width > INT_MAX - n) {
+		arena->errmsg = "cannot load a string of length > 2^31 - 1";
+		return;
+	}
+	*width += n;
+	arena->chunk_nelt[arena->nchunk - 1] += n;
+	return;
+}
+
+void _XStringSetArena_append(XStringSetArena *arena, const Chars_holder *x)
+{
+	char *dest;
+
+	dest = _XStringSetArena_reserve(arena, x->length);
+	if (dest == NULL)
+		return;
+	memcpy(dest, x->ptr, x->length * sizeof(char));
+	_XStringSetArena_commit(arena, x->length);
+	return;
+}
+
+/* Copies the current (i.e. last) string to 'dest'. Its bytes are the last
+   bytes of the arena. */
+void _XStringSetArena_copy_last_elt(const XStringSetArena *arena, char *dest)
+{
+	int n, chunk, m;
+
+	n = arena->width[arena->nelt - 1];
+	for (chunk = arena->nchunk - 1; n != 0; chunk--) {
+		m = (int) arena->chunk_nelt[chunk];
+		if (m > n)
+			m = n;
+		n -= m;
+		memcpy(dest + n, arena->chunk_ptr[chunk] +
+				 arena->chunk_nelt[chunk] - m,
+		       m * sizeof(char));
+	}
+	return;
+}
+
+/* Removes the last 'n' bytes of the current string. Only the space freed in
+   the last chunk is reused by the next strings. */
+void _XStringSetArena_shrink_last_elt(XStringSetArena *arena, int n)
+{
+	int chunk, m;
+
+	if (arena->errmsg != NULL)
+		return;
+	arena->width[arena->nelt - 1] -= n;
+	for (chunk = arena->nchunk - 1; n != 0; chunk--) {
+		m = (int) arena->chunk_nelt[chunk];
+		if (m > n)
+			m = n;
+		arena->chunk_nelt[chunk] -= m;
+		n -= m;
+	}
+	return;
+}
+
+/* Removes the current string. */
+void _XStringSetArena_drop_last_elt(XStringSetArena *arena)
+{
+	if (arena->errmsg != NULL)
+		return;
+	_XStringSetArena_shrink_last_elt(arena, arena->width[arena->nelt - 1]);
+	arena->nelt--;
+	return;
+}
+
+static int get_XStringSetArenas_length(const XStringSetArena *arenas,
+		int narena)
+{
+	long long int ans;
+	int k;
+
+	ans = 0;
+	for (k = 0; k < narena; k++)
+		ans += arenas[k].nelt;
+	if (ans > INT_MAX)
+		error("too many strings");
+	return (int) ans;
+}
+
+/* Returns the widths of the strings in 'arenas' (concatenated). */
+SEXP _get_XStringSetArenas_width(const XStringSetArena *arenas, int narena)
+{
+	SEXP ans;
+	int k, *ans_p;
+
+	PROTECT(ans = NEW_INTEGER(get_XStringSetArenas_length(arenas, narena)));
+	ans_p = INTEGER(ans);
+	for (k = 0; k < narena; k++) {
+		if (arenas[k].nelt == 0)
+			continue;
+		memcpy(ans_p, arenas[k].width, arenas[k].nelt * sizeof(int));
+		ans_p += arenas[k].nelt;
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* Copies the next 'n' bytes of 'arena' to 'dest'. The position in the arena
+   is tracked by '*chunk' and '*chunk_offset'. */
+static void copy_arena_bytes(const XStringSetArena *arena,
+		int *chunk, size_t *chunk_offset, char *dest, int n)
+{
+	int m;
+
+	for ( ; n != 0; n -= m, dest += m) {
+		while (*chunk_offset == arena->chunk_nelt[*chunk]) {
+			(*chunk)++;
+			*chunk_offset = 0;
+		}
+		m = (int) (arena->chunk_nelt[*chunk] - *chunk_offset);
+		if (m > n)
+			m = n;
+		memcpy(dest, arena->chunk_ptr[*chunk] + *chunk_offset,
+		       m * sizeof(char));
+		*chunk_offset += m;
+	}
+	return;
+}
+
+/*
+ * Concatenates the strings in 'arenas' (in that order).
+ * 'width' must be R_NilValue or have 1 element per string in the arenas. If
+ * not R_NilValue, it must be >= the widths of the strings in the arenas and
+ * is used as the width of the returned XStringSet. In that case, the strings
+ * that are shorter than 'width' are not padded i.e. they are followed by
+ * whatever bytes were present in the freshly allocated XStringSet object.
+ */
+SEXP _new_XStringSet_from_XStringSetArenas(const char *element_type,
+		const XStringSetArena *arenas, int narena,
+		SEXP width, SEXP names)
+{
+	SEXP ans;
+	XStringSet_holder ans_holder;
+	Chars_holder ans_elt;
+	const XStringSetArena *arena;
+	int i, k, j, chunk;
+	size_t chunk_offset;
+
+	if (width == R_NilValue)
+		PROTECT(width = _get_XStringSetArenas_width(arenas, narena));
+	else
+		PROTECT(width = duplicate(width));
+	if (names != R_NilValue)
+		SET_NAMES(width, names);
+	PROTECT(ans = _alloc_XStringSet(element_type, width));
+	ans_holder = _hold_XStringSet(ans);
+	i = 0;
+	for (k = 0; k < narena; k++) {
+		arena = arenas + k;
+		chunk = 0;
+		chunk_offset = 0;
+		for (j = 0; j < arena->nelt; j++, i++) {
+			ans_elt = _get_elt_from_XStringSet_holder(&ans_holder,
+								  i);
+			/* ans_elt.ptr is a (const char *) so we need to cast
+			   it to (char *) in order to write to it */
+			copy_arena_bytes(arena, &chunk, &chunk_offset,
+					 (char *) ans_elt.ptr,
+					 arena->width[j]);
+		}
+	}
+	UNPROTECT(2);
+	return ans;
+}
+
+/* Concatenates the strings in 'arenas' (in that order) into a character
+   vector. Used for the sequence names. */
+SEXP _new_CHARACTER_from_XStringSetArenas(const XStringSetArena *arenas,
+		int narena)
+{
+	SEXP ans, ans_elt;
+	const XStringSetArena *arena;
+	int max_width, i, k, j, chunk;
+	size_t chunk_offset;
+	char *buf;
+
+	max_width = 0;
+	for (k = 0; k < narena; k++)
+		for (j = 0; j < arenas[k].nelt; j++)
+			if (arenas[k].width[j] > max_width)
+				max_width = arenas[k].width[j];
+	buf = R_alloc((long) max_width + 1, sizeof(char));
+	PROTECT(ans = NEW_CHARACTER(get_XStringSetArenas_length(arenas,
+								narena)));
+	i = 0;
+	for (k = 0; k < narena; k++) {
+		arena = arenas + k;
+		chunk = 0;
+		chunk_offset = 0;
+		for (j = 0; j < arena->nelt; j++, i++) {
+			copy_arena_bytes(arena, &chunk, &chunk_offset,
+					 buf, arena->width[j]);
+			PROTECT(ans_elt = mkCharLen(buf, arena->width[j]));
+			SET_STRING_ELT(ans, i, ans_elt);
+			UNPROTECT(1);
+		}
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+
 /****************************************************************************
  * From CHARACTER to XStringSet and vice-versa.
  */
@@ -0,0 +1,259 @@
+#include "Biostrings.h"
+#include <R_ext/Utils.h>        /* R_CheckUserInterrupt */
+
+#include <stdlib.h>             /* for abs() */
+#include <limits.h>             /* for INT_MAX */
+
+
+/*
+ * Bit-parallel computation of the (unit cost) Levenshtein distance.
+ *
+ * This is Myers' algorithm (G. Myers, "A fast bit-vector algorithm for
+ * approximate string matching based on dynamic programming", J. ACM 1999) in
+ * the block-based formulation of H. Hyyro ("A bit-vector algorithm for
+ * computing Levenshtein and Damerau edit distances", Nordic J. of Computing
+ * 2003) so that patterns longer than NBIT_PER_BITWORD letters are supported.
+ * The pattern is split in blocks of NBIT_PER_BITWORD rows and each column of
+ * the DP matrix is encoded as the vertical deltas (+1/-1) of every block.
+ *
+ * When a cutoff 'max_dist' is supplied, only the blocks intersecting the
+ * Ukkonen band (rows <= column + max_dist) are computed, and the computation
+ * stops as soon as every cell of the current column is known to be
+ * > 'max_dist'. In that case the returned distance is 'max_dist' + 1.
+ */
+
+#define HIGH_BIT ((BitWord) 1 << (NBIT_PER_BITWORD - 1))
+
+LevenshteinBuf _new_LevenshteinBuf(int nclass, int max_P_length)
+{
+	LevenshteinBuf buf;
+
+	buf.nclass = nclass;
+	buf.max_nblock = max_P_length == 0 ? 1 :
+			 (max_P_length - 1) / NBIT_PER_BITWORD + 1;
+	buf.peq = (BitWord *) R_alloc((long) nclass * buf.max_nblock,
+				      sizeof(BitWord));
+	buf.Pv = (BitWord *) R_alloc((long) buf.max_nblock, sizeof(BitWord));
+	buf.Mv = (BitWord *) R_alloc((long) buf.max_nblock, sizeof(BitWord));
+	buf.score = (int *) R_alloc((long) buf.max_nblock, sizeof(int));
+	buf.P_length = buf.nblock = 0;
+	return buf;
+}
+
+/* 'byte2class' must map every letter in 'P' to a class (checked by caller). */
+void _set_levenshtein_pattern(LevenshteinBuf *buf,
+		const Chars_holder *P, const ByteTrTable *byte2class)
+{
+	int i, class;
+
+	buf->P_length = P->length;
+	buf->nblock = P->length == 0 ? 0 :
+		      (P->length - 1) / NBIT_PER_BITWORD + 1;
+	memset(buf->peq, 0, sizeof(BitWord) * buf->nclass * buf->nblock);
+	for (i = 0; i < P->length; i++) {
+		class = byte2class->byte2code[(unsigned char) P->ptr[i]];
+		buf->peq[class * buf->nblock + i / NBIT_PER_BITWORD] |=
+			(BitWord) 1 << (i % NBIT_PER_BITWORD);
+	}
+	return;
+}
+
+/*
+ * Moves block (Pv, Mv) to the next column. 'hin' is the horizontal delta
+ * entering the block from above (-1, 0 or +1). Returns the horizontal delta
+ * of the row selected by 'out_bit' (the last row of the block).
+ */
+static int advance_block(BitWord *Pv, BitWord *Mv, BitWord Eq, int hin,
+		BitWord out_bit)
+{
+	BitWord Xv, Xh, Ph, Mh, hin_is_neg;
+	int hout;
+
+	hin_is_neg = hin < 0;
+	Xv = Eq | *Mv;
+	Eq |= hin_is_neg;
+	Xh = (((Eq & *Pv) + *Pv) ^ *Pv) | Eq;
+	Ph = *Mv | ~(Xh | *Pv);
+	Mh = *Pv & Xh;
+	hout = (Ph & out_bit) ? 1 : ((Mh & out_bit) ? -1 : 0);
+	Ph <<= 1;
+	Mh <<= 1;
+	Mh |= hin_is_neg;
+	Ph |= hin > 0;
+	*Pv = Mh | ~(Xv | Ph);
+	*Mv = Ph & Xv;
+	return hout;
+}
+
+/* Nb of rows in block 'b' for a pattern of length 'P_length'. */
+static int get_block_nrow(int b, int P_length)
+{
+	int nrow;
+
+	nrow = P_length - b * NBIT_PER_BITWORD;
+	return nrow < NBIT_PER_BITWORD ? nrow : NBIT_PER_BITWORD;
+}
+
+/*
+ * Levenshtein distance between the pattern currently set in 'buf' and 'S'.
+ * A negative 'max_dist' means no cutoff.
+ */
+int _levenshtein_distance(LevenshteinBuf *buf, const Chars_holder *S,
+		const ByteTrTable *byte2class, int max_dist)
+{
+	int m, n, j, b, last_block, needed_block, hin, block_min, min_score;
+	BitWord last_bit;
+	const BitWord *Eq;
+
+	m = buf->P_length;
+	n = S->length;
+	if (max_dist >= 0 && abs(m - n) > max_dist)
+		return max_dist + 1;
+	if (m == 0)
+		return n;
+	last_bit = (BitWord) 1 << ((m - 1) % NBIT_PER_BITWORD);
+	last_block = -1;
+	for (j = 1; j <= n; j++) {
+		Eq = buf->peq + byte2class->byte2code[(unsigned char) S->ptr[j - 1]]
+			      * buf->nblock;
+		/* Add the blocks entering the band. Their cells are initialized
+		   with upper bounds of their true values. */
+		if (max_dist < 0 || j + max_dist >= m)
+			needed_block = buf->nblock - 1;
+		else
+			needed_block = (j + max_dist - 1) / NBIT_PER_BITWORD;
+		while (last_block < needed_block) {
+			last_block++;
+			buf->Pv[last_block] = ~((BitWord) 0);
+			buf->Mv[last_block] = 0;
+			buf->score[last_block] =
+				(last_block == 0 ? j - 1 : buf->score[last_block - 1]) +
+				get_block_nrow(last_block, m);
+		}
+		hin = 1;
+		for (b = 0; b <= last_block; b++) {
+			hin = advance_block(buf->Pv + b, buf->Mv + b, Eq[b], hin,
+					    b == buf->nblock - 1 ? last_bit : HIGH_BIT);
+			buf->score[b] += hin;
+		}
+		if (max_dist < 0)
+			continue;
+		/* Early termination. The distance cannot be smaller than the
+		   smallest score in the current column. */
+		if (last_block == buf->nblock - 1
+		 && buf->score[last_block] - (n - j) > max_dist)
+			return max_dist + 1;
+		min_score = INT_MAX;
+		for (b = 0; b <= last_block; b++) {
+			block_min = buf->score[b] - get_block_nrow(b, m) + 1;
+			if (block_min < min_score)
+				min_score = block_min;
+		}
+		if (min_score > max_dist)
+			return max_dist + 1;
+	}
+	if (n == 0)
+		return m;
+	return buf->score[buf->nblock - 1];
+}
+
+
+/****************************************************************************
+ * XStringSet_dist_levenshtein() used by stringDist, method = "levenshtein".
+ */
+
+#define DIST_TILE_SIZE 64
+
+static void dist_levenshtein_tile(const XStringSet_holder *X, int X_length,
+		int tile, LevenshteinBuf *buf, const ByteTrTable *byte2class,
+		int max_dist, double *ans0)
+{
+	Chars_holder x_i, x_j;
+	int i1, i2, j1, j2, i, j;
+	double *ans_elt;
+
+	_get_upper_triangle_tile(X_length, DIST_TILE_SIZE, tile,
+				 &i1, &i2, &j1, &j2);
+	for (i = i1; i < i2; i++) {
+		x_i = _get_elt_from_XStringSet_holder(X, i);
+		_set_levenshtein_pattern(buf, &x_i, byte2class);
+		j = j1 > i ? j1 : i + 1;
+		ans_elt = ans0 + _get_dist_offset(X_length, i, j);
+		for ( ; j < j2; j++, ans_elt++) {
+			x_j = _get_elt_from_XStringSet_holder(X, j);
+			*ans_elt = _levenshtein_distance(buf, &x_j, byte2class,
+							 max_dist);
+		}
+	}
+	return;
+}
+
+/*
+ * 'lkup' maps every letter of the alphabet to its class i.e. to a
+ * non-negative integer such that 2 letters are considered equal iff they
+ * belong to the same class.
+ * 'max_distance' must be a single integer (NA for no cutoff).
+ */
+/* --- .Call ENTRY POINT --- */
+SEXP XStringSet_dist_levenshtein(SEXP x, SEXP lkup, SEXP max_distance,
+		SEXP nthreads)
+{
+	XStringSet_holder X;
+	ByteTrTable byte2class;
+	LevenshteinBuf *bufs;
+	Chars_holder x_i;
+	int X_length, max_dist, nclass, max_length, i, j, class,
+	    ntile, tile, nthreads0;
+	double *ans0;
+	SEXP ans;
+
+	X = _hold_XStringSet(x);
+	X_length = _get_length_from_XStringSet_holder(&X);
+	max_dist = INTEGER(max_distance)[0];
+	if (max_dist == NA_INTEGER)
+		max_dist = -1;
+	_init_ByteTrTable_with_lkup(&byte2class, lkup);
+
+	/* Check all the letters upfront so that the worker threads never
+	   encounter an unknown letter. */
+	nclass = 0;
+	max_length = 0;
+	for (i = 0; i < X_length; i++) {
+		x_i = _get_elt_from_XStringSet_holder(&X, i);
+		if (x_i.length > max_length)
+			max_length = x_i.length;
+		for (j = 0; j < x_i.length; j++) {
+			class = byte2class.byte2code[(unsigned char) x_i.ptr[j]];
+			if (class == NA_INTEGER || class < 0)
+				error("key %d not in lookup table",
+				      (int) (unsigned char) x_i.ptr[j]);
+			if (class >= nclass)
+				nclass = class + 1;
+		}
+	}
+
+	nthreads0 = _get_nthreads(nthreads);
+	bufs = (LevenshteinBuf *) R_alloc((long) nthreads0,
+					  sizeof(LevenshteinBuf));
+	for (i = 0; i < nthreads0; i++)
+		bufs[i] = _new_LevenshteinBuf(nclass, max_length);
+
+	PROTECT(ans = NEW_NUMERIC((R_xlen_t) X_length * (X_length - 1) / 2));
+	ans0 = REAL(ans);
+	ntile = _get_upper_triangle_ntile(X_length, DIST_TILE_SIZE);
+	if (nthreads0 == 1) {
+		for (tile = 0; tile < ntile; tile++) {
+			R_CheckUserInterrupt();
+			dist_levenshtein_tile(&X, X_length, tile, bufs,
+					      &byte2class, max_dist, ans0);
+		}
+	} else {
+		#pragma omp parallel for num_threads(nthreads0) schedule(dynamic)
+		for (tile = 0; tile < ntile; tile++)
+			dist_levenshtein_tile(&X, X_length, tile,
+					      bufs + _get_thread_num(),
+					      &byte2class, max_dist, ans0);
+	}
+	UNPROTECT(1);
+	return ans;
+}
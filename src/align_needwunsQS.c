@@ -5,8 +5,30 @@
 #include <stdio.h>
 
 
-#define SCO(i1, i2) (sco[n2 * (i1) + (i2)])
-#define TRA(i1, i2) (tra[n2 * (i1) + (i2)])
+/*
+ * Global alignment with a linear gap cost in linear space (Hirschberg's
+ * divide-and-conquer algorithm). Only 2 rows of scores of length
+ * nchar(s2) + 1 are used: the optimal alignment is split at the middle row
+ * of s1 (the column where it crosses this row is found by combining the
+ * forward scores of the top half with the backward scores of the bottom
+ * half) and the 2 halves are aligned recursively.
+ */
+
+typedef struct needwuns_buf {
+	const int *mat;
+	int mat_nrow;
+	int gap_cost;
+	char gap_code;
+	const char *s1;         /* the letters of s1 */
+	const char *s2;         /* the letters of s2 */
+	int *codes1;            /* the scoring matrix indices of s1 */
+	int *codes2;            /* the scoring matrix indices of s2 */
+	int *fwd_row;           /* nchar(s2) + 1 forward scores */
+	int *bwd_row;           /* nchar(s2) + 1 backward scores */
+	char *al1;              /* aligned s1 */
+	char *al2;              /* aligned s2 */
+	int nal;
+} NeedwunsBuf;
 
 #define SET_LKUP_VAL_INT(lkup, length, key) \
 { \
@@ -16,92 +38,198 @@
 	} \
 }
 
-static int nal = 0;
-static char *al1_buf, *al2_buf, *al1, *al2;
+#define SUBST_SCORE(buf, i1, i2) \
+	((buf)->mat[(buf)->mat_nrow * (buf)->codes1[i1] + (buf)->codes2[i2]])
 
-/* Returns the score of the alignment */
-static int needwunsQS(const Chars_holder *S1, const Chars_holder *S2,
-		const int *mat, int mat_nrow, const int *lkup, int lkup_length,
-		int gap_cost, char gap_code)
+/* Translates the letters of 'S' into scoring matrix indices once. */
+static int *get_codes(const Chars_holder *S, const int *lkup, int lkup_length)
 {
-	int *sco, sc, n1, n2, i1, i2, j1, j2, al_buf_size;
-	char *tra, tr;
-
-	n1 = S1->length + 1;
-	n2 = S2->length + 1;
-	sco = (int *) R_alloc((long) n1 * n2, sizeof(int));
-	tra = (char *) R_alloc((long) n1 * n2, sizeof(char));
-	for (i1 = 0; i1 <= S1->length; i1++)
-		SCO(i1, 0) = - i1 * gap_cost;
-	for (i2 = 1; i2 <= S2->length; i2++)
-		SCO(0, i2) = - i2 * gap_cost;
-	for (i1 = 1, j1 = 0; i1 <= S1->length; i1++, j1++) {
-		for (i2 = 1, j2 = 0; i2 <= S2->length; i2++, j2++) {
-			int lkup_val, m1, m2, scR, scD, scI;
-			SET_LKUP_VAL_INT(lkup, lkup_length, S1->ptr[j1]);
-			m1 = lkup_val;
-			SET_LKUP_VAL_INT(lkup, lkup_length, S2->ptr[j2]);
-			m2 = lkup_val;
-			scR = SCO(j1, j2) + mat[mat_nrow * m1 + m2];
-			scD = SCO(j1, i2) - gap_cost;
-			scI = SCO(i1, j2) - gap_cost;
-			if (scD >= scI) {
-				sc = scD;
-				tr = 'D'; /* Deletion (gap in aligned string 2) */
-			} else {
-				sc = scI;
-				tr = 'I'; /* Insertion (gap in aligned string 1) */
-			}
-			if (scR >= sc) {
-				sc = scR;
-				tr = 'R'; /* Replacement (can be an exact match) */
+	int *codes, i, lkup_val;
+
+	codes = (int *) R_alloc((long) S->length, sizeof(int));
+	for (i = 0; i < S->length; i++) {
+		SET_LKUP_VAL_INT(lkup, lkup_length, S->ptr[i]);
+		codes[i] = lkup_val;
+	}
+	return codes;
+}
+
+static int max3(int scR, int scD, int scI)
+{
+	int sc;
+
+	sc = scD >= scI ? scD : scI;
+	return scR >= sc ? scR : sc;
+}
+
+/*
+ * Sets 'row[j]' (0 <= j <= len2) to the score of the optimal alignment of
+ * s1[from1, from1 + len1) with s2[from2, from2 + j).
+ */
+static void set_fwd_row(const NeedwunsBuf *buf, int from1, int len1,
+		int from2, int len2, int *row)
+{
+	int i1, i2, diag, up;
+
+	for (i2 = 0; i2 <= len2; i2++)
+		row[i2] = - i2 * buf->gap_cost;
+	for (i1 = 1; i1 <= len1; i1++) {
+		diag = row[0];
+		row[0] = - i1 * buf->gap_cost;
+		for (i2 = 1; i2 <= len2; i2++) {
+			up = row[i2];
+			row[i2] = max3(diag + SUBST_SCORE(buf, from1 + i1 - 1,
+							    from2 + i2 - 1),
+				       up - buf->gap_cost,
+				       row[i2 - 1] - buf->gap_cost);
+			diag = up;
+		}
+	}
+	return;
+}
+
+/*
+ * Sets 'row[j]' (0 <= j <= len2) to the score of the optimal alignment of
+ * s1[from1, from1 + len1) with s2[from2 + j, from2 + len2).
+ */
+static void set_bwd_row(const NeedwunsBuf *buf, int from1, int len1,
+		int from2, int len2, int *row)
+{
+	int i1, i2, diag, down;
+
+	for (i2 = len2; i2 >= 0; i2--)
+		row[i2] = - (len2 - i2) * buf->gap_cost;
+	for (i1 = len1 - 1; i1 >= 0; i1--) {
+		diag = row[len2];
+		row[len2] = - (len1 - i1) * buf->gap_cost;
+		for (i2 = len2 - 1; i2 >= 0; i2--) {
+			down = row[i2];
+			row[i2] = max3(diag + SUBST_SCORE(buf, from1 + i1,
+							    from2 + i2),
+				       down - buf->gap_cost,
+				       row[i2 + 1] - buf->gap_cost);
+			diag = down;
+		}
+	}
+	return;
+}
+
+static void append_R(NeedwunsBuf *buf, int i1, int i2)
+{
+	buf->al1[buf->nal] = buf->s1[i1];
+	buf->al2[buf->nal] = buf->s2[i2];
+	buf->nal++;
+	return;
+}
+
+static void append_D(NeedwunsBuf *buf, int i1)
+{
+	buf->al1[buf->nal] = buf->s1[i1];
+	buf->al2[buf->nal] = buf->gap_code;
+	buf->nal++;
+	return;
+}
+
+static void append_I(NeedwunsBuf *buf, int i2)
+{
+	buf->al1[buf->nal] = buf->gap_code;
+	buf->al2[buf->nal] = buf->s2[i2];
+	buf->nal++;
+	return;
+}
+
+static void hirschberg(NeedwunsBuf *buf, int from1, int len1,
+		int from2, int len2)
+{
+	int i2, mid1, best_i2, best_sc, sc;
+
+	if (len1 == 0) {
+		for (i2 = 0; i2 < len2; i2++)
+			append_I(buf, from2 + i2);
+		return;
+	}
+	if (len2 == 0) {
+		for (i2 = 0; i2 < len1; i2++)
+			append_D(buf, from1 + i2);
+		return;
+	}
+	if (len1 == 1) {
+		/* Replace the letter of s1 with the best letter of s2, or
+		   delete it. */
+		best_i2 = -1;
+		best_sc = - 2 * buf->gap_cost;
+		for (i2 = 0; i2 < len2; i2++) {
+			sc = SUBST_SCORE(buf, from1, from2 + i2);
+			if (sc >= best_sc) {
+				best_sc = sc;
+				best_i2 = i2;
 			}
-			SCO(i1, i2) = sc;
-			TRA(i1, i2) = tr;
 		}
+		if (best_i2 == -1)
+			append_D(buf, from1);
+		for (i2 = 0; i2 < len2; i2++) {
+			if (i2 == best_i2)
+				append_R(buf, from1, from2 + i2);
+			else
+				append_I(buf, from2 + i2);
+		}
+		return;
 	}
-	al_buf_size = S1->length + S2->length;
-	al1_buf = (char *) R_alloc((long) al_buf_size, sizeof(char));
-	al2_buf = (char *) R_alloc((long) al_buf_size, sizeof(char));
-	nal = 0;
-	al1 = al1_buf + al_buf_size;
-	al2 = al2_buf + al_buf_size;
-	i1 = S1->length; i2 = S2->length;
-	while (i1 >= 1 || i2 >= 1) {
-		nal++;
-		al1--;
-		al2--;
-		j1 = i1 - 1;
-		j2 = i2 - 1;
-		if (i2 == 0)
-			tr = 'D';
-		else if (i1 == 0)
-			tr = 'I';
-		else
-			tr = TRA(i1, i2);
-		switch (tr) {
-		    case 'D':
-			*al1 = S1->ptr[j1];
-			*al2 = gap_code;
-			i1--;
-			break;
-		    case 'I':
-			*al1 = gap_code;
-			*al2 = S2->ptr[j2];
-			i2--;
-			break;
-		    case 'R':
-			*al1 = S1->ptr[j1];
-			*al2 = S2->ptr[j2];
-			i1--;
-			i2--;
-			break;
-		    default:
-			error("unknown traceback code %d", (int) tr);
-			break;
+	mid1 = len1 / 2;
+	set_fwd_row(buf, from1, mid1, from2, len2, buf->fwd_row);
+	set_bwd_row(buf, from1 + mid1, len1 - mid1, from2, len2, buf->bwd_row);
+	best_i2 = 0;
+	for (i2 = 1; i2 <= len2; i2++) {
+		if (buf->fwd_row[i2] + buf->bwd_row[i2] >=
+		    buf->fwd_row[best_i2] + buf->bwd_row[best_i2])
+			best_i2 = i2;
+	}
+	hirschberg(buf, from1, mid1, from2, best_i2);
+	hirschberg(buf, from1 + mid1, len1 - mid1,
+		   from2 + best_i2, len2 - best_i2);
+	return;
+}
+
+/* Returns the score of the alignment stored in 'buf'. */
+static int get_alignment_score(const NeedwunsBuf *buf)
+{
+	int score, i, i1, i2;
+
+	score = 0;
+	for (i = i1 = i2 = 0; i < buf->nal; i++) {
+		if (buf->al1[i] == buf->gap_code) {
+			score -= buf->gap_cost;
+			i2++;
+		} else if (buf->al2[i] == buf->gap_code) {
+			score -= buf->gap_cost;
+			i1++;
+		} else {
+			score += SUBST_SCORE(buf, i1, i2);
+			i1++;
+			i2++;
 		}
 	}
-	return sc;
+	return score;
+}
+
+/* Returns the score of the alignment */
+static int needwunsQS(NeedwunsBuf *buf, const Chars_holder *S1,
+		const Chars_holder *S2, const int *lkup, int lkup_length)
+{
+	int al_buf_size;
+
+	buf->s1 = S1->ptr;
+	buf->s2 = S2->ptr;
+	buf->codes1 = get_codes(S1, lkup, lkup_length);
+	buf->codes2 = get_codes(S2, lkup, lkup_length);
+	buf->fwd_row = (int *) R_alloc((long) S2->length + 1, sizeof(int));
+	buf->bwd_row = (int *) R_alloc((long) S2->length + 1, sizeof(int));
+	al_buf_size = S1->length + S2->length;
+	buf->al1 = (char *) R_alloc((long) al_buf_size, sizeof(char));
+	buf->al2 = (char *) R_alloc((long) al_buf_size, sizeof(char));
+	buf->nal = 0;
+	hirschberg(buf, 0, S1->length, 0, S2->length);
+	return get_alignment_score(buf);
 }
 
 /*
@@ -120,15 +248,17 @@ SEXP align_needwunsQS(SEXP s1, SEXP s2,
 		SEXP gap_cost, SEXP gap_code)
 {
 	Chars_holder S1, S2;
-	int nrow, score;
+	NeedwunsBuf buf;
+	int score;
 	SEXP ans, ans_names, tag, ans_elt;
 
 	S1 = hold_XRaw(s1);
 	S2 = hold_XRaw(s2);
-	nrow = INTEGER(mat_nrow)[0];
-	score = needwunsQS(&S1, &S2,
-		   INTEGER(mat), nrow, INTEGER(lkup), LENGTH(lkup),
-		   INTEGER(gap_cost)[0], (char) RAW(gap_code)[0]);
+	buf.mat = INTEGER(mat);
+	buf.mat_nrow = INTEGER(mat_nrow)[0];
+	buf.gap_cost = INTEGER(gap_cost)[0];
+	buf.gap_code = (char) RAW(gap_code)[0];
+	score = needwunsQS(&buf, &S1, &S2, INTEGER(lkup), LENGTH(lkup));
 
 	PROTECT(ans = NEW_LIST(3));
 	/* set the names */
@@ -139,14 +269,14 @@ SEXP align_needwunsQS(SEXP s1, SEXP s2,
 	SET_NAMES(ans, ans_names);
 	UNPROTECT(1);
 	/* set the "al1" element */
-	PROTECT(tag = NEW_RAW(nal));
-	memcpy((char *) RAW(tag), al1, nal * sizeof(char));
+	PROTECT(tag = NEW_RAW(buf.nal));
+	memcpy((char *) RAW(tag), buf.al1, buf.nal * sizeof(char));
 	PROTECT(ans_elt = new_SharedVector("SharedRaw", tag));
 	SET_ELEMENT(ans, 0, ans_elt);
 	UNPROTECT(2);
 	/* set the "al2" element */
-	PROTECT(tag = NEW_RAW(nal));
-	memcpy((char *) RAW(tag), al2, nal * sizeof(char));
+	PROTECT(tag = NEW_RAW(buf.nal));
+	memcpy((char *) RAW(tag), buf.al2, buf.nal * sizeof(char));
 	PROTECT(ans_elt = new_SharedVector("SharedRaw", tag));
 	SET_ELEMENT(ans, 1, ans_elt);
 	UNPROTECT(2);
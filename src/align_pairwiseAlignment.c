@@ -4,6 +4,8 @@
 #include <R_ext/Utils.h>        /* R_CheckUserInterrupt */
 
 #include <float.h>
+#include <math.h>               /* for floor(), fabs() */
+#include <limits.h>             /* for INT_MAX */
 #include <stdlib.h>
 
 #define MAX(x, y) (x > y ? x : y)
@@ -19,16 +21,25 @@
 #define GLOBAL_LOCAL_ALIGNMENT 4
 #define LOCAL_GLOBAL_ALIGNMENT 5
 
-#define SUBSTITUTION 'S'
-#define DELETION     'D'
-#define INSERTION    'I'
-#define TERMINATION  'T'
+/* Traceback codes. They fit in 2 bits. */
+#define SUBSTITUTION 0
+#define DELETION     1
+#define INSERTION    2
+#define TERMINATION  3
 
 #define CURR_MATRIX(i, j) (currMatrix[i + nCharString1Plus1 * j])
 #define PREV_MATRIX(i, j) (prevMatrix[i + nCharString1Plus1 * j])
-#define S_TRACE_MATRIX(i, j) (sTraceMatrix[i + nCharString1 * j])
-#define D_TRACE_MATRIX(i, j) (dTraceMatrix[i + nCharString1 * j])
-#define I_TRACE_MATRIX(i, j) (iTraceMatrix[i + nCharString1 * j])
+/* The 3 traceback codes of a cell (for the substitution, deletion and
+ * insertion matrices) are packed in a single byte. */
+#define TRACE_MATRIX(i, j) (traceMatrix[i + nCharString1 * j])
+#define PACK_TRACE(s, d, i) ((unsigned char) ((s) | ((d) << 2) | ((i) << 4)))
+#define S_TRACE_MATRIX(i, j) (TRACE_MATRIX(i, j) & 3)
+#define D_TRACE_MATRIX(i, j) ((TRACE_MATRIX(i, j) >> 2) & 3)
+#define I_TRACE_MATRIX(i, j) ((TRACE_MATRIX(i, j) >> 4) & 3)
+#define SET_D_TRACE_MATRIX(i, j, code) \
+	(TRACE_MATRIX(i, j) = (TRACE_MATRIX(i, j) & ~(3 << 2)) | ((code) << 2))
+#define SET_I_TRACE_MATRIX(i, j, code) \
+	(TRACE_MATRIX(i, j) = (TRACE_MATRIX(i, j) & ~(3 << 4)) | ((code) << 4))
 #define FUZZY_MATRIX(i, j) (fuzzyMatrix[i + fuzzyMatrixDim[0] * j])
 #define SUBSTITUTION_ARRAY(i, j, k) (substitutionArray[i + substitutionArrayDim[0] * (j + substitutionArrayDim[1] * k)])
 
@@ -95,9 +106,27 @@ void print_AlignInfo(const struct AlignInfo *alignInfoPtr)
 struct AlignBuffer {
 	float *currMatrix;
 	float *prevMatrix;
-	char *sTraceMatrix;
-	char *iTraceMatrix;
-	char *dTraceMatrix;
+	unsigned char *traceMatrix;
+
+	/* Query profile of string1 (see get_profile_row() below). */
+	int *element1;     /* substitution index of each letter of string1 */
+	int *stringElt1;   /* fuzzy index of each letter of string1 */
+	float *profile;    /* 'profileMaxNRow' score rows */
+	int *intProfile;   /* replaces 'profile' when 'useIntScores' is true */
+	int *profileRow;   /* row in 'profile' of each subject key */
+	int *profileStamp; /* generation at which the row was computed */
+	int profileNRow;
+	int profileMaxNRow;
+	int stamp;
+	/* string1 (and the sequence used for its substitution indices) that
+	 * 'element1' and 'stringElt1' were computed for */
+	Chars_holder profileString1;
+	Chars_holder profileSequence1;
+
+	/* Integer scores (see intScoreOnlyAlignment() below) */
+	int useIntScores;
+	int *currIntMatrix;
+	int *prevIntMatrix;
 };
 void function2(struct AlignBuffer *);
 
@@ -121,6 +150,175 @@ struct IndelBuffer {
 };
 void function4(struct IndelBuffer *);
 
+/*
+ * Query profile.
+ *
+ * The score of aligning letter i of string1 with letter j of string2 only
+ * depends on i and on the "subject key" of letter j, i.e. on the pair
+ * (fuzzy index, substitution index) of letter j. So for each subject key
+ * found in string2 we compute once the full column of substitution scores
+ * against string1. The inner loops of pairwiseAlignment() then read this
+ * contiguous row instead of doing 2 table lookups, 1 fuzzy matrix lookup and
+ * 1 substitution array lookup per cell.
+ * The rows are computed lazily and are cached in the AlignBuffer until the
+ * next call to set_profile_string1(). When the cache is full it's simply
+ * emptied.
+ */
+
+static void alloc_AlignBuffer_profile(struct AlignBuffer *alignBufferPtr,
+		const int alignmentBufferSize,
+		const int *substitutionArrayDim,
+		const int *fuzzyMatrixDim,
+		const int useIntScores)
+{
+	int nkey = fuzzyMatrixDim[1] * substitutionArrayDim[1];
+
+	alignBufferPtr->element1 = (int *) R_alloc((long) alignmentBufferSize, sizeof(int));
+	alignBufferPtr->stringElt1 = (int *) R_alloc((long) alignmentBufferSize, sizeof(int));
+	alignBufferPtr->profileMaxNRow = MIN(nkey, MAX(1, MAX_BUF_SIZE / alignmentBufferSize));
+	alignBufferPtr->useIntScores = useIntScores;
+	if (useIntScores) {
+		alignBufferPtr->profile = NULL;
+		alignBufferPtr->intProfile = (int *) R_alloc((long) alignBufferPtr->profileMaxNRow *
+							     alignmentBufferSize, sizeof(int));
+		alignBufferPtr->currIntMatrix = (int *) R_alloc((long) 3 * alignmentBufferSize, sizeof(int));
+		alignBufferPtr->prevIntMatrix = (int *) R_alloc((long) 3 * alignmentBufferSize, sizeof(int));
+	} else {
+		alignBufferPtr->profile = (float *) R_alloc((long) alignBufferPtr->profileMaxNRow *
+							    alignmentBufferSize, sizeof(float));
+		alignBufferPtr->intProfile = NULL;
+		alignBufferPtr->currIntMatrix = NULL;
+		alignBufferPtr->prevIntMatrix = NULL;
+	}
+	alignBufferPtr->profileRow = (int *) R_alloc((long) nkey, sizeof(int));
+	alignBufferPtr->profileStamp = (int *) R_alloc((long) nkey, sizeof(int));
+	memset(alignBufferPtr->profileStamp, 0, nkey * sizeof(int));
+	alignBufferPtr->profileNRow = 0;
+	alignBufferPtr->stamp = 0;
+	alignBufferPtr->profileString1.ptr = NULL;
+	alignBufferPtr->profileString1.length = -1;
+	alignBufferPtr->profileSequence1.ptr = NULL;
+	alignBufferPtr->profileSequence1.length = -1;
+	return;
+}
+
+static void reset_profile(struct AlignBuffer *alignBufferPtr, const int nkey)
+{
+	if (alignBufferPtr->stamp == INT_MAX) {
+		memset(alignBufferPtr->profileStamp, 0, nkey * sizeof(int));
+		alignBufferPtr->stamp = 0;
+	}
+	alignBufferPtr->stamp++;
+	alignBufferPtr->profileNRow = 0;
+	return;
+}
+
+/* The letters of string1 are stored in reverse order, like the rows of the
+ * DP matrices. Nothing needs to be done when string1 is the same as in the
+ * previous call (e.g. when a single pattern is aligned against many
+ * subjects): the cached profile rows are still valid. */
+static void set_profile_string1(struct AlignBuffer *alignBufferPtr,
+		const Chars_holder *string1,
+		const Chars_holder *sequence1,
+		const int scalar1,
+		const int *substitutionLookupTable,
+		const int substitutionLookupTableLength,
+		const int *fuzzyLookupTable,
+		const int fuzzyLookupTableLength,
+		const int nkey)
+{
+	int iMinus1, iElt, lookupValue = 0;
+
+	if (string1->ptr == alignBufferPtr->profileString1.ptr &&
+	    string1->length == alignBufferPtr->profileString1.length &&
+	    sequence1->ptr == alignBufferPtr->profileSequence1.ptr &&
+	    sequence1->length == alignBufferPtr->profileSequence1.length)
+		return;
+	for (iMinus1 = 0, iElt = string1->length - 1; iElt >= 0; iMinus1++, iElt--) {
+		SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, string1->ptr[iElt]);
+		alignBufferPtr->stringElt1[iMinus1] = lookupValue;
+		SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength,
+				 sequence1->ptr[scalar1 ? 0 : iElt]);
+		alignBufferPtr->element1[iMinus1] = lookupValue;
+	}
+	alignBufferPtr->profileString1 = *string1;
+	alignBufferPtr->profileSequence1 = *sequence1;
+	reset_profile(alignBufferPtr, nkey);
+	return;
+}
+
+/* Returns the offset in the profile of the row of the subject key
+ * (stringElt2, element2). Sets '*isNew' to 1 if the row still has to be
+ * filled. */
+static long get_profile_offset(struct AlignBuffer *alignBufferPtr,
+		const int nCharString1,
+		const int element2,
+		const int stringElt2,
+		const int *substitutionArrayDim,
+		const int *fuzzyMatrixDim,
+		int *isNew)
+{
+	int key;
+
+	key = stringElt2 * substitutionArrayDim[1] + element2;
+	*isNew = alignBufferPtr->profileStamp[key] != alignBufferPtr->stamp;
+	if (*isNew) {
+		if (alignBufferPtr->profileNRow == alignBufferPtr->profileMaxNRow)
+			reset_profile(alignBufferPtr, fuzzyMatrixDim[1] * substitutionArrayDim[1]);
+		alignBufferPtr->profileRow[key] = alignBufferPtr->profileNRow++;
+		alignBufferPtr->profileStamp[key] = alignBufferPtr->stamp;
+	}
+	return (long) alignBufferPtr->profileRow[key] * nCharString1;
+}
+
+static const float *get_profile_row(struct AlignBuffer *alignBufferPtr,
+		const int nCharString1,
+		const int element2,
+		const int stringElt2,
+		const double *substitutionArray,
+		const int *substitutionArrayDim,
+		const int *fuzzyMatrix,
+		const int *fuzzyMatrixDim)
+{
+	int iMinus1, fuzzy, isNew;
+	float *row;
+
+	row = alignBufferPtr->profile +
+	      get_profile_offset(alignBufferPtr, nCharString1, element2, stringElt2,
+				 substitutionArrayDim, fuzzyMatrixDim, &isNew);
+	if (!isNew)
+		return row;
+	for (iMinus1 = 0; iMinus1 < nCharString1; iMinus1++) {
+		fuzzy = FUZZY_MATRIX(alignBufferPtr->stringElt1[iMinus1], stringElt2);
+		row[iMinus1] = (float) SUBSTITUTION_ARRAY(alignBufferPtr->element1[iMinus1], element2, fuzzy);
+	}
+	return row;
+}
+
+static const int *get_int_profile_row(struct AlignBuffer *alignBufferPtr,
+		const int nCharString1,
+		const int element2,
+		const int stringElt2,
+		const double *substitutionArray,
+		const int *substitutionArrayDim,
+		const int *fuzzyMatrix,
+		const int *fuzzyMatrixDim)
+{
+	int iMinus1, fuzzy, isNew;
+	int *row;
+
+	row = alignBufferPtr->intProfile +
+	      get_profile_offset(alignBufferPtr, nCharString1, element2, stringElt2,
+				 substitutionArrayDim, fuzzyMatrixDim, &isNew);
+	if (!isNew)
+		return row;
+	for (iMinus1 = 0; iMinus1 < nCharString1; iMinus1++) {
+		fuzzy = FUZZY_MATRIX(alignBufferPtr->stringElt1[iMinus1], stringElt2);
+		row[iMinus1] = (int) SUBSTITUTION_ARRAY(alignBufferPtr->element1[iMinus1], element2, fuzzy);
+	}
+	return row;
+}
+
 /* Traceback through the score matrices */
 static void traceback(const struct AlignBuffer *alignBufferPtr,
 		      char currTraceMatrix,
@@ -129,9 +327,7 @@ static void traceback(const struct AlignBuffer *alignBufferPtr,
 {
 	int i, j;
 	char prevTraceMatrix = '?';
-	const char *sTraceMatrix = alignBufferPtr->sTraceMatrix;
-	const char *iTraceMatrix = alignBufferPtr->iTraceMatrix;
-	const char *dTraceMatrix = alignBufferPtr->dTraceMatrix;
+	const unsigned char *traceMatrix = alignBufferPtr->traceMatrix;
 	const int nCharString1 = align1InfoPtr->string.length;
 	const int nCharString2 = align2InfoPtr->string.length;
 	const int nCharString1Minus1 = nCharString1 - 1;
@@ -216,6 +412,325 @@ static void traceback(const struct AlignBuffer *alignBufferPtr,
 	return;
 }
 
+/*
+ * X-drop pruning for local and overlap alignments.
+ *
+ * A cell whose best score (over the 3 matrices) falls more than 'value' below
+ * the best score seen so far is abandoned: its scores are set to -Inf. The
+ * rows of a column that can still be reached from a live cell form a range
+ * that follows the live cells of the previous column, so the cells outside
+ * this range are never computed. Local alignments stop as soon as a column
+ * has no live cell left.
+ * With Z-drop (as in minimap2) the allowed drop also grows by 'gapExtension'
+ * per row of distance between the diagonal of the cell and the diagonal of
+ * the best cell, so that a long gap is not mistaken for a divergent region.
+ * Note that the cells of a column are only guaranteed to be set (possibly to
+ * -Inf) in the computed range extended by 1 row on each side, and in the last
+ * row.
+ */
+#define NO_ROW -1
+#define KILL_CURR_ROW(i) \
+{ \
+	CURR_MATRIX(i, 0) = NEGATIVE_INFINITY; \
+	CURR_MATRIX(i, 1) = NEGATIVE_INFINITY; \
+	CURR_MATRIX(i, 2) = NEGATIVE_INFINITY; \
+}
+#define KILL_PREV_ROW(i) \
+{ \
+	PREV_MATRIX(i, 0) = NEGATIVE_INFINITY; \
+	PREV_MATRIX(i, 1) = NEGATIVE_INFINITY; \
+	PREV_MATRIX(i, 2) = NEGATIVE_INFINITY; \
+}
+
+struct DropOff {
+	int active;
+	int zdrop;
+	float value;
+	float gapExtension;
+
+	/* Set by pairwiseAlignment() */
+	float bestScore;
+	int iBest;
+	int jBest;
+	int prevFirst;     /* first live row of the previous column */
+	int prevLast;      /* last live row of the previous column */
+	int currFirst;     /* first live row of the current column */
+	int currLast;      /* last live row of the current column */
+};
+
+static void reset_DropOff(struct DropOff *dropOffPtr)
+{
+	dropOffPtr->bestScore = NEGATIVE_INFINITY;
+	dropOffPtr->iBest = dropOffPtr->jBest = 0;
+	dropOffPtr->prevFirst = dropOffPtr->prevLast = NO_ROW;
+	dropOffPtr->currFirst = dropOffPtr->currLast = NO_ROW;
+	return;
+}
+
+static void prune_DropOff_cell(struct DropOff *dropOffPtr, float *currMatrix,
+		const int nCharString1Plus1, const int i, const int j)
+{
+	float cellScore, maxDrop;
+	int diagDist;
+
+	cellScore = MAX(CURR_MATRIX(i, 0), MAX(CURR_MATRIX(i, 1), CURR_MATRIX(i, 2)));
+	maxDrop = dropOffPtr->value;
+	if (dropOffPtr->zdrop) {
+		diagDist = abs((i - dropOffPtr->iBest) - (j - dropOffPtr->jBest));
+		if (diagDist > 0)
+			maxDrop += diagDist * dropOffPtr->gapExtension;
+	}
+	if (cellScore == NEGATIVE_INFINITY || cellScore < dropOffPtr->bestScore - maxDrop) {
+		KILL_CURR_ROW(i);
+		return;
+	}
+	if (cellScore > dropOffPtr->bestScore) {
+		dropOffPtr->bestScore = cellScore;
+		dropOffPtr->iBest = i;
+		dropOffPtr->jBest = j;
+	}
+	if (dropOffPtr->currFirst == NO_ROW)
+		dropOffPtr->currFirst = i;
+	dropOffPtr->currLast = i;
+	return;
+}
+
+/*
+ * Must be called once row 0 of the current column has been set. Prunes it and
+ * returns the first row of the current column to compute. Rows after '*iLast'
+ * only need to be computed as long as the row above them is live.
+ */
+static int start_DropOff_column(struct DropOff *dropOffPtr, float *currMatrix,
+		const int nCharString1, const int j, int *iLast)
+{
+	const int nCharString1Plus1 = nCharString1 + 1;
+	int iFirst;
+
+	dropOffPtr->prevFirst = dropOffPtr->currFirst;
+	dropOffPtr->prevLast = dropOffPtr->currLast;
+	dropOffPtr->currFirst = dropOffPtr->currLast = NO_ROW;
+	prune_DropOff_cell(dropOffPtr, currMatrix, nCharString1Plus1, 0, j);
+	if (dropOffPtr->currFirst == 0)
+		iFirst = 1;
+	else if (dropOffPtr->prevFirst == NO_ROW)
+		iFirst = nCharString1Plus1;
+	else
+		iFirst = MAX(1, dropOffPtr->prevFirst);
+	*iLast = dropOffPtr->prevLast + 1;
+	if (iFirst >= 2)
+		KILL_CURR_ROW(iFirst - 1);
+	return iFirst;
+}
+
+/*
+ * Rows 'iFirst' to 'iEnd' - 1 of the current column have been computed. Sets
+ * row 'iEnd' and the last row to -Inf if they were not computed, or all the
+ * rows that were not computed if 'fillAll' is true.
+ */
+static void end_DropOff_column(float *currMatrix, const int nCharString1,
+		const int iFirst, const int iEnd, const int fillAll)
+{
+	const int nCharString1Plus1 = nCharString1 + 1;
+	int i;
+
+	if (iEnd <= nCharString1) {
+		KILL_CURR_ROW(iEnd);
+		KILL_CURR_ROW(nCharString1);
+	}
+	if (fillAll) {
+		for (i = 1; i < iFirst - 1; i++)
+			KILL_CURR_ROW(i);
+		for (i = iEnd + 1; i < nCharString1; i++)
+			KILL_CURR_ROW(i);
+	}
+	return;
+}
+
+/* Alignment of 2 strings when at least one of them is empty */
+static double zeroCharAlignment(
+		struct AlignInfo *align1InfoPtr,
+		struct AlignInfo *align2InfoPtr,
+		const float gapOpening,
+		const float gapExtension)
+{
+	const int nCharString1 = align1InfoPtr->string.length;
+	const int nCharString2 = align2InfoPtr->string.length;
+	double zeroCharScore;
+
+	align1InfoPtr->startRange = -1;
+	align2InfoPtr->startRange = -1;
+	align1InfoPtr->widthRange = 0;
+	align2InfoPtr->widthRange = 0;
+	if (nCharString1 >= 1 && align1InfoPtr->endGap)
+		zeroCharScore = - gapOpening - nCharString1 * gapExtension;
+	else if (nCharString2 >= 1 && align2InfoPtr->endGap)
+		zeroCharScore = - gapOpening - nCharString2 * gapExtension;
+	else
+		zeroCharScore = 0.0;
+	align1InfoPtr->lengthMismatch = 0;
+	align2InfoPtr->lengthMismatch = 0;
+	align1InfoPtr->lengthIndel = 0;
+	align2InfoPtr->lengthIndel = 0;
+	return zeroCharScore;
+}
+
+/*
+ * Integer scores.
+ *
+ * When the substitution scores and the gap penalties are all integers, the
+ * scores of the DP matrices are integers too and they can be computed with
+ * int arithmetic instead of float arithmetic. The int rows are as compact as
+ * the float rows but integer additions and comparisons are cheaper and easier
+ * to vectorize for the compiler.
+ * The float computations are exact as long as all the scores stay below 2^24
+ * in absolute value, so the integer scores are only used in that case: the
+ * returned scores are then identical to the float ones. -Inf is represented
+ * by INT_NEGATIVE_INFINITY, which is low enough to stay below any real score
+ * and high enough to never overflow when penalties are subtracted from it.
+ */
+#define MAX_EXACT_FLOAT_SCORE 16777216.0  /* 2^24 */
+#define INT_NEGATIVE_INFINITY (INT_MIN / 2)
+#define CURR_INT_MATRIX(i, j) (currIntMatrix[i + nCharString1Plus1 * j])
+#define PREV_INT_MATRIX(i, j) (prevIntMatrix[i + nCharString1Plus1 * j])
+
+/* Can the scores of the alignments of strings of at most 'maxNChar1' and
+ * 'maxNChar2' letters be computed with integers? */
+static int use_int_scores(const double *substitutionArray,
+		const int substitutionArrayLength,
+		const float gapOpening,
+		const float gapExtension,
+		const int maxNChar1,
+		const int maxNChar2)
+{
+	double maxAbsScore = 0.0, value;
+	int i;
+
+	if (!R_FINITE(gapOpening) || !R_FINITE(gapExtension) ||
+	    gapOpening != floor(gapOpening) || gapExtension != floor(gapExtension))
+		return 0;
+	for (i = 0; i < substitutionArrayLength; i++) {
+		value = substitutionArray[i];
+		if (!R_FINITE(value) || value != floor(value))
+			return 0;
+		maxAbsScore = MAX(maxAbsScore, fabs(value));
+	}
+	/* Each of the (at most) maxNChar1 + maxNChar2 steps of a path through
+	 * the DP matrices adds at most 1 substitution score or 1 gap opening
+	 * and 1 gap extension penalty. */
+	return ((double) maxNChar1 + maxNChar2 + 1) *
+	       (maxAbsScore + fabs(gapOpening) + fabs(gapExtension)) < MAX_EXACT_FLOAT_SCORE;
+}
+
+/* Same as the 'scoreOnly' part of pairwiseAlignment() below (without X-drop
+ * pruning) but with int scores */
+static double intScoreOnlyAlignment(
+		const struct AlignInfo *align1InfoPtr,
+		const struct AlignInfo *align2InfoPtr,
+		const Chars_holder *sequence2,
+		const int scalar2,
+		const int localAlignment,
+		const int gapOpening,
+		const int gapExtension,
+		const double *substitutionArray,
+		const int *substitutionArrayDim,
+		const int *substitutionLookupTable,
+		const int substitutionLookupTableLength,
+		const int *fuzzyMatrix,
+		const int *fuzzyMatrixDim,
+		const int *fuzzyLookupTable,
+		const int fuzzyLookupTableLength,
+		struct AlignBuffer *alignBufferPtr)
+{
+	int i, j, iMinus1, jElt, lookupValue = 0, element2, stringElt2;
+	const int nCharString1 = align1InfoPtr->string.length;
+	const int nCharString2 = align2InfoPtr->string.length;
+	const int nCharString1Plus1 = nCharString1 + 1;
+	const int noEndGap1 = !align1InfoPtr->endGap;
+	const int noEndGap2 = !align2InfoPtr->endGap;
+	const int gapOpeningPlusExtension = gapOpening + gapExtension;
+	const int endGapAddend = (align2InfoPtr->endGap ? - gapExtension : 0);
+	int *currIntMatrix = alignBufferPtr->currIntMatrix;
+	int *prevIntMatrix = alignBufferPtr->prevIntMatrix;
+	int *tempMatrix, substitutionValue, maxScore = INT_NEGATIVE_INFINITY;
+	const int *profileRow;
+
+	CURR_INT_MATRIX(0, 0) = 0;
+	CURR_INT_MATRIX(0, 1) = (align2InfoPtr->endGap ? - gapOpening : 0);
+	for (i = 1; i <= nCharString1; i++) {
+		CURR_INT_MATRIX(i, 0) = INT_NEGATIVE_INFINITY;
+		CURR_INT_MATRIX(i, 1) = INT_NEGATIVE_INFINITY;
+	}
+	for (i = 0; i <= nCharString1; i++)
+		CURR_INT_MATRIX(i, 2) = (noEndGap1 ? 0 : - gapOpening - i * gapExtension);
+
+	for (j = 1, jElt = nCharString2 - 1; j <= nCharString2; j++, jElt--) {
+		tempMatrix = prevIntMatrix;
+		prevIntMatrix = currIntMatrix;
+		currIntMatrix = tempMatrix;
+
+		CURR_INT_MATRIX(0, 0) = INT_NEGATIVE_INFINITY;
+		CURR_INT_MATRIX(0, 1) = PREV_INT_MATRIX(0, 1) + endGapAddend;
+		CURR_INT_MATRIX(0, 2) = INT_NEGATIVE_INFINITY;
+
+		SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, align2InfoPtr->string.ptr[jElt]);
+		stringElt2 = lookupValue;
+		SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence2->ptr[scalar2 ? 0 : jElt]);
+		element2 = lookupValue;
+		profileRow = get_int_profile_row(alignBufferPtr, nCharString1, element2, stringElt2,
+						 substitutionArray, substitutionArrayDim,
+						 fuzzyMatrix, fuzzyMatrixDim);
+		if (localAlignment) {
+			for (i = 1, iMinus1 = 0; i <= nCharString1; i++, iMinus1++) {
+				substitutionValue = profileRow[iMinus1];
+				CURR_INT_MATRIX(i, 0) =
+					MAX(0,
+						MAX(PREV_INT_MATRIX(iMinus1, 0),
+						MAX(PREV_INT_MATRIX(iMinus1, 1), PREV_INT_MATRIX(iMinus1, 2))) + substitutionValue);
+				CURR_INT_MATRIX(i, 1) =
+					MAX(MAX(PREV_INT_MATRIX(i, 0), PREV_INT_MATRIX(i, 2)) - gapOpeningPlusExtension,
+					    PREV_INT_MATRIX(i, 1) - gapExtension);
+				CURR_INT_MATRIX(i, 2) =
+					MAX(MAX(CURR_INT_MATRIX(iMinus1, 0), CURR_INT_MATRIX(iMinus1, 1)) - gapOpeningPlusExtension,
+					    CURR_INT_MATRIX(iMinus1, 2) - gapExtension);
+				maxScore = MAX(CURR_INT_MATRIX(i, 0), maxScore);
+			}
+		} else {
+			for (i = 1, iMinus1 = 0; i <= nCharString1; i++, iMinus1++) {
+				substitutionValue = profileRow[iMinus1];
+				CURR_INT_MATRIX(i, 0) =
+					MAX(PREV_INT_MATRIX(iMinus1, 0),
+					MAX(PREV_INT_MATRIX(iMinus1, 1), PREV_INT_MATRIX(iMinus1, 2))) + substitutionValue;
+				CURR_INT_MATRIX(i, 1) =
+					MAX(MAX(PREV_INT_MATRIX(i, 0), PREV_INT_MATRIX(i, 2)) - gapOpeningPlusExtension,
+					    PREV_INT_MATRIX(i, 1) - gapExtension);
+				CURR_INT_MATRIX(i, 2) =
+					MAX(MAX(CURR_INT_MATRIX(iMinus1, 0), CURR_INT_MATRIX(iMinus1, 1)) - gapOpeningPlusExtension,
+					    CURR_INT_MATRIX(iMinus1, 2) - gapExtension);
+			}
+			if (noEndGap2) {
+				CURR_INT_MATRIX(nCharString1, 1) =
+					MAX(PREV_INT_MATRIX(nCharString1, 0),
+					MAX(PREV_INT_MATRIX(nCharString1, 1), PREV_INT_MATRIX(nCharString1, 2)));
+			}
+			if (noEndGap1 && j == nCharString2) {
+				for (i = 1, iMinus1 = 0; i <= nCharString1; i++, iMinus1++) {
+					CURR_INT_MATRIX(i, 2) =
+						MAX(MAX(CURR_INT_MATRIX(iMinus1, 0), CURR_INT_MATRIX(iMinus1, 1)),
+						    CURR_INT_MATRIX(iMinus1, 2));
+				}
+			}
+		}
+	}
+
+	if (!localAlignment) {
+		maxScore =
+			MAX(CURR_INT_MATRIX(nCharString1, 0),
+			MAX(CURR_INT_MATRIX(nCharString1, 1),
+			    CURR_INT_MATRIX(nCharString1, 2)));
+	}
+	return (double) maxScore;
+}
+
 /* Returns the score of the optimal pairwise alignment */
 static double pairwiseAlignment(
 		struct AlignInfo *align1InfoPtr,
@@ -233,6 +748,7 @@ static double pairwiseAlignment(
 		const int *fuzzyMatrixDim,
 		const int *fuzzyLookupTable,
 		const int fuzzyLookupTableLength,
+		const struct DropOff *dropOffPtr,
 		struct AlignBuffer *alignBufferPtr)
 {
 	int i, j, iMinus1, jMinus1;
@@ -244,24 +760,13 @@ static double pairwiseAlignment(
 	const int nCharString1Minus1 = nCharString1 - 1;
 	const int nCharString2Minus1 = nCharString2 - 1;
 
+	if (nCharString1 < 1 || nCharString2 < 1)
+		return zeroCharAlignment(align1InfoPtr, align2InfoPtr, gapOpening, gapExtension);
+
 	align1InfoPtr->startRange = -1;
 	align2InfoPtr->startRange = -1;
 	align1InfoPtr->widthRange = 0;
 	align2InfoPtr->widthRange = 0;
-	if (nCharString1 < 1 || nCharString2 < 1) {
-		double zeroCharScore;
-		if (nCharString1 >= 1 && align1InfoPtr->endGap)
-			zeroCharScore = - gapOpening - nCharString1 * gapExtension;
-		else if (nCharString2 >= 1 && align2InfoPtr->endGap)
-			zeroCharScore = - gapOpening - nCharString2 * gapExtension;
-		else
-			zeroCharScore = 0.0;
-		align1InfoPtr->lengthMismatch = 0;
-		align2InfoPtr->lengthMismatch = 0;
-		align1InfoPtr->lengthIndel = 0;
-		align2InfoPtr->lengthIndel = 0;
-		return zeroCharScore;
-	}
 
 	/* Step 2:  Create objects for scores values */
 	/* Rows of currMatrix and prevMatrix = (0) substitution, (1) deletion, and (2) insertion */
@@ -281,6 +786,19 @@ static double pairwiseAlignment(
 			CURR_MATRIX(i, 2) = 0.0;
 	}
 
+	/* Step 2a:  Prune the first column (see X-drop pruning above) */
+	struct DropOff dropOff;
+	int iFirst = 1, iLast = nCharString1;
+	if (dropOffPtr != NULL)
+		dropOff = *dropOffPtr;
+	else
+		dropOff.active = 0;
+	reset_DropOff(&dropOff);
+	if (dropOff.active) {
+		for (i = 0; i <= nCharString1; i++)
+			prune_DropOff_cell(&dropOff, currMatrix, nCharString1Plus1, i, 0);
+	}
+
 	/* Step 3:  Perform main alignment operations */
 	Chars_holder sequence1, sequence2;
 	int scalar1, scalar2;
@@ -295,7 +813,20 @@ static double pairwiseAlignment(
 		scalar1 = (nCharString1 == 1);
 		scalar2 = (nCharString2 == 1);
 	}
-	int lookupValue = 0, element1, element2, stringElt1, stringElt2, fuzzy, iElt, jElt;
+	set_profile_string1(alignBufferPtr, &(align1InfoPtr->string), &sequence1, scalar1,
+			    substitutionLookupTable, substitutionLookupTableLength,
+			    fuzzyLookupTable, fuzzyLookupTableLength,
+			    fuzzyMatrixDim[1] * substitutionArrayDim[1]);
+	if (scoreOnly && alignBufferPtr->useIntScores)
+		return intScoreOnlyAlignment(align1InfoPtr, align2InfoPtr, &sequence2, scalar2,
+					     localAlignment, (int) gapOpening, (int) gapExtension,
+					     substitutionArray, substitutionArrayDim,
+					     substitutionLookupTable, substitutionLookupTableLength,
+					     fuzzyMatrix, fuzzyMatrixDim,
+					     fuzzyLookupTable, fuzzyLookupTableLength,
+					     alignBufferPtr);
+	int lookupValue = 0, element2, stringElt2, iElt, jElt;
+	const float *profileRow;
 	const int noEndGap1 = !align1InfoPtr->endGap;
 	const int noEndGap2 = !align2InfoPtr->endGap;
 	const float gapOpeningPlusExtension = gapOpening + gapExtension;
@@ -312,19 +843,26 @@ static double pairwiseAlignment(
 			CURR_MATRIX(0, 0) = NEGATIVE_INFINITY;
 			CURR_MATRIX(0, 1) = PREV_MATRIX(0, 1) + endGapAddend;
 			CURR_MATRIX(0, 2) = NEGATIVE_INFINITY;
+			if (dropOff.active)
+				iFirst = start_DropOff_column(&dropOff, currMatrix, nCharString1, j, &iLast);
 
 			SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, align2InfoPtr->string.ptr[jElt]);
 			stringElt2 = lookupValue;
 			SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence2.ptr[scalar2 ? 0 : jElt]);
 			element2 = lookupValue;
+			profileRow = get_profile_row(alignBufferPtr, nCharString1, element2, stringElt2,
+						     substitutionArray, substitutionArrayDim,
+						     fuzzyMatrix, fuzzyMatrixDim);
 			if (localAlignment) {
-				for (i = 1, iMinus1 = 0, iElt = nCharString1Minus1; i <= nCharString1; i++, iMinus1++, iElt--) {
-					SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, align1InfoPtr->string.ptr[iElt]);
-					stringElt1 = lookupValue;
-					SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence1.ptr[scalar1 ? 0 : iElt]);
-					element1 = lookupValue;
-					fuzzy = FUZZY_MATRIX(stringElt1, stringElt2);
-					substitutionValue = (float) SUBSTITUTION_ARRAY(element1, element2, fuzzy);
+				for (i = iFirst, iMinus1 = iFirst - 1, iElt = nCharString1 - iFirst; i <= nCharString1; i++, iMinus1++, iElt--) {
+					if (i > iLast) {
+						/* Only reachable from the row above */
+						if (dropOff.currLast != iMinus1)
+							break;
+						if (i < nCharString1)
+							KILL_PREV_ROW(i);
+					}
+					substitutionValue = profileRow[iMinus1];
 
 					CURR_MATRIX(i, 0) =
 						MAX(0.0,
@@ -337,16 +875,26 @@ static double pairwiseAlignment(
 						MAX(MAX(CURR_MATRIX(iMinus1, 0), CURR_MATRIX(iMinus1, 1)) - gapOpeningPlusExtension,
 						    CURR_MATRIX(iMinus1, 2) - gapExtension);
 
+					if (dropOff.active)
+						prune_DropOff_cell(&dropOff, currMatrix, nCharString1Plus1, i, j);
+
 					maxScore = MAX(CURR_MATRIX(i, 0), maxScore);
 				}
+				if (dropOff.active) {
+					end_DropOff_column(currMatrix, nCharString1, iFirst, i, 0);
+					if (dropOff.currFirst == NO_ROW)
+						break;
+				}
 			} else {
-				for (i = 1, iMinus1 = 0, iElt = nCharString1Minus1; i <= nCharString1; i++, iMinus1++, iElt--) {
-					SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, align1InfoPtr->string.ptr[iElt]);
-					stringElt1 = lookupValue;
-					SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence1.ptr[scalar1 ? 0 : iElt]);
-					element1 = lookupValue;
-					fuzzy = FUZZY_MATRIX(stringElt1, stringElt2);
-					substitutionValue = (float) SUBSTITUTION_ARRAY(element1, element2, fuzzy);
+				for (i = iFirst, iMinus1 = iFirst - 1, iElt = nCharString1 - iFirst; i <= nCharString1; i++, iMinus1++, iElt--) {
+					if (i > iLast) {
+						/* Only reachable from the row above */
+						if (dropOff.currLast != iMinus1)
+							break;
+						if (i < nCharString1)
+							KILL_PREV_ROW(i);
+					}
+					substitutionValue = profileRow[iMinus1];
 
 					CURR_MATRIX(i, 0) =
 						MAX(PREV_MATRIX(iMinus1, 0),
@@ -357,7 +905,11 @@ static double pairwiseAlignment(
 					CURR_MATRIX(i, 2) =
 						MAX(MAX(CURR_MATRIX(iMinus1, 0), CURR_MATRIX(iMinus1, 1)) - gapOpeningPlusExtension,
 						    CURR_MATRIX(iMinus1, 2) - gapExtension);
+					if (dropOff.active)
+						prune_DropOff_cell(&dropOff, currMatrix, nCharString1Plus1, i, j);
 				}
+				if (dropOff.active)
+					end_DropOff_column(currMatrix, nCharString1, iFirst, i, noEndGap1 && j == nCharString2);
 				if (noEndGap2) {
 					CURR_MATRIX(nCharString1, 1) =
 						MAX(PREV_MATRIX(nCharString1, 0), MAX(PREV_MATRIX(nCharString1, 1), PREV_MATRIX(nCharString1, 2)));
@@ -379,9 +931,8 @@ static double pairwiseAlignment(
 		}
 	} else {
 		/* Step 3a:  Create objects for traceback values */
-		char *sTraceMatrix = alignBufferPtr->sTraceMatrix;
-		char *iTraceMatrix = alignBufferPtr->iTraceMatrix;
-		char *dTraceMatrix = alignBufferPtr->dTraceMatrix;
+		unsigned char *traceMatrix = alignBufferPtr->traceMatrix;
+		int sTrace, dTrace, iTrace;
 
 		/* Step 3b:  Prepare the alignment info object for alignment */
 		const int alignmentBufferSize = nCharString1Plus1;
@@ -405,63 +956,74 @@ static double pairwiseAlignment(
 			CURR_MATRIX(0, 0) = NEGATIVE_INFINITY;
 			CURR_MATRIX(0, 1) = PREV_MATRIX(0, 1) + endGapAddend;
 			CURR_MATRIX(0, 2) = NEGATIVE_INFINITY;
+			if (dropOff.active)
+				iFirst = start_DropOff_column(&dropOff, currMatrix, nCharString1, j, &iLast);
 
 			SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, align2InfoPtr->string.ptr[jElt]);
 			stringElt2 = lookupValue;
 			SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence2.ptr[scalar2 ? 0 : jElt]);
 			element2 = lookupValue;
+			profileRow = get_profile_row(alignBufferPtr, nCharString1, element2, stringElt2,
+						     substitutionArray, substitutionArrayDim,
+						     fuzzyMatrix, fuzzyMatrixDim);
 			if (localAlignment) {
-				for (i = 1, iMinus1 = 0, iElt = nCharString1Minus1; i <= nCharString1; i++, iMinus1++, iElt--) {
-					SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, align1InfoPtr->string.ptr[iElt]);
-					stringElt1 = lookupValue;
-					SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence1.ptr[scalar1 ? 0 : iElt]);
-					element1 = lookupValue;
-					fuzzy = FUZZY_MATRIX(stringElt1, stringElt2);
-					substitutionValue = (float) SUBSTITUTION_ARRAY(element1, element2, fuzzy);
+				for (i = iFirst, iMinus1 = iFirst - 1, iElt = nCharString1 - iFirst; i <= nCharString1; i++, iMinus1++, iElt--) {
+					if (i > iLast) {
+						/* Only reachable from the row above */
+						if (dropOff.currLast != iMinus1)
+							break;
+						if (i < nCharString1)
+							KILL_PREV_ROW(i);
+					}
+					substitutionValue = profileRow[iMinus1];
 
 					/* Step 3c:  Generate (0) substitution, (1) deletion, and (2) insertion scores
 					 *           and traceback values
 					 */
 					if (PREV_MATRIX(iMinus1, 0) >= MAX(PREV_MATRIX(iMinus1, 1), PREV_MATRIX(iMinus1, 2))) {
-						S_TRACE_MATRIX(iMinus1, jMinus1) = SUBSTITUTION;
+						sTrace = SUBSTITUTION;
 						CURR_MATRIX(i, 0) = PREV_MATRIX(iMinus1, 0) + substitutionValue;
 					} else if (PREV_MATRIX(iMinus1, 1) >= PREV_MATRIX(iMinus1, 2)) {
-						S_TRACE_MATRIX(iMinus1, jMinus1) = DELETION;
+						sTrace = DELETION;
 						CURR_MATRIX(i, 0) = PREV_MATRIX(iMinus1, 1) + substitutionValue;
 					} else {
-						S_TRACE_MATRIX(iMinus1, jMinus1) = INSERTION;
+						sTrace = INSERTION;
 						CURR_MATRIX(i, 0) = PREV_MATRIX(iMinus1, 2) + substitutionValue;
 					}
 					if (PREV_MATRIX(i, 1) > (MAX(PREV_MATRIX(i, 0), PREV_MATRIX(i, 2)) - gapOpening)) {
-						D_TRACE_MATRIX(iMinus1, jMinus1) = DELETION;
+						dTrace = DELETION;
 						CURR_MATRIX(i, 1) = PREV_MATRIX(i, 1) - gapExtension;
 					} else if (PREV_MATRIX(i, 0) >= PREV_MATRIX(i, 2)) {
-						D_TRACE_MATRIX(iMinus1, jMinus1) = SUBSTITUTION;
+						dTrace = SUBSTITUTION;
 						CURR_MATRIX(i, 1) = PREV_MATRIX(i, 0) - gapOpeningPlusExtension;
 					} else {
-						D_TRACE_MATRIX(iMinus1, jMinus1) = INSERTION;
+						dTrace = INSERTION;
 						CURR_MATRIX(i, 1) = PREV_MATRIX(i, 2) - gapOpeningPlusExtension;
 					}
 					if (CURR_MATRIX(iMinus1, 2) > (MAX(CURR_MATRIX(iMinus1, 0), CURR_MATRIX(iMinus1, 1)) - gapOpening)) {
-						I_TRACE_MATRIX(iMinus1, jMinus1) = INSERTION;
+						iTrace = INSERTION;
 						CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 2) - gapExtension;
 					} else if (CURR_MATRIX(iMinus1, 0) >= CURR_MATRIX(iMinus1, 1)) {
-						I_TRACE_MATRIX(iMinus1, jMinus1) = SUBSTITUTION;
+						iTrace = SUBSTITUTION;
 						CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 0) - gapOpeningPlusExtension;
 					} else {
-						I_TRACE_MATRIX(iMinus1, jMinus1) = DELETION;
+						iTrace = DELETION;
 						CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 1) - gapOpeningPlusExtension;
 					}
 
 					CURR_MATRIX(i, 0) = MAX(0.0, CURR_MATRIX(i, 0));
 					if (CURR_MATRIX(i, 0) == 0.0)
-						S_TRACE_MATRIX(iMinus1, jMinus1) = TERMINATION;
+						sTrace = TERMINATION;
 					CURR_MATRIX(i, 1) = MAX(0.0, CURR_MATRIX(i, 1));
 					if (CURR_MATRIX(i, 1) == 0.0)
-						D_TRACE_MATRIX(iMinus1, jMinus1) = TERMINATION;
+						dTrace = TERMINATION;
 					CURR_MATRIX(i, 2) = MAX(0.0, CURR_MATRIX(i, 2));
 					if (CURR_MATRIX(i, 2) == 0.0)
-						I_TRACE_MATRIX(iMinus1, jMinus1) = TERMINATION;
+						iTrace = TERMINATION;
+					TRACE_MATRIX(iMinus1, jMinus1) = PACK_TRACE(sTrace, dTrace, iTrace);
+
+					if (dropOff.active)
+						prune_DropOff_cell(&dropOff, currMatrix, nCharString1Plus1, i, j);
 
 					/* Step 3d:  Get the optimal score for local alignments */
 					if (CURR_MATRIX(i, 0) >= maxScore) {
@@ -471,72 +1033,82 @@ static double pairwiseAlignment(
 					}
 				}
 			} else {
-				for (i = 1, iMinus1 = 0, iElt = nCharString1Minus1; i <= nCharString1; i++, iMinus1++, iElt--) {
-					SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, align1InfoPtr->string.ptr[iElt]);
-					stringElt1 = lookupValue;
-					SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence1.ptr[scalar1 ? 0 : iElt]);
-					element1 = lookupValue;
-					fuzzy = FUZZY_MATRIX(stringElt1, stringElt2);
-					substitutionValue = (float) SUBSTITUTION_ARRAY(element1, element2, fuzzy);
+				for (i = iFirst, iMinus1 = iFirst - 1, iElt = nCharString1 - iFirst; i <= nCharString1; i++, iMinus1++, iElt--) {
+					if (i > iLast) {
+						/* Only reachable from the row above */
+						if (dropOff.currLast != iMinus1)
+							break;
+						if (i < nCharString1)
+							KILL_PREV_ROW(i);
+					}
+					substitutionValue = profileRow[iMinus1];
 
 					/* Step 3c:  Generate (0) substitution, (1) deletion, and (2) insertion scores
 					 *           and traceback values
 					 */
 					if (PREV_MATRIX(iMinus1, 0) >= MAX(PREV_MATRIX(iMinus1, 1), PREV_MATRIX(iMinus1, 2))) {
-						S_TRACE_MATRIX(iMinus1, jMinus1) = SUBSTITUTION;
+						sTrace = SUBSTITUTION;
 						CURR_MATRIX(i, 0) = PREV_MATRIX(iMinus1, 0) + substitutionValue;
 					} else if (PREV_MATRIX(iMinus1, 1) >= PREV_MATRIX(iMinus1, 2)) {
-						S_TRACE_MATRIX(iMinus1, jMinus1) = DELETION;
+						sTrace = DELETION;
 						CURR_MATRIX(i, 0) = PREV_MATRIX(iMinus1, 1) + substitutionValue;
 					} else {
-						S_TRACE_MATRIX(iMinus1, jMinus1) = INSERTION;
+						sTrace = INSERTION;
 						CURR_MATRIX(i, 0) = PREV_MATRIX(iMinus1, 2) + substitutionValue;
 					}
 					if (PREV_MATRIX(i, 1) > (MAX(PREV_MATRIX(i, 0), PREV_MATRIX(i, 2)) - gapOpening)) {
-						D_TRACE_MATRIX(iMinus1, jMinus1) = DELETION;
+						dTrace = DELETION;
 						CURR_MATRIX(i, 1) = PREV_MATRIX(i, 1) - gapExtension;
 					} else if (PREV_MATRIX(i, 0) >= PREV_MATRIX(i, 2)) {
-						D_TRACE_MATRIX(iMinus1, jMinus1) = SUBSTITUTION;
+						dTrace = SUBSTITUTION;
 						CURR_MATRIX(i, 1) = PREV_MATRIX(i, 0) - gapOpeningPlusExtension;
 					} else {
-						D_TRACE_MATRIX(iMinus1, jMinus1) = INSERTION;
+						dTrace = INSERTION;
 						CURR_MATRIX(i, 1) = PREV_MATRIX(i, 2) - gapOpeningPlusExtension;
 					}
 					if (CURR_MATRIX(iMinus1, 2) > (MAX(CURR_MATRIX(iMinus1, 0), CURR_MATRIX(iMinus1, 1)) - gapOpening)) {
-						I_TRACE_MATRIX(iMinus1, jMinus1) = INSERTION;
+						iTrace = INSERTION;
 						CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 2) - gapExtension;
 					} else if (CURR_MATRIX(iMinus1, 0) >= CURR_MATRIX(iMinus1, 1)) {
-						I_TRACE_MATRIX(iMinus1, jMinus1) = SUBSTITUTION;
+						iTrace = SUBSTITUTION;
 						CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 0) - gapOpeningPlusExtension;
 					} else {
-						I_TRACE_MATRIX(iMinus1, jMinus1) = DELETION;
+						iTrace = DELETION;
 						CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 1) - gapOpeningPlusExtension;
 					}
+					TRACE_MATRIX(iMinus1, jMinus1) = PACK_TRACE(sTrace, dTrace, iTrace);
+					if (dropOff.active)
+						prune_DropOff_cell(&dropOff, currMatrix, nCharString1Plus1, i, j);
 				}
 			}
+			if (dropOff.active) {
+				end_DropOff_column(currMatrix, nCharString1, iFirst, i, noEndGap1 && j == nCharString2);
+				if (localAlignment && dropOff.currFirst == NO_ROW)
+					break;
+			}
 
 			if (noEndGap2) {
 				if (PREV_MATRIX(nCharString1, 1) >= MAX(PREV_MATRIX(nCharString1, 0), PREV_MATRIX(nCharString1, 2))) {
-					D_TRACE_MATRIX(nCharString1Minus1, jMinus1) = DELETION;
+					SET_D_TRACE_MATRIX(nCharString1Minus1, jMinus1, DELETION);
 					CURR_MATRIX(nCharString1, 1) = PREV_MATRIX(nCharString1, 1);
 				} else if (PREV_MATRIX(nCharString1, 0) >= PREV_MATRIX(nCharString1, 2)) {
-					D_TRACE_MATRIX(nCharString1Minus1, jMinus1) = SUBSTITUTION;
+					SET_D_TRACE_MATRIX(nCharString1Minus1, jMinus1, SUBSTITUTION);
 					CURR_MATRIX(nCharString1, 1) = PREV_MATRIX(nCharString1, 0);
 				} else {
-					D_TRACE_MATRIX(nCharString1Minus1, jMinus1) = INSERTION;
+					SET_D_TRACE_MATRIX(nCharString1Minus1, jMinus1, INSERTION);
 					CURR_MATRIX(nCharString1, 1) = PREV_MATRIX(nCharString1, 2);
 				}
 			}
 			if (noEndGap1 && j == nCharString2) {
 				for (i = 1, iMinus1 = 0; i <= nCharString1; i++, iMinus1++) {
 					if (CURR_MATRIX(iMinus1, 2) >= MAX(CURR_MATRIX(iMinus1, 0), CURR_MATRIX(iMinus1, 1))) {
-						I_TRACE_MATRIX(iMinus1, jMinus1) = INSERTION;
+						SET_I_TRACE_MATRIX(iMinus1, jMinus1, INSERTION);
 						CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 2);
 					} else if (CURR_MATRIX(iMinus1, 0) >= CURR_MATRIX(iMinus1, 1)) {
-						I_TRACE_MATRIX(iMinus1, jMinus1) = SUBSTITUTION;
+						SET_I_TRACE_MATRIX(iMinus1, jMinus1, SUBSTITUTION);
 						CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 0);
 					} else {
-						I_TRACE_MATRIX(iMinus1, jMinus1) = DELETION;
+						SET_I_TRACE_MATRIX(iMinus1, jMinus1, DELETION);
 						CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 1);
 					}
 				}
@@ -574,10 +1146,237 @@ static double pairwiseAlignment(
 	return (double) maxScore;
 }
 
+/*
+ * Fills the AlignInfo structures from the edit operations found by the
+ * wavefront alignment engine. Does the same bookkeeping as traceback(), in
+ * particular the end gaps are not part of the aligned ranges.
+ */
+static void set_AlignInfo_from_ops(const char *ops, int nops,
+		struct AlignInfo *align1InfoPtr,
+		struct AlignInfo *align2InfoPtr)
+{
+	int n, p1, p2;
+	char prevOp = '?';
+	const int nCharString1 = align1InfoPtr->string.length;
+	const int nCharString2 = align2InfoPtr->string.length;
+	const int alignmentBufferSize = nCharString1 + 1;
+
+	align1InfoPtr->lengthMismatch = 0;
+	align2InfoPtr->lengthMismatch = 0;
+	align1InfoPtr->lengthIndel = 0;
+	align2InfoPtr->lengthIndel = 0;
+	align1InfoPtr->startRange = 1;
+	align2InfoPtr->startRange = 1;
+	align1InfoPtr->widthRange = 0;
+	align2InfoPtr->widthRange = 0;
+	memset(align1InfoPtr->widthIndel, 0, alignmentBufferSize * sizeof(int));
+	memset(align2InfoPtr->widthIndel, 0, alignmentBufferSize * sizeof(int));
+
+	for (n = p1 = p2 = 0; n < nops && p1 < nCharString1 && p2 < nCharString2; n++) {
+		switch (ops[n]) {
+		case 'M':
+			align1InfoPtr->widthRange++;
+			align2InfoPtr->widthRange++;
+			if (align1InfoPtr->string.ptr[p1] != align2InfoPtr->string.ptr[p2]) {
+				align1InfoPtr->mismatch[align1InfoPtr->lengthMismatch++] = p1 + 1;
+				align2InfoPtr->mismatch[align2InfoPtr->lengthMismatch++] = p2 + 1;
+			}
+			p1++;
+			p2++;
+			break;
+		case 'I':
+			if (p2 == 0) {
+				align1InfoPtr->startRange++;
+			} else {
+				align1InfoPtr->widthRange++;
+				if (prevOp != 'I')
+					align2InfoPtr->startIndel[align2InfoPtr->lengthIndel++] = p2 + 1;
+				align2InfoPtr->widthIndel[align2InfoPtr->lengthIndel - 1] += 1;
+			}
+			p1++;
+			break;
+		case 'D':
+			if (p1 == 0) {
+				align2InfoPtr->startRange++;
+			} else {
+				align2InfoPtr->widthRange++;
+				if (prevOp != 'D')
+					align1InfoPtr->startIndel[align1InfoPtr->lengthIndel++] = p1 + 1;
+				align1InfoPtr->widthIndel[align1InfoPtr->lengthIndel - 1] += 1;
+			}
+			p2++;
+			break;
+		}
+		prevOp = ops[n];
+	}
+
+	const int offset1 = align1InfoPtr->startRange - 1;
+	for (n = 0; n < align1InfoPtr->lengthIndel; n++)
+		align1InfoPtr->startIndel[n] -= offset1;
+	const int offset2 = align2InfoPtr->startRange - 1;
+	for (n = 0; n < align2InfoPtr->lengthIndel; n++)
+		align2InfoPtr->startIndel[n] -= offset2;
+	return;
+}
+
+/*
+ * Same as pairwiseAlignment() but uses the wavefront alignment engine (see
+ * align_wfa.c). Only for non-local alignments with a constant match score and
+ * a constant mismatch score. 'wfaPenalties' is the result of
+ * .makeWFAPenalties(): the alignment score is recovered from the penalty
+ * returned by _wfa_align() with
+ *   score = (match * (nchar(pattern) + nchar(subject)) - penalty) / 2
+ * where match = wfaPenalties[3].
+ */
+static double wfaAlignment(
+		struct AlignInfo *align1InfoPtr,
+		struct AlignInfo *align2InfoPtr,
+		const int scoreOnly,
+		const float gapOpening,
+		const float gapExtension,
+		const int *wfaPenalties,
+		WFABuf *wfaBufPtr)
+{
+	int penalty;
+	const int nCharString1 = align1InfoPtr->string.length;
+	const int nCharString2 = align2InfoPtr->string.length;
+
+	if (nCharString1 < 1 || nCharString2 < 1)
+		return zeroCharAlignment(align1InfoPtr, align2InfoPtr, gapOpening, gapExtension);
+	penalty = _wfa_align(wfaBufPtr, &(align1InfoPtr->string), &(align2InfoPtr->string),
+			     wfaPenalties, align1InfoPtr->endGap, align2InfoPtr->endGap,
+			     !scoreOnly);
+	if (!scoreOnly)
+		set_AlignInfo_from_ops(wfaBufPtr->ops, wfaBufPtr->nops,
+				       align1InfoPtr, align2InfoPtr);
+	return ((double) wfaPenalties[3] * (nCharString1 + nCharString2) - penalty) / 2.0;
+}
+
+/*
+ * The lookup tables are checked once for all the letters of 'x' so that
+ * pairwiseAlignment() cannot raise an error when it's called on a worker
+ * thread.
+ */
+static void check_XStringSet_lookup(const XStringSet_holder *x_holder,
+				    const int *lookupTable,
+				    const int lookupTableLength)
+{
+	int i, j, lookupValue;
+	Chars_holder x_elt;
+
+	for (i = 0; i < _get_length_from_XStringSet_holder(x_holder); i++) {
+		x_elt = _get_elt_from_XStringSet_holder(x_holder, i);
+		for (j = 0; j < x_elt.length; j++)
+			SET_LOOKUP_VALUE(lookupTable, lookupTableLength, x_elt.ptr[j]);
+	}
+	return;
+}
+
+/*
+ * Computes the scores of all the pairs on 'nthreads' threads. Each thread
+ * streams its pairs through its own buffers, so when a single pattern is
+ * aligned against many subjects, its letters are translated and its query
+ * profile is computed only once per thread.
+ */
+static void align_scores_parallel(
+		const int nthreads,
+		const XStringSet_holder *pattern_holder,
+		const XStringSet_holder *subject_holder,
+		const XStringSet_holder *patternQuality_holder,
+		const XStringSet_holder *subjectQuality_holder,
+		const int numberOfStrings,
+		const int multiplePatterns,
+		const int multipleSubjects,
+		const int quality1Increment,
+		const int quality2Increment,
+		const struct AlignInfo *align1Info,
+		const struct AlignInfo *align2Info,
+		const int alignmentBufferSize,
+		const int localAlignment,
+		const float gapOpening,
+		const float gapExtension,
+		const int useQuality,
+		const double *substitutionArray,
+		const int *substitutionArrayDim,
+		const int *substitutionLookupTable,
+		const int substitutionLookupTableLength,
+		const int *fuzzyMatrix,
+		const int *fuzzyMatrixDim,
+		const int *fuzzyLookupTable,
+		const int fuzzyLookupTableLength,
+		const struct DropOff *dropOffPtr,
+		const int useIntScores,
+		double *score)
+{
+	struct AlignInfo *align1Infos, *align2Infos;
+	struct AlignBuffer *alignBuffers;
+	int i;
+
+	/* Make sure that pairwiseAlignment() won't hit an unknown letter */
+	check_XStringSet_lookup(pattern_holder, fuzzyLookupTable, fuzzyLookupTableLength);
+	check_XStringSet_lookup(subject_holder, fuzzyLookupTable, fuzzyLookupTableLength);
+	check_XStringSet_lookup(useQuality ? patternQuality_holder : pattern_holder,
+				substitutionLookupTable, substitutionLookupTableLength);
+	check_XStringSet_lookup(useQuality ? subjectQuality_holder : subject_holder,
+				substitutionLookupTable, substitutionLookupTableLength);
+
+	/* One pair of alignment info objects and one alignment buffer per thread */
+	align1Infos = (struct AlignInfo *) R_alloc((long) nthreads, sizeof(struct AlignInfo));
+	align2Infos = (struct AlignInfo *) R_alloc((long) nthreads, sizeof(struct AlignInfo));
+	alignBuffers = (struct AlignBuffer *) R_alloc((long) nthreads, sizeof(struct AlignBuffer));
+	for (i = 0; i < nthreads; i++) {
+		align1Infos[i] = *align1Info;
+		align2Infos[i] = *align2Info;
+		alignBuffers[i].currMatrix = (float *) R_alloc((long) 3 * alignmentBufferSize, sizeof(float));
+		alignBuffers[i].prevMatrix = (float *) R_alloc((long) 3 * alignmentBufferSize, sizeof(float));
+		alloc_AlignBuffer_profile(alignBuffers + i, alignmentBufferSize,
+					  substitutionArrayDim, fuzzyMatrixDim, useIntScores);
+	}
+
+	#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 16)
+	for (i = 0; i < numberOfStrings; i++) {
+		int thread = _get_thread_num();
+		struct AlignInfo *align1InfoPtr = align1Infos + thread;
+		struct AlignInfo *align2InfoPtr = align2Infos + thread;
+		align1InfoPtr->string =
+			_get_elt_from_XStringSet_holder(pattern_holder, multiplePatterns ? i : 0);
+		align2InfoPtr->string =
+			_get_elt_from_XStringSet_holder(subject_holder, multipleSubjects ? i : 0);
+		if (useQuality) {
+			align1InfoPtr->quality =
+				_get_elt_from_XStringSet_holder(patternQuality_holder, i * quality1Increment);
+			align2InfoPtr->quality =
+				_get_elt_from_XStringSet_holder(subjectQuality_holder,
+								multipleSubjects ? i * quality2Increment : 0);
+		}
+		score[i] = pairwiseAlignment(
+				align1InfoPtr,
+				align2InfoPtr,
+				localAlignment,
+				1,
+				gapOpening,
+				gapExtension,
+				useQuality,
+				substitutionArray,
+				substitutionArrayDim,
+				substitutionLookupTable,
+				substitutionLookupTableLength,
+				fuzzyMatrix,
+				fuzzyMatrixDim,
+				fuzzyLookupTable,
+				fuzzyLookupTableLength,
+				dropOffPtr,
+				alignBuffers + thread);
+	}
+	return;
+}
+
 /*
  * INPUTS
  * 'pattern':                XStringSet or QualityScaledXStringSet object for patterns
  * 'subject':                XStringSet or QualityScaledXStringSet object for subject
+ *                           (of length 1 or 'length(pattern)', or of any
+ *                            length if 'pattern' is of length 1)
  * 'type':                   type of pairwise alignment
  *                           (character vector of length 1;
  *                            'global', 'local', 'overlap', 'global-local',
@@ -611,6 +1410,15 @@ static double pairwiseAlignment(
  * 'fuzzyLookupTable':         lookup table for translating XString bytes to
  *                             fuzzy indices
  *                             (integer vector)
+ * 'wfaPenalties':             NULL for the dynamic programming algorithm, or
+ *                             the penalties to use with the wavefront
+ *                             alignment engine
+ *                             (integer vector of length 4)
+ * 'dropOff':                  NULL, or the X-drop (or Z-drop) value and
+ *                             whether it's a Z-drop
+ *                             (double vector of length 2)
+ * 'nthreads':                 number of threads to use for computing the
+ *                             scores (single positive integer)
  *
  * OUTPUT
  * If scoreOnly = TRUE, returns either a vector of scores
@@ -632,9 +1440,13 @@ SEXP XStringSet_align_pairwiseAlignment(
 		SEXP substitutionLookupTable,
 		SEXP fuzzyMatrix,
 		SEXP fuzzyMatrixDim,
-		SEXP fuzzyLookupTable)
+		SEXP fuzzyLookupTable,
+		SEXP wfaPenalties,
+		SEXP dropOff,
+		SEXP nthreads)
 {
 	const int scoreOnlyValue = LOGICAL(scoreOnly)[0];
+	const int useWFA = wfaPenalties != R_NilValue;
 	const int useQualityValue = LOGICAL(useQuality)[0];
 	const int localAlignment = (INTEGER(typeCode)[0] == LOCAL_ALIGNMENT);
 	float gapOpeningValue = REAL(gapOpening)[0];
@@ -646,8 +1458,13 @@ SEXP XStringSet_align_pairwiseAlignment(
 
 	XStringSet_holder pattern_holder = _hold_XStringSet(pattern);
 	XStringSet_holder subject_holder = _hold_XStringSet(subject);
-	const int numberOfStrings = _get_length_from_XStringSet_holder(&pattern_holder);
+	/* Either 1 subject for all the patterns, 1 subject per pattern, or 1
+	 * pattern for all the subjects */
+	const int numberOfPatterns = _get_length_from_XStringSet_holder(&pattern_holder);
 	const int multipleSubjects = _get_length_from_XStringSet_holder(&subject_holder) > 1;
+	const int multiplePatterns = numberOfPatterns > 1 || !multipleSubjects;
+	const int numberOfStrings = multiplePatterns ? numberOfPatterns :
+				    _get_length_from_XStringSet_holder(&subject_holder);
 	int lengthOfPatternQualitySet = 0;
 	int lengthOfSubjectQualitySet = 0;
 
@@ -687,7 +1504,7 @@ SEXP XStringSet_align_pairwiseAlignment(
 	reset_ovflow_flag();
 	if (multipleSubjects) {
 		for (i = 0; i < numberOfStrings; i++) {
-			int nchar1 = _get_elt_from_XStringSet_holder(&pattern_holder, i).length;
+			int nchar1 = _get_elt_from_XStringSet_holder(&pattern_holder, multiplePatterns ? i : 0).length;
 			int nchar2 = _get_elt_from_XStringSet_holder(&subject_holder, i).length;
 			nCharString1 = MAX(nCharString1, nchar1);
 			nCharString2 = MAX(nCharString2, nchar2);
@@ -701,12 +1518,40 @@ SEXP XStringSet_align_pairwiseAlignment(
 		nCharString2 = align2Info.string.length;
 		nCharProduct = safe_int_mult(nCharString1, nCharString2);
 	}
-	if (get_ovflow_flag())
+	/* The wavefront alignment engine doesn't use the traceback matrix */
+	if (get_ovflow_flag() && !useWFA)
 		error("max(nchar(pattern) * nchar(subject)) is too big "
 		      "(must be <= %d)", INT_MAX);
 	const int alignmentBufferSize = nCharString1 + 1;
+	/* Only the scores computed without X-drop pruning by the dynamic
+	 * programming engine can be computed with integers */
+	const int useIntScores = scoreOnlyValue && !useWFA && dropOff == R_NilValue &&
+		use_int_scores(REAL(substitutionArray), LENGTH(substitutionArray),
+			       gapOpeningValue, gapExtensionValue, nCharString1, nCharString2);
 	alignBuffer.currMatrix = (float *) R_alloc((long) 3 * alignmentBufferSize, sizeof(float));
 	alignBuffer.prevMatrix = (float *) R_alloc((long) 3 * alignmentBufferSize, sizeof(float));
+	alloc_AlignBuffer_profile(&alignBuffer, alignmentBufferSize,
+				  INTEGER(substitutionArrayDim), INTEGER(fuzzyMatrixDim),
+				  useIntScores);
+
+	WFABuf wfaBuf;
+	if (useWFA)
+		_init_WFABuf(&wfaBuf);
+
+	/* 'dropOff' is NULL or c(X, isZdrop) */
+	struct DropOff dropOffConfig;
+	dropOffConfig.active = dropOff != R_NilValue;
+	if (dropOffConfig.active) {
+		dropOffConfig.value = REAL(dropOff)[0];
+		dropOffConfig.zdrop = REAL(dropOff)[1] != 0.0;
+		dropOffConfig.gapExtension = gapExtensionValue;
+	}
+
+	/* Only the scores computed by the dynamic programming engine can be
+	 * computed on several threads */
+	int nthreadsValue = _get_nthreads(nthreads);
+	if (!scoreOnlyValue || useWFA)
+		nthreadsValue = 1;
 
 	struct MismatchBuffer mismatchBuffer;
 	struct IndelBuffer indel1Buffer;
@@ -719,9 +1564,8 @@ SEXP XStringSet_align_pairwiseAlignment(
 		align2Info.startIndel = (int *) R_alloc((long) alignmentBufferSize, sizeof(int));
 		align1Info.widthIndel = (int *) R_alloc((long) alignmentBufferSize, sizeof(int));
 		align2Info.widthIndel = (int *) R_alloc((long) alignmentBufferSize, sizeof(int));
-		alignBuffer.sTraceMatrix = (char *) R_alloc((long) nCharProduct, sizeof(char));
-		alignBuffer.iTraceMatrix = (char *) R_alloc((long) nCharProduct, sizeof(char));
-		alignBuffer.dTraceMatrix = (char *) R_alloc((long) nCharProduct, sizeof(char));
+		if (!useWFA)
+			alignBuffer.traceMatrix = (unsigned char *) R_alloc((long) nCharProduct, sizeof(unsigned char));
 
 		mismatchBufferSize = MIN(MAX_BUF_SIZE, alignmentBufferSize + numberOfStrings * (alignmentBufferSize/4));
 		mismatchBuffer.pattern = (int *) R_alloc((long) mismatchBufferSize, sizeof(int));
@@ -741,11 +1585,27 @@ SEXP XStringSet_align_pairwiseAlignment(
 	}
 
 	double *score;
-	if (scoreOnlyValue) {
+	if (nthreadsValue > 1) {
+		PROTECT(output = NEW_NUMERIC(numberOfStrings));
+		align_scores_parallel(nthreadsValue,
+				      &pattern_holder, &subject_holder,
+				      &patternQuality_holder, &subjectQuality_holder,
+				      numberOfStrings, multiplePatterns, multipleSubjects,
+				      quality1Increment, quality2Increment,
+				      &align1Info, &align2Info, alignmentBufferSize,
+				      localAlignment, gapOpeningValue, gapExtensionValue,
+				      useQualityValue,
+				      REAL(substitutionArray), INTEGER(substitutionArrayDim),
+				      INTEGER(substitutionLookupTable), LENGTH(substitutionLookupTable),
+				      INTEGER(fuzzyMatrix), INTEGER(fuzzyMatrixDim),
+				      INTEGER(fuzzyLookupTable), LENGTH(fuzzyLookupTable),
+				      &dropOffConfig, useIntScores, REAL(output));
+		UNPROTECT(1);
+	} else if (scoreOnlyValue) {
 		PROTECT(output = NEW_NUMERIC(numberOfStrings));
 		for (i = 0, score = REAL(output); i < numberOfStrings; i++, score++) {
 	        R_CheckUserInterrupt();
-			align1Info.string = _get_elt_from_XStringSet_holder(&pattern_holder, i);
+			align1Info.string = _get_elt_from_XStringSet_holder(&pattern_holder, multiplePatterns ? i : 0);
 			if (useQualityValue) {
 				align1Info.quality = _get_elt_from_XStringSet_holder(&patternQuality_holder, quality1Element);
 				quality1Element += quality1Increment;
@@ -757,23 +1617,34 @@ SEXP XStringSet_align_pairwiseAlignment(
 					quality2Element += quality2Increment;
 				}
 			}
-			*score = pairwiseAlignment(
-					&align1Info,
-					&align2Info,
-					localAlignment,
-					scoreOnlyValue,
-					gapOpeningValue,
-					gapExtensionValue,
-					useQualityValue,
-					REAL(substitutionArray),
-					INTEGER(substitutionArrayDim),
-					INTEGER(substitutionLookupTable),
-					LENGTH(substitutionLookupTable),
-					INTEGER(fuzzyMatrix),
-					INTEGER(fuzzyMatrixDim),
-					INTEGER(fuzzyLookupTable),
-					LENGTH(fuzzyLookupTable),
-					&alignBuffer);
+			if (useWFA)
+				*score = wfaAlignment(
+						&align1Info,
+						&align2Info,
+						scoreOnlyValue,
+						gapOpeningValue,
+						gapExtensionValue,
+						INTEGER(wfaPenalties),
+						&wfaBuf);
+			else
+				*score = pairwiseAlignment(
+						&align1Info,
+						&align2Info,
+						localAlignment,
+						scoreOnlyValue,
+						gapOpeningValue,
+						gapExtensionValue,
+						useQualityValue,
+						REAL(substitutionArray),
+						INTEGER(substitutionArrayDim),
+						INTEGER(substitutionLookupTable),
+						LENGTH(substitutionLookupTable),
+						INTEGER(fuzzyMatrix),
+						INTEGER(fuzzyMatrixDim),
+						INTEGER(fuzzyLookupTable),
+						LENGTH(fuzzyLookupTable),
+						&dropOffConfig,
+						&alignBuffer);
 		}
 		UNPROTECT(1);
 	} else {
@@ -829,7 +1700,7 @@ SEXP XStringSet_align_pairwiseAlignment(
 				align1RangeStart++, align1RangeWidth++, align1MismatchEnds++, align1IndelEnds++,
 				align2RangeStart++, align2RangeWidth++, align2MismatchEnds++, align2IndelEnds++) {
 	        R_CheckUserInterrupt();
-			align1Info.string = _get_elt_from_XStringSet_holder(&pattern_holder, i);
+			align1Info.string = _get_elt_from_XStringSet_holder(&pattern_holder, multiplePatterns ? i : 0);
 			if (useQualityValue) {
 				align1Info.quality = _get_elt_from_XStringSet_holder(&patternQuality_holder, quality1Element);
 				quality1Element += quality1Increment;
@@ -841,23 +1712,34 @@ SEXP XStringSet_align_pairwiseAlignment(
 					quality2Element += quality2Increment;
 				}
 			}
-			*score = pairwiseAlignment(
-					&align1Info,
-					&align2Info,
-					localAlignment,
-					scoreOnlyValue,
-					gapOpeningValue,
-					gapExtensionValue,
-					useQualityValue,
-					REAL(substitutionArray),
-					INTEGER(substitutionArrayDim),
-					INTEGER(substitutionLookupTable),
-					LENGTH(substitutionLookupTable),
-					INTEGER(fuzzyMatrix),
-					INTEGER(fuzzyMatrixDim),
-					INTEGER(fuzzyLookupTable),
-					LENGTH(fuzzyLookupTable),
-					&alignBuffer);
+			if (useWFA)
+				*score = wfaAlignment(
+						&align1Info,
+						&align2Info,
+						scoreOnlyValue,
+						gapOpeningValue,
+						gapExtensionValue,
+						INTEGER(wfaPenalties),
+						&wfaBuf);
+			else
+				*score = pairwiseAlignment(
+						&align1Info,
+						&align2Info,
+						localAlignment,
+						scoreOnlyValue,
+						gapOpeningValue,
+						gapExtensionValue,
+						useQualityValue,
+						REAL(substitutionArray),
+						INTEGER(substitutionArrayDim),
+						INTEGER(substitutionLookupTable),
+						LENGTH(substitutionLookupTable),
+						INTEGER(fuzzyMatrix),
+						INTEGER(fuzzyMatrixDim),
+						INTEGER(fuzzyLookupTable),
+						LENGTH(fuzzyLookupTable),
+						&dropOffConfig,
+						&alignBuffer);
 			*align1MismatchEnds = align1Info.lengthMismatch + align1MismatchPrevEnd;
 			*align2MismatchEnds = align2Info.lengthMismatch + align2MismatchPrevEnd;
 			if (align1Info.lengthMismatch > 0) {
@@ -1037,6 +1919,74 @@ SEXP XStringSet_align_pairwiseAlignment(
 
 
 
+#define DIST_TILE_SIZE 64
+
+/*
+ * Fills the part of the "dist" vector 'score0' that corresponds to tile
+ * 'tile' of the upper triangle (see _get_upper_triangle_tile() in utils.c).
+ */
+static void align_distance_tile(
+		int tile,
+		const XStringSet_holder *string_holder,
+		const XStringSet_holder *stringQuality_holder,
+		const int numberOfStrings,
+		const int qualityIncrement,
+		struct AlignInfo *align1InfoPtr,
+		struct AlignInfo *align2InfoPtr,
+		const int localAlignment,
+		const float gapOpening,
+		const float gapExtension,
+		const int useQuality,
+		const double *substitutionArray,
+		const int *substitutionArrayDim,
+		const int *substitutionLookupTable,
+		const int substitutionLookupTableLength,
+		const int *fuzzyMatrix,
+		const int *fuzzyMatrixDim,
+		const int *fuzzyLookupTable,
+		const int fuzzyLookupTableLength,
+		struct AlignBuffer *alignBufferPtr,
+		double *score0)
+{
+	int i, j, i1, i2, j1, j2;
+	double *score;
+
+	_get_upper_triangle_tile(numberOfStrings, DIST_TILE_SIZE, tile,
+				 &i1, &i2, &j1, &j2);
+	for (i = i1; i < i2; i++) {
+		align1InfoPtr->string = _get_elt_from_XStringSet_holder(string_holder, i);
+		if (useQuality)
+			align1InfoPtr->quality =
+				_get_elt_from_XStringSet_holder(stringQuality_holder, i * qualityIncrement);
+		j = MAX(j1, i + 1);
+		for (score = score0 + _get_dist_offset(numberOfStrings, i, j); j < j2; j++, score++) {
+			align2InfoPtr->string = _get_elt_from_XStringSet_holder(string_holder, j);
+			if (useQuality)
+				align2InfoPtr->quality =
+					_get_elt_from_XStringSet_holder(stringQuality_holder, j * qualityIncrement);
+			*score = pairwiseAlignment(
+					align1InfoPtr,
+					align2InfoPtr,
+					localAlignment,
+					1,
+					gapOpening,
+					gapExtension,
+					useQuality,
+					substitutionArray,
+					substitutionArrayDim,
+					substitutionLookupTable,
+					substitutionLookupTableLength,
+					fuzzyMatrix,
+					fuzzyMatrixDim,
+					fuzzyLookupTable,
+					fuzzyLookupTableLength,
+					NULL,
+					alignBufferPtr);
+		}
+	}
+	return;
+}
+
 /*
  * INPUTS
  * 'string':                   XStringSet object for strings
@@ -1068,6 +2018,8 @@ SEXP XStringSet_align_pairwiseAlignment(
  * 'fuzzyLookupTable':         lookup table for translating XString bytes to
  *                             fuzzy indices
  *                             (integer vector)
+ * 'nthreads':                 number of threads to use
+ *                             (single positive integer)
  *
  * OUTPUT
  * Return a numeric vector containing the lower triangle of the score matrix.
@@ -1085,9 +2037,9 @@ SEXP XStringSet_align_distance(
 		SEXP substitutionLookupTable,
 		SEXP fuzzyMatrix,
 		SEXP fuzzyMatrixDim,
-		SEXP fuzzyLookupTable)
+		SEXP fuzzyLookupTable,
+		SEXP nthreads)
 {
-	int scoreOnlyValue = 1;
 	int useQualityValue = LOGICAL(useQuality)[0];
 	float gapOpeningValue = REAL(gapOpening)[0];
 	float gapExtensionValue = REAL(gapExtension)[0];
@@ -1096,11 +2048,12 @@ SEXP XStringSet_align_distance(
 		gapExtensionValue = POSITIVE_INFINITY;
 	}
 	int localAlignment = (INTEGER(typeCode)[0] == LOCAL_ALIGNMENT);
+	int nthreadsValue = _get_nthreads(nthreads);
 
-	/* Create the alignment info objects */
-	struct AlignInfo align1Info, align2Info;
-	align1Info.endGap = (INTEGER(typeCode)[0] == GLOBAL_ALIGNMENT);
-	align2Info.endGap = (INTEGER(typeCode)[0] == GLOBAL_ALIGNMENT);
+	/* Create the alignment info objects (one pair per thread) */
+	struct AlignInfo *align1Infos, *align2Infos;
+	align1Infos = (struct AlignInfo *) R_alloc((long) nthreadsValue, sizeof(struct AlignInfo));
+	align2Infos = (struct AlignInfo *) R_alloc((long) nthreadsValue, sizeof(struct AlignInfo));
 
 	int numberOfStrings = _get_XStringSet_length(string);
 	int lengthOfStringQualitySet = 0;
@@ -1116,78 +2069,80 @@ SEXP XStringSet_align_distance(
 
 	SEXP output;
 
-	int i, j, iQualityElement = 0, jQualityElement = 0;
+	int i, tile, ntile;
 	int qualityIncrement = ((lengthOfStringQualitySet < numberOfStrings) ? 0 : 1);
 
-	/* Create the alignment buffer object */
-	struct AlignBuffer alignBuffer;
+	/* Create the alignment buffer objects (one per thread) */
+	struct AlignBuffer *alignBuffers;
 	int nCharString = 0;
 	for (i = 0; i < numberOfStrings; i++) {
 		nCharString = MAX(nCharString, _get_elt_from_XStringSet_holder(&string_holder, i).length);
 	}
 	int alignmentBufferSize = nCharString + 1;
-	alignBuffer.currMatrix = (float *) R_alloc((long) 3 * alignmentBufferSize, sizeof(float));
-	alignBuffer.prevMatrix = (float *) R_alloc((long) 3 * alignmentBufferSize, sizeof(float));
+	int useIntScores = use_int_scores(REAL(substitutionArray), LENGTH(substitutionArray),
+					  gapOpeningValue, gapExtensionValue,
+					  nCharString, nCharString);
+	alignBuffers = (struct AlignBuffer *) R_alloc((long) nthreadsValue, sizeof(struct AlignBuffer));
+	for (i = 0; i < nthreadsValue; i++) {
+		align1Infos[i].endGap = (INTEGER(typeCode)[0] == GLOBAL_ALIGNMENT);
+		align2Infos[i].endGap = (INTEGER(typeCode)[0] == GLOBAL_ALIGNMENT);
+		alignBuffers[i].currMatrix = (float *) R_alloc((long) 3 * alignmentBufferSize, sizeof(float));
+		alignBuffers[i].prevMatrix = (float *) R_alloc((long) 3 * alignmentBufferSize, sizeof(float));
+		alloc_AlignBuffer_profile(alignBuffers + i, alignmentBufferSize,
+					  INTEGER(substitutionArrayDim), INTEGER(fuzzyMatrixDim),
+					  useIntScores);
+	}
 
-	double *score;
-	PROTECT(output = NEW_NUMERIC((numberOfStrings * (numberOfStrings - 1)) / 2));
-	score = REAL(output);
-	if (!useQualityValue) {
-		for (i = 0; i < numberOfStrings; i++) {
-	        R_CheckUserInterrupt();
-			align1Info.string = _get_elt_from_XStringSet_holder(&string_holder, i);
-			for (j = i + 1; j < numberOfStrings; j++) {
-				align2Info.string = _get_elt_from_XStringSet_holder(&string_holder, j);
-				*score = pairwiseAlignment(
-						&align1Info,
-						&align2Info,
-						localAlignment,
-						scoreOnlyValue,
-						gapOpeningValue,
-						gapExtensionValue,
-						useQualityValue,
-						REAL(substitutionArray),
-						INTEGER(substitutionArrayDim),
-						INTEGER(substitutionLookupTable),
-						LENGTH(substitutionLookupTable),
-						INTEGER(fuzzyMatrix),
-						INTEGER(fuzzyMatrixDim),
-						INTEGER(fuzzyLookupTable),
-						LENGTH(fuzzyLookupTable),
-						&alignBuffer);
-				score++;
-			}
+	/* Make sure that pairwiseAlignment() won't hit an unknown letter */
+	check_XStringSet_lookup(&string_holder, INTEGER(fuzzyLookupTable), LENGTH(fuzzyLookupTable));
+	if (useQualityValue)
+		check_XStringSet_lookup(&stringQuality_holder,
+					INTEGER(substitutionLookupTable), LENGTH(substitutionLookupTable));
+	else
+		check_XStringSet_lookup(&string_holder,
+					INTEGER(substitutionLookupTable), LENGTH(substitutionLookupTable));
+
+	const double *substitutionArrayValue = REAL(substitutionArray);
+	const int *substitutionArrayDimValue = INTEGER(substitutionArrayDim);
+	const int *substitutionLookupTableValue = INTEGER(substitutionLookupTable);
+	const int substitutionLookupTableLength = LENGTH(substitutionLookupTable);
+	const int *fuzzyMatrixValue = INTEGER(fuzzyMatrix);
+	const int *fuzzyMatrixDimValue = INTEGER(fuzzyMatrixDim);
+	const int *fuzzyLookupTableValue = INTEGER(fuzzyLookupTable);
+	const int fuzzyLookupTableLength = LENGTH(fuzzyLookupTable);
+
+	double *score0;
+	PROTECT(output = NEW_NUMERIC(((R_xlen_t) numberOfStrings * (numberOfStrings - 1)) / 2));
+	score0 = REAL(output);
+	ntile = _get_upper_triangle_ntile(numberOfStrings, DIST_TILE_SIZE);
+	if (nthreadsValue == 1) {
+		for (tile = 0; tile < ntile; tile++) {
+			R_CheckUserInterrupt();
+			align_distance_tile(tile, &string_holder, &stringQuality_holder,
+					    numberOfStrings, qualityIncrement,
+					    align1Infos, align2Infos,
+					    localAlignment, gapOpeningValue, gapExtensionValue,
+					    useQualityValue,
+					    substitutionArrayValue, substitutionArrayDimValue,
+					    substitutionLookupTableValue, substitutionLookupTableLength,
+					    fuzzyMatrixValue, fuzzyMatrixDimValue,
+					    fuzzyLookupTableValue, fuzzyLookupTableLength,
+					    alignBuffers, score0);
 		}
 	} else {
-		for (i = 0; i < numberOfStrings; i++) {
-	        R_CheckUserInterrupt();
-			align1Info.string = _get_elt_from_XStringSet_holder(&string_holder, i);
-			align1Info.quality = _get_elt_from_XStringSet_holder(&stringQuality_holder, iQualityElement);
-			jQualityElement = iQualityElement + qualityIncrement;
-			iQualityElement += qualityIncrement;
-			for (j = i + 1; j < numberOfStrings; j++) {
-				align2Info.string = _get_elt_from_XStringSet_holder(&string_holder, j);
-				align2Info.quality = _get_elt_from_XStringSet_holder(&stringQuality_holder, jQualityElement);
-				jQualityElement += qualityIncrement;
-				*score = pairwiseAlignment(
-						&align1Info,
-						&align2Info,
-						localAlignment,
-						scoreOnlyValue,
-						gapOpeningValue,
-						gapExtensionValue,
-						useQualityValue,
-						REAL(substitutionArray),
-						INTEGER(substitutionArrayDim),
-						INTEGER(substitutionLookupTable),
-						LENGTH(substitutionLookupTable),
-						INTEGER(fuzzyMatrix),
-						INTEGER(fuzzyMatrixDim),
-						INTEGER(fuzzyLookupTable),
-						LENGTH(fuzzyLookupTable),
-						&alignBuffer);
-				score++;
-			}
+		#pragma omp parallel for num_threads(nthreadsValue) schedule(dynamic)
+		for (tile = 0; tile < ntile; tile++) {
+			int thread = _get_thread_num();
+			align_distance_tile(tile, &string_holder, &stringQuality_holder,
+					    numberOfStrings, qualityIncrement,
+					    align1Infos + thread, align2Infos + thread,
+					    localAlignment, gapOpeningValue, gapExtensionValue,
+					    useQualityValue,
+					    substitutionArrayValue, substitutionArrayDimValue,
+					    substitutionLookupTableValue, substitutionLookupTableLength,
+					    fuzzyMatrixValue, fuzzyMatrixDimValue,
+					    fuzzyLookupTableValue, fuzzyLookupTableLength,
+					    alignBuffers + thread, score0);
 		}
 	}
 	UNPROTECT(1);
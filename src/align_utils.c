@@ -3,6 +3,8 @@
 #include "IRanges_interface.h"
 #include "S4Vectors_interface.h"
 
+#include <limits.h>             /* for INT_MAX */
+
 
 const char* get_qualityless_classname(SEXP object)
 {
@@ -71,9 +73,57 @@ SEXP AlignedXStringSet_nchar(SEXP alignedXStringSet)
 }
 
 
-SEXP AlignedXStringSet_align_aligned(SEXP alignedXStringSet, SEXP gapCode)
+/*
+ * Gapped strings are rebuilt from the raw start/width vectors of the indel
+ * CompressedIRangesList objects (no R API calls inside the loops) so that the
+ * alignments can be filled in parallel, a segment at a time.
+ */
+typedef struct indel_ranges {
+	const int *start;
+	const int *width;
+	const int *end;
+} IndelRanges;
+
+static IndelRanges hold_IndelRanges(SEXP indel)
+{
+	IndelRanges ranges;
+	SEXP unlistData = get_CompressedList_unlistData(indel);
+
+	ranges.start = INTEGER(get_IRanges_start(unlistData));
+	ranges.width = INTEGER(get_IRanges_width(unlistData));
+	ranges.end = INTEGER(get_PartitioningByEnd_end(
+				get_CompressedList_partitioning(indel)));
+	return ranges;
+}
+
+static int get_IndelRanges_offset(const IndelRanges *ranges, int i)
+{
+	return i == 0 ? 0 : ranges->end[i - 1];
+}
+
+static void fill_aligned_string(char *out, const char *src, int srcWidth,
+		const int *indelStart, const int *indelWidth, int numberOfIndel,
+		char gapCodeValue)
+{
+	int j, prevStart = 0, currStart;
+
+	for (j = 0; j < numberOfIndel; j++) {
+		currStart = indelStart[j] - 1;
+		memcpy(out, src, currStart - prevStart);
+		out += currStart - prevStart;
+		src += currStart - prevStart;
+		memset(out, gapCodeValue, indelWidth[j]);
+		out += indelWidth[j];
+		prevStart = currStart;
+	}
+	memcpy(out, src, srcWidth - prevStart);
+	return;
+}
+
+SEXP AlignedXStringSet_align_aligned(SEXP alignedXStringSet, SEXP gapCode,
+		SEXP nthreads)
 {
-	int i, j, k;
+	int i, nthreads0;
 	char gapCodeValue = (char) RAW(gapCode)[0];
 
 	SEXP unaligned = GET_SLOT(alignedXStringSet, install("unaligned"));
@@ -81,9 +131,11 @@ SEXP AlignedXStringSet_align_aligned(SEXP alignedXStringSet, SEXP gapCode)
 
 	SEXP range = GET_SLOT(alignedXStringSet, install("range"));
 	int numberOfAlignments = get_IRanges_length(range);
+	const int *rangeStart = INTEGER(get_IRanges_start(range));
+	const int *rangeWidth = INTEGER(get_IRanges_width(range));
 
 	SEXP indel = GET_SLOT(alignedXStringSet, install("indel"));
-	CompressedIRangesList_holder indel_holder = hold_CompressedIRangesList(indel);
+	IndelRanges indelRanges = hold_IndelRanges(indel);
 
 	const char *stringSetClass = get_qualityless_classname(unaligned);
 	const char *stringClass = get_List_elementType(unaligned);
@@ -92,21 +144,20 @@ SEXP AlignedXStringSet_align_aligned(SEXP alignedXStringSet, SEXP gapCode)
 
 	SEXP output;
 
+	/* Single pass over the widths: the start of every aligned string
+	   and the total nb of letters. */
 	SEXP alignedRanges, alignedStart, alignedWidth;
 	PROTECT(alignedWidth = AlignedXStringSet_nchar(alignedXStringSet));
-	PROTECT(alignedStart = NEW_INTEGER(LENGTH(alignedWidth)));
-	int totalNChars = 0;
-	const int *width_i, *start_i;
-	int *start_iPlus1;
-	for (i = 0, width_i = INTEGER(alignedWidth); i < LENGTH(alignedWidth); i++, width_i++) {
-		totalNChars += *width_i;
-	}
-	if (totalNChars > 0) {
-		INTEGER(alignedStart)[0] = 1;
-		for (i = 0, start_i = INTEGER(alignedStart), width_i = INTEGER(alignedWidth),
-				start_iPlus1 = INTEGER(alignedStart) + 1; i < LENGTH(alignedWidth) - 1;
-				i++, start_i++, width_i++, start_iPlus1++) {
-			*start_iPlus1 = *start_i + *width_i;
+	PROTECT(alignedStart = NEW_INTEGER(numberOfAlignments));
+	const int *width_i = INTEGER(alignedWidth);
+	int *start_i = INTEGER(alignedStart);
+	R_xlen_t totalNChars = 0;
+	for (i = 0; i < numberOfAlignments; i++) {
+		start_i[i] = (int) totalNChars + 1;
+		totalNChars += width_i[i];
+		if (totalNChars > INT_MAX) {
+			UNPROTECT(2);
+			error("too many letters in the aligned strings");
 		}
 	}
 	SEXP alignedStringTag;
@@ -116,39 +167,19 @@ SEXP AlignedXStringSet_align_aligned(SEXP alignedXStringSet, SEXP gapCode)
 	PROTECT(output = new_XRawList_from_tag(stringSetClass, stringClass, alignedStringTag, alignedRanges));
 
 	int stringIncrement = (numberOfStrings == 1 ? 0 : 1);
-	int index = 0, stringElement = 0;
-	const int *rangeStart, *rangeWidth;
-	for (i = 0, rangeStart = INTEGER(get_IRanges_start(range)), rangeWidth = INTEGER(get_IRanges_width(range));
-	         i < numberOfAlignments; i++, rangeStart++, rangeWidth++) {
-		Chars_holder origString = _get_elt_from_XStringSet_holder(&unaligned_holder, stringElement);
-		char *origStringPtr = (char *) (origString.ptr + (*rangeStart - 1));
-		IRanges_holder indelElement = get_elt_from_CompressedIRangesList_holder(&indel_holder, i);
-		int numberOfIndel = get_length_from_IRanges_holder(&indelElement);
-		if (numberOfIndel == 0) {
-			memcpy(&alignedStringPtr[index], origStringPtr, *rangeWidth * sizeof(char));
-			index += *rangeWidth;
-		} else {
-			int prevStart = 0;
-			for (j = 0; j < numberOfIndel; j++) {
-				int currStart = get_start_elt_from_IRanges_holder(&indelElement, j) - 1;
-				int currWidth = get_width_elt_from_IRanges_holder(&indelElement, j);
-				int copyElements = currStart - prevStart;
-				if (copyElements > 0) {
-					memcpy(&alignedStringPtr[index], origStringPtr, copyElements * sizeof(char));
-					index += copyElements;
-					origStringPtr += copyElements;
-				}
-				for (k = 0; k < currWidth; k++) {
-					alignedStringPtr[index] = gapCodeValue;
-					index++;
-				}
-				prevStart = currStart;
-			}
-			int copyElements = *rangeWidth - prevStart;
-			memcpy(&alignedStringPtr[index], origStringPtr, copyElements * sizeof(char));
-			index += copyElements;
-		}
-		stringElement += stringIncrement;
+	nthreads0 = _get_nthreads(nthreads);
+	#pragma omp parallel for num_threads(nthreads0) schedule(static)
+	for (i = 0; i < numberOfAlignments; i++) {
+		Chars_holder origString = _get_elt_from_XStringSet_holder(
+				&unaligned_holder, i * stringIncrement);
+		int offset = get_IndelRanges_offset(&indelRanges, i);
+		fill_aligned_string(alignedStringPtr + (start_i[i] - 1),
+				    origString.ptr + (rangeStart[i] - 1),
+				    rangeWidth[i],
+				    indelRanges.start + offset,
+				    indelRanges.width + offset,
+				    indelRanges.end[i] - offset,
+				    gapCodeValue);
 	}
 	UNPROTECT(5);
 
@@ -156,9 +187,63 @@ SEXP AlignedXStringSet_align_aligned(SEXP alignedXStringSet, SEXP gapCode)
 }
 
 
-SEXP PairwiseAlignmentsSingleSubject_align_aligned(SEXP alignment, SEXP gapCode, SEXP endgapCode)
+/*
+ * Fills 'out' with the pattern of an alignment mapped onto the subject
+ * coordinates i.e. pattern letters that are inserted in the subject are
+ * dropped and deletions from the subject become gaps.
+ * Indel starts are in ungapped letter coordinates (relative to the aligned
+ * range) of their own string.
+ */
+static void fill_mapped_string(char *out, const char *src,
+		int subjectStart, int subjectWidth, int numberOfChars,
+		const int *indelStartPattern, const int *indelWidthPattern,
+		int numberOfIndelPattern,
+		const int *indelStartSubject, const int *indelWidthSubject,
+		int numberOfIndelSubject,
+		char gapCodeValue, char endgapCodeValue)
+{
+	int j = 1, jPattern = 1, jp = 0, js = 0, n, trailing;
+
+	memset(out, endgapCodeValue, subjectStart - 1);
+	out += subjectStart - 1;
+	while (j <= subjectWidth) {
+		if (js < numberOfIndelSubject && j >= indelStartSubject[js]) {
+			src += indelWidthSubject[js];
+			jPattern += indelWidthSubject[js];
+			js++;
+		} else if (jp < numberOfIndelPattern &&
+			   jPattern >= indelStartPattern[jp]) {
+			memset(out, gapCodeValue, indelWidthPattern[jp]);
+			out += indelWidthPattern[jp];
+			j += indelWidthPattern[jp];
+			jp++;
+		} else {
+			/* Longest run of pattern letters before the next
+			   indel. */
+			n = subjectWidth - j + 1;
+			if (js < numberOfIndelSubject &&
+			    indelStartSubject[js] - j < n)
+				n = indelStartSubject[js] - j;
+			if (jp < numberOfIndelPattern &&
+			    indelStartPattern[jp] - jPattern < n)
+				n = indelStartPattern[jp] - jPattern;
+			memcpy(out, src, n);
+			out += n;
+			src += n;
+			j += n;
+			jPattern += n;
+		}
+	}
+	trailing = numberOfChars - (subjectStart + subjectWidth - 1);
+	if (trailing > 0)
+		memset(out, endgapCodeValue, trailing);
+	return;
+}
+
+SEXP PairwiseAlignmentsSingleSubject_align_aligned(SEXP alignment, SEXP gapCode,
+		SEXP endgapCode, SEXP nthreads)
 {
-	int i, j, k;
+	int i, nthreads0;
 	char gapCodeValue = (char) RAW(gapCode)[0];
 	char endgapCodeValue = (char) RAW(endgapCode)[0];
 
@@ -167,13 +252,11 @@ SEXP PairwiseAlignmentsSingleSubject_align_aligned(SEXP alignment, SEXP gapCode,
 	XStringSet_holder unalignedPattern_holder = _hold_XStringSet(unalignedPattern);
 	SEXP rangePattern = GET_SLOT(pattern, install("range"));
 	SEXP namesPattern = get_IRanges_names(rangePattern);
-	SEXP indelPattern = GET_SLOT(pattern, install("indel"));
-	CompressedIRangesList_holder indelPattern_holder = hold_CompressedIRangesList(indelPattern);
+	IndelRanges indelPattern = hold_IndelRanges(GET_SLOT(pattern, install("indel")));
 
 	SEXP subject = GET_SLOT(alignment, install("subject"));
 	SEXP rangeSubject = GET_SLOT(subject, install("range"));
-	SEXP indelSubject = GET_SLOT(subject, install("indel"));
-	CompressedIRangesList_holder indelSubject_holder = hold_CompressedIRangesList(indelSubject);
+	IndelRanges indelSubject = hold_IndelRanges(GET_SLOT(subject, install("indel")));
 
 	const char *stringSetClass = get_qualityless_classname(unalignedPattern);
 	const char *stringClass = get_List_elementType(unalignedPattern);
@@ -181,19 +264,23 @@ SEXP PairwiseAlignmentsSingleSubject_align_aligned(SEXP alignment, SEXP gapCode,
 	int numberOfAlignments = get_IRanges_length(rangePattern);
 	int numberOfChars = INTEGER(_get_XStringSet_width(GET_SLOT(subject, install("unaligned"))))[0];
 
+	const int *rangeStartPattern = INTEGER(get_IRanges_start(rangePattern));
+	const int *rangeStartSubject = INTEGER(get_IRanges_start(rangeSubject));
+	const int *rangeWidthSubject = INTEGER(get_IRanges_width(rangeSubject));
+
 	SEXP output;
 
+	/* All the mapped strings have the width of the subject. */
+	R_xlen_t totalNChars = (R_xlen_t) numberOfAlignments * numberOfChars;
+	if (totalNChars > INT_MAX)
+		error("too many letters in the aligned strings");
 	SEXP mappedRanges, mappedStart, mappedWidth;
 	PROTECT(mappedWidth = NEW_INTEGER(numberOfAlignments));
 	PROTECT(mappedStart = NEW_INTEGER(numberOfAlignments));
-	int totalNChars = numberOfAlignments * numberOfChars;
-	int *width_i, *start_i;
-	if (totalNChars > 0) {
-		for (i = 0, start_i = INTEGER(mappedStart), width_i = INTEGER(mappedWidth);
-				i < numberOfAlignments; i++, start_i++, width_i++) {
-			*start_i = i * numberOfChars + 1;
-			*width_i = numberOfChars;
-		}
+	int *width_i = INTEGER(mappedWidth), *start_i = INTEGER(mappedStart);
+	for (i = 0; i < numberOfAlignments; i++) {
+		start_i[i] = i * numberOfChars + 1;
+		width_i[i] = numberOfChars;
 	}
 	SEXP mappedStringTag;
 	PROTECT(mappedStringTag = NEW_RAW(totalNChars));
@@ -201,68 +288,24 @@ SEXP PairwiseAlignmentsSingleSubject_align_aligned(SEXP alignment, SEXP gapCode,
 	char *mappedStringPtr = (char *) RAW(mappedStringTag);
 	PROTECT(output = new_XRawList_from_tag(stringSetClass, stringClass, mappedStringTag, mappedRanges));
 
-	int index = 0;
-	const int *rangeStartPattern, *rangeWidthPattern, *rangeStartSubject, *rangeWidthSubject;
-	for (i = 0,
-			rangeStartPattern = INTEGER(get_IRanges_start(rangePattern)),
-			rangeWidthPattern = INTEGER(get_IRanges_width(rangePattern)),
-			rangeStartSubject = INTEGER(get_IRanges_start(rangeSubject)),
-			rangeWidthSubject = INTEGER(get_IRanges_width(rangeSubject));
-	         i < numberOfAlignments;
-	         i++, rangeStartPattern++, rangeWidthPattern++, rangeStartSubject++, rangeWidthSubject++) {
-		Chars_holder origString = _get_elt_from_XStringSet_holder(&unalignedPattern_holder, i);
-		char *origStringPtr = (char *) (origString.ptr + (*rangeStartPattern - 1));
-		IRanges_holder indelElementPattern = get_elt_from_CompressedIRangesList_holder(&indelPattern_holder, i);
-		IRanges_holder indelElementSubject = get_elt_from_CompressedIRangesList_holder(&indelSubject_holder, i);
-		int numberOfIndelPattern = get_length_from_IRanges_holder(&indelElementPattern);
-		int numberOfIndelSubject = get_length_from_IRanges_holder(&indelElementSubject);
-
-		for (j = 0; j < *rangeStartSubject - 1; j++) {
-			mappedStringPtr[index] = endgapCodeValue;
-			index++;
-		}
-		int jPattern = 1, jp = 0, js = 0;
-		int indelStartPattern, indelWidthPattern, indelStartSubject, indelWidthSubject;
-		if (numberOfIndelPattern > 0) {
-			indelStartPattern = get_start_elt_from_IRanges_holder(&indelElementPattern, jp);
-			indelWidthPattern = get_width_elt_from_IRanges_holder(&indelElementPattern, jp);
-		}
-		if (numberOfIndelSubject > 0) {
-			indelStartSubject = get_start_elt_from_IRanges_holder(&indelElementSubject, js);
-			indelWidthSubject = get_width_elt_from_IRanges_holder(&indelElementSubject, js);
-		}
-		for (j = 1; j <= *rangeWidthSubject; j++) {
-			if ((numberOfIndelSubject == 0) || (j < indelStartSubject)) {
-				if ((numberOfIndelPattern == 0) || (jPattern < indelStartPattern)) {
-					mappedStringPtr[index] = *origStringPtr;
-					index++;
-					origStringPtr++;
-					jPattern++;
-				} else {
-					for (k = 0; k < indelWidthPattern; k++) {
-						mappedStringPtr[index] = gapCodeValue;
-						index++;
-					}
-					j += indelWidthPattern - 1;
-					jp++;
-					indelStartPattern = get_start_elt_from_IRanges_holder(&indelElementPattern, jp);
-					indelWidthPattern = get_width_elt_from_IRanges_holder(&indelElementPattern, jp);
-					numberOfIndelPattern--;
-				}
-			} else {
-				origStringPtr += indelWidthSubject;
-				jPattern += indelWidthSubject;
-				j--;
-				js++;
-				indelStartSubject = get_start_elt_from_IRanges_holder(&indelElementSubject, js);
-				indelWidthSubject = get_width_elt_from_IRanges_holder(&indelElementSubject, js);
-				numberOfIndelSubject--;
-			}
-		}
-		for (j = *rangeStartSubject + (*rangeWidthSubject - 1); j < numberOfChars; j++) {
-			mappedStringPtr[index] = endgapCodeValue;
-			index++;
-		}
+	nthreads0 = _get_nthreads(nthreads);
+	#pragma omp parallel for num_threads(nthreads0) schedule(static)
+	for (i = 0; i < numberOfAlignments; i++) {
+		Chars_holder origString = _get_elt_from_XStringSet_holder(
+				&unalignedPattern_holder, i);
+		int offsetPattern = get_IndelRanges_offset(&indelPattern, i);
+		int offsetSubject = get_IndelRanges_offset(&indelSubject, i);
+		fill_mapped_string(mappedStringPtr + (R_xlen_t) i * numberOfChars,
+				   origString.ptr + (rangeStartPattern[i] - 1),
+				   rangeStartSubject[i], rangeWidthSubject[i],
+				   numberOfChars,
+				   indelPattern.start + offsetPattern,
+				   indelPattern.width + offsetPattern,
+				   indelPattern.end[i] - offsetPattern,
+				   indelSubject.start + offsetSubject,
+				   indelSubject.width + offsetSubject,
+				   indelSubject.end[i] - offsetSubject,
+				   gapCodeValue, endgapCodeValue);
 	}
 	UNPROTECT(5);
 
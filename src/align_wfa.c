@@ -0,0 +1,466 @@
+#include "Biostrings.h"
+#include <R_ext/Utils.h>        /* R_CheckUserInterrupt */
+
+#include <limits.h>             /* for INT_MAX, INT_MIN */
+
+
+/*
+ * Wavefront alignment (WFA) of 2 strings with gap-affine penalties.
+ *
+ * This is the algorithm described in S. Marco-Sola et al., "Fast gap-affine
+ * pairwise alignment using the wavefront algorithm", Bioinformatics 2021.
+ * Instead of filling the full DP matrix, WFA computes, for increasing values
+ * s of the alignment penalty, the furthest reaching point of every diagonal
+ * that can be reached with penalty s (the "wavefront" of s), and it extends
+ * these points along the exact matches for free. It stops as soon as the end
+ * of the alignment is reached, so its cost is O((n + m) * s) where s is the
+ * penalty of the optimal alignment. This makes it much faster than DP on
+ * highly similar strings.
+ *
+ * The penalties are non-negative integers:
+ *   penalties[0]: mismatch (> 0);
+ *   penalties[1]: gap opening;
+ *   penalties[2]: gap extension (> 0), so a gap of length k costs
+ *                 penalties[1] + k * penalties[2];
+ *   penalties[3]: cost of each letter of an unpenalized end gap, i.e. of an
+ *                 end gap in string P when 'endGap1' is 0, or in string S when
+ *                 'endGap2' is 0.
+ * Matches are free. See .makeWFAPenalties() in R/pairwiseAlignment.R for how
+ * the scores of pairwiseAlignment() are converted to such penalties.
+ *
+ * Diagonal k is made of the cells (v, h) with h - v = k, where v (resp. h) is
+ * the nb of letters of P (resp. S) already aligned. A point on diagonal k is
+ * represented by its offset h.
+ */
+
+#define M_WAVEFRONT 0
+#define I_WAVEFRONT 1   /* the last operation consumed a letter of P only */
+#define D_WAVEFRONT 2   /* the last operation consumed a letter of S only */
+
+#define OFFSET_NULL (INT_MIN / 2)
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+void _init_WFABuf(WFABuf *buf)
+{
+	buf->offsets = NULL;
+	buf->offsets_maxlen = 0;
+	buf->base = NULL;
+	buf->lo = buf->hi = NULL;
+	buf->max_nscore = 0;
+	buf->nslot = 0;
+	buf->slot_len = 0;
+	buf->ops = NULL;
+	buf->ops_maxlen = 0;
+	buf->nops = 0;
+	return;
+}
+
+/*
+ * The buffers only grow and are allocated with R_alloc() so nothing leaks if
+ * the computation is interrupted.
+ */
+static void *grow_buf(void *buf, long old_len, long new_len, size_t eltsize)
+{
+	void *new_buf;
+
+	new_buf = R_alloc(new_len, eltsize);
+	if (old_len != 0)
+		memcpy(new_buf, buf, old_len * eltsize);
+	return new_buf;
+}
+
+static void reserve_scores(WFABuf *buf, int nscore)
+{
+	int new_max_nscore;
+
+	if (nscore <= buf->max_nscore)
+		return;
+	new_max_nscore = MAX(2 * buf->max_nscore, MAX(nscore, 256));
+	buf->base = (long *) grow_buf(buf->base, buf->max_nscore,
+				      new_max_nscore, sizeof(long));
+	buf->lo = (int *) grow_buf(buf->lo, buf->max_nscore,
+				   new_max_nscore, sizeof(int));
+	buf->hi = (int *) grow_buf(buf->hi, buf->max_nscore,
+				   new_max_nscore, sizeof(int));
+	buf->max_nscore = new_max_nscore;
+	return;
+}
+
+static void reserve_offsets(WFABuf *buf, long used_len, long len)
+{
+	long new_maxlen;
+
+	if (len <= buf->offsets_maxlen)
+		return;
+	new_maxlen = MAX(2 * buf->offsets_maxlen, MAX(len, 4096));
+	buf->offsets = (int *) grow_buf(buf->offsets, used_len,
+					new_maxlen, sizeof(int));
+	buf->offsets_maxlen = new_maxlen;
+	return;
+}
+
+/*
+ * Makes the slots at least 'len' long. The wavefronts they hold are moved to
+ * their new place.
+ */
+static void reserve_slots(WFABuf *buf, long len)
+{
+	long new_slot_len;
+	int *new_offsets, i;
+
+	if (len <= buf->slot_len)
+		return;
+	new_slot_len = MAX(2 * buf->slot_len, MAX(len, 1024));
+	new_offsets = (int *) R_alloc((long) buf->nslot * new_slot_len,
+				      sizeof(int));
+	for (i = 0; i < buf->nslot; i++) {
+		if (buf->lo[i] <= buf->hi[i])
+			memcpy(new_offsets + (long) i * new_slot_len,
+			       buf->offsets + buf->base[i],
+			       3L * (buf->hi[i] - buf->lo[i] + 1) * sizeof(int));
+		buf->base[i] = (long) i * new_slot_len;
+	}
+	buf->offsets = new_offsets;
+	buf->offsets_maxlen = (long) buf->nslot * new_slot_len;
+	buf->slot_len = new_slot_len;
+	return;
+}
+
+/* Index in 'base', 'lo' and 'hi' of the wavefront of score s. */
+static int get_slot(const WFABuf *buf, int s)
+{
+	return buf->nslot == 0 ? s : s % buf->nslot;
+}
+
+static int get_offset(const WFABuf *buf, int s, int component, int k)
+{
+	int i, lo, hi;
+
+	if (s < 0)
+		return OFFSET_NULL;
+	i = get_slot(buf, s);
+	lo = buf->lo[i];
+	hi = buf->hi[i];
+	if (k < lo || k > hi)
+		return OFFSET_NULL;
+	return buf->offsets[buf->base[i] + (long) component * (hi - lo + 1)
+			    + (k - lo)];
+}
+
+/*
+ * Offset of the starting point of diagonal k if an alignment can start
+ * there with penalty s (the starting points other than (0, 0) correspond to
+ * unpenalized leading end gaps).
+ */
+static int get_seed(int s, int k, int n1, int n2, int endLetter,
+		int endGap1, int endGap2)
+{
+	int t;
+
+	if (k == 0)
+		return s == 0 ? 0 : OFFSET_NULL;
+	t = k > 0 ? k : -k;
+	if (endLetter == 0) {
+		if (s != 0)
+			return OFFSET_NULL;
+	} else if (s % endLetter != 0 || s / endLetter != t) {
+		return OFFSET_NULL;
+	}
+	if (k < 0)
+		return !endGap1 && t <= n1 ? 0 : OFFSET_NULL;
+	return !endGap2 && t <= n2 ? k : OFFSET_NULL;
+}
+
+static void widen_with_diagonal(int k, int *lo, int *hi)
+{
+	*lo = MIN(*lo, k);
+	*hi = MAX(*hi, k);
+	return;
+}
+
+/* Widens [lo, hi] so it contains the diagonals of the seeds of penalty s. */
+static void widen_with_seeds(int s, int n1, int n2, int endLetter,
+		int endGap1, int endGap2, int *lo, int *hi)
+{
+	int t;
+
+	if (s == 0)
+		widen_with_diagonal(0, lo, hi);
+	if (endLetter == 0) {
+		if (s != 0)
+			return;
+		if (!endGap1)
+			widen_with_diagonal(-n1, lo, hi);
+		if (!endGap2)
+			widen_with_diagonal(n2, lo, hi);
+		return;
+	}
+	if (s % endLetter != 0)
+		return;
+	t = s / endLetter;
+	if (!endGap1 && t <= n1)
+		widen_with_diagonal(-t, lo, hi);
+	if (!endGap2 && t <= n2)
+		widen_with_diagonal(t, lo, hi);
+	return;
+}
+
+static void widen_with_source(const WFABuf *buf, int s, int shift,
+		int *lo, int *hi)
+{
+	int i;
+
+	if (s < 0)
+		return;
+	i = get_slot(buf, s);
+	if (buf->lo[i] > buf->hi[i])
+		return;
+	*lo = MIN(*lo, buf->lo[i] - shift);
+	*hi = MAX(*hi, buf->hi[i] + shift);
+	return;
+}
+
+/* Offset on diagonal k after a mismatch from wavefront s, or OFFSET_NULL. */
+static int mismatch_offset(const WFABuf *buf, int s, int k, int n1, int n2)
+{
+	int h;
+
+	h = get_offset(buf, s, M_WAVEFRONT, k);
+	if (h == OFFSET_NULL || h >= n2 || h - k >= n1)
+		return OFFSET_NULL;
+	return h + 1;
+}
+
+/* Offset on diagonal k after consuming a letter of P from diagonal k + 1. */
+static int insertion_offset(const WFABuf *buf, int s, int component, int k,
+		int n1)
+{
+	int h;
+
+	h = get_offset(buf, s, component, k + 1);
+	if (h == OFFSET_NULL || h - (k + 1) >= n1)
+		return OFFSET_NULL;
+	return h;
+}
+
+/* Offset on diagonal k after consuming a letter of S from diagonal k - 1. */
+static int deletion_offset(const WFABuf *buf, int s, int component, int k,
+		int n2)
+{
+	int h;
+
+	h = get_offset(buf, s, component, k - 1);
+	if (h == OFFSET_NULL || h >= n2)
+		return OFFSET_NULL;
+	return h + 1;
+}
+
+static void append_ops(WFABuf *buf, char op, int n)
+{
+	for ( ; n > 0; n--)
+		buf->ops[buf->nops++] = op;
+	return;
+}
+
+/*
+ * Walks back from the end point of the optimal alignment and stores its
+ * edit operations in 'buf->ops' (from the start to the end of the
+ * alignment).
+ */
+static void wfa_backtrace(WFABuf *buf, const int *penalties,
+		const Chars_holder *P, const Chars_holder *S,
+		int endGap1, int endGap2, int s, int k)
+{
+	int n1, n2, x, oe, e, c, component, h, src_h, src, h0, i, j;
+	char tmp;
+
+	n1 = P->length;
+	n2 = S->length;
+	x = penalties[0];
+	oe = penalties[1] + penalties[2];
+	e = penalties[2];
+	c = penalties[3];
+	if (buf->ops_maxlen < n1 + n2) {
+		buf->ops = (char *) R_alloc((long) n1 + n2, sizeof(char));
+		buf->ops_maxlen = n1 + n2;
+	}
+	buf->nops = 0;
+	component = M_WAVEFRONT;
+	h = get_offset(buf, s, M_WAVEFRONT, k);
+	while (1) {
+		if (component == I_WAVEFRONT) {
+			append_ops(buf, 'I', 1);
+			if (insertion_offset(buf, s - oe, M_WAVEFRONT, k, n1) == h) {
+				component = M_WAVEFRONT;
+				s -= oe;
+			} else {
+				s -= e;
+			}
+			k++;
+			continue;
+		}
+		if (component == D_WAVEFRONT) {
+			append_ops(buf, 'D', 1);
+			if (deletion_offset(buf, s - oe, M_WAVEFRONT, k, n2) == h) {
+				component = M_WAVEFRONT;
+				s -= oe;
+			} else {
+				s -= e;
+			}
+			k--;
+			h--;
+			continue;
+		}
+		/* Find where the extension along the matches started. */
+		src_h = mismatch_offset(buf, s - x, k, n1, n2);
+		src = 'X';
+		if ((h0 = get_offset(buf, s, I_WAVEFRONT, k)) > src_h) {
+			src_h = h0;
+			src = 'I';
+		}
+		if ((h0 = get_offset(buf, s, D_WAVEFRONT, k)) > src_h) {
+			src_h = h0;
+			src = 'D';
+		}
+		if ((h0 = get_seed(s, k, n1, n2, c, endGap1, endGap2)) > src_h) {
+			src_h = h0;
+			src = 'S';
+		}
+		append_ops(buf, 'M', h - src_h);
+		h = src_h;
+		if (src == 'X') {
+			append_ops(buf, 'M', 1);
+			s -= x;
+			h--;
+		} else if (src == 'I') {
+			component = I_WAVEFRONT;
+		} else if (src == 'D') {
+			component = D_WAVEFRONT;
+		} else {
+			/* Unpenalized leading end gap. */
+			append_ops(buf, k < 0 ? 'I' : 'D', k < 0 ? -k : k);
+			break;
+		}
+	}
+	for (i = 0, j = buf->nops - 1; i < j; i++, j--) {
+		tmp = buf->ops[i];
+		buf->ops[i] = buf->ops[j];
+		buf->ops[j] = tmp;
+	}
+	return;
+}
+
+/*
+ * Returns the penalty of the optimal alignment of P and S. 'endGap1' (resp.
+ * 'endGap2') indicates whether the end gaps in P (resp. S) are penalized like
+ * the other gaps. If 'traceback' is non-zero, the edit operations of the
+ * optimal alignment are stored in 'buf->ops'. Otherwise only the wavefronts
+ * that the next ones can depend on are kept, i.e. the last
+ * max(mismatch, gap opening + gap extension) + 1 ones.
+ */
+int _wfa_align(WFABuf *buf, const Chars_holder *P, const Chars_holder *S,
+		const int *penalties, int endGap1, int endGap2, int traceback)
+{
+	int n1, n2, x, oe, e, c, s, i, k, lo, hi, w, h, v, Mk, Ik, Dk, h0,
+	    total, best, best_s, best_k;
+	long used_len;
+	int *M, *I, *D;
+
+	n1 = P->length;
+	n2 = S->length;
+	x = penalties[0];
+	oe = penalties[1] + penalties[2];
+	e = penalties[2];
+	c = penalties[3];
+	best = INT_MAX;
+	best_s = best_k = 0;
+	used_len = 0;
+	buf->nslot = traceback ? 0 : MAX(x, oe) + 1;
+	if (buf->nslot != 0) {
+		reserve_scores(buf, buf->nslot);
+		buf->slot_len = buf->offsets_maxlen / buf->nslot;
+		for (i = 0; i < buf->nslot; i++) {
+			buf->base[i] = (long) i * buf->slot_len;
+			buf->lo[i] = 0;
+			buf->hi[i] = -1;
+		}
+	}
+	for (s = 0; ; s++) {
+		if (s % 1024 == 1023)
+			R_CheckUserInterrupt();
+		if (buf->nslot == 0)
+			reserve_scores(buf, s + 1);
+		i = get_slot(buf, s);
+		lo = INT_MAX;
+		hi = INT_MIN;
+		widen_with_source(buf, s - x, 0, &lo, &hi);
+		widen_with_source(buf, s - oe, 1, &lo, &hi);
+		widen_with_source(buf, s - e, 1, &lo, &hi);
+		widen_with_seeds(s, n1, n2, c, endGap1, endGap2, &lo, &hi);
+		lo = MAX(lo, -n1);
+		hi = MIN(hi, n2);
+		if (lo > hi) {
+			/* Empty wavefront */
+			buf->lo[i] = 0;
+			buf->hi[i] = -1;
+		} else {
+			w = hi - lo + 1;
+			if (buf->nslot == 0) {
+				reserve_offsets(buf, used_len, used_len + 3L * w);
+				buf->base[i] = used_len;
+				used_len += 3L * w;
+			} else {
+				reserve_slots(buf, 3L * w);
+			}
+			buf->lo[i] = lo;
+			buf->hi[i] = hi;
+			M = buf->offsets + buf->base[i];
+			I = M + w;
+			D = I + w;
+			for (k = lo; k <= hi; k++) {
+				Ik = MAX(insertion_offset(buf, s - oe, M_WAVEFRONT, k, n1),
+					 insertion_offset(buf, s - e, I_WAVEFRONT, k, n1));
+				Dk = MAX(deletion_offset(buf, s - oe, M_WAVEFRONT, k, n2),
+					 deletion_offset(buf, s - e, D_WAVEFRONT, k, n2));
+				Mk = MAX(mismatch_offset(buf, s - x, k, n1, n2),
+					 MAX(Ik, Dk));
+				h0 = get_seed(s, k, n1, n2, c, endGap1, endGap2);
+				Mk = MAX(Mk, h0);
+				I[k - lo] = Ik;
+				D[k - lo] = Dk;
+				if (Mk == OFFSET_NULL) {
+					M[k - lo] = OFFSET_NULL;
+					continue;
+				}
+				/* Extend along the exact matches. */
+				h = Mk;
+				v = h - k;
+				while (h < n2 && v < n1 && S->ptr[h] == P->ptr[v]) {
+					h++;
+					v++;
+				}
+				M[k - lo] = h;
+				if (v == n1 && h == n2)
+					total = s;
+				else if (v == n1 && !endGap2)
+					total = s + c * (n2 - h);
+				else if (h == n2 && !endGap1)
+					total = s + c * (n1 - v);
+				else
+					continue;
+				if (total < best) {
+					best = total;
+					best_s = s;
+					best_k = k;
+				}
+			}
+		}
+		if (best <= s)
+			break;
+	}
+	if (traceback)
+		wfa_backtrace(buf, penalties, P, S, endGap1, endGap2,
+			      best_s, best_k);
+	return best;
+}
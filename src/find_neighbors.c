@@ -0,0 +1,526 @@
+/****************************************************************************
+ *          Search of all the pairs of strings within distance k            *
+ ****************************************************************************/
+#include "Biostrings.h"
+#include <R_ext/Utils.h>        /* R_CheckUserInterrupt */
+
+#include <stdlib.h>             /* for qsort(), realloc(), free() */
+#include <limits.h>             /* for INT_MAX */
+
+
+/*
+ * Pigeonhole seed indexing.
+ *
+ * If string y is cut in k + 1 non-overlapping segments (its "seeds") and
+ * string x is within distance k of y, then at least one of the seeds of y
+ * occurs exactly in x:
+ *   - at the same position for the Hamming distance;
+ *   - shifted by at most k positions for the Levenshtein distance.
+ * So the strings are grouped by length, and for each group and each seed the
+ * strings of the group are sorted by the content of their seed. The
+ * candidate neighbors of x are then found by binary search of the substrings
+ * of x in these sorted seeds, and only the distances to the candidates are
+ * computed. This makes the search practical on millions of short strings
+ * (e.g. barcodes or UMIs) as long as k is small compared to their length.
+ */
+
+#define HAMMING_DIST     1
+#define LEVENSHTEIN_DIST 2
+
+/* The strings of length 'length' are elts[order[offset + t]] for 0 <= t <
+ * 'nelt'. seed_order[s * nelt + t] is the t-th string of the group when the
+ * strings are sorted by the content of seed s. */
+typedef struct length_group {
+	int length;
+	int offset;
+	int nelt;
+	int *seed_order;
+} LengthGroup;
+
+typedef struct seed_index {
+	const Chars_holder *elts;
+	int nseed;
+	int ngroup;
+	LengthGroup *groups;
+} SeedIndex;
+
+static int get_seed_start(int length, int nseed, int s)
+{
+	return (int) ((long) s * length / nseed);
+}
+
+
+/****************************************************************************
+ * Construction of the seed index. Runs on the main thread only.
+ */
+
+/* Sort contexts (qsort() doesn't pass any context to the compar function) */
+static const Chars_holder *sort_elts;
+static int sort_seed_start, sort_seed_length;
+
+static int compar_lengths(const void *p1, const void *p2)
+{
+	int i1, i2, ret;
+
+	i1 = *((const int *) p1);
+	i2 = *((const int *) p2);
+	ret = sort_elts[i1].length - sort_elts[i2].length;
+	return ret != 0 ? ret : i1 - i2;
+}
+
+static int compar_seeds(const void *p1, const void *p2)
+{
+	int i1, i2, ret;
+
+	i1 = *((const int *) p1);
+	i2 = *((const int *) p2);
+	ret = memcmp(sort_elts[i1].ptr + sort_seed_start,
+		     sort_elts[i2].ptr + sort_seed_start,
+		     sort_seed_length);
+	return ret != 0 ? ret : i1 - i2;
+}
+
+static SeedIndex new_SeedIndex(const Chars_holder *elts, int nelt, int nseed)
+{
+	SeedIndex index;
+	LengthGroup *group;
+	int *order, i, g, s, start;
+
+	index.elts = elts;
+	index.nseed = nseed;
+
+	/* Group the strings by length */
+	order = (int *) R_alloc((long) nelt, sizeof(int));
+	for (i = 0; i < nelt; i++)
+		order[i] = i;
+	sort_elts = elts;
+	qsort(order, nelt, sizeof(int), compar_lengths);
+	index.ngroup = 0;
+	for (i = 0; i < nelt; i++)
+		if (i == 0 || elts[order[i]].length != elts[order[i - 1]].length)
+			index.ngroup++;
+	index.groups = (LengthGroup *) R_alloc((long) index.ngroup,
+					       sizeof(LengthGroup));
+	for (i = 0, g = -1; i < nelt; i++) {
+		if (i == 0 || elts[order[i]].length != elts[order[i - 1]].length) {
+			group = index.groups + ++g;
+			group->length = elts[order[i]].length;
+			group->offset = i;
+			group->nelt = 0;
+		}
+		group->nelt++;
+	}
+
+	/* Sort the strings of each group by the content of each seed */
+	for (g = 0; g < index.ngroup; g++) {
+		group = index.groups + g;
+		group->seed_order = (int *) R_alloc((long) nseed * group->nelt,
+						    sizeof(int));
+		for (s = 0; s < nseed; s++) {
+			memcpy(group->seed_order + (long) s * group->nelt,
+			       order + group->offset, sizeof(int) * group->nelt);
+			start = get_seed_start(group->length, nseed, s);
+			sort_seed_start = start;
+			sort_seed_length =
+				get_seed_start(group->length, nseed, s + 1) - start;
+			qsort(group->seed_order + (long) s * group->nelt,
+			      group->nelt, sizeof(int), compar_seeds);
+		}
+	}
+	return index;
+}
+
+/*
+ * Returns the first t in [t1, t2) such that the seed starting at 'start' of
+ * string seed_order[t] is >= (or > if 'upper' is 1) 'seed'.
+ */
+static int bsearch_seed(const Chars_holder *elts, const int *seed_order,
+		int t1, int t2, int start, const char *seed, int seed_length,
+		int upper)
+{
+	int t, cmp;
+
+	while (t1 < t2) {
+		t = t1 + (t2 - t1) / 2;
+		cmp = memcmp(elts[seed_order[t]].ptr + start, seed, seed_length);
+		if (cmp < 0 || (upper && cmp == 0))
+			t1 = t + 1;
+		else
+			t2 = t;
+	}
+	return t1;
+}
+
+
+/****************************************************************************
+ * Buffer of pairs.
+ *
+ * Filled by the worker threads so it must not use the R API: it's grown with
+ * realloc() and it's emptied (and freed) by the main thread after each batch
+ * of strings.
+ */
+
+typedef struct pair_buf {
+	int *from;
+	int *to;
+	int *dist;
+	long nelt;
+	long buflength;
+	int failed;   /* 1 if a realloc() failed */
+} PairBuf;
+
+static void init_PairBuf(PairBuf *buf)
+{
+	buf->from = buf->to = buf->dist = NULL;
+	buf->nelt = buf->buflength = 0;
+	buf->failed = 0;
+	return;
+}
+
+static void free_PairBuf(PairBuf *buf)
+{
+	free(buf->from);
+	free(buf->to);
+	free(buf->dist);
+	init_PairBuf(buf);
+	return;
+}
+
+static void append_pair(PairBuf *buf, int from, int to, int dist)
+{
+	long new_buflength;
+	int *new_from, *new_to, *new_dist;
+
+	if (buf->failed)
+		return;
+	if (buf->nelt == buf->buflength) {
+		new_buflength = buf->buflength == 0 ? 1024 : 2 * buf->buflength;
+		new_from = (int *) realloc(buf->from, new_buflength * sizeof(int));
+		if (new_from != NULL)
+			buf->from = new_from;
+		new_to = (int *) realloc(buf->to, new_buflength * sizeof(int));
+		if (new_to != NULL)
+			buf->to = new_to;
+		new_dist = (int *) realloc(buf->dist, new_buflength * sizeof(int));
+		if (new_dist != NULL)
+			buf->dist = new_dist;
+		if (new_from == NULL || new_to == NULL || new_dist == NULL) {
+			buf->failed = 1;
+			return;
+		}
+		buf->buflength = new_buflength;
+	}
+	buf->from[buf->nelt] = from;
+	buf->to[buf->nelt] = to;
+	buf->dist[buf->nelt] = dist;
+	buf->nelt++;
+	return;
+}
+
+/* Collected pairs. Allocated with R_alloc() so nothing leaks if the user
+ * interrupts the search. */
+typedef struct pairs {
+	int *from;
+	int *to;
+	int *dist;
+	long nelt;
+	long buflength;
+} Pairs;
+
+static void move_PairBuf_to_Pairs(PairBuf *buf, Pairs *pairs)
+{
+	long new_buflength;
+	int *new_from, *new_to, *new_dist;
+
+	if (buf->nelt == 0) {
+		free_PairBuf(buf);
+		return;
+	}
+	if (pairs->nelt + buf->nelt > pairs->buflength) {
+		new_buflength = 2 * pairs->buflength;
+		if (new_buflength < pairs->nelt + buf->nelt)
+			new_buflength = pairs->nelt + buf->nelt;
+		new_from = (int *) R_alloc(new_buflength, sizeof(int));
+		new_to = (int *) R_alloc(new_buflength, sizeof(int));
+		new_dist = (int *) R_alloc(new_buflength, sizeof(int));
+		if (pairs->nelt != 0) {
+			memcpy(new_from, pairs->from, pairs->nelt * sizeof(int));
+			memcpy(new_to, pairs->to, pairs->nelt * sizeof(int));
+			memcpy(new_dist, pairs->dist, pairs->nelt * sizeof(int));
+		}
+		pairs->from = new_from;
+		pairs->to = new_to;
+		pairs->dist = new_dist;
+		pairs->buflength = new_buflength;
+	}
+	memcpy(pairs->from + pairs->nelt, buf->from, buf->nelt * sizeof(int));
+	memcpy(pairs->to + pairs->nelt, buf->to, buf->nelt * sizeof(int));
+	memcpy(pairs->dist + pairs->nelt, buf->dist, buf->nelt * sizeof(int));
+	pairs->nelt += buf->nelt;
+	free_PairBuf(buf);
+	return;
+}
+
+
+/****************************************************************************
+ * Search of the neighbors of 1 string. Runs on the worker threads: must not
+ * use the R API.
+ */
+
+typedef struct neighbor_search {
+	int method;
+	int max_dist;
+	const SeedIndex *index;
+
+	/* Hamming distance on 2-bit packed strings (see _twobit_pack() in
+	 * utils.c). NULL if the strings are not all made of the 4 bases. */
+	const BitWord *words;
+	const int *word_offsets;
+
+	/* Levenshtein distance */
+	const ByteTrTable *byte2class;
+} NeighborSearch;
+
+/* Per thread buffers */
+typedef struct neighbor_buf {
+	int *stamp;   /* last string for which each string was a candidate */
+	LevenshteinBuf levenshtein_buf;
+	PairBuf pairs;
+} NeighborBuf;
+
+static int get_dist(const NeighborSearch *search, NeighborBuf *buf,
+		int i, int j, int *pattern_is_set)
+{
+	const Chars_holder *elts = search->index->elts;
+
+	if (search->method == HAMMING_DIST) {
+		if (search->words != NULL)
+			return _twobit_hamming(
+				search->words + search->word_offsets[i],
+				search->words + search->word_offsets[j],
+				_get_twobit_nword(elts[i].length),
+				search->max_dist);
+		return _nmismatch_at_Pshift(elts + i, elts + j, 0,
+					    search->max_dist,
+					    _select_bytewise_match_table(1, 1));
+	}
+	if (!*pattern_is_set) {
+		_set_levenshtein_pattern(&(buf->levenshtein_buf), elts + i,
+					 search->byte2class);
+		*pattern_is_set = 1;
+	}
+	return _levenshtein_distance(&(buf->levenshtein_buf), elts + j,
+				     search->byte2class, search->max_dist);
+}
+
+/* Appends the pairs (i, j) with j > i and dist(i, j) <= max_dist to
+ * buf->pairs */
+static void find_neighbors_of(const NeighborSearch *search, NeighborBuf *buf,
+		int i)
+{
+	const SeedIndex *index = search->index;
+	const Chars_holder *x = index->elts + i;
+	const LengthGroup *group;
+	const int *seed_order;
+	int k, g, s, start, seed_length, shift, min_shift, max_shift, pos, t,
+	    t1, t2, j, dist, pattern_is_set;
+
+	k = search->max_dist;
+	pattern_is_set = 0;
+	for (g = 0; g < index->ngroup; g++) {
+		group = index->groups + g;
+		if (search->method == HAMMING_DIST ?
+		    group->length != x->length :
+		    abs(group->length - x->length) > k)
+			continue;
+		for (s = 0; s < index->nseed; s++) {
+			seed_order = group->seed_order + (long) s * group->nelt;
+			start = get_seed_start(group->length, index->nseed, s);
+			seed_length = get_seed_start(group->length,
+						     index->nseed, s + 1) - start;
+			/* An empty seed is found everywhere */
+			max_shift = search->method == HAMMING_DIST ||
+				    seed_length == 0 ? 0 : k;
+			/* Only the shifts that keep the seed within x */
+			min_shift = -start > -max_shift ? -start : -max_shift;
+			if (x->length - seed_length - start < max_shift)
+				max_shift = x->length - seed_length - start;
+			for (shift = min_shift; shift <= max_shift; shift++) {
+				pos = start + shift;
+				t1 = bsearch_seed(index->elts, seed_order,
+						  0, group->nelt, start,
+						  x->ptr + pos, seed_length, 0);
+				t2 = bsearch_seed(index->elts, seed_order,
+						  t1, group->nelt, start,
+						  x->ptr + pos, seed_length, 1);
+				for (t = t1; t < t2; t++) {
+					j = seed_order[t];
+					if (j <= i || buf->stamp[j] == i)
+						continue;
+					buf->stamp[j] = i;
+					dist = get_dist(search, buf, i, j,
+							&pattern_is_set);
+					if (dist <= k)
+						append_pair(&(buf->pairs),
+							    i, j, dist);
+				}
+			}
+		}
+	}
+	return;
+}
+
+
+/****************************************************************************
+ * XStringSet_find_neighbors()
+ */
+
+#define NEIGHBOR_BATCH_SIZE 4096
+
+/* Returns NULL if a string contains a letter that is not a base. */
+static BitWord *pack_elts(const Chars_holder *elts, int nelt,
+		SEXP base_codes, int *word_offsets)
+{
+	ByteTrTable eightbit2twobit;
+	BitWord *words;
+	long nword;
+	int i;
+
+	_init_byte2offset_with_INTEGER(&eightbit2twobit, base_codes, 1);
+	for (i = 0, nword = 0; i < nelt; i++) {
+		if (!_is_twobit_packable(&eightbit2twobit, elts + i))
+			return NULL;
+		word_offsets[i] = nword;
+		nword += _get_twobit_nword(elts[i].length);
+	}
+	words = (BitWord *) R_alloc(nword, sizeof(BitWord));
+	for (i = 0; i < nelt; i++)
+		_twobit_pack(&eightbit2twobit, elts + i, words + word_offsets[i]);
+	return words;
+}
+
+/*
+ * 'method' must be "hamming" or "levenshtein".
+ * 'max_distance' must be a single non-negative integer.
+ * 'base_codes' must be NULL or the 4 codes of the bases (for DNA or RNA).
+ * Returns the pairs (i, j), i < j, of strings within 'max_distance' of each
+ * other in a list of 3 integer vectors: 'from' (i), 'to' (j) and 'distance'.
+ * 'from' and 'to' are 1-based and the pairs are not sorted.
+ */
+/* --- .Call ENTRY POINT --- */
+SEXP XStringSet_find_neighbors(SEXP x, SEXP method, SEXP max_distance,
+		SEXP base_codes, SEXP nthreads)
+{
+	XStringSet_holder X;
+	Chars_holder *elts;
+	SeedIndex index;
+	NeighborSearch search;
+	NeighborBuf *bufs;
+	ByteTrTable byte2class;
+	Pairs pairs;
+	int x_length, max_length, nseed, nthreads0, i, i1, i2, failed,
+	    *word_offsets;
+	long p;
+	SEXP ans, ans_names, ans_elt;
+
+	X = _hold_XStringSet(x);
+	x_length = _get_length_from_XStringSet_holder(&X);
+	elts = (Chars_holder *) R_alloc((long) x_length, sizeof(Chars_holder));
+	max_length = 0;
+	for (i = 0; i < x_length; i++) {
+		elts[i] = _get_elt_from_XStringSet_holder(&X, i);
+		if (elts[i].length > max_length)
+			max_length = elts[i].length;
+	}
+
+	search.method = strcmp(CHAR(STRING_ELT(method, 0)), "hamming") == 0 ?
+			HAMMING_DIST : LEVENSHTEIN_DIST;
+	search.max_dist = INTEGER(max_distance)[0];
+	if (search.max_dist == NA_INTEGER || search.max_dist < 0)
+		error("'max_distance' must be a single non-negative integer");
+	/* No distance is greater than 'max_length' and, with more seeds than
+	   letters, the 1st seed of each string is empty so all the strings are
+	   candidates anyway. */
+	if (search.max_dist > max_length)
+		search.max_dist = max_length;
+	nseed = search.max_dist < INT_MAX ? search.max_dist + 1 : INT_MAX;
+	index = new_SeedIndex(elts, x_length, nseed);
+	search.index = &index;
+	search.words = NULL;
+	search.word_offsets = NULL;
+	if (search.method == HAMMING_DIST && base_codes != R_NilValue) {
+		word_offsets = (int *) R_alloc((long) x_length, sizeof(int));
+		search.words = pack_elts(elts, x_length, base_codes,
+					 word_offsets);
+		search.word_offsets = word_offsets;
+	}
+	/* Letters are compared as is (1 class per byte value) */
+	for (i = 0; i < BYTETRTABLE_LENGTH; i++)
+		byte2class.byte2code[i] = i;
+	search.byte2class = &byte2class;
+
+	nthreads0 = _get_nthreads(nthreads);
+	bufs = (NeighborBuf *) R_alloc((long) nthreads0, sizeof(NeighborBuf));
+	for (i = 0; i < nthreads0; i++) {
+		bufs[i].stamp = (int *) R_alloc((long) x_length, sizeof(int));
+		memset(bufs[i].stamp, -1, sizeof(int) * x_length);
+		if (search.method == LEVENSHTEIN_DIST)
+			bufs[i].levenshtein_buf =
+				_new_LevenshteinBuf(BYTETRTABLE_LENGTH,
+						    max_length);
+		init_PairBuf(&(bufs[i].pairs));
+	}
+
+	pairs.from = pairs.to = pairs.dist = NULL;
+	pairs.nelt = pairs.buflength = 0;
+	for (i1 = 0; i1 < x_length; i1 = i2) {
+		i2 = i1 + NEIGHBOR_BATCH_SIZE;
+		if (i2 > x_length)
+			i2 = x_length;
+		if (nthreads0 == 1) {
+			for (i = i1; i < i2; i++)
+				find_neighbors_of(&search, bufs, i);
+		} else {
+			#pragma omp parallel for num_threads(nthreads0) schedule(dynamic, 64)
+			for (i = i1; i < i2; i++)
+				find_neighbors_of(&search,
+						  bufs + _get_thread_num(), i);
+		}
+		failed = 0;
+		for (i = 0; i < nthreads0; i++) {
+			if (bufs[i].pairs.failed)
+				failed = 1;
+			else
+				move_PairBuf_to_Pairs(&(bufs[i].pairs), &pairs);
+		}
+		if (failed) {
+			for (i = 0; i < nthreads0; i++)
+				free_PairBuf(&(bufs[i].pairs));
+			error("XStringSet_find_neighbors(): "
+			      "memory allocation failed");
+		}
+		R_CheckUserInterrupt();
+	}
+
+	PROTECT(ans = NEW_LIST(3));
+	PROTECT(ans_names = NEW_CHARACTER(3));
+	SET_STRING_ELT(ans_names, 0, mkChar("from"));
+	SET_STRING_ELT(ans_names, 1, mkChar("to"));
+	SET_STRING_ELT(ans_names, 2, mkChar("distance"));
+	SET_NAMES(ans, ans_names);
+	UNPROTECT(1);
+	ans_elt = NEW_INTEGER(pairs.nelt);
+	SET_VECTOR_ELT(ans, 0, ans_elt);
+	for (p = 0; p < pairs.nelt; p++)
+		INTEGER(ans_elt)[p] = pairs.from[p] + 1;
+	ans_elt = NEW_INTEGER(pairs.nelt);
+	SET_VECTOR_ELT(ans, 1, ans_elt);
+	for (p = 0; p < pairs.nelt; p++)
+		INTEGER(ans_elt)[p] = pairs.to[p] + 1;
+	ans_elt = NEW_INTEGER(pairs.nelt);
+	SET_VECTOR_ELT(ans, 2, ans_elt);
+	if (pairs.nelt != 0)
+		memcpy(INTEGER(ans_elt), pairs.dist, sizeof(int) * pairs.nelt);
+	UNPROTECT(1);
+	return ans;
+}
@@ -1,6 +1,7 @@
 #include "Biostrings.h"
 #include "XVector_interface.h"
 #include "IRanges_interface.h"
+#include <R_ext/Utils.h>        /* R_CheckUserInterrupt */
 
 static ByteTrTable byte2offset;
 
@@ -838,6 +839,208 @@ SEXP XStringSet_consensus_matrix(SEXP x, SEXP shift, SEXP width,
 }
 
 
+/*
+ * The consensus matrix of a MultipleAlignment object is computed by tiles of
+ * CONSENSUS_TILE_NCOL columns so that the counts of a tile stay in the cache
+ * while all the rows are added to it. The tiles are processed in parallel.
+ * 'rowmask' and 'colmask' are the (1-based) indices of the masked rows and
+ * columns. The masked rows are not counted and the masked columns are set
+ * to NA.
+ */
+#define CONSENSUS_TILE_NCOL 1024
+
+static void update_consensus_tile(int *mat, int mat_nrow, int mat_ncol,
+		const XStringSet_holder *x_holder, const int *rows, int nrows,
+		SEXP codes, int tile)
+{
+	int j1, j2, i;
+	Chars_holder x_elt;
+
+	j1 = tile * CONSENSUS_TILE_NCOL;
+	j2 = j1 + CONSENSUS_TILE_NCOL;
+	if (j2 > mat_ncol)
+		j2 = mat_ncol;
+	for (i = 0; i < nrows; i++) {
+		x_elt = _get_elt_from_XStringSet_holder(x_holder, rows[i]);
+		if (x_elt.length <= j1)
+			continue;
+		x_elt.ptr += j1;
+		x_elt.length -= j1;
+		update_letter_freqs2(mat + (size_t) j1 * mat_nrow, &x_elt,
+				     codes, 0, mat_nrow, j2 - j1);
+	}
+	return;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP MultipleAlignment_consensus_matrix(SEXP x, SEXP rowmask, SEXP colmask,
+		SEXP width, SEXP with_other, SEXP codes, SEXP nthreads)
+{
+	SEXP ans;
+	int ans_nrow, ans_ncol, x_length, nrows, ntile, tile, nthreads0,
+	    i, j, *rows, *ans_col;
+	char *is_masked;
+	XStringSet_holder x_holder;
+
+	ans_nrow = get_ans_width(codes, LOGICAL(with_other)[0]);
+	ans_ncol = INTEGER(width)[0];
+	x_length = _get_XStringSet_length(x);
+	x_holder = _hold_XStringSet(x);
+
+	is_masked = (char *) R_alloc((long) x_length + 1, sizeof(char));
+	memset(is_masked, 0, x_length);
+	for (i = 0; i < LENGTH(rowmask); i++)
+		is_masked[INTEGER(rowmask)[i] - 1] = 1;
+	rows = (int *) R_alloc((long) x_length + 1, sizeof(int));
+	for (i = nrows = 0; i < x_length; i++)
+		if (!is_masked[i])
+			rows[nrows++] = i;
+
+	PROTECT(ans = allocMatrix(INTSXP, ans_nrow, ans_ncol));
+	memset(INTEGER(ans), 0, sizeof(int) * ans_nrow * ans_ncol);
+	ntile = (ans_ncol + CONSENSUS_TILE_NCOL - 1) / CONSENSUS_TILE_NCOL;
+	nthreads0 = _get_nthreads(nthreads);
+	if (nthreads0 == 1) {
+		for (tile = 0; tile < ntile; tile++) {
+			R_CheckUserInterrupt();
+			update_consensus_tile(INTEGER(ans), ans_nrow, ans_ncol,
+					      &x_holder, rows, nrows, codes,
+					      tile);
+		}
+	} else {
+		#pragma omp parallel for num_threads(nthreads0) schedule(dynamic)
+		for (tile = 0; tile < ntile; tile++)
+			update_consensus_tile(INTEGER(ans), ans_nrow, ans_ncol,
+					      &x_holder, rows, nrows, codes,
+					      tile);
+	}
+	for (j = 0; j < LENGTH(colmask); j++) {
+		ans_col = INTEGER(ans) + (size_t) (INTEGER(colmask)[j] - 1) *
+					 ans_nrow;
+		for (i = 0; i < ans_nrow; i++)
+			ans_col[i] = NA_INTEGER;
+	}
+	set_names(ans, codes, LOGICAL(with_other)[0], 0, 0);
+	UNPROTECT(1);
+	return ans;
+}
+
+/*
+ * Consensus letter of every column of 'cmat', a consensus matrix (of counts)
+ * returned by MultipleAlignment_consensus_matrix().
+ * 'code_rows' are the (1-based) rows of 'cmat' to use for the consensus and
+ * 'gap_row' the row of the gaps (NA if none). A column is:
+ *   '#' if it's masked or has no letter in 'code_rows' nor gap,
+ *   '-' if it has more gaps than letters in 'code_rows' (a column with
+ *       no letter needs at least 2 gaps, like in the original R code that
+ *       set the letter count of such a column to 1),
+ *   otherwise it's made of symbols i.e. of the columns of 'weights'
+ *   ('weights[s, k]' is the contribution of the letter in 'code_rows[k]' to
+ *   symbol 's'; NULL means that the symbols are the letters themselves).
+ * The symbols with a frequency >= 'threshold' are selected, then:
+ *   - if 'weights' is NULL, 'letters' contains the letter of every symbol
+ *     and is used if a single symbol is selected, 'ambiguity_map' (a single
+ *     letter) being used otherwise;
+ *   - otherwise 'letters' contains the letter of every symbol (i.e. the
+ *     alphabet) and the selected letters, pasted in that order, are looked
+ *     up in the values of 'ambiguity_map', a named character vector whose
+ *     names are the consensus letters.
+ */
+/* --- .Call ENTRY POINT --- */
+SEXP MultipleAlignment_consensus_string(SEXP cmat, SEXP code_rows,
+		SEXP gap_row, SEXP weights, SEXP threshold, SEXP letters,
+		SEXP ambiguity_map)
+{
+	SEXP letter, map_names;
+	int cmat_nrow, cmat_ncol, ncode, nsym, gap_row0, any_code, j, k, s,
+	    m, selected, nselected, colsum, ngap;
+	const int *col, *rows;
+	const double *w;
+	double threshold0, *sym_freq;
+	char *ans_buf, *set_buf;
+
+	cmat_nrow = INTEGER(GET_DIM(cmat))[0];
+	cmat_ncol = INTEGER(GET_DIM(cmat))[1];
+	ncode = LENGTH(code_rows);
+	rows = INTEGER(code_rows);
+	gap_row0 = INTEGER(gap_row)[0];
+	nsym = weights == R_NilValue ? ncode : INTEGER(GET_DIM(weights))[0];
+	w = weights == R_NilValue ? NULL : REAL(weights);
+	threshold0 = REAL(threshold)[0];
+	sym_freq = (double *) R_alloc((long) nsym + 1, sizeof(double));
+	set_buf = (char *) R_alloc((long) nsym + 1, sizeof(char));
+	map_names = GET_NAMES(ambiguity_map);
+	ans_buf = (char *) R_alloc((long) cmat_ncol + 1, sizeof(char));
+
+	/* The gaps are reported only if some column has letters. */
+	any_code = 0;
+	for (j = 0; j < cmat_ncol && !any_code; j++) {
+		col = INTEGER(cmat) + (size_t) j * cmat_nrow;
+		for (k = 0; k < ncode; k++) {
+			if (col[rows[k] - 1] != NA_INTEGER
+			 && col[rows[k] - 1] > 0) {
+				any_code = 1;
+				break;
+			}
+		}
+	}
+	for (j = 0; j < cmat_ncol; j++) {
+		col = INTEGER(cmat) + (size_t) j * cmat_nrow;
+		ans_buf[j] = '#';
+		if (!any_code || col[0] == NA_INTEGER)
+			continue;
+		colsum = 0;
+		for (k = 0; k < ncode; k++)
+			colsum += col[rows[k] - 1];
+		ngap = gap_row0 == NA_INTEGER ? 0 : col[gap_row0 - 1];
+		if (ngap > (colsum == 0 ? 1 : colsum)) {
+			ans_buf[j] = '-';
+			continue;
+		}
+		if (colsum == 0)
+			continue;
+		if (w == NULL) {
+			for (k = 0; k < ncode; k++)
+				sym_freq[k] = (double) col[rows[k] - 1] / colsum;
+		} else {
+			for (s = 0; s < nsym; s++) {
+				sym_freq[s] = 0.0;
+				for (k = 0; k < ncode; k++)
+					sym_freq[s] += w[s + k * nsym] *
+						((double) col[rows[k] - 1] / colsum);
+			}
+		}
+		selected = nselected = 0;
+		for (s = 0; s < nsym; s++) {
+			if (sym_freq[s] >= threshold0) {
+				selected = s;
+				set_buf[nselected++] =
+					CHAR(STRING_ELT(letters, s))[0];
+			}
+		}
+		if (w == NULL) {
+			letter = nselected == 1 ? STRING_ELT(letters, selected) :
+					STRING_ELT(ambiguity_map, 0);
+		} else {
+			set_buf[nselected] = '\0';
+			for (m = 0; m < LENGTH(ambiguity_map); m++) {
+				if (STRING_ELT(ambiguity_map, m) != NA_STRING
+				 && strcmp(CHAR(STRING_ELT(ambiguity_map, m)),
+					   set_buf) == 0)
+					break;
+			}
+			if (m == LENGTH(ambiguity_map))
+				error("'ambiguityMap' is missing some combinations "
+				      "of row names");
+			letter = STRING_ELT(map_names, m);
+		}
+		ans_buf[j] = CHAR(letter)[0];
+	}
+	ans_buf[cmat_ncol] = '\0';
+	return mkString(ans_buf);
+}
+
+
 /****************************************************************************
  *                        --- Two-way Alphabet Frequency ---                *
  ****************************************************************************/
@@ -5,6 +5,7 @@
 #include "Biostrings.h"
 #include "XVector_interface.h"
 #include "IRanges_interface.h"
+#include <R_ext/Utils.h> /* for R_CheckUserInterrupt() */
 
 
 /****************************************************************************
@@ -557,13 +558,93 @@ SEXP XStringSet_vmatch_pattern_at(SEXP pattern, SEXP subject, SEXP at, SEXP at_t
 
 /*
  * XStringSet_dist_hamming() used by stringDist, method = "hamming".
+ * The pairs are visited tile by tile (see _get_upper_triangle_tile() in
+ * utils.c) and each distance is written directly at its place in 'ans'.
+ * When all the strings are made of the 4 bases only (e.g. barcodes or UMIs),
+ * they are first packed in 2-bit words (see _twobit_pack() in utils.c) and
+ * each distance is computed with a few XOR and popcount operations instead
+ * of a letter by letter comparison.
  */
-SEXP XStringSet_dist_hamming(SEXP x)
+#define DIST_TILE_SIZE 64
+
+static void dist_hamming_tile(const XStringSet_holder *X, int X_length,
+		int tile, int max_nmis, int *ans0)
+{
+	Chars_holder x_i, x_j;
+	int i1, i2, j1, j2, i, j, *ans_elt;
+
+	_get_upper_triangle_tile(X_length, DIST_TILE_SIZE, tile,
+				 &i1, &i2, &j1, &j2);
+	for (i = i1; i < i2; i++) {
+		x_i = _get_elt_from_XStringSet_holder(X, i);
+		j = j1 > i ? j1 : i + 1;
+		ans_elt = ans0 + _get_dist_offset(X_length, i, j);
+		for ( ; j < j2; j++, ans_elt++) {
+			x_j = _get_elt_from_XStringSet_holder(X, j);
+			*ans_elt = nedit_at(&x_i, &x_j, 1, 0, max_nmis, 0, 1, 1);
+		}
+	}
+	return;
+}
+
+static void dist_twobit_hamming_tile(const BitWord *words, int nword,
+		int X_length, int tile, int max_nmis, int *ans0)
+{
+	const BitWord *x_i;
+	int i1, i2, j1, j2, i, j, *ans_elt;
+
+	_get_upper_triangle_tile(X_length, DIST_TILE_SIZE, tile,
+				 &i1, &i2, &j1, &j2);
+	for (i = i1; i < i2; i++) {
+		x_i = words + (long) i * nword;
+		j = j1 > i ? j1 : i + 1;
+		ans_elt = ans0 + _get_dist_offset(X_length, i, j);
+		for ( ; j < j2; j++, ans_elt++)
+			*ans_elt = _twobit_hamming(x_i, words + (long) j * nword,
+						   nword, max_nmis);
+	}
+	return;
+}
+
+/* Returns NULL if a string contains a letter that is not a base. */
+static BitWord *twobit_pack_XStringSet(const XStringSet_holder *X,
+		int X_length, SEXP base_codes, int nword)
+{
+	ByteTrTable eightbit2twobit;
+	BitWord *words;
+	Chars_holder x_i;
+	int i;
+
+	_init_byte2offset_with_INTEGER(&eightbit2twobit, base_codes, 1);
+	/* Check all the letters first so nothing is allocated or packed in
+	   vain when we fall back on the byte comparison. */
+	for (i = 0; i < X_length; i++) {
+		x_i = _get_elt_from_XStringSet_holder(X, i);
+		if (!_is_twobit_packable(&eightbit2twobit, &x_i))
+			return NULL;
+	}
+	words = (BitWord *) R_alloc((long) X_length * nword, sizeof(BitWord));
+	for (i = 0; i < X_length; i++) {
+		x_i = _get_elt_from_XStringSet_holder(X, i);
+		_twobit_pack(&eightbit2twobit, &x_i, words + (long) i * nword);
+	}
+	return words;
+}
+
+/*
+ * 'base_codes' must be NULL or the 4 codes of the bases (for DNA or RNA).
+ * 'max_distance' must be a single integer (NA for no cutoff). The distances
+ * greater than 'max_distance' are reported as 'max_distance' + 1.
+ */
+/* --- .Call ENTRY POINT --- */
+SEXP XStringSet_dist_hamming(SEXP x, SEXP base_codes, SEXP max_distance,
+		SEXP nthreads)
 {
 	Chars_holder x_i, x_j;
 	XStringSet_holder X;
-	int X_length, *ans_elt, i, j, max_nmis;
-	unsigned long ans_length;
+	int X_length, *ans0, j, max_nmis, ntile, tile, nthreads0, nword;
+	R_xlen_t ans_length;
+	BitWord *words;
 	SEXP ans;
 
 	X = _hold_XStringSet(x);
@@ -577,23 +658,42 @@ SEXP XStringSet_dist_hamming(SEXP x)
 		if (x_i.length != x_j.length)
 		      error("Hamming distance requires equal length strings");
 	}
-
-	ans_length = ((unsigned long) X_length) *
-		     ((unsigned long) X_length - 1) / 2;
-	if (ans_length > INT_MAX)
-		error("result would be too big an object");
-	PROTECT(ans = NEW_INTEGER((int) ans_length));
-	ans_elt = INTEGER(ans);
-
-	max_nmis = _get_elt_from_XStringSet_holder(&X, 0).length;
-	for (i = 0; i < (X_length - 1); i++) {
-		x_i = _get_elt_from_XStringSet_holder(&X, i);
-		for (j = (i+1); j < X_length; j++, ans_elt++) {
-			x_j = _get_elt_from_XStringSet_holder(&X, j);
-			*ans_elt = nedit_at(&x_i, &x_j, 1, 0, max_nmis, 0, 1, 1);
+	max_nmis = INTEGER(max_distance)[0];
+	if (max_nmis == NA_INTEGER || max_nmis > x_i.length)
+		max_nmis = x_i.length;
+
+	nword = _get_twobit_nword(x_i.length);
+	words = base_codes == R_NilValue ? NULL :
+		twobit_pack_XStringSet(&X, X_length, base_codes, nword);
+
+	/* Can be a long vector */
+	ans_length = (R_xlen_t) X_length * (X_length - 1) / 2;
+	PROTECT(ans = NEW_INTEGER(ans_length));
+	ans0 = INTEGER(ans);
+
+	ntile = _get_upper_triangle_ntile(X_length, DIST_TILE_SIZE);
+	nthreads0 = _get_nthreads(nthreads);
+	if (nthreads0 == 1) {
+		for (tile = 0; tile < ntile; tile++) {
+			R_CheckUserInterrupt();
+			if (words != NULL)
+				dist_twobit_hamming_tile(words, nword, X_length,
+							 tile, max_nmis, ans0);
+			else
+				dist_hamming_tile(&X, X_length, tile,
+						  max_nmis, ans0);
+		}
+	} else {
+		#pragma omp parallel for num_threads(nthreads0) schedule(dynamic)
+		for (tile = 0; tile < ntile; tile++) {
+			if (words != NULL)
+				dist_twobit_hamming_tile(words, nword, X_length,
+							 tile, max_nmis, ans0);
+			else
+				dist_hamming_tile(&X, X_length, tile,
+						  max_nmis, ans0);
 		}
 	}
 	UNPROTECT(1);
 	return ans;
 }
-
@@ -0,0 +1,777 @@
+/****************************************************************************
+ *                        Read/write UCSC .2bit files                       *
+ ****************************************************************************/
+#include "Biostrings.h"
+#include "XVector_interface.h"
+
+#include <stdio.h>   /* for fopen(), fread(), remove() */
+#include <ctype.h>   /* for tolower(), islower() */
+#include <math.h>    /* for llround() */
+
+
+/*
+ * A .2bit file starts with a header made of 4 32-bit integers (signature,
+ * version, nb of sequences, reserved), followed by the index of the
+ * sequences: for each sequence, the length of its name (1 byte), its name,
+ * and the offset of its record in the file (32 bits in a version 0 file,
+ * 64 bits in a version 1 file). The record of a sequence is made of:
+ *   - dnaSize: the length of the sequence;
+ *   - nBlockCount, nBlockStarts, nBlockSizes: the runs of N's;
+ *   - maskBlockCount, maskBlockStarts, maskBlockSizes: the soft-masked
+ *     (i.e. lower case) regions;
+ *   - reserved;
+ *   - the bases packed 4 per byte, 2 bits per base (T=0, C=1, A=2, G=3),
+ *     the 1st base in the most significant bits. The N's are packed as T's.
+ * All the integers are 32-bit and stored in the byte order of the machine
+ * that wrote the file, which is given by the signature.
+ */
+
+#define TWOBIT_SIGNATURE 0x1A412743UL
+#define TWOBIT_MAX_NAME_LENGTH 255
+#define TWOBIT_BUF_SIZE (1 << 20)
+
+static const char *TwoBit_letters = "TCAG";
+
+typedef struct twobit_file {
+	const char *path;
+	FILE *file;
+	int big_endian;
+	int version;
+	int nseq;
+} TwoBitFile;
+
+static void close_2bit_file(TwoBitFile *tbf)
+{
+	if (tbf->file != NULL) {
+		fclose(tbf->file);
+		tbf->file = NULL;
+	}
+	return;
+}
+
+/* The file is closed by close_2bit_file_on_exit() when the error unwinds
+   the loading. */
+static void TwoBit_error(TwoBitFile *tbf, const char *msg)
+{
+	error("reading .2bit file '%s': %s", tbf->path, msg);
+}
+
+/*
+ * The files are read thru R_UnwindProtect() with this function as cleanup
+ * so the file is closed even if an error is raised (e.g. by R_alloc() or
+ * by a malformed file) or the user interrupts the loading.
+ */
+static void close_2bit_file_on_exit(void *data, Rboolean jump)
+{
+	close_2bit_file((TwoBitFile *) data);
+	return;
+}
+
+static unsigned long get_u32(const unsigned char *p, int big_endian)
+{
+	if (big_endian)
+		return (unsigned long) p[3] | (unsigned long) p[2] << 8 |
+		       (unsigned long) p[1] << 16 | (unsigned long) p[0] << 24;
+	return (unsigned long) p[0] | (unsigned long) p[1] << 8 |
+	       (unsigned long) p[2] << 16 | (unsigned long) p[3] << 24;
+}
+
+static unsigned long read_u32(TwoBitFile *tbf)
+{
+	unsigned char buf[4];
+
+	if (fread(buf, 1, 4, tbf->file) != 4)
+		TwoBit_error(tbf, "unexpected end of file");
+	return get_u32(buf, tbf->big_endian);
+}
+
+static long long int read_offset(TwoBitFile *tbf)
+{
+	unsigned long lo, hi;
+
+	lo = read_u32(tbf);
+	if (tbf->version == 0)
+		return (long long int) lo;
+	hi = read_u32(tbf);
+	if (tbf->big_endian) {
+		unsigned long tmp = lo;
+		lo = hi;
+		hi = tmp;
+	}
+	return (long long int) hi << 32 | (long long int) lo;
+}
+
+static void open_2bit_file(TwoBitFile *tbf, const char *path)
+{
+	unsigned char header[16];
+	unsigned long nseq;
+
+	tbf->path = path;
+	tbf->file = fopen(path, "rb");
+	if (tbf->file == NULL)
+		error("cannot open file '%s'", path);
+	if (fread(header, 1, sizeof(header), tbf->file) != sizeof(header))
+		TwoBit_error(tbf, "not a .2bit file");
+	if (get_u32(header, 0) == TWOBIT_SIGNATURE)
+		tbf->big_endian = 0;
+	else if (get_u32(header, 1) == TWOBIT_SIGNATURE)
+		tbf->big_endian = 1;
+	else
+		TwoBit_error(tbf, "not a .2bit file");
+	tbf->version = (int) get_u32(header + 4, tbf->big_endian);
+	if (tbf->version != 0 && tbf->version != 1)
+		TwoBit_error(tbf, "unsupported .2bit version");
+	nseq = get_u32(header + 8, tbf->big_endian);
+	if (nseq > (unsigned long) INT_MAX)
+		TwoBit_error(tbf, "too many sequences");
+	tbf->nseq = (int) nseq;
+	return;
+}
+
+/*
+ * The N blocks or mask blocks of a record. The 'starts' and 'sizes' arrays
+ * are read into 'buf' (starts first), which is reused from one record to
+ * the next and reallocated with R_alloc() when it's too small.
+ */
+typedef struct twobit_blocks {
+	int nblock;
+	unsigned long *buf;
+	int buflength;
+} TwoBitBlocks;
+
+static void read_2bit_blocks(TwoBitFile *tbf, TwoBitBlocks *blocks,
+		long long int dna_size)
+{
+	unsigned long nblock;
+	int i;
+
+	nblock = read_u32(tbf);
+	if (nblock > (unsigned long) dna_size)
+		TwoBit_error(tbf, "invalid block count");
+	if ((int) nblock > blocks->buflength) {
+		blocks->buflength = 2 * (int) nblock;
+		blocks->buf = (unsigned long *)
+			R_alloc(2 * (size_t) blocks->buflength,
+				sizeof(unsigned long));
+	}
+	blocks->nblock = (int) nblock;
+	for (i = 0; i < 2 * blocks->nblock; i++)
+		blocks->buf[i] = read_u32(tbf);
+	for (i = 0; i < blocks->nblock; i++) {
+		if ((long long int) blocks->buf[i] +
+		    (long long int) blocks->buf[blocks->nblock + i] > dna_size)
+			TwoBit_error(tbf, "block out of sequence bounds");
+	}
+	return;
+}
+
+static void skip_2bit_blocks(TwoBitFile *tbf, long long int dna_size)
+{
+	unsigned long nblock;
+
+	nblock = read_u32(tbf);
+	if (nblock > (unsigned long) dna_size)
+		TwoBit_error(tbf, "invalid block count");
+	if (_seek_file(tbf->file, _tell_file(tbf->file) +
+				  8LL * (long long int) nblock) != 0)
+		TwoBit_error(tbf, "seek error");
+	return;
+}
+
+/* Intersection of the i-th block with the region [pos0, pos0 + width). */
+static int get_block_overlap(const TwoBitBlocks *blocks, int i,
+		long long int pos0, int width, int *from, int *to)
+{
+	long long int start, end;
+
+	start = (long long int) blocks->buf[i] - pos0;
+	end = start + (long long int) blocks->buf[blocks->nblock + i];
+	if (start < 0)
+		start = 0;
+	if (end > width)
+		end = width;
+	if (start >= end)
+		return 0;
+	*from = (int) start;
+	*to = (int) end;
+	return 1;
+}
+
+
+/****************************************************************************
+ * Reading the index of a .2bit file.
+ */
+
+typedef struct twobit_index_loading {
+	TwoBitFile tbf;
+	SEXP filepath;
+} TwoBitIndexLoading;
+
+/* Called thru R_UnwindProtect() by read_2bit_index(). */
+static SEXP load_2bit_index(void *data)
+{
+	TwoBitIndexLoading *loading;
+	TwoBitFile *tbf;
+	SEXP ans, ans_name, ans_length, ans_offset;
+	unsigned char name_length;
+	char name[TWOBIT_MAX_NAME_LENGTH + 1];
+	unsigned long dna_size;
+	long long int offset;
+	int i;
+
+	loading = (TwoBitIndexLoading *) data;
+	tbf = &(loading->tbf);
+	open_2bit_file(tbf, translateChar(STRING_ELT(loading->filepath, 0)));
+	PROTECT(ans_name = NEW_CHARACTER(tbf->nseq));
+	PROTECT(ans_length = NEW_INTEGER(tbf->nseq));
+	PROTECT(ans_offset = NEW_NUMERIC(tbf->nseq));
+	for (i = 0; i < tbf->nseq; i++) {
+		if (fread(&name_length, 1, 1, tbf->file) != 1
+		 || fread(name, 1, name_length, tbf->file) != name_length)
+			TwoBit_error(tbf, "unexpected end of file");
+		name[name_length] = '\0';
+		SET_STRING_ELT(ans_name, i, mkChar(name));
+		REAL(ans_offset)[i] = (double) read_offset(tbf);
+	}
+	for (i = 0; i < tbf->nseq; i++) {
+		offset = llround(REAL(ans_offset)[i]);
+		if (_seek_file(tbf->file, offset) != 0)
+			TwoBit_error(tbf, "seek error");
+		dna_size = read_u32(tbf);
+		if (dna_size > (unsigned long) INT_MAX)
+			TwoBit_error(tbf, "sequence too long");
+		INTEGER(ans_length)[i] = (int) dna_size;
+	}
+	PROTECT(ans = NEW_LIST(3));
+	SET_VECTOR_ELT(ans, 0, ans_name);
+	SET_VECTOR_ELT(ans, 1, ans_length);
+	SET_VECTOR_ELT(ans, 2, ans_offset);
+	UNPROTECT(4);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Returns list(name, length, offset) with 1 element per sequence.
+ */
+SEXP read_2bit_index(SEXP filepath)
+{
+	TwoBitIndexLoading loading;
+	SEXP cont, ans;
+
+	loading.tbf.file = NULL;
+	loading.filepath = filepath;
+	PROTECT(cont = R_MakeUnwindCont());
+	ans = R_UnwindProtect(load_2bit_index, &loading,
+			      close_2bit_file_on_exit, &(loading.tbf), cont);
+	UNPROTECT(1);
+	return ans;
+}
+
+
+/****************************************************************************
+ * Extracting regions from .2bit files.
+ *
+ * The packed bases are expanded thru a table that maps each byte to its 4
+ * letters, already encoded with 'lkup'. Then the N blocks overlapping with
+ * the region are filled with N's and, when decoding to plain letters (i.e.
+ * 'lkup' is NULL), the mask blocks are turned to lower case.
+ */
+
+typedef struct twobit_decoder {
+	char byte2letters[256][4];
+	char N;
+	int apply_masks;
+} TwoBitDecoder;
+
+static int encode_letter(char c, const ByteTrTable *byte2code)
+{
+	int code;
+
+	if (byte2code == NULL)
+		return (unsigned char) c;
+	code = byte2code->byte2code[(unsigned char) c];
+	if (code == NA_INTEGER)
+		error("Biostrings internal error in encode_letter(): "
+		      "'%c' not in lookup table", c);
+	return code;
+}
+
+static void init_TwoBitDecoder(TwoBitDecoder *decoder, SEXP lkup)
+{
+	ByteTrTable byte2code;
+	const ByteTrTable *tr;
+	char codes[4];
+	int k, j;
+
+	if (lkup != R_NilValue) {
+		_init_ByteTrTable_with_lkup(&byte2code, lkup);
+		tr = &byte2code;
+	} else {
+		tr = NULL;
+	}
+	for (j = 0; j < 4; j++)
+		codes[j] = (char) encode_letter(TwoBit_letters[j], tr);
+	for (k = 0; k < 256; k++)
+		for (j = 0; j < 4; j++)
+			decoder->byte2letters[k][j] = codes[k >> (6 - 2 * j) & 3];
+	decoder->N = (char) encode_letter('N', tr);
+	decoder->apply_masks = tr == NULL;
+	return;
+}
+
+/* Decodes the 'width' bases starting at 0-based position 'pos0' in the
+   sequence whose packed bases start at 'dna_offset' in the file. */
+static void read_2bit_bases(TwoBitFile *tbf, long long int dna_offset,
+		long long int pos0, int width, char *dest,
+		const TwoBitDecoder *decoder, unsigned char *buf)
+{
+	long long int nbyte;
+	size_t n, k;
+	int skip, ncopied, m;
+	const char *letters;
+
+	if (_seek_file(tbf->file, dna_offset + pos0 / 4) != 0)
+		TwoBit_error(tbf, "seek error");
+	nbyte = (pos0 + width - 1) / 4 - pos0 / 4 + 1;
+	skip = (int) (pos0 % 4);
+	ncopied = 0;
+	while (nbyte > 0) {
+		n = nbyte < TWOBIT_BUF_SIZE ? (size_t) nbyte : TWOBIT_BUF_SIZE;
+		if (fread(buf, 1, n, tbf->file) != n)
+			TwoBit_error(tbf, "unexpected end of file");
+		nbyte -= n;
+		for (k = 0; k < n; k++) {
+			letters = decoder->byte2letters[buf[k]];
+			if (skip == 0 && width - ncopied >= 4) {
+				memcpy(dest + ncopied, letters, 4);
+				ncopied += 4;
+				continue;
+			}
+			m = 4 - skip;
+			if (m > width - ncopied)
+				m = width - ncopied;
+			memcpy(dest + ncopied, letters + skip, m);
+			ncopied += m;
+			skip = 0;
+		}
+	}
+	return;
+}
+
+typedef struct twobit_regions_loading {
+	TwoBitFile tbf;
+	SEXP filepath, fileno, offset, start, width, elementType, lkup;
+} TwoBitRegionsLoading;
+
+/* Called thru R_UnwindProtect() by read_2bit_regions(). */
+static SEXP load_2bit_regions(void *data)
+{
+	TwoBitRegionsLoading *loading;
+	TwoBitFile *tbf;
+	TwoBitDecoder decoder;
+	TwoBitBlocks nblocks, mblocks;
+	SEXP ans;
+	XStringSet_holder ans_holder;
+	Chars_holder ans_elt;
+	unsigned char *buf;
+	char *dest;
+	int nregion, i, j, k, fileno_i, width_i, from, to;
+	long long int pos0, dna_size, dna_offset;
+
+	loading = (TwoBitRegionsLoading *) data;
+	tbf = &(loading->tbf);
+	init_TwoBitDecoder(&decoder, loading->lkup);
+	nregion = LENGTH(loading->width);
+	PROTECT(ans = _alloc_XStringSet(
+			CHAR(STRING_ELT(loading->elementType, 0)),
+			loading->width));
+	ans_holder = _hold_XStringSet(ans);
+	buf = (unsigned char *) R_alloc(TWOBIT_BUF_SIZE, sizeof(char));
+	fileno_i = 0;
+	memset(&nblocks, 0, sizeof(TwoBitBlocks));
+	memset(&mblocks, 0, sizeof(TwoBitBlocks));
+	for (i = 0; i < nregion; i++) {
+		width_i = INTEGER(loading->width)[i];
+		if (width_i == 0)
+			continue;
+		if (INTEGER(loading->fileno)[i] != fileno_i) {
+			close_2bit_file(tbf);
+			fileno_i = INTEGER(loading->fileno)[i];
+			open_2bit_file(tbf, translateChar(
+				STRING_ELT(loading->filepath, fileno_i - 1)));
+		}
+		pos0 = (long long int) INTEGER(loading->start)[i] - 1;
+		if (_seek_file(tbf->file,
+			       llround(REAL(loading->offset)[i])) != 0)
+			TwoBit_error(tbf, "seek error");
+		dna_size = (long long int) read_u32(tbf);
+		if (pos0 + width_i > dna_size)
+			TwoBit_error(tbf, "the index doesn't match the file");
+		read_2bit_blocks(tbf, &nblocks, dna_size);
+		if (decoder.apply_masks)
+			read_2bit_blocks(tbf, &mblocks, dna_size);
+		else
+			skip_2bit_blocks(tbf, dna_size);
+		read_u32(tbf);  /* reserved */
+		dna_offset = _tell_file(tbf->file);
+		ans_elt = _get_elt_from_XStringSet_holder(&ans_holder, i);
+		dest = (char *) ans_elt.ptr;
+		read_2bit_bases(tbf, dna_offset, pos0, width_i, dest,
+				&decoder, buf);
+		for (k = 0; k < nblocks.nblock; k++) {
+			if (get_block_overlap(&nblocks, k, pos0, width_i,
+					      &from, &to))
+				memset(dest + from, decoder.N, to - from);
+		}
+		if (!decoder.apply_masks)
+			continue;
+		for (k = 0; k < mblocks.nblock; k++) {
+			if (!get_block_overlap(&mblocks, k, pos0, width_i,
+					       &from, &to))
+				continue;
+			for (j = from; j < to; j++)
+				dest[j] = (char) tolower((unsigned char) dest[j]);
+		}
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Args:
+ *   filepath:    A character vector of paths to .2bit files.
+ *   fileno:      Integer vector of 1-based indices in 'filepath', with 1
+ *                element per region. The regions must be grouped by file.
+ *   offset:      The offsets of the records of the regions (as returned
+ *                by read_2bit_index()).
+ *   start:       Integer vector of 1-based start positions of the regions
+ *                in their sequence.
+ *   width:       Integer vector of widths of the regions (checked by the
+ *                caller to be within the bounds of their sequence).
+ *   elementType: The elementType of the XStringSet to return.
+ *   lkup:        Lookup table for encoding the letters, or NULL to return
+ *                the letters with the soft-masked regions in lower case.
+ */
+SEXP read_2bit_regions(SEXP filepath, SEXP fileno, SEXP offset,
+		SEXP start, SEXP width, SEXP elementType, SEXP lkup)
+{
+	TwoBitRegionsLoading loading;
+	SEXP cont, ans;
+
+	loading.tbf.file = NULL;
+	loading.filepath = filepath;
+	loading.fileno = fileno;
+	loading.offset = offset;
+	loading.start = start;
+	loading.width = width;
+	loading.elementType = elementType;
+	loading.lkup = lkup;
+	PROTECT(cont = R_MakeUnwindCont());
+	ans = R_UnwindProtect(load_2bit_regions, &loading,
+			      close_2bit_file_on_exit, &(loading.tbf), cont);
+	UNPROTECT(1);
+	return ans;
+}
+
+
+/****************************************************************************
+ * Writing .2bit files.
+ *
+ * The file is written in 2 passes over the sequences: the 1st pass checks
+ * the letters and counts the N blocks and mask blocks of each sequence so
+ * the offsets of the records in the index can be computed, the 2nd pass
+ * writes the records thru a BGZFwriter (with no compression).
+ * The letters are decoded with 'lkup' (like for writing a FASTA file) then
+ * mapped to their 2-bit code with 'letter2bits'. Lower case letters are
+ * soft-masked.
+ */
+
+typedef struct twobit_encoder {
+	const int *lkup;
+	int lkup_len;
+	signed char letter2bits[256];  /* -1 for N, -2 for invalid letters */
+} TwoBitEncoder;
+
+static void init_TwoBitEncoder(TwoBitEncoder *encoder, SEXP lkup)
+{
+	int c, j;
+
+	if (lkup == R_NilValue) {
+		encoder->lkup = NULL;
+		encoder->lkup_len = 0;
+	} else {
+		encoder->lkup = INTEGER(lkup);
+		encoder->lkup_len = LENGTH(lkup);
+	}
+	for (c = 0; c < 256; c++)
+		encoder->letter2bits[c] = -2;
+	for (j = 0; j < 4; j++) {
+		c = (unsigned char) TwoBit_letters[j];
+		encoder->letter2bits[c] = (signed char) j;
+		encoder->letter2bits[tolower(c)] = (signed char) j;
+	}
+	encoder->letter2bits['N'] = encoder->letter2bits['n'] = -1;
+	return;
+}
+
+/* Returns the decoded letter or -1 if 'code' is not in 'lkup'. */
+static int decode_letter(const TwoBitEncoder *encoder, char code)
+{
+	int c, letter;
+
+	c = (unsigned char) code;
+	if (encoder->lkup == NULL)
+		return c;
+	if (c >= encoder->lkup_len)
+		return -1;
+	letter = encoder->lkup[c];
+	return letter == NA_INTEGER ? -1 : letter;
+}
+
+/*
+ * Walks the sequence and calls 'block_hook' for each run of N's and for
+ * each run of lower case letters. Returns -1 if the sequence contains a
+ * letter that cannot be stored in a .2bit file.
+ */
+typedef void (*TwoBitBlockHook)(void *data, int is_mask, int start, int size);
+
+static int walk_2bit_blocks(const TwoBitEncoder *encoder,
+		const Chars_holder *seq, TwoBitBlockHook block_hook, void *data)
+{
+	int j, letter, is_N, is_lower, N_start, lower_start;
+
+	N_start = lower_start = -1;
+	for (j = 0; j <= seq->length; j++) {
+		if (j < seq->length) {
+			letter = decode_letter(encoder, seq->ptr[j]);
+			if (letter < 0 || letter > 255
+			 || encoder->letter2bits[letter] == -2)
+				return -1;
+			is_N = encoder->letter2bits[letter] == -1;
+			is_lower = islower(letter) != 0;
+		} else {
+			is_N = is_lower = 0;
+		}
+		if (is_N && N_start < 0) {
+			N_start = j;
+		} else if (!is_N && N_start >= 0) {
+			block_hook(data, 0, N_start, j - N_start);
+			N_start = -1;
+		}
+		if (is_lower && lower_start < 0) {
+			lower_start = j;
+		} else if (!is_lower && lower_start >= 0) {
+			block_hook(data, 1, lower_start, j - lower_start);
+			lower_start = -1;
+		}
+	}
+	return 0;
+}
+
+typedef struct twobit_block_counts {
+	int nN;
+	int nmask;
+} TwoBitBlockCounts;
+
+static void count_block_hook(void *data, int is_mask, int start, int size)
+{
+	TwoBitBlockCounts *counts = (TwoBitBlockCounts *) data;
+
+	if (is_mask)
+		counts->nmask++;
+	else
+		counts->nN++;
+	return;
+}
+
+/* Filled by the 2nd pass. The buffers are big enough to hold the blocks of
+   the sequence with the most blocks. */
+typedef struct twobit_block_buf {
+	int nN, nmask;
+	unsigned char *N_starts, *N_sizes, *mask_starts, *mask_sizes;
+} TwoBitBlockBuf;
+
+static void put_u32(unsigned char *p, unsigned long x)
+{
+	p[0] = (unsigned char) (x & 0xff);
+	p[1] = (unsigned char) (x >> 8 & 0xff);
+	p[2] = (unsigned char) (x >> 16 & 0xff);
+	p[3] = (unsigned char) (x >> 24 & 0xff);
+	return;
+}
+
+static void store_block_hook(void *data, int is_mask, int start, int size)
+{
+	TwoBitBlockBuf *buf = (TwoBitBlockBuf *) data;
+
+	if (is_mask) {
+		put_u32(buf->mask_starts + 4 * buf->nmask, start);
+		put_u32(buf->mask_sizes + 4 * buf->nmask, size);
+		buf->nmask++;
+	} else {
+		put_u32(buf->N_starts + 4 * buf->nN, start);
+		put_u32(buf->N_sizes + 4 * buf->nN, size);
+		buf->nN++;
+	}
+	return;
+}
+
+static long long int get_2bit_record_size(const TwoBitBlockCounts *counts,
+		int seqlength)
+{
+	return 16LL + 8LL * counts->nN + 8LL * counts->nmask +
+	       ((long long int) seqlength + 3) / 4;
+}
+
+static void write_u32(BGZFwriter *writer, unsigned long x)
+{
+	unsigned char buf[4];
+
+	put_u32(buf, x);
+	_BGZFwriter_write(writer, (const char *) buf, 4);
+	return;
+}
+
+static void write_2bit_bases(BGZFwriter *writer,
+		const TwoBitEncoder *encoder, const Chars_holder *seq)
+{
+	unsigned char buf[4096];
+	int j, n, bits, letter;
+	unsigned char byte;
+
+	n = 0;
+	byte = 0;
+	for (j = 0; j < seq->length; j++) {
+		letter = decode_letter(encoder, seq->ptr[j]);
+		bits = encoder->letter2bits[letter];
+		if (bits < 0)
+			bits = 0;  /* N's are packed as T's */
+		byte = (unsigned char) (byte << 2 | bits);
+		if (j % 4 != 3)
+			continue;
+		buf[n++] = byte;
+		byte = 0;
+		if (n == sizeof(buf)) {
+			_BGZFwriter_write(writer, (const char *) buf, n);
+			n = 0;
+		}
+	}
+	if (j % 4 != 0)
+		buf[n++] = (unsigned char) (byte << 2 * (4 - j % 4));
+	_BGZFwriter_write(writer, (const char *) buf, n);
+	return;
+}
+
+/* --- .Call ENTRY POINT ---
+ * 'filepath' must be the expanded path to the file and 'lkup' the lookup
+ * table for decoding the sequences.
+ */
+SEXP write_XStringSet_to_2bit(SEXP x, SEXP filepath, SEXP lkup)
+{
+	XStringSet_holder X;
+	TwoBitEncoder encoder;
+	TwoBitBlockCounts *counts;
+	TwoBitBlockBuf block_buf;
+	int x_length, i, max_nN, max_nmask, version;
+	SEXP x_names, name;
+	Chars_holder X_elt;
+	long long int index_size, offset;
+	const char *path, *errmsg;
+	BGZFwriter *writer;
+
+	X = _hold_XStringSet(x);
+	x_length = _get_length_from_XStringSet_holder(&X);
+	init_TwoBitEncoder(&encoder, lkup);
+	x_names = get_XVectorList_names(x);
+	if (x_names == R_NilValue)
+		error("'x' must have names");
+
+	/* 1st pass: check the names and letters and count the blocks. */
+	counts = (TwoBitBlockCounts *)
+		R_alloc(x_length, sizeof(TwoBitBlockCounts));
+	index_size = 16;
+	max_nN = max_nmask = 0;
+	for (i = 0; i < x_length; i++) {
+		name = STRING_ELT(x_names, i);
+		if (name == NA_STRING)
+			error("'names(x)' contains NAs");
+		if (LENGTH(name) == 0 || LENGTH(name) > TWOBIT_MAX_NAME_LENGTH)
+			error("the names of the sequences must have between "
+			      "1 and %d characters", TWOBIT_MAX_NAME_LENGTH);
+		index_size += 1 + LENGTH(name) + 4;
+		X_elt = _get_elt_from_XStringSet_holder(&X, i);
+		counts[i].nN = counts[i].nmask = 0;
+		if (walk_2bit_blocks(&encoder, &X_elt,
+				     count_block_hook, counts + i) != 0)
+			error("sequence %d contains letters other than "
+			      "A, C, G, T and N", i + 1);
+		if (counts[i].nN > max_nN)
+			max_nN = counts[i].nN;
+		if (counts[i].nmask > max_nmask)
+			max_nmask = counts[i].nmask;
+	}
+
+	/* Switch to 64-bit offsets if the file is 4 GB or more. */
+	offset = index_size;
+	for (i = 0; i < x_length; i++) {
+		X_elt = _get_elt_from_XStringSet_holder(&X, i);
+		offset += get_2bit_record_size(counts + i, X_elt.length);
+	}
+	version = offset > 0xffffffffLL ? 1 : 0;
+	if (version == 1)
+		index_size += 4LL * x_length;
+
+	block_buf.N_starts = (unsigned char *) R_alloc(max_nN, 4);
+	block_buf.N_sizes = (unsigned char *) R_alloc(max_nN, 4);
+	block_buf.mask_starts = (unsigned char *) R_alloc(max_nmask, 4);
+	block_buf.mask_sizes = (unsigned char *) R_alloc(max_nmask, 4);
+
+	path = CHAR(STRING_ELT(filepath, 0));
+	writer = _open_BGZFwriter(path, 0, -1, 1);
+	if (writer == NULL)
+		error("cannot open file '%s'", path);
+
+	/* Header and index. */
+	write_u32(writer, TWOBIT_SIGNATURE);
+	write_u32(writer, version);
+	write_u32(writer, x_length);
+	write_u32(writer, 0);
+	offset = index_size;
+	for (i = 0; i < x_length; i++) {
+		name = STRING_ELT(x_names, i);
+		_BGZFwriter_putc(writer, (char) LENGTH(name));
+		_BGZFwriter_write(writer, CHAR(name), LENGTH(name));
+		write_u32(writer, (unsigned long) (offset & 0xffffffffLL));
+		if (version == 1)
+			write_u32(writer, (unsigned long) (offset >> 32));
+		X_elt = _get_elt_from_XStringSet_holder(&X, i);
+		offset += get_2bit_record_size(counts + i, X_elt.length);
+	}
+
+	/* 2nd pass: the records. */
+	for (i = 0; i < x_length; i++) {
+		X_elt = _get_elt_from_XStringSet_holder(&X, i);
+		block_buf.nN = block_buf.nmask = 0;
+		walk_2bit_blocks(&encoder, &X_elt, store_block_hook,
+				 &block_buf);
+		write_u32(writer, X_elt.length);
+		write_u32(writer, block_buf.nN);
+		_BGZFwriter_write(writer, (const char *) block_buf.N_starts,
+				  4 * (size_t) block_buf.nN);
+		_BGZFwriter_write(writer, (const char *) block_buf.N_sizes,
+				  4 * (size_t) block_buf.nN);
+		write_u32(writer, block_buf.nmask);
+		_BGZFwriter_write(writer, (const char *) block_buf.mask_starts,
+				  4 * (size_t) block_buf.nmask);
+		_BGZFwriter_write(writer, (const char *) block_buf.mask_sizes,
+				  4 * (size_t) block_buf.nmask);
+		write_u32(writer, 0);
+		write_2bit_bases(writer, &encoder, &X_elt);
+	}
+	errmsg = _close_BGZFwriter(writer);
+	if (errmsg != NULL) {
+		remove(path);
+		error("writing file '%s': %s", path, errmsg);
+	}
+	return R_NilValue;
+}
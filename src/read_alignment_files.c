@@ -0,0 +1,674 @@
+/****************************************************************************
+ *          Read/write multiple alignment files (Stockholm, Clustal,        *
+ *                            Phylip interleaved)                           *
+ ****************************************************************************/
+#include "Biostrings.h"
+#include "XVector_interface.h"
+#include "S4Vectors_interface.h"
+
+#include <ctype.h>  /* for isspace() */
+
+
+#define IOBUF_SIZE 20002
+static char errmsg_buf[200];
+
+#define STOCKHOLM_FORMAT 1
+#define CLUSTAL_FORMAT   2
+#define PHYLIP_FORMAT    3
+
+static const char *Phylip_mask_markup = "Mask";
+
+static int has_prefix(const Chars_holder *s, const char *prefix)
+{
+	int i = 0;
+	char c;
+
+	while ((c = prefix[i]) != '\0') {
+		if (i >= s->length || s->ptr[i] != c)
+			return 0;
+		i++;
+	}
+	return 1;
+}
+
+
+/****************************************************************************
+ * Reading lines of arbitrary length.
+ *
+ * The rows of non-interleaved alignments can be much longer than IOBUF_SIZE
+ * so the line buffer grows as needed. It's allocated with R_alloc() so we
+ * don't need to free it (even on error).
+ */
+
+typedef struct line_buf {
+	char *ptr;
+	int length;
+	int buflength;
+} LineBuf;
+
+static LineBuf new_LineBuf()
+{
+	LineBuf line;
+
+	line.buflength = IOBUF_SIZE;
+	line.ptr = (char *) R_alloc((long) line.buflength, sizeof(char));
+	line.length = 0;
+	return line;
+}
+
+/* Returns 0 on EOF, 1 if a line was read, and -1 on read error. The trailing
+   LF or CRLF is removed. */
+static int read_line(SEXP filexp, LineBuf *line)
+{
+	int ret_code, EOL_in_buf, nbyte_in;
+	char *new_ptr;
+
+	line->length = 0;
+	while (1) {
+		if (line->buflength - line->length < IOBUF_SIZE) {
+			line->buflength = 2 * line->buflength + IOBUF_SIZE;
+			new_ptr = (char *) R_alloc((long) line->buflength,
+						   sizeof(char));
+			memcpy(new_ptr, line->ptr, line->length);
+			line->ptr = new_ptr;
+		}
+		ret_code = filexp_gets(filexp, line->ptr + line->length,
+				       IOBUF_SIZE, &EOL_in_buf);
+		if (ret_code == 0)
+			return line->length != 0;
+		if (ret_code == -1)
+			return -1;
+		if (EOL_in_buf) {
+			nbyte_in = strlen(line->ptr + line->length);
+			line->length += delete_trailing_LF_or_CRLF(
+					line->ptr + line->length, nbyte_in);
+			return 1;
+		}
+		line->length += IOBUF_SIZE - 1;
+	}
+}
+
+static Chars_holder strip_white(const char *ptr, int length)
+{
+	Chars_holder x;
+
+	while (length > 0 && isspace((unsigned char) *ptr)) {
+		ptr++;
+		length--;
+	}
+	while (length > 0 && isspace((unsigned char) ptr[length - 1]))
+		length--;
+	x.ptr = ptr;
+	x.length = length;
+	return x;
+}
+
+/* Splits 'x' into its first whitespace-free token (returned) and the rest
+   (stored in 'rest', leading whitespace removed). */
+static Chars_holder split_first_token(const Chars_holder *x,
+		Chars_holder *rest)
+{
+	Chars_holder token;
+	int i;
+
+	for (i = 0; i < x->length && !isspace((unsigned char) x->ptr[i]); i++)
+		;
+	token.ptr = x->ptr;
+	token.length = i;
+	*rest = strip_white(x->ptr + i, x->length - i);
+	return token;
+}
+
+
+/****************************************************************************
+ * Alignment parser.
+ *
+ * All 3 formats store the alignment in blocks of rows separated by "markup"
+ * lines (blank lines, comments, consensus lines). Every block must contain
+ * the same rows in the same order. The 1st block gives the row names and
+ * the rows of a block are appended to the corresponding sequences.
+ * Like read_fasta_files(), we use 2 passes: the 1st pass collects the names
+ * and the lengths of the sequences, the 2nd pass loads the sequences into
+ * the preallocated XStringSet object.
+ */
+
+typedef struct aln_loader {
+	int format;
+	const int *lkup;
+	int lkup_len;
+	long long int ninvalid;
+	/* Block structure */
+	int block_nrow;		/* nb of rows per block, -1 until the 1st
+				   block of the 1st pass is complete */
+	int nblock;		/* nb of complete blocks */
+	int row;		/* current row in the current block */
+	int mask_row;		/* row of the Phylip mask, -1 if none */
+	IntAE *row2seq;		/* index of the sequence of every block row */
+	/* 1st pass */
+	CharAEAE *names_buf;
+	IntAE *seqlength_buf;
+	int mask_length;
+	/* 2nd pass (if 'seqs' is not R_NilValue) */
+	SEXP seqs;
+	XVectorList_holder seqs_holder;
+	int *filled;
+	int *mask;
+	int mask_filled;
+} AlnLoader;
+
+static AlnLoader new_AlnLoader(int format, SEXP lkup)
+{
+	AlnLoader loader;
+
+	loader.format = format;
+	if (lkup == R_NilValue) {
+		loader.lkup = NULL;
+		loader.lkup_len = 0;
+	} else {
+		loader.lkup = INTEGER(lkup);
+		loader.lkup_len = LENGTH(lkup);
+	}
+	loader.ninvalid = 0LL;
+	loader.block_nrow = -1;
+	loader.nblock = 0;
+	loader.row = 0;
+	loader.mask_row = -1;
+	loader.row2seq = new_IntAE(0, 0, 0);
+	loader.names_buf = new_CharAEAE(0, 0);
+	loader.seqlength_buf = new_IntAE(0, 0, 0);
+	loader.mask_length = 0;
+	loader.seqs = R_NilValue;
+	return loader;
+}
+
+/* Called after the 1st pass. 'mask' must have 'loader->mask_length'
+   elements (or be NULL if there is no mask). The block structure found
+   during the 1st pass is kept. */
+static void prepare_AlnLoader_for_2nd_pass(AlnLoader *loader,
+		SEXP seqs, int *mask)
+{
+	int nseq;
+
+	nseq = IntAE_get_nelt(loader->seqlength_buf);
+	loader->seqs = seqs;
+	loader->seqs_holder = hold_XVectorList(seqs);
+	loader->filled = (int *) R_alloc((long) nseq + 1, sizeof(int));
+	memset(loader->filled, 0, sizeof(int) * nseq);
+	loader->mask = mask;
+	loader->mask_filled = 0;
+	loader->ninvalid = 0LL;
+	loader->nblock = 0;
+	loader->row = 0;
+	return;
+}
+
+static const char *end_block(AlnLoader *loader)
+{
+	if (loader->row == 0)
+		return NULL;
+	if (loader->block_nrow == -1) {
+		loader->block_nrow = loader->row;
+	} else if (loader->row != loader->block_nrow) {
+		return "missing alignment rows";
+	}
+	loader->nblock++;
+	loader->row = 0;
+	return NULL;
+}
+
+/* Removes the whitespace from the sequence data in place and, unless
+   'is_mask' is set, translates it with 'loader->lkup'. */
+static void clean_seq_data(AlnLoader *loader, Chars_holder *data, int is_mask)
+{
+	char *dest;
+	int i, j, c;
+
+	/* data->ptr is a (const char *) but points to the line buffer */
+	dest = (char *) data->ptr;
+	for (i = j = 0; i < data->length; i++) {
+		c = (unsigned char) data->ptr[i];
+		if (isspace(c))
+			continue;
+		if (!is_mask) {
+			if (c == '.' && loader->format == STOCKHOLM_FORMAT)
+				c = '-';
+			if (loader->lkup != NULL) {
+				c = translate_byte((char) c, loader->lkup,
+						   loader->lkup_len);
+				if (c == NA_INTEGER) {
+					loader->ninvalid++;
+					continue;
+				}
+			}
+		}
+		dest[j++] = (char) c;
+	}
+	data->length = j;
+	return;
+}
+
+static void load_mask_data(AlnLoader *loader, const Chars_holder *data)
+{
+	int i;
+	char c;
+
+	if (loader->seqs == R_NilValue) {
+		loader->mask_length += data->length;
+		return;
+	}
+	for (i = 0; i < data->length; i++) {
+		c = data->ptr[i];
+		loader->mask[loader->mask_filled++] =
+			c == '0' ? 0 : (c == '1' ? 1 : NA_LOGICAL);
+	}
+	return;
+}
+
+static void load_seq_data(AlnLoader *loader, int seq,
+		const Chars_holder *data)
+{
+	Chars_holder seq_elt;
+
+	if (loader->seqs == R_NilValue) {
+		loader->seqlength_buf->elts[seq] += data->length;
+		return;
+	}
+	seq_elt = get_elt_from_XRawList_holder(&(loader->seqs_holder), seq);
+	/* seq_elt.ptr is a (const char *) so we need to cast it to (char *)
+	   in order to write to it */
+	memcpy((char *) seq_elt.ptr + loader->filled[seq],
+	       data->ptr, data->length * sizeof(char));
+	loader->filled[seq] += data->length;
+	return;
+}
+
+/* 'id' is NULL for the rows of the Phylip blocks after the 1st one. */
+static const char *add_block_row(AlnLoader *loader, Chars_holder *id,
+		Chars_holder *data)
+{
+	int row, seq, is_mask;
+	const CharAE *name;
+
+	row = loader->row++;
+	if (loader->block_nrow == -1) {
+		/* 1st block of the 1st pass */
+		is_mask = loader->format == PHYLIP_FORMAT &&
+			  has_prefix(id, Phylip_mask_markup);
+		if (is_mask) {
+			if (loader->mask_row != -1)
+				return "more than one Mask row";
+			loader->mask_row = row;
+			seq = -1;
+		} else {
+			seq = IntAE_get_nelt(loader->seqlength_buf);
+			/* 'id' is followed by whitespace or is at the end of
+			   the nul-terminated line buffer */
+			((char *) id->ptr)[id->length] = '\0';
+			CharAEAE_append_string(loader->names_buf, id->ptr);
+			IntAE_insert_at(loader->seqlength_buf, seq, 0);
+		}
+		IntAE_insert_at(loader->row2seq, row, seq);
+	} else {
+		if (row >= loader->block_nrow)
+			return "missing alignment rows";
+		seq = loader->row2seq->elts[row];
+		is_mask = seq == -1;
+		if (id != NULL && !is_mask && loader->seqs == R_NilValue) {
+			name = loader->names_buf->elts[seq];
+			if (id->length != CharAE_get_nelt(name)
+			 || memcmp(id->ptr, name->elts, id->length) != 0)
+				return "alignment rows out of order";
+		}
+	}
+	clean_seq_data(loader, data, is_mask);
+	if (is_mask)
+		load_mask_data(loader, data);
+	else
+		load_seq_data(loader, seq, data);
+	return NULL;
+}
+
+/* Blank lines, lines made of consensus symbols (Clustal), and lines starting
+   with # or // (Stockholm). 'line' has no leading/trailing whitespace. */
+static int is_markup_line(int format, const Chars_holder *line)
+{
+	int i;
+	char c;
+
+	if (line->length == 0)
+		return 1;
+	switch (format) {
+	case STOCKHOLM_FORMAT:
+		return line->ptr[0] == '#' ||
+		       (line->length == 2 && line->ptr[0] == '/'
+					  && line->ptr[1] == '/');
+	case CLUSTAL_FORMAT:
+		for (i = 0; i < line->length; i++) {
+			c = line->ptr[i];
+			if (!(isspace((unsigned char) c) ||
+			      c == '*' || c == ':' || c == '.'))
+				return 0;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+static int is_valid_header(int format, int lineno, const Chars_holder *line)
+{
+	int i;
+
+	switch (format) {
+	case STOCKHOLM_FORMAT:
+		return has_prefix(line, "# STOCKHOLM");
+	case CLUSTAL_FORMAT:
+		if (lineno == 1)
+			return has_prefix(line, "CLUSTAL");
+		return line->length == 0;
+	case PHYLIP_FORMAT:
+		/* "<nb of rows> <nb of columns> ..." */
+		for (i = 0;
+		     i < line->length && isdigit((unsigned char) line->ptr[i]);
+		     i++)
+			;
+		return i > 0 && i + 1 < line->length
+		       && isspace((unsigned char) line->ptr[i])
+		       && isdigit((unsigned char) line->ptr[i + 1]);
+	}
+	return 0;
+}
+
+static const char *parse_alignment_file(SEXP filexp, AlnLoader *loader)
+{
+	static const char *format_names[] = {"", "Stockholm", "Clustal aln",
+					     "Phylip"};
+	int lineno, nheader_lines, ret_code;
+	LineBuf line;
+	Chars_holder stripped, id, data;
+	const char *errmsg;
+
+	nheader_lines = loader->format == CLUSTAL_FORMAT ? 3 : 1;
+	line = new_LineBuf();
+	lineno = 0;
+	while ((ret_code = read_line(filexp, &line)) != 0) {
+		lineno++;
+		if (ret_code == -1) {
+			snprintf(errmsg_buf, sizeof(errmsg_buf),
+				 "read error while reading characters "
+				 "from line %d", lineno);
+			return errmsg_buf;
+		}
+		line.ptr[line.length] = '\0';
+		stripped = strip_white(line.ptr, line.length);
+		if (lineno <= nheader_lines) {
+			if (!is_valid_header(loader->format, lineno,
+					     &stripped))
+				break;
+			continue;
+		}
+		if (is_markup_line(loader->format, &stripped)) {
+			errmsg = end_block(loader);
+		} else if (loader->format == PHYLIP_FORMAT
+			&& loader->nblock != 0) {
+			errmsg = add_block_row(loader, NULL, &stripped);
+		} else {
+			id = split_first_token(&stripped, &data);
+			if (loader->format == CLUSTAL_FORMAT) {
+				/* Drop the optional nb of residues that
+				   follows the sequence data. */
+				split_first_token(&data, &stripped);
+				data.length = stripped.ptr - data.ptr;
+				data = strip_white(data.ptr, data.length);
+			}
+			errmsg = add_block_row(loader, &id, &data);
+		}
+		if (errmsg != NULL)
+			return errmsg;
+	}
+	if (lineno < nheader_lines || (loader->format != PHYLIP_FORMAT &&
+				       lineno < 3) || ret_code != 0)
+	{
+		snprintf(errmsg_buf, sizeof(errmsg_buf),
+			 "invalid %s file", format_names[loader->format]);
+		return errmsg_buf;
+	}
+	errmsg = end_block(loader);
+	if (errmsg != NULL)
+		return errmsg;
+	if (loader->block_nrow == -1)
+		return "missing alignment rows";
+	return NULL;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Returns a list of length 2: the sequences as an XStringSet object of
+ * type 'elementType', and the Phylip mask as a logical vector (or NULL).
+ */
+SEXP read_alignment_file(SEXP filexp_list, SEXP format,
+		SEXP elementType, SEXP lkup)
+{
+	SEXP filexp, seqlengths, seqnames, seqs, mask, ans;
+	const char *format0, *filename, *errmsg;
+	int format_code;
+	long long int offset0;
+	AlnLoader loader;
+
+	filexp = VECTOR_ELT(filexp_list, 0);
+	filename = CHAR(STRING_ELT(GET_NAMES(filexp_list), 0));
+	format0 = CHAR(STRING_ELT(format, 0));
+	if (strcmp(format0, "stockholm") == 0)
+		format_code = STOCKHOLM_FORMAT;
+	else if (strcmp(format0, "clustal") == 0)
+		format_code = CLUSTAL_FORMAT;
+	else if (strcmp(format0, "phylip") == 0)
+		format_code = PHYLIP_FORMAT;
+	else
+		error("Biostrings internal error in read_alignment_file(): "
+		      "unsupported format \"%s\"", format0);
+	loader = new_AlnLoader(format_code, lkup);
+
+	/* 1st pass */
+	offset0 = filexp_tell(filexp);
+	errmsg = parse_alignment_file(filexp, &loader);
+	if (errmsg != NULL)
+		error("reading alignment file %s: %s", filename, errmsg);
+	if (loader.ninvalid != 0LL)
+		warning("reading alignment file %s: ignored %lld "
+			"invalid one-letter sequence codes",
+			filename, loader.ninvalid);
+	filexp_seek(filexp, offset0, SEEK_SET);
+
+	/* Allocation */
+	PROTECT(seqlengths = new_INTEGER_from_IntAE(loader.seqlength_buf));
+	PROTECT(seqnames = new_CHARACTER_from_CharAEAE(loader.names_buf));
+	SET_NAMES(seqlengths, seqnames);
+	PROTECT(seqs = _alloc_XStringSet(CHAR(STRING_ELT(elementType, 0)),
+					 seqlengths));
+	if (loader.mask_row == -1) {
+		PROTECT(mask = R_NilValue);
+	} else {
+		PROTECT(mask = NEW_LOGICAL(loader.mask_length));
+	}
+
+	/* 2nd pass */
+	prepare_AlnLoader_for_2nd_pass(&loader, seqs,
+			mask == R_NilValue ? NULL : LOGICAL(mask));
+	parse_alignment_file(filexp, &loader);
+
+	PROTECT(ans = NEW_LIST(2));
+	SET_VECTOR_ELT(ans, 0, seqs);
+	SET_VECTOR_ELT(ans, 1, mask);
+	UNPROTECT(5);
+	return ans;
+}
+
+
+/****************************************************************************
+ * Writing Phylip interleaved files.
+ *
+ * The output is assembled in a large buffer that is written with a single
+ * filexp_puts() call every time it's full.
+ */
+
+#define NLETTER_PER_GROUP 10
+#define NGROUP_PER_LINE 5
+#define OUTBUF_SIZE 65536
+
+typedef struct out_buf {
+	SEXP filexp;
+	char *ptr;
+	int length;
+	int buflength;
+} OutBuf;
+
+static void flush_OutBuf(OutBuf *out)
+{
+	out->ptr[out->length] = '\0';
+	filexp_puts(out->filexp, out->ptr);
+	out->length = 0;
+	return;
+}
+
+/* Makes sure that 'n' more bytes (+ the terminating nul) fit in 'out'. */
+static void reserve_OutBuf(OutBuf *out, int n)
+{
+	if (out->length + n >= out->buflength)
+		flush_OutBuf(out);
+	return;
+}
+
+static void end_line(OutBuf *out)
+{
+	/* Drop the trailing whitespace. */
+	while (out->length > 0 && out->ptr[out->length - 1] == ' ')
+		out->length--;
+	out->ptr[out->length++] = '\n';
+	return;
+}
+
+static void append_padded_name(OutBuf *out, const char *name, int width)
+{
+	int n;
+
+	n = strlen(name);
+	memcpy(out->ptr + out->length, name, n);
+	memset(out->ptr + out->length + n, ' ', width - n + 3);
+	out->length += width + 3;
+	return;
+}
+
+/* Appends the letters 'j1' to 'j2 - 1' of a row in groups of
+   NLETTER_PER_GROUP letters. */
+static void append_row_letters(OutBuf *out, const Chars_holder *row,
+		const int *cols, const int *mask, int j1, int j2,
+		const int *lkup, int lkup_len)
+{
+	int j, k, c;
+
+	for (j = j1; j < j2; j++) {
+		if (j > j1 && (j - j1) % NLETTER_PER_GROUP == 0)
+			out->ptr[out->length++] = ' ';
+		if (mask != NULL) {
+			c = mask[j] ? '1' : '0';
+		} else {
+			k = cols == NULL ? j : cols[j] - 1;
+			c = row->ptr[k];
+			if (lkup != NULL)
+				c = translate_byte((char) c, lkup, lkup_len);
+		}
+		out->ptr[out->length++] = (char) c;
+	}
+	return;
+}
+
+/* --- .Call ENTRY POINT ---
+ * 'x': the unmasked XStringSet of a MultipleAlignment object.
+ * 'rows': the (1-based) rows to write.
+ * 'cols': the (1-based) columns to write or NULL for all the columns.
+ * 'names': the names of the rows to write.
+ * 'mask': NULL or a logical vector with one element per column to write,
+ *         written as a first row named "Mask".
+ * 'header': the first line.
+ */
+SEXP write_MultipleAlignment(SEXP x, SEXP rows, SEXP cols, SEXP names,
+		SEXP mask, SEXP header, SEXP show_row_names, SEXP filexp_list,
+		SEXP lkup)
+{
+	XStringSet_holder X;
+	OutBuf out;
+	Chars_holder row;
+	int nrow, ncol, name_width, line_length, show_row_names0,
+	    lkup_len, i, j1, j2, n;
+	const int *cols0, *mask0, *lkup0;
+	const char *name;
+
+	X = _hold_XStringSet(x);
+	nrow = LENGTH(rows);
+	if (cols != R_NilValue) {
+		cols0 = INTEGER(cols);
+		ncol = LENGTH(cols);
+	} else {
+		cols0 = NULL;
+		ncol = _get_length_from_XStringSet_holder(&X) == 0 ? 0 :
+		       _get_elt_from_XStringSet_holder(&X, 0).length;
+	}
+	mask0 = mask == R_NilValue ? NULL : LOGICAL(mask);
+	show_row_names0 = LOGICAL(show_row_names)[0];
+	if (lkup == R_NilValue) {
+		lkup0 = NULL;
+		lkup_len = 0;
+	} else {
+		lkup0 = INTEGER(lkup);
+		lkup_len = LENGTH(lkup);
+	}
+	name_width = mask0 != NULL ? strlen(Phylip_mask_markup) : 0;
+	for (i = 0; i < nrow; i++) {
+		if (STRING_ELT(names, i) == NA_STRING)
+			error("the row names contain NAs");
+		n = strlen(CHAR(STRING_ELT(names, i)));
+		if (n > name_width)
+			name_width = n;
+	}
+	line_length = name_width + 3 + NGROUP_PER_LINE *
+				       (NLETTER_PER_GROUP + 1) + 1;
+	out.filexp = VECTOR_ELT(filexp_list, 0);
+	out.buflength = OUTBUF_SIZE > 2 * line_length ? OUTBUF_SIZE :
+							2 * line_length;
+	out.ptr = (char *) R_alloc((long) out.buflength, sizeof(char));
+	out.length = 0;
+
+	filexp_puts(out.filexp, CHAR(STRING_ELT(header, 0)));
+	filexp_puts(out.filexp, "\n");
+	for (j1 = 0; j1 < ncol; j1 = j2) {
+		j2 = j1 + NGROUP_PER_LINE * NLETTER_PER_GROUP;
+		if (j2 > ncol)
+			j2 = ncol;
+		if (j1 != 0) {
+			reserve_OutBuf(&out, 1);
+			out.ptr[out.length++] = '\n';
+		}
+		if (mask0 != NULL) {
+			reserve_OutBuf(&out, line_length);
+			append_padded_name(&out,
+				j1 == 0 || show_row_names0 ?
+					Phylip_mask_markup : "",
+				name_width);
+			append_row_letters(&out, NULL, NULL, mask0, j1, j2,
+					   NULL, 0);
+			end_line(&out);
+		}
+		for (i = 0; i < nrow; i++) {
+			row = _get_elt_from_XStringSet_holder(&X,
+						INTEGER(rows)[i] - 1);
+			name = j1 == 0 || show_row_names0 ?
+				CHAR(STRING_ELT(names, i)) : "";
+			reserve_OutBuf(&out, line_length);
+			append_padded_name(&out, name, name_width);
+			append_row_letters(&out, &row, cols0, NULL, j1, j2,
+					   lkup0, lkup_len);
+			end_line(&out);
+		}
+	}
+	flush_OutBuf(&out);
+	return R_NilValue;
+}
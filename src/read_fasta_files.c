@@ -9,9 +9,17 @@
 
 #include <math.h>  /* for llround */
 
+#ifndef _WIN32
+#include <fcntl.h>     /* for open() */
+#include <unistd.h>    /* for pread(), close() */
+#include <sys/stat.h>  /* for fstat() */
+#include <sys/mman.h>  /* for mmap(), munmap(), madvise() */
+#endif
+
 
 #define IOBUF_SIZE 20002
 static char errmsg_buf[200];
+#pragma omp threadprivate(errmsg_buf)
 
 static int has_prefix(const char *s, const char *prefix)
 {
@@ -47,6 +55,28 @@ static int translate(Chars_holder *x, const int *lkup, int lkup_len)
 	return nbinvalid;
 }
 
+/* Like translate() but 'src' is left untouched and the translated bytes are
+   written to 'dest'. Returns the nb of bytes written to 'dest'. */
+static int translate_to(char *dest, const Chars_holder *src,
+		const ByteTrTable *byte2code, int *nbinvalid)
+{
+	int i, j, c;
+
+	if (byte2code == NULL) {
+		memcpy(dest, src->ptr, src->length * sizeof(char));
+		return src->length;
+	}
+	for (i = j = 0; i < src->length; i++) {
+		c = byte2code->byte2code[(unsigned char) src->ptr[i]];
+		if (c == NA_INTEGER) {
+			(*nbinvalid)++;
+			continue;
+		}
+		dest[j++] = (char) c;
+	}
+	return j;
+}
+
 static void append_Chars_holder(Chars_holder *dest, const Chars_holder *src)
 {
 	/* dest->ptr is a (const char *) so we need to cast it to (char *)
@@ -73,8 +103,15 @@ typedef struct fasta_loader {
 	void (*new_empty_seq_hook)(struct fasta_loader *loader);
 	void (*append_seq_hook)(struct fasta_loader *loader,
 				const Chars_holder *seq_data);
+	/* Used by parse_mmapped_FASTA_file() instead of 'append_seq_hook'.
+	   'seq_data' is read-only and not translated yet. Returns the nb of
+	   invalid letters in 'seq_data'. */
+	int (*append_raw_seq_hook)(struct fasta_loader *loader,
+				   const Chars_holder *seq_data,
+				   const ByteTrTable *byte2code);
 	const int *lkup;
 	int lkup_len;
+	ByteTrTable byte2code;  /* same as 'lkup' (if not NULL) */
 	void *ext;  /* loader extension (optional) */
 } FASTAloader;
 
@@ -148,6 +185,27 @@ static void FASTA_INDEX_append_seq_hook(FASTAloader *loader,
 	return;
 }
 
+static int FASTA_INDEX_append_raw_seq_hook(FASTAloader *loader,
+		const Chars_holder *seq_data, const ByteTrTable *byte2code)
+{
+	INDEX_FASTAloaderExt *loader_ext;
+	IntAE *seqlength_buf;
+	int nbinvalid, i;
+
+	nbinvalid = 0;
+	if (byte2code != NULL) {
+		for (i = 0; i < seq_data->length; i++)
+			if (byte2code->byte2code[(unsigned char) seq_data->ptr[i]]
+			    == NA_INTEGER)
+				nbinvalid++;
+	}
+	loader_ext = loader->ext;
+	seqlength_buf = loader_ext->seqlength_buf;
+	seqlength_buf->elts[IntAE_get_nelt(seqlength_buf) - 1] +=
+		seq_data->length - nbinvalid;
+	return nbinvalid;
+}
+
 static FASTAloader new_FASTAloader_with_INDEX_ext(int load_descs, SEXP lkup,
 		INDEX_FASTAloaderExt *loader_ext)
 {
@@ -156,12 +214,14 @@ static FASTAloader new_FASTAloader_with_INDEX_ext(int load_descs, SEXP lkup,
 	loader.new_desc_hook = load_descs ? &FASTA_INDEX_new_desc_hook : NULL;
 	loader.new_empty_seq_hook = &FASTA_INDEX_new_empty_seq_hook;
 	loader.append_seq_hook = &FASTA_INDEX_append_seq_hook;
+	loader.append_raw_seq_hook = &FASTA_INDEX_append_raw_seq_hook;
 	if (lkup == R_NilValue) {
 		loader.lkup = NULL;
 		loader.lkup_len = 0;
 	} else {
 		loader.lkup = INTEGER(lkup);
 		loader.lkup_len = LENGTH(lkup);
+		_init_ByteTrTable_with_lkup(&(loader.byte2code), lkup);
 	}
 	loader.ext = loader_ext;
 	return loader;
@@ -213,6 +273,24 @@ static void FASTA_append_seq_hook(FASTAloader *loader,
 	return;
 }
 
+static int FASTA_append_raw_seq_hook(FASTAloader *loader,
+		const Chars_holder *seq_data, const ByteTrTable *byte2code)
+{
+	FASTAloaderExt *loader_ext;
+	Chars_holder *seq_elt_holder;
+	int nbinvalid;
+
+	loader_ext = loader->ext;
+	seq_elt_holder = &(loader_ext->seq_elt_holder);
+	/* seq_elt_holder->ptr is a (const char *) so we need to cast it to
+	   (char *) in order to write to it */
+	nbinvalid = 0;
+	seq_elt_holder->length += translate_to(
+			(char *) seq_elt_holder->ptr + seq_elt_holder->length,
+			seq_data, byte2code, &nbinvalid);
+	return nbinvalid;
+}
+
 static FASTAloader new_FASTAloader(SEXP lkup, FASTAloaderExt *loader_ext)
 {
 	FASTAloader loader;
@@ -220,20 +298,143 @@ static FASTAloader new_FASTAloader(SEXP lkup, FASTAloaderExt *loader_ext)
 	loader.new_desc_hook = NULL;
 	loader.new_empty_seq_hook = &FASTA_new_empty_seq_hook;
 	loader.append_seq_hook = &FASTA_append_seq_hook;
+	loader.append_raw_seq_hook = &FASTA_append_raw_seq_hook;
 	if (lkup == R_NilValue) {
 		loader.lkup = NULL;
 		loader.lkup_len = 0;
 	} else {
 		loader.lkup = INTEGER(lkup);
 		loader.lkup_len = LENGTH(lkup);
+		_init_ByteTrTable_with_lkup(&(loader.byte2code), lkup);
+	}
+	loader.ext = loader_ext;
+	return loader;
+}
+
+/*
+ * The FASTA ARENA loader.
+ * Used by read_fasta_files() to load the sequences in a single pass, without
+ * knowing their lengths in advance. The descriptions are loaded in their own
+ * arena. The ARENA loader doesn't use the R API so several ARENA loaders can
+ * be used concurrently by worker threads.
+ */
+
+typedef struct arena_fasta_loader_ext {
+	XStringSetArena desc_arena;
+	XStringSetArena seq_arena;
+} ARENA_FASTAloaderExt;
+
+static ARENA_FASTAloaderExt new_ARENA_FASTAloaderExt()
+{
+	ARENA_FASTAloaderExt loader_ext;
+
+	loader_ext.desc_arena = _new_XStringSetArena();
+	loader_ext.seq_arena = _new_XStringSetArena();
+	return loader_ext;
+}
+
+static void free_ARENA_FASTAloaderExts(ARENA_FASTAloaderExt *loader_exts,
+		int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		_free_XStringSetArena(&(loader_exts[i].desc_arena));
+		_free_XStringSetArena(&(loader_exts[i].seq_arena));
+	}
+	return;
+}
+
+static const char *get_ARENA_FASTAloaderExt_errmsg(
+		const ARENA_FASTAloaderExt *loader_ext)
+{
+	if (loader_ext->desc_arena.errmsg != NULL)
+		return loader_ext->desc_arena.errmsg;
+	return loader_ext->seq_arena.errmsg;
+}
+
+static void FASTA_ARENA_new_desc_hook(FASTAloader *loader,
+		int recno, long long int offset,
+		const Chars_holder *desc_line)
+{
+	ARENA_FASTAloaderExt *loader_ext;
+	Chars_holder desc;
+
+	loader_ext = loader->ext;
+	/* Like CharAEAE_append_string(), we stop at the first embedded nul
+	   (if any). This works only because desc_line->ptr is
+	   nul-terminated! */
+	desc.ptr = desc_line->ptr;
+	desc.length = strlen(desc_line->ptr);
+	_XStringSetArena_add_elt(&(loader_ext->desc_arena));
+	_XStringSetArena_append(&(loader_ext->desc_arena), &desc);
+	return;
+}
+
+static void FASTA_ARENA_new_empty_seq_hook(FASTAloader *loader)
+{
+	ARENA_FASTAloaderExt *loader_ext;
+
+	loader_ext = loader->ext;
+	_XStringSetArena_add_elt(&(loader_ext->seq_arena));
+	return;
+}
+
+static void FASTA_ARENA_append_seq_hook(FASTAloader *loader,
+		const Chars_holder *seq_data)
+{
+	ARENA_FASTAloaderExt *loader_ext;
+
+	loader_ext = loader->ext;
+	_XStringSetArena_append(&(loader_ext->seq_arena), seq_data);
+	return;
+}
+
+static int FASTA_ARENA_append_raw_seq_hook(FASTAloader *loader,
+		const Chars_holder *seq_data, const ByteTrTable *byte2code)
+{
+	ARENA_FASTAloaderExt *loader_ext;
+	XStringSetArena *seq_arena;
+	char *dest;
+	int nbinvalid;
+
+	loader_ext = loader->ext;
+	seq_arena = &(loader_ext->seq_arena);
+	dest = _XStringSetArena_reserve(seq_arena, seq_data->length);
+	if (dest == NULL)
+		return 0;
+	nbinvalid = 0;
+	_XStringSetArena_commit(seq_arena,
+		translate_to(dest, seq_data, byte2code, &nbinvalid));
+	return nbinvalid;
+}
+
+static FASTAloader new_FASTAloader_with_ARENA_ext(int load_descs, SEXP lkup,
+		ARENA_FASTAloaderExt *loader_ext)
+{
+	FASTAloader loader;
+
+	loader.new_desc_hook = load_descs ? &FASTA_ARENA_new_desc_hook : NULL;
+	loader.new_empty_seq_hook = &FASTA_ARENA_new_empty_seq_hook;
+	loader.append_seq_hook = &FASTA_ARENA_append_seq_hook;
+	loader.append_raw_seq_hook = &FASTA_ARENA_append_raw_seq_hook;
+	if (lkup == R_NilValue) {
+		loader.lkup = NULL;
+		loader.lkup_len = 0;
+	} else {
+		loader.lkup = INTEGER(lkup);
+		loader.lkup_len = LENGTH(lkup);
+		_init_ByteTrTable_with_lkup(&(loader.byte2code), lkup);
 	}
 	loader.ext = loader_ext;
 	return loader;
 }
 
 /* Ignore empty lines and lines starting with 'FASTA_comment_markup' like in
-   the original Pearson FASTA format. */
-static const char *parse_FASTA_file(SEXP filexp,
+   the original Pearson FASTA format. The lines are read with filexp_gets(),
+   or with _BGZFreader_gets() if 'bgzf' is not NULL (in which case the
+   offsets are virtual offsets). */
+static const char *parse_FASTA_file(SEXP filexp, BGZFreader *bgzf,
 		int nrec, int skip, int seek_first_rec,
 		FASTAloader *loader,
 		int *recno, long long int *offset, long long int *ninvalid)
@@ -252,13 +453,19 @@ static const char *parse_FASTA_file(SEXP filexp,
 		if (EOL_in_buf)
 			lineno++;
 		EOL_in_prev_buf = EOL_in_buf;
-		ret_code = filexp_gets(filexp, buf, IOBUF_SIZE, &EOL_in_buf);
+		if (bgzf != NULL)
+			ret_code = _BGZFreader_gets(bgzf, buf, IOBUF_SIZE,
+						    &EOL_in_buf);
+		else
+			ret_code = filexp_gets(filexp, buf, IOBUF_SIZE,
+					       &EOL_in_buf);
 		if (ret_code == 0)
 			break;
 		if (ret_code == -1) {
 			snprintf(errmsg_buf, sizeof(errmsg_buf),
-				 "read error while reading characters "
-				 "from line %d", lineno);
+				 "%s while reading characters from line %d",
+				 bgzf != NULL ? bgzf->errmsg : "read error",
+				 lineno);
 			return errmsg_buf;
 		}
 		if (EOL_in_buf) {
@@ -268,7 +475,10 @@ static const char *parse_FASTA_file(SEXP filexp,
 			data.length = nbyte_in = IOBUF_SIZE - 1;
 		}
 		prev_offset = *offset;
-		*offset += nbyte_in;
+		if (bgzf != NULL)
+			*offset = _BGZFreader_tell(bgzf);
+		else
+			*offset += nbyte_in;
 		if (seek_first_rec) {
 			if (EOL_in_prev_buf
 			 && has_prefix(buf, FASTA_desc_markup)) {
@@ -300,8 +510,12 @@ static const char *parse_FASTA_file(SEXP filexp,
 				   we advance in the file. This is not a
 				   problem when reading the entire file but
 				   becomes one when reading a compressed file
-				   by chunk. */
-				filexp_seek(filexp, prev_offset, SEEK_SET);
+				   by chunk. A BGZFreader doesn't need to be
+				   moved back: its position is saved by the
+				   caller. */
+				if (bgzf == NULL)
+					filexp_seek(filexp, prev_offset,
+						    SEEK_SET);
 				*offset = prev_offset;
 				return NULL;
 			}
@@ -344,104 +558,537 @@ static const char *parse_FASTA_file(SEXP filexp,
 
 
 /****************************************************************************
- * read_fasta_files()
+ * Fast path for uncompressed files
+ *
+ * When the file behind 'filexp' is a plain (i.e. uncompressed) file on disk,
+ * we map it in memory and walk it with memchr() instead of reading it line by
+ * line with filexp_gets(). memchr() is vectorized by all the major libc
+ * implementations so this is much faster on big files. The sequence lines
+ * are translated directly from the mapped file into their final destination
+ * by the 'append_raw_seq_hook' of the loader.
+ * The result (and the final position of 'filexp') is the same as with
+ * parse_FASTA_file().
  */
 
-static SEXP get_fasta_seqlengths(SEXP filexp_list,
+/* gzip, bzip2 and xz magic numbers. */
+static int has_compression_magic(const unsigned char *magic, size_t nmagic)
+{
+	return (nmagic >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+	    || (nmagic >= 3 && memcmp(magic, "BZh", 3) == 0)
+	    || (nmagic >= 6 && memcmp(magic, "\xfd" "7zXZ\0", 6) == 0);
+}
+
+#ifndef _WIN32
+
+/* Sequence lines longer than this are passed to the loader by chunks. */
+#define MAX_SEQ_CHUNK_LENGTH (1 << 30)
+
+static int has_bounded_prefix(const char *s, long long int s_len,
+		const char *prefix)
+{
+	long long int i = 0;
+	char c;
+
+	while ((c = prefix[i]) != '\0') {
+		if (i >= s_len || s[i] != c)
+			return 0;
+		i++;
+	}
+	return 1;
+}
+
+/* Returns NULL if the file cannot be mapped in memory or is compressed. */
+static const char *map_plain_file(SEXP filexp, size_t *map_length)
+{
+	SEXP expath;
+	int fd;
+	struct stat st;
+	unsigned char magic[6];
+	ssize_t nmagic;
+	void *map;
+
+	expath = getAttrib(filexp, install("expath"));
+	if (!IS_CHARACTER(expath) || LENGTH(expath) != 1
+	 || STRING_ELT(expath, 0) == NA_STRING)
+		return NULL;
+	fd = open(CHAR(STRING_ELT(expath, 0)), O_RDONLY);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+	/* gzip, bzip2 and xz files are left to filexp_gets(). */
+	nmagic = pread(fd, magic, sizeof(magic), 0);
+	if (nmagic > 0 && has_compression_magic(magic, (size_t) nmagic)) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+#ifdef MADV_SEQUENTIAL
+	madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+#endif
+	*map_length = (size_t) st.st_size;
+	return (const char *) map;
+}
+
+static const char *parse_mmapped_FASTA_file(const char *map, size_t map_length,
 		int nrec, int skip, int seek_first_rec,
-		int use_names, SEXP lkup)
+		FASTAloader *loader,
+		int *recno, long long int *offset, long long int *ninvalid)
 {
-	INDEX_FASTAloaderExt loader_ext;
-	FASTAloader loader;
-	int recno, i;
-	SEXP filexp, ans, ans_names;
-	const char *filename, *errmsg;
-	long long int offset0, offset, ninvalid;
+	const char *line, *eol, *map_end;
+	const ByteTrTable *byte2code;
+	int lineno, FASTA_desc_markup_length, dont_load, is_desc;
+	long long int nbyte_in, line_length, prev_offset;
+	char desc_buf[IOBUF_SIZE];
+	Chars_holder data;
 
-	loader_ext = new_INDEX_FASTAloaderExt();
-	loader = new_FASTAloader_with_INDEX_ext(use_names, lkup, &loader_ext);
-	recno = 0;
-	for (i = 0; i < LENGTH(filexp_list); i++) {
-		filexp = VECTOR_ELT(filexp_list, i);
-		filename = CHAR(STRING_ELT(GET_NAMES(filexp_list), i));
-		/* Calls to filexp_tell() are costly on compressed files
-		   and the cost increases as we advance in the file.
-		   This is not a problem when reading the entire file but
-		   becomes one when reading a compressed file by chunk. */
-		offset0 = offset = filexp_tell(filexp);
-		ninvalid = 0LL;
-		errmsg = parse_FASTA_file(filexp, nrec, skip, seek_first_rec,
-					  &loader,
-					  &recno, &offset, &ninvalid);
-		/* Calls to filexp_seek() are costly on compressed files
-		   and the cost increases as we advance in the file.
-		   This is not a problem when reading the entire file but
-		   becomes one when reading a compressed file by chunk. */
-		filexp_seek(filexp, offset0, SEEK_SET);
-		if (errmsg != NULL)
-			error("reading FASTA file %s: %s",
-			      filename, errmsg_buf);
-		if (ninvalid != 0LL)
-			warning("reading FASTA file %s: ignored %lld "
-				"invalid one-letter sequence codes",
-				filename, ninvalid);
+	FASTA_desc_markup_length = strlen(FASTA_desc_markup);
+	byte2code = loader != NULL && loader->lkup != NULL ?
+		    &(loader->byte2code) : NULL;
+	map_end = map + map_length;
+	lineno = 0;
+	dont_load = -1;
+	for (line = map + *offset; line < map_end; line += nbyte_in) {
+		lineno++;
+		eol = memchr(line, '\n', map_end - line);
+		if (eol == NULL) {
+			nbyte_in = line_length = map_end - line;
+		} else {
+			nbyte_in = eol - line + 1;
+			line_length = nbyte_in - 1;
+			if (line_length != 0 && line[line_length - 1] == '\r')
+				line_length--;
+		}
+		prev_offset = *offset;
+		*offset += nbyte_in;
+		is_desc = has_bounded_prefix(line, line_length,
+					     FASTA_desc_markup);
+		if (seek_first_rec) {
+			if (!is_desc)
+				continue;
+			seek_first_rec = 0;
+		}
+		if (line_length == 0)
+			continue;  // we ignore empty lines
+		if (is_desc || has_bounded_prefix(line, line_length,
+						  FASTA_comment_markup)) {
+			/* Same limit as in parse_FASTA_file(). */
+			if (nbyte_in > IOBUF_SIZE - 1
+			 || (nbyte_in == IOBUF_SIZE - 1 && eol == NULL)) {
+				snprintf(errmsg_buf, sizeof(errmsg_buf),
+					 "cannot read line %d, "
+					 "line is too long", lineno);
+				return errmsg_buf;
+			}
+			if (!is_desc)
+				continue;  // we ignore comment lines
+		}
+		if (is_desc) {
+			if (nrec >= 0 && *recno >= skip + nrec) {
+				*offset = prev_offset;
+				return NULL;
+			}
+			dont_load = *recno < skip || loader == NULL;
+			if (!dont_load && loader->new_desc_hook != NULL) {
+				/* The desc hooks expect a nul-terminated
+				   string. */
+				data.length = line_length -
+					      FASTA_desc_markup_length;
+				memcpy(desc_buf,
+				       line + FASTA_desc_markup_length,
+				       data.length);
+				desc_buf[data.length] = '\0';
+				data.ptr = desc_buf;
+				loader->new_desc_hook(loader,
+						      *recno, prev_offset,
+						      &data);
+			}
+			if (!dont_load && loader->new_empty_seq_hook != NULL)
+				loader->new_empty_seq_hook(loader);
+			(*recno)++;
+			continue;
+		}
+		if (dont_load == -1) {
+			snprintf(errmsg_buf, sizeof(errmsg_buf),
+				 "\"%s\" expected at beginning of line %d",
+				 FASTA_desc_markup, lineno);
+			return errmsg_buf;
+		}
+		if (dont_load || loader->new_empty_seq_hook == NULL
+		 || loader->append_raw_seq_hook == NULL)
+			continue;
+		for (data.ptr = line; line_length > 0;
+		     data.ptr += data.length, line_length -= data.length)
+		{
+			data.length = line_length < MAX_SEQ_CHUNK_LENGTH ?
+				      (int) line_length : MAX_SEQ_CHUNK_LENGTH;
+			*ninvalid += loader->append_raw_seq_hook(loader,
+							&data, byte2code);
+		}
 	}
-	PROTECT(ans = new_INTEGER_from_IntAE(loader_ext.seqlength_buf));
-	if (use_names) {
-		PROTECT(ans_names =
-			new_CHARACTER_from_CharAEAE(loader_ext.desc_buf));
-		SET_NAMES(ans, ans_names);
-		UNPROTECT(1);
+	if (seek_first_rec) {
+		snprintf(errmsg_buf, sizeof(errmsg_buf),
+			 "no FASTA record found");
+		return errmsg_buf;
 	}
-	UNPROTECT(1);
+	return NULL;
+}
+
+#endif /* _WIN32 */
+
+/* Returns NULL if the fast path cannot be used. Uses the R API. */
+static const char *map_FASTA_filexp(SEXP filexp, long long int offset,
+		size_t *map_length)
+{
+#ifndef _WIN32
+	const char *map;
+
+	map = map_plain_file(filexp, map_length);
+	if (map != NULL && offset > (long long int) *map_length) {
+		/* Should never happen. */
+		munmap((void *) map, *map_length);
+		map = NULL;
+	}
+	return map;
+#else
+	return NULL;
+#endif
+}
+
+
+/****************************************************************************
+ * FASTA inputs
+ *
+ * A FASTA input is parsed with parse_mmapped_FASTA_file() if the file is a
+ * plain file, with parse_FASTA_file() and a BGZFreader (see BGZF_utils.c) if
+ * it's a BGZF file, and with parse_FASTA_file() and filexp_gets() otherwise.
+ * Opening, seeking and closing an input use the R API so must be done by
+ * the main thread but parse_FASTA_input() can be called by a worker thread.
+ */
+
+typedef struct fasta_input {
+	SEXP filexp;
+	const char *map;
+	size_t map_length;
+	BGZFreader *bgzf;
+} FASTAinput;
+
+/* 'nthreads' is the nb of threads used to inflate a BGZF file. '*offset'
+   is set to the current position in the input. */
+static FASTAinput open_FASTA_input(SEXP filexp, int nthreads,
+		long long int *offset)
+{
+	FASTAinput input;
+
+	input.filexp = filexp;
+	input.map = NULL;
+	input.map_length = 0;
+	input.bgzf = _open_BGZFreader(filexp, nthreads);
+	if (input.bgzf != NULL) {
+		*offset = _BGZFreader_tell(input.bgzf);
+		return input;
+	}
+	/* Calls to filexp_tell() are costly on compressed files and the cost
+	   increases as we advance in the file. This is not a problem when
+	   reading the entire file but becomes one when reading a compressed
+	   file by chunk. */
+	*offset = filexp_tell(filexp);
+	input.map = map_FASTA_filexp(filexp, *offset, &input.map_length);
+	return input;
+}
+
+/* Random access. Only cheap on plain and BGZF files. */
+static void seek_FASTA_input(FASTAinput *input, long long int offset)
+{
+	if (input->bgzf != NULL)
+		_BGZFreader_seek(input->bgzf, offset);
+	else if (input->map == NULL)
+		filexp_seek(input->filexp, offset, SEEK_SET);
+	return;
+}
+
+/* Doesn't use the R API so can be called by a worker thread. */
+static const char *parse_FASTA_input(FASTAinput *input,
+		int nrec, int skip, int seek_first_rec,
+		FASTAloader *loader,
+		int *recno, long long int *offset, long long int *ninvalid)
+{
+#ifndef _WIN32
+	if (input->map != NULL)
+		return parse_mmapped_FASTA_file(input->map, input->map_length,
+						nrec, skip, seek_first_rec,
+						loader,
+						recno, offset, ninvalid);
+#endif
+	return parse_FASTA_file(input->filexp, input->bgzf,
+				nrec, skip, seek_first_rec,
+				loader, recno, offset, ninvalid);
+}
+
+/* Leaves 'input->filexp' at 'offset' (the position returned by the last
+   parse) i.e. where parse_FASTA_file() would have left it. */
+static void close_FASTA_input(FASTAinput *input, long long int offset)
+{
+	if (input->bgzf != NULL) {
+		_close_BGZFreader(input->filexp, input->bgzf, offset);
+		return;
+	}
+#ifndef _WIN32
+	if (input->map != NULL) {
+		munmap((void *) input->map, input->map_length);
+		/* This is cheap on a plain file. */
+		filexp_seek(input->filexp, offset, SEEK_SET);
+	}
+#endif
+	return;
+}
+
+
+/****************************************************************************
+ * Parsing several files in parallel.
+ */
+
+/*
+ * The XVector functions are called thru stubs that resolve their target with
+ * R_GetCCallable() the first time they are called (see XVector_stubs.c).
+ * This is not thread-safe so the stubs used by the parsers must be resolved
+ * by the main thread before the worker threads are started. This needs to
+ * be done only once per session. 'filexp' must be positioned at the
+ * beginning of a line.
+ */
+void _resolve_parser_stubs(SEXP filexp)
+{
+	static int resolved = 0;
+	char buf[IOBUF_SIZE];
+	int EOL_in_buf, lkup0;
+	long long int offset;
+
+	if (resolved)
+		return;
+	offset = filexp_tell(filexp);
+	filexp_gets(filexp, buf, IOBUF_SIZE, &EOL_in_buf);
+	filexp_seek(filexp, offset, SEEK_SET);
+	buf[0] = '\n';
+	delete_trailing_LF_or_CRLF(buf, 1);
+	lkup0 = 0;
+	translate_byte(0, &lkup0, 1);
+	resolved = 1;
+	return;
+}
+
+/*
+ * Parses the files of 'filexp_list' in parallel, 1 file per worker thread,
+ * with 'loaders[i]' loading the records of the i-th file. The loaders must
+ * not use the R API. 'nrec' and 'skip' are not supported (they would make
+ * the parsing of a file depend on the number of records in the previous
+ * files). On return, 'offsets[i]' and 'ninvalids[i]' are set like
+ * parse_FASTA_input() would set them, and 'errmsgs[i]' points to the error
+ * message for the i-th file (or is NULL).
+ */
+static void parse_FASTA_files_in_parallel(SEXP filexp_list,
+		int seek_first_rec, FASTAloader *loaders, int nthreads,
+		long long int *offsets, long long int *ninvalids,
+		const char **errmsgs)
+{
+	int nfile, i;
+	FASTAinput *inputs;
+	char *errmsg_bufs;
+
+	nfile = LENGTH(filexp_list);
+	inputs = (FASTAinput *) R_alloc(nfile, sizeof(FASTAinput));
+	errmsg_bufs = R_alloc(nfile, sizeof(errmsg_buf));
+	for (i = 0; i < nfile; i++) {
+		/* The files are already parsed in parallel so each BGZF
+		   file is inflated by a single thread. */
+		inputs[i] = open_FASTA_input(VECTOR_ELT(filexp_list, i), 1,
+					     offsets + i);
+		ninvalids[i] = 0LL;
+	}
+	_resolve_parser_stubs(VECTOR_ELT(filexp_list, 0));
+	#pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+	for (i = 0; i < nfile; i++) {
+		int recno = 0;
+		const char *errmsg;
+
+		errmsg = parse_FASTA_input(inputs + i,
+					   -1, 0, seek_first_rec,
+					   loaders + i,
+					   &recno, offsets + i, ninvalids + i);
+		/* 'errmsg' points to the thread-local 'errmsg_buf'. */
+		if (errmsg != NULL) {
+			errmsgs[i] = errmsg_bufs + i * sizeof(errmsg_buf);
+			strcpy((char *) errmsgs[i], errmsg);
+		} else {
+			errmsgs[i] = NULL;
+		}
+	}
+	for (i = 0; i < nfile; i++)
+		close_FASTA_input(inputs + i, offsets[i]);
+	return;
+}
+
+
+/****************************************************************************
+ * read_fasta_files()
+ */
+
+/* The arenas are freed by the cleanup function of read_fasta_files() if an
+   error is raised. */
+static void check_loaded_FASTA_file(SEXP filexp_list, int i,
+		const char *errmsg, long long int ninvalid,
+		const ARENA_FASTAloaderExt *loader_ext)
+{
+	const char *filename;
+
+	filename = CHAR(STRING_ELT(GET_NAMES(filexp_list), i));
+	if (errmsg == NULL)
+		errmsg = get_ARENA_FASTAloaderExt_errmsg(loader_ext);
+	if (errmsg != NULL)
+		error("reading FASTA file %s: %s", filename, errmsg);
+	if (ninvalid != 0LL)
+		warning("reading FASTA file %s: ignored %lld "
+			"invalid one-letter sequence codes",
+			filename, ninvalid);
+	return;
+}
+
+typedef struct fasta_files_loading {
+	SEXP filexp_list;
+	int nrec;
+	int skip;
+	int seek_first_rec;
+	int use_names;
+	const char *element_type;
+	int nthreads;
+	ARENA_FASTAloaderExt *loader_exts;
+	FASTAloader *loaders;
+} FASTAfilesLoading;
+
+/* Loads the files in the arenas and copies them to the XStringSet object.
+   Called thru R_UnwindProtect() by read_fasta_files(). */
+static SEXP load_FASTA_files(void *data)
+{
+	FASTAfilesLoading *loading;
+	int nfile, recno, i;
+	SEXP ans_names, ans;
+	XStringSetArena *seq_arenas, *desc_arenas;
+	FASTAinput input;
+	long long int *offsets, *ninvalids;
+	const char **errmsgs;
+
+	loading = (FASTAfilesLoading *) data;
+	nfile = LENGTH(loading->filexp_list);
+	offsets = (long long int *) R_alloc(nfile, sizeof(long long int));
+	ninvalids = (long long int *) R_alloc(nfile, sizeof(long long int));
+	errmsgs = (const char **) R_alloc(nfile, sizeof(const char *));
+	if (loading->nthreads > 1 && nfile > 1 &&
+	    loading->nrec < 0 && loading->skip == 0) {
+		parse_FASTA_files_in_parallel(loading->filexp_list,
+					      loading->seek_first_rec,
+					      loading->loaders,
+					      loading->nthreads,
+					      offsets, ninvalids, errmsgs);
+		for (i = 0; i < nfile; i++)
+			check_loaded_FASTA_file(loading->filexp_list, i,
+						errmsgs[i], ninvalids[i],
+						loading->loader_exts + i);
+	} else {
+		recno = 0;
+		for (i = 0; i < nfile; i++) {
+			input = open_FASTA_input(
+					VECTOR_ELT(loading->filexp_list, i),
+					loading->nthreads, offsets + i);
+			ninvalids[i] = 0LL;
+			errmsgs[i] = parse_FASTA_input(&input,
+					loading->nrec, loading->skip,
+					loading->seek_first_rec,
+					loading->loaders + i,
+					&recno, offsets + i, ninvalids + i);
+			close_FASTA_input(&input, offsets[i]);
+			check_loaded_FASTA_file(loading->filexp_list, i,
+						errmsgs[i], ninvalids[i],
+						loading->loader_exts + i);
+		}
+	}
+	seq_arenas = (XStringSetArena *)
+		R_alloc(nfile, sizeof(XStringSetArena));
+	desc_arenas = (XStringSetArena *)
+		R_alloc(nfile, sizeof(XStringSetArena));
+	for (i = 0; i < nfile; i++) {
+		seq_arenas[i] = loading->loader_exts[i].seq_arena;
+		desc_arenas[i] = loading->loader_exts[i].desc_arena;
+	}
+	if (loading->use_names) {
+		PROTECT(ans_names = _new_CHARACTER_from_XStringSetArenas(
+						desc_arenas, nfile));
+	} else {
+		PROTECT(ans_names = R_NilValue);
+	}
+	PROTECT(ans = _new_XStringSet_from_XStringSetArenas(
+				loading->element_type,
+				seq_arenas, nfile, R_NilValue, ans_names));
+	UNPROTECT(2);
 	return ans;
 }
 
+static void free_FASTA_files_arenas(void *data, Rboolean jump)
+{
+	FASTAfilesLoading *loading;
+
+	loading = (FASTAfilesLoading *) data;
+	free_ARENA_FASTAloaderExts(loading->loader_exts,
+				   LENGTH(loading->filexp_list));
+	return;
+}
+
 /* --- .Call ENTRY POINT ---
- * We use a 2-pass algo so we can pre-alloc the exact amount of memory for the
- * XStringSet object that we load with the string data during the 2nd pass.
- * Because a XStringSet object cannot be grown in-place, a 1-pass algo would
- * need to load the string data in a growing object first (e.g. CharAEAE)
- * then turn it into an XStringSet object (this would require a copy of the
- * entire string data).
+ * We use a 1-pass algo: the string data is loaded in XStringSetArena's
+ * (see XStringSet_class.c) and then copied to the XStringSet object once we
+ * know the lengths of all the sequences. This is about twice faster than
+ * parsing the files twice (once to get the lengths and once to load the
+ * data), especially on compressed files, at the cost of holding the data
+ * twice in memory during the final copy.
+ * Each file is loaded in its own arenas so, when all the records are read
+ * ('nrec' < 0 and 'skip' == 0), the files can be parsed in parallel.
+ * The arenas are not allocated by R so the loading runs thru
+ * R_UnwindProtect(): they are freed even if an error is raised (or the user
+ * interrupts the loading).
  */
 SEXP read_fasta_files(SEXP filexp_list,
 		      SEXP nrec, SEXP skip, SEXP seek_first_rec,
-		      SEXP use_names, SEXP elementType, SEXP lkup)
+		      SEXP use_names, SEXP elementType, SEXP lkup,
+		      SEXP nthreads)
 {
-	int nrec0, skip0, seek_rec0, use_names0, recno, i;
-	SEXP seqlengths, ans, filexp;
-	FASTAloaderExt loader_ext;
-	FASTAloader loader;
-	long long int offset, ninvalid;
-
-	nrec0 = INTEGER(nrec)[0];
-	skip0 = INTEGER(skip)[0];
-	seek_rec0 = LOGICAL(seek_first_rec)[0];
-	use_names0 = LOGICAL(use_names)[0];
-	/* 1st pass */
-	PROTECT(seqlengths = get_fasta_seqlengths(filexp_list,
-						  nrec0, skip0, seek_rec0,
-						  use_names0, lkup));
-	/* Allocation */
-	PROTECT(ans = _alloc_XStringSet(CHAR(STRING_ELT(elementType, 0)),
-					seqlengths));
-	/* 2nd pass */
-	loader_ext = new_FASTAloaderExt(ans);
-	loader = new_FASTAloader(lkup, &loader_ext);
-	recno = 0;
-	for (i = 0; i < LENGTH(filexp_list); i++) {
-		filexp = VECTOR_ELT(filexp_list, i);
-		/* Calls to filexp_tell() are costly on compressed files
-		   and the cost increases as we advance in the file.
-		   This is not a problem when reading the entire file but
-		   becomes one when reading a compressed file by chunk. */
-		offset = filexp_tell(filexp);
-		parse_FASTA_file(filexp, nrec0, skip0, seek_rec0,
-				 &loader,
-				 &recno, &offset, &ninvalid);
+	FASTAfilesLoading loading;
+	int nfile, i;
+	SEXP cont, ans;
+
+	loading.filexp_list = filexp_list;
+	loading.nrec = INTEGER(nrec)[0];
+	loading.skip = INTEGER(skip)[0];
+	loading.seek_first_rec = LOGICAL(seek_first_rec)[0];
+	loading.use_names = LOGICAL(use_names)[0];
+	loading.element_type = CHAR(STRING_ELT(elementType, 0));
+	loading.nthreads = _get_nthreads(nthreads);
+	nfile = LENGTH(filexp_list);
+	loading.loader_exts = (ARENA_FASTAloaderExt *)
+		R_alloc(nfile, sizeof(ARENA_FASTAloaderExt));
+	loading.loaders = (FASTAloader *) R_alloc(nfile, sizeof(FASTAloader));
+	for (i = 0; i < nfile; i++) {
+		loading.loader_exts[i] = new_ARENA_FASTAloaderExt();
+		loading.loaders[i] = new_FASTAloader_with_ARENA_ext(
+						loading.use_names, lkup,
+						loading.loader_exts + i);
 	}
-	UNPROTECT(2);
+	PROTECT(cont = R_MakeUnwindCont());
+	ans = R_UnwindProtect(load_FASTA_files, &loading,
+			      free_FASTA_files_arenas, &loading, cont);
+	UNPROTECT(1);
 	return ans;
 }
 
@@ -508,32 +1155,39 @@ static SEXP make_fasta_index_data_frame(const IntAE *recno_buf,
 	return df;
 }
 
-/* --- .Call ENTRY POINT --- */
+/* --- .Call ENTRY POINT ---
+ * The offsets of the records in a BGZF file are virtual offsets (see
+ * BGZF_utils.c).
+ */
 SEXP fasta_index(SEXP filexp_list,
-		 SEXP nrec, SEXP skip, SEXP seek_first_rec, SEXP lkup)
+		 SEXP nrec, SEXP skip, SEXP seek_first_rec, SEXP lkup,
+		 SEXP nthreads)
 {
-	int nrec0, skip0, seek_rec0, i, recno, old_nrec, new_nrec, k;
+	int nrec0, skip0, seek_rec0, nthreads0, i, recno,
+	    old_nrec, new_nrec, k;
 	INDEX_FASTAloaderExt loader_ext;
 	FASTAloader loader;
 	IntAE *seqlength_buf, *fileno_buf;
-	SEXP filexp;
+	FASTAinput input;
 	long long int offset, ninvalid;
 	const char *errmsg;
 
 	nrec0 = INTEGER(nrec)[0];
 	skip0 = INTEGER(skip)[0];
 	seek_rec0 = LOGICAL(seek_first_rec)[0];
+	nthreads0 = _get_nthreads(nthreads);
 	loader_ext = new_INDEX_FASTAloaderExt();
 	loader = new_FASTAloader_with_INDEX_ext(1, lkup, &loader_ext);
 	seqlength_buf = loader_ext.seqlength_buf;
 	fileno_buf = new_IntAE(0, 0, 0);
 	for (i = recno = 0; i < LENGTH(filexp_list); i++) {
-		filexp = VECTOR_ELT(filexp_list, i);
-		offset = filexp_tell(filexp);
+		input = open_FASTA_input(VECTOR_ELT(filexp_list, i),
+					 nthreads0, &offset);
 		ninvalid = 0LL;
-		errmsg = parse_FASTA_file(filexp, nrec0, skip0, seek_rec0,
-					  &loader,
-					  &recno, &offset, &ninvalid);
+		errmsg = parse_FASTA_input(&input, nrec0, skip0, seek_rec0,
+					   &loader,
+					   &recno, &offset, &ninvalid);
+		close_FASTA_input(&input, offset);
 		if (errmsg != NULL)
 			error("reading FASTA file %s: %s",
 			      CHAR(STRING_ELT(GET_NAMES(filexp_list), i)),
@@ -576,40 +1230,399 @@ SEXP fasta_index(SEXP filexp_list,
  *                the same shape as 'nrec_list', i.e. each numeric vector has 1
  *                value per FASTA block. This value is the offset of the block
  *                (i.e. the offset of its first record) relative to the start
- *                of the file. Measured in bytes.
+ *                of the file. Measured in bytes, or a virtual offset (as
+ *                returned by fasta_index()) for a BGZF file.
  *   elementType: The elementType of the XStringSet to return (its class is
  *                inferred from this).
  *   lkup:        Lookup table for encoding the incoming sequence bytes.
+ *   nthreads:    The nb of threads used to inflate a BGZF file.
  */
 SEXP read_fasta_blocks(SEXP seqlengths,
 		SEXP filexp_list, SEXP nrec_list, SEXP offset_list,
-		SEXP elementType, SEXP lkup)
+		SEXP elementType, SEXP lkup, SEXP nthreads)
 {
-	SEXP ans, filexp, nrec, offset;
+	SEXP ans, nrec, offset;
 	FASTAloaderExt loader_ext;
 	FASTAloader loader;
-	int i, j, nrec_j, recno;
+	FASTAinput input;
+	int nthreads0, i, j, nrec_j, recno;
 	long long int offset_j, ninvalid;
 
+	nthreads0 = _get_nthreads(nthreads);
 	PROTECT(ans = _alloc_XStringSet(CHAR(STRING_ELT(elementType, 0)),
 					seqlengths));
 	loader_ext = new_FASTAloaderExt(ans);
 	loader = new_FASTAloader(lkup, &loader_ext);
 	for (i = 0; i < LENGTH(filexp_list); i++) {
-		filexp = VECTOR_ELT(filexp_list, i);
 		nrec = VECTOR_ELT(nrec_list, i);
 		offset = VECTOR_ELT(offset_list, i);
+		input = open_FASTA_input(VECTOR_ELT(filexp_list, i),
+					 nthreads0, &offset_j);
 		for (j = 0; j < LENGTH(nrec); j++) {
 			nrec_j = INTEGER(nrec)[j];
 			offset_j = llround(REAL(offset)[j]);
-			filexp_seek(filexp, offset_j, SEEK_SET);
+			seek_FASTA_input(&input, offset_j);
 			recno = 0;
 			ninvalid = 0LL;
-			parse_FASTA_file(filexp, nrec_j, 0, 0,
-					 &loader,
-					 &recno, &offset_j, &ninvalid);
+			parse_FASTA_input(&input, nrec_j, 0, 0,
+					  &loader,
+					  &recno, &offset_j, &ninvalid);
+		}
+		close_FASTA_input(&input, offset_j);
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+
+/****************************************************************************
+ * samtools-compatible FASTA index (.fai).
+ *
+ * A .fai index has 1 row per record with the name of the record (i.e. the
+ * description line up to the first white space), the length of its
+ * sequence, the offset of the sequence in the file, the nb of letters per
+ * line ("linebases"), and the nb of bytes per line including the newline
+ * ("linewidth"). All the sequence lines of a record must have the same
+ * length except the last one, which can be shorter. This is what allows
+ * computing the offset of any letter in the file.
+ */
+
+typedef struct fai_builder {
+	CharAEAE *name_buf;
+	IntAE *length_buf;
+	LLongAE *offset_buf;
+	IntAE *linebases_buf;
+	IntAE *linewidth_buf;
+	long long int length;
+	int linebases;
+	int linewidth;
+	int last_line_seen;  /* a line shorter than 'linebases' was seen */
+} FAIbuilder;
+
+static void FAI_flush_record(FAIbuilder *fai)
+{
+	int nrec;
+
+	nrec = IntAE_get_nelt(fai->length_buf);
+	if (nrec == CharAEAE_get_nelt(fai->name_buf))
+		return;  /* no pending record */
+	IntAE_insert_at(fai->length_buf, nrec, (int) fai->length);
+	IntAE_insert_at(fai->linebases_buf, nrec,
+			fai->linebases == -1 ? 0 : fai->linebases);
+	IntAE_insert_at(fai->linewidth_buf, nrec,
+			fai->linebases == -1 ? 0 : fai->linewidth);
+	return;
+}
+
+static void FAI_new_record(FAIbuilder *fai, char *desc, long long int offset)
+{
+	int i;
+
+	FAI_flush_record(fai);
+	for (i = 0; desc[i] != '\0' && desc[i] != ' ' && desc[i] != '\t'; i++)
+		{};
+	desc[i] = '\0';
+	CharAEAE_append_string(fai->name_buf, desc);
+	LLongAE_insert_at(fai->offset_buf, LLongAE_get_nelt(fai->offset_buf),
+			  offset);
+	fai->length = 0;
+	fai->linebases = -1;
+	fai->last_line_seen = 0;
+	return;
+}
+
+/* Returns 1 if the line breaks the layout of the record, 2 if the sequence
+   or the line is too long, and 0 otherwise. */
+static int FAI_add_line(FAIbuilder *fai, long long int nletter,
+		long long int nbyte)
+{
+	if (nletter == 0) {
+		/* We tolerate empty lines at the end of a record. */
+		fai->last_line_seen = 1;
+		return 0;
+	}
+	if (fai->last_line_seen)
+		return 1;
+	if (fai->linebases == -1) {
+		if (nbyte >= INT_MAX)
+			return 2;
+		fai->linebases = (int) nletter;
+		/* The last line of the file can miss its newline. */
+		fai->linewidth = nbyte == nletter ? (int) nletter + 1 :
+						    (int) nbyte;
+	} else if (nletter > fai->linebases
+		|| (nbyte != nletter &&
+		    nbyte - nletter != fai->linewidth - fai->linebases)) {
+		return 1;
+	} else if (nletter < fai->linebases) {
+		fai->last_line_seen = 1;
+	}
+	fai->length += nletter;
+	return fai->length > INT_MAX ? 2 : 0;
+}
+
+static SEXP make_fai_data_frame(const FAIbuilder *fai)
+{
+	static const char *colnames[] = {"name", "length", "offset",
+					 "linebases", "linewidth"};
+	SEXP df, df_names, tmp;
+	int nrec, i;
+
+	nrec = IntAE_get_nelt(fai->length_buf);
+	PROTECT(df = NEW_LIST(5));
+	PROTECT(df_names = NEW_CHARACTER(5));
+	for (i = 0; i < 5; i++)
+		SET_STRING_ELT(df_names, i, mkChar(colnames[i]));
+	SET_NAMES(df, df_names);
+	UNPROTECT(1);
+	SET_ELEMENT(df, 0, new_CHARACTER_from_CharAEAE(fai->name_buf));
+	SET_ELEMENT(df, 1, new_INTEGER_from_IntAE(fai->length_buf));
+	PROTECT(tmp = NEW_NUMERIC(nrec));
+	for (i = 0; i < nrec; i++)
+		REAL(tmp)[i] = (double) fai->offset_buf->elts[i];
+	SET_ELEMENT(df, 2, tmp);
+	UNPROTECT(1);
+	SET_ELEMENT(df, 3, new_INTEGER_from_IntAE(fai->linebases_buf));
+	SET_ELEMENT(df, 4, new_INTEGER_from_IntAE(fai->linewidth_buf));
+	/* list_as_data_frame() performs IN-PLACE coercion */
+	list_as_data_frame(df, nrec);
+	UNPROTECT(1);
+	return df;
+}
+
+/* --- .Call ENTRY POINT ---
+ * 'filexp_list' must contain a single "File External Pointer". Offsets are
+ * measured in bytes from the start of the uncompressed data.
+ */
+SEXP fasta_fai(SEXP filexp_list)
+{
+	SEXP filexp;
+	FAIbuilder fai;
+	char buf[IOBUF_SIZE];
+	int lineno, EOL_in_buf, EOL_in_prev_buf, ret_code, nbyte_in,
+	    in_desc, in_record, nrec;
+	long long int offset, line_nletter, line_nbyte;
+	char prev_last_char;
+
+	filexp = VECTOR_ELT(filexp_list, 0);
+	fai.name_buf = new_CharAEAE(0, 0);
+	fai.length_buf = new_IntAE(0, 0, 0);
+	fai.offset_buf = new_LLongAE(0, 0, 0);
+	fai.linebases_buf = new_IntAE(0, 0, 0);
+	fai.linewidth_buf = new_IntAE(0, 0, 0);
+	offset = filexp_tell(filexp);
+	lineno = 0;
+	EOL_in_buf = 1;
+	in_desc = in_record = 0;
+	line_nletter = line_nbyte = 0;
+	prev_last_char = '\0';
+	while (1) {
+		if (EOL_in_buf)
+			lineno++;
+		EOL_in_prev_buf = EOL_in_buf;
+		ret_code = filexp_gets(filexp, buf, IOBUF_SIZE, &EOL_in_buf);
+		if (ret_code == 0)
+			break;
+		if (ret_code == -1)
+			error("read error while reading characters "
+			      "from line %d", lineno);
+		nbyte_in = strlen(buf);
+		offset += nbyte_in;
+		if (EOL_in_prev_buf) {
+			in_desc = has_prefix(buf, FASTA_desc_markup);
+			if (in_desc) {
+				if (!EOL_in_buf)
+					error("cannot read line %d, "
+					      "line is too long", lineno);
+				buf[delete_trailing_LF_or_CRLF(buf,
+							nbyte_in)] = '\0';
+				FAI_new_record(&fai, buf +
+					       strlen(FASTA_desc_markup),
+					       offset);
+				in_record = 1;
+				continue;
+			}
+			line_nletter = line_nbyte = 0;
+			prev_last_char = '\0';
+		}
+		line_nbyte += nbyte_in;
+		if (!EOL_in_buf) {
+			prev_last_char = buf[nbyte_in - 1];
+			continue;
+		}
+		/* The newline can be split between 2 buffers ("\r" then
+		   "\n"). */
+		line_nletter = delete_trailing_LF_or_CRLF(buf, nbyte_in);
+		if (line_nletter == 0 && nbyte_in == 1 && prev_last_char == '\r')
+			line_nletter = -1;
+		line_nletter += line_nbyte - nbyte_in;
+		if (!in_record) {
+			if (line_nletter == 0)
+				continue;  // we ignore empty lines
+			error("\"%s\" expected at beginning of line %d",
+			      FASTA_desc_markup, lineno);
+		}
+		nrec = CharAEAE_get_nelt(fai.name_buf);
+		switch (FAI_add_line(&fai, line_nletter, line_nbyte)) {
+		    case 1:
+			error("line %d: the sequence lines of record %d "
+			      "don't have the same length (only the last "
+			      "line of a record can be shorter)", lineno, nrec);
+		    case 2:
+			error("line %d: the sequence of record %d is too long",
+			      lineno, nrec);
+		}
+	}
+	FAI_flush_record(&fai);
+	return make_fai_data_frame(&fai);
+}
+
+
+/****************************************************************************
+ * Extracting regions from an uncompressed FASTA file thru its .fai index.
+ */
+
+#define REGION_BUF_SIZE (1 << 20)
+
+static int open_fasta_for_regions(const char *path, FILE **file)
+{
+	unsigned char magic[6];
+	size_t nmagic;
+
+	*file = fopen(path, "rb");
+	if (*file == NULL)
+		return -1;
+	nmagic = fread(magic, 1, sizeof(magic), *file);
+	if (has_compression_magic(magic, nmagic)) {
+		fclose(*file);
+		return -2;
+	}
+	return 0;
+}
+
+/* Offset in the file of the letter at 0-based position 'pos' in the
+   sequence of a record. */
+static long long int get_letter_offset(long long int seq_offset,
+		int linebases, int linewidth, long long int pos)
+{
+	return seq_offset + (pos / linebases) * linewidth + pos % linebases;
+}
+
+/*
+ * Copies the 'width' letters starting at 'byte_offset' in 'file' to 'dest',
+ * skipping the newlines. Returns the nb of letters copied or -1 on read
+ * error.
+ */
+static long long int read_region(FILE *file, long long int byte_offset,
+		long long int nbyte, char *dest, int width,
+		const ByteTrTable *byte2code, char *buf, long long int *ninvalid)
+{
+	long long int ncopied;
+	size_t n, k;
+	int c;
+
+	if (_seek_file(file, byte_offset) != 0)
+		return -1;
+	ncopied = 0;
+	while (nbyte > 0) {
+		n = nbyte < REGION_BUF_SIZE ? (size_t) nbyte : REGION_BUF_SIZE;
+		if (fread(buf, 1, n, file) != n)
+			return -1;
+		nbyte -= n;
+		for (k = 0; k < n; k++) {
+			c = (unsigned char) buf[k];
+			if (c == '\n' || c == '\r')
+				continue;
+			if (ncopied == width)
+				return -1;
+			if (byte2code != NULL) {
+				c = byte2code->byte2code[c];
+				if (c == NA_INTEGER) {
+					(*ninvalid)++;
+					continue;
+				}
+			}
+			dest[ncopied++] = (char) c;
 		}
 	}
+	return ncopied;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Args:
+ *   filepath:    The path to an uncompressed FASTA file.
+ *   offset, linebases, linewidth:
+ *                The "offset", "linebases" and "linewidth" columns of the
+ *                .fai index of the file, with 1 row per region.
+ *   start:       Integer vector of 1-based start positions of the regions
+ *                in their sequence.
+ *   width:       Integer vector of widths of the regions (checked by the
+ *                caller to be within the bounds of their sequence).
+ *   elementType: The elementType of the XStringSet to return.
+ *   lkup:        Lookup table for encoding the incoming sequence bytes.
+ */
+SEXP read_fasta_regions(SEXP filepath, SEXP offset, SEXP linebases,
+		SEXP linewidth, SEXP start, SEXP width,
+		SEXP elementType, SEXP lkup)
+{
+	const char *path;
+	FILE *file;
+	SEXP ans;
+	XStringSet_holder ans_holder;
+	ByteTrTable byte2code;
+	Chars_holder ans_elt;
+	char *buf;
+	int nregion, i, width_i, lb_i, lw_i;
+	long long int seq_offset, pos0, byte0, byte1, ncopied, ninvalid;
+
+	if (lkup != R_NilValue)
+		_init_ByteTrTable_with_lkup(&byte2code, lkup);
+	nregion = LENGTH(width);
+	PROTECT(ans = _alloc_XStringSet(CHAR(STRING_ELT(elementType, 0)),
+					width));
+	ans_holder = _hold_XStringSet(ans);
+	buf = R_alloc(REGION_BUF_SIZE, sizeof(char));
+	path = translateChar(STRING_ELT(filepath, 0));
+	switch (open_fasta_for_regions(path, &file)) {
+	    case -1:
+		error("cannot open file '%s'", path);
+	    case -2:
+		error("extracting regions from a compressed FASTA file "
+		      "is not supported");
+	}
+	ninvalid = 0;
+	for (i = 0; i < nregion; i++) {
+		width_i = INTEGER(width)[i];
+		if (width_i == 0)
+			continue;
+		seq_offset = llround(REAL(offset)[i]);
+		lb_i = INTEGER(linebases)[i];
+		lw_i = INTEGER(linewidth)[i];
+		if (lb_i <= 0 || lw_i < lb_i) {
+			fclose(file);
+			error("invalid .fai index (region %d)", i + 1);
+		}
+		pos0 = (long long int) INTEGER(start)[i] - 1;
+		byte0 = get_letter_offset(seq_offset, lb_i, lw_i, pos0);
+		byte1 = get_letter_offset(seq_offset, lb_i, lw_i,
+					  pos0 + width_i - 1);
+		ans_elt = _get_elt_from_XStringSet_holder(&ans_holder, i);
+		ncopied = read_region(file, byte0, byte1 - byte0 + 1,
+				      (char *) ans_elt.ptr, width_i,
+				      lkup != R_NilValue ? &byte2code : NULL,
+				      buf, &ninvalid);
+		if (ninvalid != 0) {
+			fclose(file);
+			error("region %d contains invalid one-letter "
+			      "sequence codes", i + 1);
+		}
+		if (ncopied != width_i) {
+			fclose(file);
+			error("the .fai index doesn't match the FASTA file "
+			      "(region %d)", i + 1);
+		}
+	}
+	fclose(file);
 	UNPROTECT(1);
 	return ans;
 }
@@ -619,23 +1632,29 @@ SEXP read_fasta_blocks(SEXP seqlengths,
  * Writing FASTA files.
  */
 
+/*
+ * The records are formatted into the big batches of a BGZFwriter so the
+ * file is written (and compressed if 'compression_level' is not NA) by
+ * large blocks. See _open_output_BGZFwriter() for the arguments describing
+ * the file.
+ * The names are checked before the file is opened: raising an error while
+ * the writer is open would leak it.
+ */
+
 /* --- .Call ENTRY POINT --- */
-SEXP write_XStringSet_to_fasta(SEXP x, SEXP filexp_list, SEXP width, SEXP lkup)
+SEXP write_XStringSet_to_fasta(SEXP x, SEXP filepath, SEXP append,
+		SEXP compression_level, SEXP nthreads, SEXP width, SEXP lkup)
 {
 	XStringSet_holder X;
-	int x_length, width0, lkup_len, i, j1, j2, dest_nbytes;
+	int x_length, width0, lkup_len, i, j, n;
 	const int *lkup0;
-	SEXP filexp, x_names, desc;
+	SEXP x_names, desc;
 	Chars_holder X_elt;
-	char buf[IOBUF_SIZE];
+	BGZFwriter *writer;
 
 	X = _hold_XStringSet(x);
 	x_length = _get_length_from_XStringSet_holder(&X);
-	filexp = VECTOR_ELT(filexp_list, 0);
 	width0 = INTEGER(width)[0];
-	if (width0 >= IOBUF_SIZE)
-		error("'width' must be <= %d", IOBUF_SIZE - 1);
-	buf[width0] = 0;
 	if (lkup == R_NilValue) {
 		lkup0 = NULL;
 		lkup_len = 0;
@@ -644,31 +1663,31 @@ SEXP write_XStringSet_to_fasta(SEXP x, SEXP filexp_list, SEXP width, SEXP lkup)
 		lkup_len = LENGTH(lkup);
 	}
 	x_names = get_XVectorList_names(x);
+	if (x_names != R_NilValue) {
+		for (i = 0; i < x_length; i++)
+			if (STRING_ELT(x_names, i) == NA_STRING)
+				error("'names(x)' contains NAs");
+	}
+	writer = _open_output_BGZFwriter(filepath, append,
+					 compression_level, nthreads);
 	for (i = 0; i < x_length; i++) {
-		filexp_puts(filexp, FASTA_desc_markup);
+		_BGZFwriter_puts(writer, FASTA_desc_markup);
 		if (x_names != R_NilValue) {
 			desc = STRING_ELT(x_names, i);
-			if (desc == NA_STRING)
-				error("'names(x)' contains NAs");
-			filexp_puts(filexp, CHAR(desc));
+			_BGZFwriter_write(writer, CHAR(desc), LENGTH(desc));
 		}
-		filexp_puts(filexp, "\n");
+		_BGZFwriter_putc(writer, '\n');
 		X_elt = _get_elt_from_XStringSet_holder(&X, i);
-		for (j1 = 0; j1 < X_elt.length; j1 += width0) {
-			j2 = j1 + width0;
-			if (j2 > X_elt.length)
-				j2 = X_elt.length;
-			dest_nbytes = j2 - j1;
-			j2--;
-			Ocopy_bytes_from_i1i2_with_lkup(j1, j2,
-				buf, dest_nbytes,
-				X_elt.ptr, X_elt.length,
-				lkup0, lkup_len);
-			buf[dest_nbytes] = 0;
-			filexp_puts(filexp, buf);
-			filexp_puts(filexp, "\n");
+		for (j = 0; j < X_elt.length; j += width0) {
+			n = X_elt.length - j;
+			if (n > width0)
+				n = width0;
+			_BGZFwriter_write_with_lkup(writer, X_elt.ptr + j, n,
+						    lkup0, lkup_len);
+			_BGZFwriter_putc(writer, '\n');
 		}
 	}
+	_close_output_BGZFwriter(writer, filepath, append);
 	return R_NilValue;
 }
 
@@ -7,9 +7,17 @@
 #include "XVector_interface.h"
 #include "S4Vectors_interface.h"
 
+#include <stdlib.h>  /* for malloc(), free() */
+#include <ctype.h>   /* for isspace() */
+#include <pthread.h>
+
 
 #define IOBUF_SIZE 20002
-static char errmsg_buf[200];
+#define ERRMSG_BUF_SIZE 200
+/* Only used by the main thread. The parsers running in other threads (see
+   parse_FASTQ_files_in_parallel() and the streaming FASTQ reader) write
+   their error message to a buffer owned by the caller. */
+static char errmsg_buf[ERRMSG_BUF_SIZE];
 
 static int has_prefix(const char *s, const char *prefix)
 {
@@ -45,16 +53,6 @@ static int translate(Chars_holder *x, const int *lkup, int lkup_len)
 	return nbinvalid;
 }
 
-static void append_Chars_holder(Chars_holder *dest, const Chars_holder *src)
-{
-	/* dest->ptr is a (const char *) so we need to cast it to (char *)
-	   in order to write to it */
-	memcpy((char *) dest->ptr + dest->length,
-	       src->ptr, src->length * sizeof(char));
-	dest->length += src->length;
-	return;
-}
-
 
 /****************************************************************************
  * FASTQ parser
@@ -62,6 +60,23 @@ static void append_Chars_holder(Chars_holder *dest, const Chars_holder *src)
 
 static const char *FASTQ_line1_markup = "@", *FASTQ_line3_markup = "+";
 
+/*
+ * The filters and trimmers applied to each record by the FASTQ loader (see
+ * FASTQ_end_record_hook() below). A negative value means "not set".
+ * Qualities are Phred scores i.e. quality bytes minus 'qual_offset'.
+ */
+typedef struct fastq_filter {
+	int min_length;
+	int max_length;
+	int max_N;
+	double min_mean_qual;
+	int min_qual;
+	int trim_qual;         /* trim the 3' bases with a lower quality */
+	int qual_offset;
+	int use_quals;         /* at least 1 of the 3 above is set */
+	int N_code, n_code;    /* 'N' and 'n' after translation */
+} FASTQfilter;
+
 typedef struct fastq_loader {
 	void (*new_seqid_hook)(struct fastq_loader *loader,
 			       const Chars_holder *seqid);
@@ -73,8 +88,11 @@ typedef struct fastq_loader {
         void (*new_empty_qual_hook)(struct fastq_loader *loader);
 	const char *(*append_qual_hook)(struct fastq_loader *loader,
 					const Chars_holder *qual_data);
+	const char *(*end_record_hook)(struct fastq_loader *loader);
 	const int *lkup;
 	int lkup_len;
+	const FASTQfilter *filter;
+	int drop_quals;  /* quals are loaded for 'filter' only */
 	void *ext;  /* loader extension (optional) */
 } FASTQloader;
 
@@ -134,6 +152,7 @@ static FASTQloader new_FASTQloader_with_SEQLEN_ext(SEXP lkup,
 	loader.new_qualid_hook = NULL;
 	loader.new_empty_qual_hook = NULL;
 	loader.append_qual_hook = NULL;
+	loader.end_record_hook = NULL;
 	if (lkup == R_NilValue) {
 		loader.lkup = NULL;
 		loader.lkup_len = 0;
@@ -141,6 +160,8 @@ static FASTQloader new_FASTQloader_with_SEQLEN_ext(SEXP lkup,
 		loader.lkup = INTEGER(lkup);
 		loader.lkup_len = LENGTH(lkup);
 	}
+	loader.filter = NULL;
+	loader.drop_quals = 0;
 	loader.ext = loader_ext;
 	return loader;
 }
@@ -152,61 +173,84 @@ static FASTQloader new_FASTQloader_with_SEQLEN_ext(SEXP lkup,
  * corresponding read sequence. Note that a quality sequence shorter than
  * the corresponding read sequence is not considered an error. It's padded
  * to the length of the read with whatever bytes were present in the
- * BStringSet object where the quality sequences are copied (this object
- * is pre-allocated and its geometry always reflects the read lengths).
+ * BStringSet object where the quality sequences are copied at the end (this
+ * object is allocated with the read lengths).
  * Unfortunately this is likely to cause problems downstream.
+ * The read ids, reads and quality sequences are loaded in a single pass in 3
+ * XStringSetArena's (see XStringSet_class.c). The FASTQ loader doesn't use
+ * the R API so several FASTQ loaders can be used concurrently by worker
+ * threads.
+ * If the loader has a filter, each record is filtered and trimmed as soon as
+ * its quality line is loaded, so the arenas only grow with the reads that
+ * are kept.
  */
 
 typedef struct fastq_loader_ext {
-	CharAEAE *seqid_buf;
-	XVectorList_holder seq_holder;
-	int nseq;
-	Chars_holder seq_elt_holder;
-	XVectorList_holder qual_holder;
-	int nqual;
-	Chars_holder qual_elt_holder;
+	XStringSetArena seqid_arena;
+	XStringSetArena seq_arena;
+	XStringSetArena qual_arena;
+	char *rec_buf;         /* used by FASTQ_end_record_hook() */
+	int rec_buflength;
 } FASTQloaderExt;
 
-static FASTQloaderExt new_FASTQloaderExt(SEXP sequences, SEXP qualities)
+static FASTQloaderExt new_FASTQloaderExt()
 {
 	FASTQloaderExt loader_ext;
 
-	loader_ext.seqid_buf =
-		new_CharAEAE(_get_XStringSet_length(sequences), 0);
-	loader_ext.seq_holder = hold_XVectorList(sequences);
-	loader_ext.nseq = -1;
-	if (qualities != R_NilValue) {
-		loader_ext.qual_holder = hold_XVectorList(qualities);
-		loader_ext.nqual = -1;
-	}
+	loader_ext.seqid_arena = _new_XStringSetArena();
+	loader_ext.seq_arena = _new_XStringSetArena();
+	loader_ext.qual_arena = _new_XStringSetArena();
+	loader_ext.rec_buf = NULL;
+	loader_ext.rec_buflength = 0;
 	return loader_ext;
 }
 
+static void free_FASTQloaderExts(FASTQloaderExt *loader_exts, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		_free_XStringSetArena(&(loader_exts[i].seqid_arena));
+		_free_XStringSetArena(&(loader_exts[i].seq_arena));
+		_free_XStringSetArena(&(loader_exts[i].qual_arena));
+		free(loader_exts[i].rec_buf);
+		loader_exts[i].rec_buf = NULL;
+		loader_exts[i].rec_buflength = 0;
+	}
+	return;
+}
+
+static const char *get_FASTQloaderExt_errmsg(const FASTQloaderExt *loader_ext)
+{
+	if (loader_ext->seqid_arena.errmsg != NULL)
+		return loader_ext->seqid_arena.errmsg;
+	if (loader_ext->seq_arena.errmsg != NULL)
+		return loader_ext->seq_arena.errmsg;
+	return loader_ext->qual_arena.errmsg;
+}
+
 static void FASTQ_new_seqid_hook(FASTQloader *loader,
 				 const Chars_holder *seqid)
 {
 	FASTQloaderExt *loader_ext;
-	CharAEAE *seqid_buf;
+	Chars_holder id;
 
 	loader_ext = loader->ext;
-	seqid_buf = loader_ext->seqid_buf;
-	// This works only because seqid->ptr is nul-terminated!
-	CharAEAE_append_string(seqid_buf, seqid->ptr);
+	/* Like CharAEAE_append_string(), we stop at the first embedded nul
+	   (if any). This works only because seqid->ptr is nul-terminated! */
+	id.ptr = seqid->ptr;
+	id.length = strlen(seqid->ptr);
+	_XStringSetArena_add_elt(&(loader_ext->seqid_arena));
+	_XStringSetArena_append(&(loader_ext->seqid_arena), &id);
 	return;
 }
 
 static void FASTQ_new_empty_seq_hook(FASTQloader *loader)
 {
 	FASTQloaderExt *loader_ext;
-	Chars_holder *seq_elt_holder;
 
 	loader_ext = loader->ext;
-	seq_elt_holder = &(loader_ext->seq_elt_holder);
-	loader_ext->nseq++;
-	*seq_elt_holder = get_elt_from_XRawList_holder(
-					&(loader_ext->seq_holder),
-					loader_ext->nseq);
-	seq_elt_holder->length = 0;
+	_XStringSetArena_add_elt(&(loader_ext->seq_arena));
 	return;
 }
 
@@ -216,11 +260,11 @@ static const char *FASTQ_append_seq_hook(FASTQloader *loader,
 		Chars_holder *seq_data)
 {
 	FASTQloaderExt *loader_ext;
-	Chars_holder *seq_elt_holder;
 	int ninvalid;
 
 	loader_ext = loader->ext;
-	seq_elt_holder = &(loader_ext->seq_elt_holder);
+	if (loader_ext->seq_arena.errmsg != NULL)
+		return loader_ext->seq_arena.errmsg;
 	if (loader->lkup != NULL) {
 		ninvalid = translate(seq_data,
 				     loader->lkup,
@@ -228,54 +272,224 @@ static const char *FASTQ_append_seq_hook(FASTQloader *loader,
 		if (ninvalid != 0)
 			return "read sequence contains invalid letters";
 	}
-	append_Chars_holder(seq_elt_holder, seq_data);
+	_XStringSetArena_append(&(loader_ext->seq_arena), seq_data);
 	return NULL;
 }
 
 static void FASTQ_new_empty_qual_hook(FASTQloader *loader)
 {
 	FASTQloaderExt *loader_ext;
-	Chars_holder *qual_elt_holder;
 
 	loader_ext = loader->ext;
-	qual_elt_holder = &(loader_ext->qual_elt_holder);
-	loader_ext->nqual++;
-	*qual_elt_holder = get_elt_from_XRawList_holder(
-					&(loader_ext->qual_holder),
-					loader_ext->nqual);
-	qual_elt_holder->length = 0;
+	_XStringSetArena_add_elt(&(loader_ext->qual_arena));
 	return;
 }
 
 /* Check that the quality sequence is not longer than the read sequence.
-   This prevents writing beyond the pre-allocated memory for the quality
-   sequence. */
+   This prevents writing beyond the memory allocated for the quality
+   sequence when the arena is copied to its final BStringSet object. */
 static const char *FASTQ_append_qual_hook(FASTQloader *loader,
 		const Chars_holder *qual_data)
 {
 	FASTQloaderExt *loader_ext;
-	Chars_holder *seq_elt_holder, *qual_elt_holder;
+	const XStringSetArena *seq_arena, *qual_arena;
+	int seq_width, qual_width;
 
 	loader_ext = loader->ext;
-	seq_elt_holder = &(loader_ext->seq_elt_holder);
-	qual_elt_holder = &(loader_ext->qual_elt_holder);
-	if (qual_elt_holder->length + qual_data->length >
-	    seq_elt_holder->length)
-	{
+	seq_arena = &(loader_ext->seq_arena);
+	qual_arena = &(loader_ext->qual_arena);
+	if (seq_arena->errmsg != NULL)
+		return seq_arena->errmsg;
+	if (qual_arena->errmsg != NULL)
+		return qual_arena->errmsg;
+	seq_width = seq_arena->width[seq_arena->nelt - 1];
+	qual_width = qual_arena->width[qual_arena->nelt - 1];
+	if (qual_width + qual_data->length > seq_width)
 		return "quality sequence is longer than read sequence";
+	_XStringSetArena_append(&(loader_ext->qual_arena), qual_data);
+	return NULL;
+}
+
+/* Returns the Phred score of the i-th letter of the current record. A
+   letter with no quality byte (quality sequence shorter than the read) is
+   considered to have a score of 0. */
+static int get_qual(const char *qual, int qual_width, int i, int offset)
+{
+	return i < qual_width ? (unsigned char) qual[i] - offset : 0;
+}
+
+/* Returns 1 if the record must be dropped. Sets '*width' to the width of the
+   read after trimming. */
+static int filter_FASTQ_record(const FASTQfilter *filter,
+		FASTQloaderExt *loader_ext, int *width)
+{
+	XStringSetArena *seq_arena, *qual_arena;
+	int qual_width, min_qual, q, nN, i;
+	long long int qual_sum;
+	char *buf;
+
+	seq_arena = &(loader_ext->seq_arena);
+	qual_arena = &(loader_ext->qual_arena);
+	buf = loader_ext->rec_buf;
+	qual_width = 0;
+	if (filter->use_quals) {
+		qual_width = qual_arena->width[qual_arena->nelt - 1];
+		_XStringSetArena_copy_last_elt(qual_arena, buf);
+		if (filter->trim_qual >= 0) {
+			while (*width > 0 &&
+			       get_qual(buf, qual_width, *width - 1,
+					filter->qual_offset) < filter->trim_qual)
+				(*width)--;
+		}
 	}
-	append_Chars_holder(qual_elt_holder, qual_data);
+	if (filter->min_length >= 0 && *width < filter->min_length)
+		return 1;
+	if (filter->max_length >= 0 && *width > filter->max_length)
+		return 1;
+	if (filter->min_mean_qual >= 0 || filter->min_qual >= 0) {
+		qual_sum = 0;
+		min_qual = INT_MAX;
+		for (i = 0; i < *width; i++) {
+			q = get_qual(buf, qual_width, i, filter->qual_offset);
+			qual_sum += q;
+			if (q < min_qual)
+				min_qual = q;
+		}
+		/* An empty read has no mean quality. */
+		if (filter->min_mean_qual >= 0 && (*width == 0 ||
+		    (double) qual_sum / *width < filter->min_mean_qual))
+			return 1;
+		if (filter->min_qual >= 0 && min_qual < filter->min_qual)
+			return 1;
+	}
+	if (filter->max_N >= 0) {
+		_XStringSetArena_copy_last_elt(seq_arena, buf);
+		nN = 0;
+		for (i = 0; i < *width; i++) {
+			if ((unsigned char) buf[i] == filter->N_code ||
+			    (unsigned char) buf[i] == filter->n_code)
+				nN++;
+		}
+		if (nN > filter->max_N)
+			return 1;
+	}
+	return 0;
+}
+
+/* Makes sure that 'loader_ext->rec_buf' can hold 'buflength' bytes. */
+static const char *grow_FASTQ_rec_buf(FASTQloaderExt *loader_ext,
+		int buflength)
+{
+	char *buf;
+
+	if (buflength <= loader_ext->rec_buflength)
+		return NULL;
+	buf = (char *) realloc(loader_ext->rec_buf, buflength);
+	if (buf == NULL)
+		return "cannot allocate memory for filtering a record";
+	loader_ext->rec_buf = buf;
+	loader_ext->rec_buflength = buflength;
+	return NULL;
+}
+
+/* Applies the filter of the loader to the current (i.e. last loaded) record.
+   Sets '*keep' to 0 if the record must be dropped, and '*width' to the width
+   of the read after trimming. */
+static const char *check_last_FASTQ_record(FASTQloader *loader,
+		int *keep, int *width)
+{
+	FASTQloaderExt *loader_ext;
+	XStringSetArena *seq_arena, *qual_arena;
+	int seq_width, qual_width;
+	const char *errmsg;
+
+	loader_ext = loader->ext;
+	seq_arena = &(loader_ext->seq_arena);
+	qual_arena = &(loader_ext->qual_arena);
+	errmsg = get_FASTQloaderExt_errmsg(loader_ext);
+	if (errmsg != NULL)
+		return errmsg;
+	seq_width = seq_arena->width[seq_arena->nelt - 1];
+	qual_width = qual_arena->nelt != 0 ?
+		     qual_arena->width[qual_arena->nelt - 1] : 0;
+	errmsg = grow_FASTQ_rec_buf(loader_ext, seq_width > qual_width ?
+						seq_width : qual_width);
+	if (errmsg != NULL)
+		return errmsg;
+	*width = seq_width;
+	*keep = !filter_FASTQ_record(loader->filter, loader_ext, width);
+	return NULL;
+}
+
+static void drop_last_FASTQ_record(FASTQloader *loader)
+{
+	FASTQloaderExt *loader_ext;
+
+	loader_ext = loader->ext;
+	if (loader->new_seqid_hook != NULL)
+		_XStringSetArena_drop_last_elt(&(loader_ext->seqid_arena));
+	_XStringSetArena_drop_last_elt(&(loader_ext->seq_arena));
+	if (loader->new_empty_qual_hook != NULL)
+		_XStringSetArena_drop_last_elt(&(loader_ext->qual_arena));
+	return;
+}
+
+/* Trims the current record to 'width' letters. Also drops its quality
+   sequence if the qualities were loaded for the filter only. */
+static void trim_last_FASTQ_record(FASTQloader *loader, int width)
+{
+	XStringSetArena *seq_arena, *qual_arena;
+	int seq_width, qual_width;
+
+	seq_arena = &(((FASTQloaderExt *) loader->ext)->seq_arena);
+	qual_arena = &(((FASTQloaderExt *) loader->ext)->qual_arena);
+	seq_width = seq_arena->width[seq_arena->nelt - 1];
+	if (width < seq_width)
+		_XStringSetArena_shrink_last_elt(seq_arena,
+						 seq_width - width);
+	if (loader->new_empty_qual_hook == NULL)
+		return;
+	qual_width = qual_arena->width[qual_arena->nelt - 1];
+	if (loader->drop_quals)
+		_XStringSetArena_drop_last_elt(qual_arena);
+	else if (qual_width > width)
+		_XStringSetArena_shrink_last_elt(qual_arena,
+						 qual_width - width);
+	return;
+}
+
+/* Called once the quality line of a record is loaded. Drops or trims the
+   record. */
+static const char *FASTQ_end_record_hook(FASTQloader *loader)
+{
+	int keep, width;
+	const char *errmsg;
+
+	errmsg = check_last_FASTQ_record(loader, &keep, &width);
+	if (errmsg != NULL)
+		return errmsg;
+	if (keep)
+		trim_last_FASTQ_record(loader, width);
+	else
+		drop_last_FASTQ_record(loader);
 	return NULL;
 }
 
+/* 'filter' can be NULL. */
 static FASTQloader new_FASTQloader(int load_seqids, int load_quals,
-		SEXP lkup, FASTQloaderExt *loader_ext)
+		SEXP lkup, const FASTQfilter *filter,
+		FASTQloaderExt *loader_ext)
 {
 	FASTQloader loader;
 
 	loader.new_seqid_hook = load_seqids ? &FASTQ_new_seqid_hook : NULL;
 	loader.new_empty_seq_hook = FASTQ_new_empty_seq_hook;
 	loader.append_seq_hook = FASTQ_append_seq_hook;
+	loader.drop_quals = 0;
+	if (filter != NULL && filter->use_quals && !load_quals) {
+		load_quals = 1;
+		loader.drop_quals = 1;
+	}
 	if (load_quals) {
 		/* Quality ids are always ignored for now. */
 		//loader.new_qualid_hook = &FASTQ_new_qualid_hook;
@@ -287,6 +501,7 @@ static FASTQloader new_FASTQloader(int load_seqids, int load_quals,
 		loader.new_empty_qual_hook = NULL;
 		loader.append_qual_hook = NULL;
 	}
+	loader.end_record_hook = filter != NULL ? &FASTQ_end_record_hook : NULL;
 	if (lkup == R_NilValue) {
 		loader.lkup = NULL;
 		loader.lkup_len = 0;
@@ -294,15 +509,53 @@ static FASTQloader new_FASTQloader(int load_seqids, int load_quals,
 		loader.lkup = INTEGER(lkup);
 		loader.lkup_len = LENGTH(lkup);
 	}
+	loader.filter = filter;
 	loader.ext = loader_ext;
 	return loader;
 }
 
-/* Ignore empty lines. */
-static const char *parse_FASTQ_file(SEXP filexp,
+/*
+ * 'filter' must be NULL or a numeric vector of length 7 (see fastq.filter()
+ * in R/XStringSet-io.R) with NAs for the filters that are not set. Returns
+ * NULL if 'filter' is NULL.
+ */
+static const FASTQfilter *get_FASTQfilter(SEXP filter, SEXP lkup,
+		FASTQfilter *ans)
+{
+	const double *vals;
+	int lkup_len;
+
+	if (filter == R_NilValue)
+		return NULL;
+	vals = REAL(filter);
+	ans->min_length = ISNAN(vals[0]) ? -1 : (int) vals[0];
+	ans->max_length = ISNAN(vals[1]) ? -1 : (int) vals[1];
+	ans->max_N = ISNAN(vals[2]) ? -1 : (int) vals[2];
+	ans->min_mean_qual = ISNAN(vals[3]) ? -1.0 : vals[3];
+	ans->min_qual = ISNAN(vals[4]) ? -1 : (int) vals[4];
+	ans->trim_qual = ISNAN(vals[5]) ? -1 : (int) vals[5];
+	ans->qual_offset = (int) vals[6];
+	ans->use_quals = ans->min_mean_qual >= 0 || ans->min_qual >= 0 ||
+			 ans->trim_qual >= 0;
+	if (lkup == R_NilValue) {
+		ans->N_code = 'N';
+		ans->n_code = 'n';
+	} else {
+		lkup_len = LENGTH(lkup);
+		ans->N_code = translate_byte('N', INTEGER(lkup), lkup_len);
+		ans->n_code = translate_byte('n', INTEGER(lkup), lkup_len);
+	}
+	return ans;
+}
+
+/* Ignore empty lines. The lines are read with filexp_gets(), or with
+   _BGZFreader_gets() if 'bgzf' is not NULL (in which case the offsets are
+   virtual offsets). The error message is written to 'errbuf' (of length
+   ERRMSG_BUF_SIZE) and 'errbuf' is returned. */
+static const char *parse_FASTQ_file(SEXP filexp, BGZFreader *bgzf,
 		int nrec, int skip, int seek_first_rec,
 		FASTQloader *loader,
-		int *recno, long long int *offset)
+		int *recno, long long int *offset, char *errbuf)
 {
 	int lineno, EOL_in_buf, EOL_in_prev_buf, ret_code, nbyte_in,
 	    FASTQ_line1_markup_length, FASTQ_line3_markup_length,
@@ -321,14 +574,20 @@ static const char *parse_FASTQ_file(SEXP filexp,
 		if (EOL_in_buf)
 			lineno++;
 		EOL_in_prev_buf = EOL_in_buf;
-		ret_code = filexp_gets(filexp, buf, IOBUF_SIZE, &EOL_in_buf);
+		if (bgzf != NULL)
+			ret_code = _BGZFreader_gets(bgzf, buf, IOBUF_SIZE,
+						    &EOL_in_buf);
+		else
+			ret_code = filexp_gets(filexp, buf, IOBUF_SIZE,
+					       &EOL_in_buf);
 		if (ret_code == 0)
 			break;
 		if (ret_code == -1) {
-			snprintf(errmsg_buf, sizeof(errmsg_buf),
-				 "read error while reading characters "
-				 "from line %d", lineno);
-			return errmsg_buf;
+			snprintf(errbuf, ERRMSG_BUF_SIZE,
+				 "%s while reading characters from line %d",
+				 bgzf != NULL ? bgzf->errmsg : "read error",
+				 lineno);
+			return errbuf;
 		}
 		if (EOL_in_buf) {
 			nbyte_in = strlen(buf);
@@ -337,7 +596,10 @@ static const char *parse_FASTQ_file(SEXP filexp,
 			data.length = nbyte_in = IOBUF_SIZE - 1;
 		}
 		prev_offset = *offset;
-		*offset += nbyte_in;
+		if (bgzf != NULL)
+			*offset = _BGZFreader_tell(bgzf);
+		else
+			*offset += nbyte_in;
 		if (seek_first_rec) {
 			if (EOL_in_prev_buf
 			 && has_prefix(buf, FASTQ_line1_markup)) {
@@ -355,10 +617,10 @@ static const char *parse_FASTQ_file(SEXP filexp,
 				lineinrecno = 1;
 		}
 		if (!EOL_in_buf && (lineinrecno == 1 || lineinrecno == 3)) {
-			snprintf(errmsg_buf, sizeof(errmsg_buf),
+			snprintf(errbuf, ERRMSG_BUF_SIZE,
 				 "cannot read line %d, "
 				 "line is too long", lineno);
-			return errmsg_buf;
+			return errbuf;
 		}
 		buf[data.length] = '\0';
 		errmsg = NULL;
@@ -370,16 +632,20 @@ static const char *parse_FASTQ_file(SEXP filexp,
 				   we advance in the file. This is not a
 				   problem when reading the entire file but
 				   becomes one when reading a compressed file
-				   by chunk. */
-				filexp_seek(filexp, prev_offset, SEEK_SET);
+				   by chunk. A BGZFreader doesn't need to be
+				   moved back: its position is saved by the
+				   caller. */
+				if (bgzf == NULL)
+					filexp_seek(filexp, prev_offset,
+						    SEEK_SET);
 				*offset = prev_offset;
 				return NULL;
 			}
 			if (!has_prefix(buf, FASTQ_line1_markup)) {
-				snprintf(errmsg_buf, sizeof(errmsg_buf),
+				snprintf(errbuf, ERRMSG_BUF_SIZE,
 				    "\"%s\" expected at beginning of line %d",
 				    FASTQ_line1_markup, lineno);
-				return errmsg_buf;
+				return errbuf;
 			}
 			dont_load = *recno < skip || loader == NULL;
 			if (dont_load || loader->new_seqid_hook == NULL)
@@ -398,10 +664,10 @@ static const char *parse_FASTQ_file(SEXP filexp,
 			break;
 		    case 3:
 			if (!has_prefix(buf, FASTQ_line3_markup)) {
-				snprintf(errmsg_buf, sizeof(errmsg_buf),
+				snprintf(errbuf, ERRMSG_BUF_SIZE,
 				    "\"%s\" expected at beginning of line %d",
 				    FASTQ_line3_markup, lineno);
-				return errmsg_buf;
+				return errbuf;
 			}
 			if (dont_load || loader->new_qualid_hook == NULL)
 				continue;
@@ -412,25 +678,55 @@ static const char *parse_FASTQ_file(SEXP filexp,
 		    case 4:
 			if (EOL_in_buf)
 				(*recno)++;
-			if (dont_load || loader->new_empty_qual_hook == NULL)
-				continue;
-			if (EOL_in_prev_buf)
-				loader->new_empty_qual_hook(loader);
-			if (loader->append_qual_hook != NULL)
-				errmsg = loader->append_qual_hook(loader,
-								  &data);
+			if (dont_load)
+				break;
+			if (loader->new_empty_qual_hook != NULL) {
+				if (EOL_in_prev_buf)
+					loader->new_empty_qual_hook(loader);
+				if (loader->append_qual_hook != NULL)
+					errmsg = loader->append_qual_hook(
+							loader, &data);
+			}
+			if (errmsg == NULL && EOL_in_buf
+			 && loader->end_record_hook != NULL)
+				errmsg = loader->end_record_hook(loader);
 			break;
 		}
 		if (errmsg != NULL) {
-			snprintf(errmsg_buf, sizeof(errmsg_buf),
+			snprintf(errbuf, ERRMSG_BUF_SIZE,
 				 "line %d: %s", lineno, errmsg);
-			return errmsg_buf;
+			return errbuf;
 		}
+		/* Stop right after the last record to load rather than at the
+		   beginning of the next record. This way we don't need to
+		   move back with filexp_seek(), and the file is left at the
+		   right place for reading the next chunk of records. */
+		if (lineinrecno == 4 && EOL_in_buf
+		 && nrec >= 0 && *recno >= skip + nrec)
+			return NULL;
 	}
 	if (seek_first_rec) {
-		snprintf(errmsg_buf, sizeof(errmsg_buf),
+		snprintf(errbuf, ERRMSG_BUF_SIZE,
 			 "no FASTQ record found");
-		return errmsg_buf;
+		return errbuf;
+	}
+	/* A last record whose quality line is not terminated by an EOL was
+	   neither counted nor filtered in the loop. Neither was a last record
+	   with no quality line (truncated file), which gets an empty quality
+	   sequence before being filtered. */
+	if (lineinrecno == 4 && !EOL_in_prev_buf)
+		(*recno)++;
+	if ((lineinrecno == 2 || lineinrecno == 3 ||
+	     (lineinrecno == 4 && !EOL_in_prev_buf)) && !dont_load
+	 && loader->end_record_hook != NULL) {
+		if (lineinrecno != 4 && loader->new_empty_qual_hook != NULL)
+			loader->new_empty_qual_hook(loader);
+		errmsg = loader->end_record_hook(loader);
+		if (errmsg != NULL) {
+			snprintf(errbuf, ERRMSG_BUF_SIZE,
+				 "line %d: %s", lineno, errmsg);
+			return errbuf;
+		}
 	}
 	return NULL;
 }
@@ -447,6 +743,7 @@ static SEXP get_fastq_seqlengths(SEXP filexp_list,
 	FASTQloader loader;
 	int recno, i;
 	SEXP filexp;
+	BGZFreader *bgzf;
 	long long int offset0, offset;
 	const char *errmsg;
 
@@ -455,19 +752,32 @@ static SEXP get_fastq_seqlengths(SEXP filexp_list,
 	recno = 0;
 	for (i = 0; i < LENGTH(filexp_list); i++) {
 		filexp = VECTOR_ELT(filexp_list, i);
-		/* Calls to filexp_tell() are costly on compressed files
-		   and the cost increases as we advance in the file.
-		   This is not a problem when reading the entire file but
-		   becomes one when reading a compressed file by chunk. */
-		offset0 = offset = filexp_tell(filexp);
-		errmsg = parse_FASTQ_file(filexp, nrec, skip, seek_first_rec,
-					  &loader,
-					  &recno, &offset);
-		/* Calls to filexp_seek() are costly on compressed files
-		   and the cost increases as we advance in the file.
-		   This is not a problem when reading the entire file but
-		   becomes one when reading a compressed file by chunk. */
-		filexp_seek(filexp, offset0, SEEK_SET);
+		bgzf = _open_BGZFreader(filexp, 1);
+		if (bgzf != NULL) {
+			offset0 = offset = _BGZFreader_tell(bgzf);
+			errmsg = parse_FASTQ_file(filexp, bgzf,
+						  nrec, skip, seek_first_rec,
+						  &loader,
+						  &recno, &offset, errmsg_buf);
+			_close_BGZFreader(filexp, bgzf, offset0);
+		} else {
+			/* Calls to filexp_tell() are costly on compressed
+			   files and the cost increases as we advance in the
+			   file. This is not a problem when reading the entire
+			   file but becomes one when reading a compressed file
+			   by chunk. */
+			offset0 = offset = filexp_tell(filexp);
+			errmsg = parse_FASTQ_file(filexp, NULL,
+						  nrec, skip, seek_first_rec,
+						  &loader,
+						  &recno, &offset, errmsg_buf);
+			/* Calls to filexp_seek() are costly on compressed
+			   files and the cost increases as we advance in the
+			   file. This is not a problem when reading the entire
+			   file but becomes one when reading a compressed file
+			   by chunk. */
+			filexp_seek(filexp, offset0, SEEK_SET);
+		}
 		if (errmsg != NULL)
 			error("reading FASTQ file %s: %s",
 			      CHAR(STRING_ELT(GET_NAMES(filexp_list), i)),
@@ -494,88 +804,787 @@ SEXP fastq_seqlengths(SEXP filexp_list,
 	return get_fastq_seqlengths(filexp_list, nrec0, skip0, seek_rec0);
 }
 
+/*
+ * Parses the files of 'filexp_list' in parallel, 1 file per worker thread,
+ * with 'loaders[i]' loading the records of the i-th file. 'nrec' and 'skip'
+ * are not supported. On return, 'errmsgs[i]' points to the error message for
+ * the i-th file (or is NULL).
+ */
+static void parse_FASTQ_files_in_parallel(SEXP filexp_list,
+		int seek_first_rec, FASTQloader *loaders, int nthreads,
+		const char **errmsgs)
+{
+	int nfile, i;
+	SEXP *filexps;
+	BGZFreader **bgzfs;
+	long long int *offsets;
+	char *errbufs;
+
+	nfile = LENGTH(filexp_list);
+	filexps = (SEXP *) R_alloc(nfile, sizeof(SEXP));
+	bgzfs = (BGZFreader **) R_alloc(nfile, sizeof(BGZFreader *));
+	offsets = (long long int *) R_alloc(nfile, sizeof(long long int));
+	errbufs = R_alloc(nfile, ERRMSG_BUF_SIZE);
+	for (i = 0; i < nfile; i++) {
+		filexps[i] = VECTOR_ELT(filexp_list, i);
+		/* The files are already parsed in parallel so each BGZF
+		   file is inflated by a single thread. */
+		bgzfs[i] = _open_BGZFreader(filexps[i], 1);
+		offsets[i] = bgzfs[i] != NULL ? _BGZFreader_tell(bgzfs[i]) :
+						filexp_tell(filexps[i]);
+	}
+	_resolve_parser_stubs(filexps[0]);
+	#pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+	for (i = 0; i < nfile; i++) {
+		int recno = 0;
+
+		errmsgs[i] = parse_FASTQ_file(filexps[i], bgzfs[i],
+					      -1, 0, seek_first_rec,
+					      loaders + i,
+					      &recno, offsets + i,
+					      errbufs + i * ERRMSG_BUF_SIZE);
+	}
+	for (i = 0; i < nfile; i++) {
+		if (bgzfs[i] != NULL)
+			_close_BGZFreader(filexps[i], bgzfs[i], offsets[i]);
+	}
+	return;
+}
+
+/* The arenas are freed by the cleanup function of the caller (see
+   run_FASTQloading() below) if an error is raised. */
+static void check_loaded_FASTQ_file(SEXP filexp_list, int i,
+		const char *errmsg, int load_quals, FASTQloaderExt *loader_exts)
+{
+	FASTQloaderExt *loader_ext;
+
+	loader_ext = loader_exts + i;
+	if (errmsg == NULL && load_quals) {
+		/* A record with no quality line (truncated file) gets an
+		   empty quality sequence, like with the former 2-pass
+		   algo. */
+		while (loader_ext->qual_arena.errmsg == NULL &&
+		       _get_XStringSetArena_length(&(loader_ext->qual_arena)) <
+		       _get_XStringSetArena_length(&(loader_ext->seq_arena)))
+			_XStringSetArena_add_elt(&(loader_ext->qual_arena));
+	}
+	if (errmsg == NULL)
+		errmsg = get_FASTQloaderExt_errmsg(loader_ext);
+	if (errmsg != NULL)
+		error("reading FASTQ file %s: %s",
+		      CHAR(STRING_ELT(GET_NAMES(filexp_list), i)),
+		      errmsg);
+	return;
+}
+
+/*
+ * Copies the data loaded by the FASTQ loaders to the XStringSet object(s)
+ * returned by read_fastq_files() (see below). The arenas are not freed.
+ */
+static SEXP new_XStringSets_from_FASTQloaderExts(FASTQloaderExt *loader_exts,
+		int nfile, int load_seqids, int load_quals, SEXP elementType)
+{
+	XStringSetArena *seqid_arenas, *seq_arenas, *qual_arenas;
+	SEXP seqlengths, sequences, seqids, qualities, ans;
+	int i;
+
+	seqid_arenas = (XStringSetArena *)
+		R_alloc(nfile, sizeof(XStringSetArena));
+	seq_arenas = (XStringSetArena *)
+		R_alloc(nfile, sizeof(XStringSetArena));
+	qual_arenas = (XStringSetArena *)
+		R_alloc(nfile, sizeof(XStringSetArena));
+	for (i = 0; i < nfile; i++) {
+		seqid_arenas[i] = loader_exts[i].seqid_arena;
+		seq_arenas[i] = loader_exts[i].seq_arena;
+		qual_arenas[i] = loader_exts[i].qual_arena;
+	}
+	if (load_seqids) {
+		PROTECT(seqids = _new_CHARACTER_from_XStringSetArenas(
+						seqid_arenas, nfile));
+	} else {
+		PROTECT(seqids = R_NilValue);
+	}
+	PROTECT(seqlengths = _get_XStringSetArenas_width(seq_arenas, nfile));
+	PROTECT(sequences = _new_XStringSet_from_XStringSetArenas(
+					CHAR(STRING_ELT(elementType, 0)),
+					seq_arenas, nfile,
+					seqlengths, seqids));
+	if (!load_quals) {
+		UNPROTECT(3);
+		return sequences;
+	}
+	PROTECT(qualities = _new_XStringSet_from_XStringSetArenas("BString",
+					qual_arenas, nfile,
+					seqlengths, R_NilValue));
+	PROTECT(ans = NEW_LIST(2));
+	SET_ELEMENT(ans, 0, sequences);
+	SET_ELEMENT(ans, 1, qualities);
+	UNPROTECT(5);
+	return ans;
+}
+
+/*
+ * The arenas are not allocated by R so the FASTQ files are loaded (and the
+ * loaded data copied to the final XStringSet objects) thru R_UnwindProtect():
+ * the arenas are freed even if an error is raised (or the user interrupts
+ * the loading).
+ */
+typedef struct fastq_loading {
+	SEXP filexp_list;
+	SEXP filexp_list2;     /* the mates when reading pairs */
+	int nrec;
+	int skip;
+	int seek_first_rec;
+	int load_seqids;
+	int load_quals;
+	int nthreads;
+	SEXP elementType;
+	FASTQloaderExt *loader_exts;
+	FASTQloader *loaders;
+	int nloader;
+	const char *errmsg;    /* set when yielding a chunk of a FASTQ stream */
+} FASTQloading;
+
+static void free_FASTQloading_arenas(void *data, Rboolean jump)
+{
+	FASTQloading *loading;
+
+	loading = (FASTQloading *) data;
+	free_FASTQloaderExts(loading->loader_exts, loading->nloader);
+	return;
+}
+
+static SEXP run_FASTQloading(SEXP (*fun)(void *), FASTQloading *loading)
+{
+	SEXP cont, ans;
+
+	PROTECT(cont = R_MakeUnwindCont());
+	ans = R_UnwindProtect(fun, loading,
+			      free_FASTQloading_arenas, loading, cont);
+	UNPROTECT(1);
+	return ans;
+}
+
+/* Called thru run_FASTQloading() by read_fastq_files(). */
+static SEXP load_FASTQ_files(void *data)
+{
+	FASTQloading *loading;
+	int nfile, recno, i;
+	SEXP filexp;
+	BGZFreader *bgzf;
+	long long int offset;
+	const char **errmsgs;
+
+	loading = (FASTQloading *) data;
+	nfile = loading->nloader;
+	errmsgs = (const char **) R_alloc(nfile, sizeof(const char *));
+	if (loading->nthreads > 1 && nfile > 1 &&
+	    loading->nrec < 0 && loading->skip == 0) {
+		parse_FASTQ_files_in_parallel(loading->filexp_list,
+					      loading->seek_first_rec,
+					      loading->loaders,
+					      loading->nthreads, errmsgs);
+		for (i = 0; i < nfile; i++)
+			check_loaded_FASTQ_file(loading->filexp_list, i,
+						errmsgs[i],
+						loading->load_quals,
+						loading->loader_exts);
+	} else {
+		recno = 0;
+		for (i = 0; i < nfile; i++) {
+			filexp = VECTOR_ELT(loading->filexp_list, i);
+			bgzf = _open_BGZFreader(filexp, loading->nthreads);
+			/* Calls to filexp_tell() are costly on compressed
+			   files and the cost increases as we advance in the
+			   file. This is not a problem when reading the entire
+			   file but becomes one when reading a compressed file
+			   by chunk. */
+			offset = bgzf != NULL ? _BGZFreader_tell(bgzf) :
+						filexp_tell(filexp);
+			errmsgs[i] = parse_FASTQ_file(filexp, bgzf,
+						loading->nrec, loading->skip,
+						loading->seek_first_rec,
+						loading->loaders + i,
+						&recno, &offset, errmsg_buf);
+			if (bgzf != NULL)
+				_close_BGZFreader(filexp, bgzf, offset);
+			check_loaded_FASTQ_file(loading->filexp_list, i,
+						errmsgs[i],
+						loading->load_quals,
+						loading->loader_exts);
+		}
+	}
+	return new_XStringSets_from_FASTQloaderExts(loading->loader_exts,
+						    nfile,
+						    loading->load_seqids,
+						    loading->load_quals,
+						    loading->elementType);
+}
+
 /* --- .Call ENTRY POINT ---
  * Return an XStringSet object if 'with_qualities' is FALSE, or a list of 2
  * parallel XStringSet objects of the same shape if 'with_qualities' is TRUE.
- * We use a 2-pass algo so we can pre-alloc the exact amount of memory for the
- * XStringSet object that we load with the string data during the 2nd pass.
- * Because a XStringSet object cannot be grown in-place, a 1-pass algo would
- * need to load the string data in a growing object first (e.g. CharAEAE)
- * then turn it into an XStringSet object (this would require a copy of the
- * entire string data).
+ * We use a 1-pass algo: the string data is loaded in XStringSetArena's (see
+ * XStringSet_class.c) and then copied to the XStringSet objects once we know
+ * the lengths of all the reads. This avoids parsing (and decompressing) the
+ * files twice, at the cost of holding the data twice in memory during the
+ * final copy.
+ * Each file is loaded in its own arenas so, when all the records are read
+ * ('nrec' < 0 and 'skip' == 0), the files can be parsed in parallel.
+ * 'filter' must be NULL or a numeric vector of length 7 (see
+ * get_FASTQfilter()). 'nrec' and 'skip' count the records in the files,
+ * before filtering.
  */
 SEXP read_fastq_files(SEXP filexp_list, SEXP nrec, SEXP skip,
 		SEXP seek_first_rec,
 		SEXP use_names, SEXP elementType, SEXP lkup,
-		SEXP with_qualities)
+		SEXP with_qualities, SEXP nthreads, SEXP filter)
 {
-	int nrec0, skip0, seek_rec0, load_seqids, load_quals, recno, i;
-	SEXP filexp, seqlengths, sequences, seqids, qualities, ans;
-	FASTQloaderExt loader_ext;
+	FASTQloading loading;
+	FASTQfilter filter_buf;
+	const FASTQfilter *filter0;
+	int nfile, i;
+
+	nfile = LENGTH(filexp_list);
+	loading.filexp_list = filexp_list;
+	loading.filexp_list2 = R_NilValue;
+	loading.nrec = INTEGER(nrec)[0];
+	loading.skip = INTEGER(skip)[0];
+	loading.seek_first_rec = LOGICAL(seek_first_rec)[0];
+	loading.load_seqids = LOGICAL(use_names)[0];
+	loading.load_quals = LOGICAL(with_qualities)[0];
+	loading.nthreads = _get_nthreads(nthreads);
+	loading.elementType = elementType;
+	loading.loader_exts = (FASTQloaderExt *)
+		R_alloc(nfile, sizeof(FASTQloaderExt));
+	loading.loaders = (FASTQloader *) R_alloc(nfile, sizeof(FASTQloader));
+	loading.nloader = nfile;
+	loading.errmsg = NULL;
+	filter0 = get_FASTQfilter(filter, lkup, &filter_buf);
+	for (i = 0; i < nfile; i++) {
+		loading.loader_exts[i] = new_FASTQloaderExt();
+		loading.loaders[i] = new_FASTQloader(loading.load_seqids,
+						     loading.load_quals, lkup,
+						     filter0,
+						     loading.loader_exts + i);
+	}
+	return run_FASTQloading(load_FASTQ_files, &loading);
+}
+
+
+/****************************************************************************
+ * Streaming FASTQ reader.
+ *
+ * A FASTQstream reads a FASTQ file by chunks of 'chunksize' records and
+ * keeps its position in the file between chunks. If prefetching is enabled,
+ * the next chunk is parsed (and inflated if the file is compressed) in the
+ * arenas of the stream by a background thread while R processes the current
+ * chunk. Like with parse_FASTQ_files_in_parallel(), the background thread
+ * doesn't use the R API: the stub of filexp_gets() is resolved before the
+ * thread is started.
+ * The list of "File External Pointers" and the lookup table used by the
+ * thread are preserved until the stream is closed, so they cannot be
+ * garbage collected (and the file cannot be closed by the finalizer of its
+ * "File External Pointer") while the thread is running.
+ */
+
+typedef struct fastq_stream {
+	SEXP prot;             /* list(filexp_list, lkup, elementType) */
+	SEXP filexp;
+	BGZFreader *bgzf;
+	int chunksize;
+	int load_seqids;
+	int load_quals;
+	int prefetch;
+	FASTQfilter filter;
+	FASTQloaderExt loader_ext;  /* the next chunk */
 	FASTQloader loader;
+	int has_chunk;         /* 'loader_ext' holds a parsed chunk */
+	int at_eof;            /* no more chunk to parse */
 	long long int offset;
+	char errmsg[ERRMSG_BUF_SIZE];
+	int thread_is_running;
+	pthread_t thread;
+} FASTQstream;
+
+/* When the records are filtered, we keep parsing until we get 'chunksize'
+   records that pass the filter (or reach the end of the file). */
+static void load_FASTQ_chunk(FASTQstream *stream)
+{
+	int nkept, nrec, recno;
 	const char *errmsg;
 
-	nrec0 = INTEGER(nrec)[0];
-	skip0 = INTEGER(skip)[0];
-	seek_rec0 = LOGICAL(seek_first_rec)[0];
-	load_seqids = LOGICAL(use_names)[0];
-	load_quals = LOGICAL(with_qualities)[0];
-	/* 1st pass */
-	PROTECT(seqlengths = get_fastq_seqlengths(filexp_list,
-						  nrec0, skip0, seek_rec0));
-	/* Allocation */
-	PROTECT(sequences = _alloc_XStringSet(CHAR(STRING_ELT(elementType, 0)),
-					      seqlengths));
-	if (load_quals) {
-		PROTECT(qualities = _alloc_XStringSet("BString", seqlengths));
+	stream->loader_ext = new_FASTQloaderExt();
+	stream->errmsg[0] = '\0';
+	nkept = 0;
+	while (nkept < stream->chunksize) {
+		nrec = stream->chunksize - nkept;
+		recno = 0;
+		errmsg = parse_FASTQ_file(stream->filexp, stream->bgzf,
+					  nrec, 0, 0,
+					  &(stream->loader),
+					  &recno, &(stream->offset),
+					  stream->errmsg);
+		if (errmsg != NULL) {
+			stream->at_eof = 1;
+			break;
+		}
+		if (recno < nrec) {
+			stream->at_eof = 1;
+			break;
+		}
+		nkept = _get_XStringSetArena_length(
+				&(stream->loader_ext.seq_arena));
+	}
+	stream->has_chunk = 1;
+	return;
+}
+
+static void *FASTQ_prefetch_thread(void *stream)
+{
+	load_FASTQ_chunk((FASTQstream *) stream);
+	return NULL;
+}
+
+/* Falls back to parsing the next chunk in wait_for_FASTQ_chunk() if the
+   thread cannot be created. */
+static void prefetch_FASTQ_chunk(FASTQstream *stream)
+{
+	if (!stream->prefetch || stream->at_eof)
+		return;
+	if (pthread_create(&(stream->thread), NULL,
+			   FASTQ_prefetch_thread, stream) == 0)
+		stream->thread_is_running = 1;
+	return;
+}
+
+static void wait_for_FASTQ_chunk(FASTQstream *stream)
+{
+	if (stream->thread_is_running) {
+		pthread_join(stream->thread, NULL);
+		stream->thread_is_running = 0;
+	}
+	if (!stream->has_chunk && !stream->at_eof)
+		load_FASTQ_chunk(stream);
+	return;
+}
+
+static void close_FASTQstream(FASTQstream *stream)
+{
+	if (stream->thread_is_running)
+		pthread_join(stream->thread, NULL);
+	if (stream->has_chunk)
+		free_FASTQloaderExts(&(stream->loader_ext), 1);
+	if (stream->bgzf != NULL)
+		_close_BGZFreader(stream->filexp, stream->bgzf,
+				  stream->offset);
+	R_ReleaseObject(stream->prot);
+	free(stream);
+	return;
+}
+
+static void FASTQstream_finalizer(SEXP stream_xp)
+{
+	FASTQstream *stream;
+
+	stream = (FASTQstream *) R_ExternalPtrAddr(stream_xp);
+	if (stream == NULL)
+		return;
+	R_ClearExternalPtr(stream_xp);
+	close_FASTQstream(stream);
+	return;
+}
+
+static FASTQstream *get_FASTQstream(SEXP stream_xp)
+{
+	FASTQstream *stream;
+
+	stream = (FASTQstream *) R_ExternalPtrAddr(stream_xp);
+	if (stream == NULL)
+		error("the FASTQ stream is closed");
+	return stream;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Args:
+ *   filexp_list:    A list containing a single "File External Pointer".
+ *   chunksize:      A single positive integer.
+ *   use_names, elementType, lkup, with_qualities:
+ *                   See read_fastq_files().
+ *   prefetch:       A single logical.
+ *   nthreads:       Nb of threads used to inflate a BGZF file.
+ *   filter:         See read_fastq_files().
+ * The file must not be accessed thru 'filexp_list' until the stream is
+ * closed.
+ */
+SEXP fastq_stream_open(SEXP filexp_list, SEXP chunksize,
+		SEXP use_names, SEXP elementType, SEXP lkup,
+		SEXP with_qualities, SEXP prefetch, SEXP nthreads,
+		SEXP filter)
+{
+	SEXP prot, stream_xp, filexp;
+	FASTQstream *stream;
+	BGZFreader *bgzf;
+
+	PROTECT(prot = NEW_LIST(3));
+	SET_ELEMENT(prot, 0, filexp_list);
+	SET_ELEMENT(prot, 1, lkup);
+	SET_ELEMENT(prot, 2, elementType);
+	PROTECT(stream_xp = R_MakeExternalPtr(NULL, R_NilValue, prot));
+	filexp = VECTOR_ELT(filexp_list, 0);
+	bgzf = _open_BGZFreader(filexp, _get_nthreads(nthreads));
+	_resolve_parser_stubs(filexp);
+	stream = (FASTQstream *) malloc(sizeof(FASTQstream));
+	if (stream == NULL) {
+		if (bgzf != NULL)
+			_close_BGZFreader(filexp, bgzf,
+					  _BGZFreader_tell(bgzf));
+		error("cannot allocate memory for the FASTQ stream");
+	}
+	stream->prot = prot;
+	stream->filexp = filexp;
+	stream->bgzf = bgzf;
+	stream->chunksize = INTEGER(chunksize)[0];
+	stream->load_seqids = LOGICAL(use_names)[0];
+	stream->load_quals = LOGICAL(with_qualities)[0];
+	stream->prefetch = LOGICAL(prefetch)[0];
+	stream->loader = new_FASTQloader(stream->load_seqids,
+					 stream->load_quals, lkup,
+					 get_FASTQfilter(filter, lkup,
+							 &(stream->filter)),
+					 &(stream->loader_ext));
+	stream->has_chunk = stream->at_eof = 0;
+	stream->errmsg[0] = '\0';
+	stream->thread_is_running = 0;
+	stream->offset = bgzf != NULL ? _BGZFreader_tell(bgzf) : 0;
+	R_PreserveObject(prot);
+	R_SetExternalPtrAddr(stream_xp, stream);
+	R_RegisterCFinalizerEx(stream_xp, FASTQstream_finalizer, TRUE);
+	prefetch_FASTQ_chunk(stream);
+	UNPROTECT(2);
+	return stream_xp;
+}
+
+static SEXP yield_FASTQ_chunk(void *data)
+{
+	FASTQloading *loading;
+
+	loading = (FASTQloading *) data;
+	check_loaded_FASTQ_file(loading->filexp_list, 0, loading->errmsg,
+				loading->load_quals, loading->loader_exts);
+	return new_XStringSets_from_FASTQloaderExts(loading->loader_exts, 1,
+						    loading->load_seqids,
+						    loading->load_quals,
+						    loading->elementType);
+}
+
+/* --- .Call ENTRY POINT ---
+ * Returns the next chunk of records in the same form as read_fastq_files(),
+ * with 0 records once the end of the file is reached. The parsing of the
+ * following chunk is started before the current chunk is copied to its
+ * XStringSet object(s).
+ */
+SEXP fastq_stream_yield(SEXP stream_xp)
+{
+	FASTQstream *stream;
+	FASTQloaderExt loader_ext;
+	char errmsg[ERRMSG_BUF_SIZE];
+	FASTQloading loading;
+
+	stream = get_FASTQstream(stream_xp);
+	wait_for_FASTQ_chunk(stream);
+	if (stream->has_chunk) {
+		loader_ext = stream->loader_ext;
+		strcpy(errmsg, stream->errmsg);
+		stream->has_chunk = 0;
 	} else {
-		qualities = R_NilValue;
+		loader_ext = new_FASTQloaderExt();
+		errmsg[0] = '\0';
 	}
-	/* 2nd pass */
-	loader_ext = new_FASTQloaderExt(sequences, qualities);
-	loader = new_FASTQloader(load_seqids, load_quals, lkup, &loader_ext);
-	recno = 0;
-	for (i = 0; i < LENGTH(filexp_list); i++) {
-		filexp = VECTOR_ELT(filexp_list, i);
-		/* Calls to filexp_tell() are costly on compressed files
-		   and the cost increases as we advance in the file.
-		   This is not a problem when reading the entire file but
-		   becomes one when reading a compressed file by chunk. */
-		offset = filexp_tell(filexp);
-		errmsg = parse_FASTQ_file(filexp, nrec0, skip0, seek_rec0,
-					  &loader,
-					  &recno, &offset);
-		if (errmsg != NULL) {
-			UNPROTECT(load_quals ? 3 : 2);
-			error("reading FASTQ file %s: %s",
-			      CHAR(STRING_ELT(GET_NAMES(filexp_list), i)),
-			      errmsg_buf);
+	prefetch_FASTQ_chunk(stream);
+	loading.filexp_list = VECTOR_ELT(stream->prot, 0);
+	loading.filexp_list2 = R_NilValue;
+	loading.load_seqids = stream->load_seqids;
+	loading.load_quals = stream->load_quals;
+	loading.elementType = VECTOR_ELT(stream->prot, 2);
+	loading.loader_exts = &loader_ext;
+	loading.loaders = NULL;
+	loading.nloader = 1;
+	loading.errmsg = errmsg[0] != '\0' ? errmsg : NULL;
+	return run_FASTQloading(yield_FASTQ_chunk, &loading);
+}
+
+/* --- .Call ENTRY POINT ---
+ * Returns FALSE if the stream was already closed.
+ */
+SEXP fastq_stream_close(SEXP stream_xp)
+{
+	FASTQstream *stream;
+
+	stream = (FASTQstream *) R_ExternalPtrAddr(stream_xp);
+	if (stream == NULL)
+		return ScalarLogical(0);
+	R_ClearExternalPtr(stream_xp);
+	close_FASTQstream(stream);
+	return ScalarLogical(1);
+}
+
+
+/****************************************************************************
+ * Paired-end FASTQ files.
+ *
+ * The 2 files of a pair are parsed in lockstep, 1 record at a time, with 1
+ * FASTQ loader per file. The loaders don't filter the records: each pair is
+ * filtered once both records are loaded, and is dropped if one of its 2
+ * records doesn't pass the filter.
+ */
+
+/* Returns the length of the part of a read id that must be the same for the
+   2 records of a pair i.e. the id up to the first white space, without its
+   /1 or /2 suffix. */
+static int get_pair_id_length(const char *id, int id_width)
+{
+	int n;
+
+	for (n = 0; n < id_width && !isspace((unsigned char) id[n]); n++) {}
+	if (n >= 2 && id[n - 2] == '/' && (id[n - 1] == '1' || id[n - 1] == '2'))
+		n -= 2;
+	return n;
+}
+
+static const char *check_FASTQ_pair_ids(FASTQloader *loaders)
+{
+	FASTQloaderExt *loader_ext;
+	XStringSetArena *seqid_arena;
+	int id_width, id_length[2], j;
+	const char *errmsg;
+
+	for (j = 0; j < 2; j++) {
+		loader_ext = loaders[j].ext;
+		seqid_arena = &(loader_ext->seqid_arena);
+		id_width = seqid_arena->width[seqid_arena->nelt - 1];
+		errmsg = grow_FASTQ_rec_buf(loader_ext, id_width);
+		if (errmsg != NULL)
+			return errmsg;
+		_XStringSetArena_copy_last_elt(seqid_arena,
+					       loader_ext->rec_buf);
+		id_length[j] = get_pair_id_length(loader_ext->rec_buf,
+						  id_width);
+	}
+	if (id_length[0] == id_length[1] &&
+	    memcmp(((FASTQloaderExt *) loaders[0].ext)->rec_buf,
+		   ((FASTQloaderExt *) loaders[1].ext)->rec_buf,
+		   id_length[0]) == 0)
+		return NULL;
+	snprintf(errmsg_buf, sizeof(errmsg_buf),
+		 "read ids \"%.*s\" and \"%.*s\" don't match",
+		 id_length[0] < 60 ? id_length[0] : 60,
+		 ((FASTQloaderExt *) loaders[0].ext)->rec_buf,
+		 id_length[1] < 60 ? id_length[1] : 60,
+		 ((FASTQloaderExt *) loaders[1].ext)->rec_buf);
+	return errmsg_buf;
+}
+
+/* Called once the 2 records of a pair are loaded. */
+static const char *end_FASTQ_pair(FASTQloader *loaders, int load_seqids)
+{
+	FASTQloaderExt *loader_ext;
+	int keep, keep_j, width[2], j;
+	const char *errmsg;
+
+	for (j = 0; j < 2; j++) {
+		loader_ext = loaders[j].ext;
+		errmsg = get_FASTQloaderExt_errmsg(loader_ext);
+		if (errmsg != NULL)
+			return errmsg;
+		/* A record with no quality line (truncated file) gets an
+		   empty quality sequence. */
+		if (_get_XStringSetArena_length(&(loader_ext->qual_arena)) <
+		    _get_XStringSetArena_length(&(loader_ext->seq_arena)))
+			_XStringSetArena_add_elt(&(loader_ext->qual_arena));
+	}
+	errmsg = check_FASTQ_pair_ids(loaders);
+	if (errmsg != NULL)
+		return errmsg;
+	keep = 1;
+	for (j = 0; j < 2; j++) {
+		if (loaders[j].filter == NULL) {
+			width[j] = INT_MAX;
+			continue;
 		}
+		errmsg = check_last_FASTQ_record(loaders + j, &keep_j,
+						 width + j);
+		if (errmsg != NULL)
+			return errmsg;
+		keep = keep && keep_j;
 	}
-	if (load_seqids) {
-		PROTECT(seqids =
-			new_CHARACTER_from_CharAEAE(loader_ext.seqid_buf));
-		_set_XStringSet_names(sequences, seqids);
-		UNPROTECT(1);
+	for (j = 0; j < 2; j++) {
+		if (!keep) {
+			drop_last_FASTQ_record(loaders + j);
+			continue;
+		}
+		trim_last_FASTQ_record(loaders + j, width[j]);
+		if (!load_seqids)
+			_XStringSetArena_drop_last_elt(
+			    &(((FASTQloaderExt *) loaders[j].ext)->seqid_arena));
 	}
-	if (!load_quals) {
-		UNPROTECT(2);
-		return sequences;
+	return NULL;
+}
+
+/* In case of error, sets '*pairno' to the number of the faulty pair and
+   '*errfile' to the index (0 or 1) of the file where the error occured. */
+static const char *parse_FASTQ_pairs(SEXP *filexps, BGZFreader **bgzfs,
+		int nrec, int skip, FASTQloader *loaders, int load_seqids,
+		int *pairno, long long int *offsets, int *errfile)
+{
+	int nrec_in[2], n, recno, j;
+	const char *errmsg;
+	XStringSetArena *seq_arena;
+
+	while (nrec < 0 || *pairno < skip + nrec) {
+		for (j = 0; j < 2; j++) {
+			seq_arena = &(((FASTQloaderExt *)
+				       loaders[j].ext)->seq_arena);
+			n = _get_XStringSetArena_length(seq_arena);
+			recno = 0;
+			errmsg = parse_FASTQ_file(filexps[j], bgzfs[j],
+					1, 0, 0,
+					*pairno < skip ? NULL : loaders + j,
+					&recno, offsets + j, errmsg_buf);
+			if (errmsg != NULL) {
+				(*pairno)++;
+				*errfile = j;
+				return errmsg;
+			}
+			nrec_in[j] = *pairno < skip ?
+				recno :
+				_get_XStringSetArena_length(seq_arena) - n;
+		}
+		if (nrec_in[0] != nrec_in[1]) {
+			(*pairno)++;
+			*errfile = nrec_in[0] < nrec_in[1] ? 0 : 1;
+			return "file has less records than its mate file";
+		}
+		if (nrec_in[0] == 0)
+			return NULL;  /* end of the 2 files */
+		(*pairno)++;
+		if (*pairno <= skip)
+			continue;
+		errmsg = end_FASTQ_pair(loaders, load_seqids);
+		if (errmsg != NULL) {
+			*errfile = 0;
+			return errmsg;
+		}
+	}
+	return NULL;
+}
+
+/* Called thru run_FASTQloading() by read_fastq_pairs(). */
+static SEXP load_FASTQ_pairs(void *data)
+{
+	FASTQloading *loading;
+	int nfile, pairno, errfile, i, j;
+	SEXP filexps[2], ans, ans_elt;
+	BGZFreader *bgzfs[2];
+	long long int offsets[2];
+	const char *errmsg;
+
+	loading = (FASTQloading *) data;
+	nfile = LENGTH(loading->filexp_list);
+	pairno = 0;
+	errmsg = NULL;
+	for (i = 0; i < nfile && errmsg == NULL; i++) {
+		filexps[0] = VECTOR_ELT(loading->filexp_list, i);
+		filexps[1] = VECTOR_ELT(loading->filexp_list2, i);
+		for (j = 0; j < 2; j++) {
+			bgzfs[j] = _open_BGZFreader(filexps[j],
+						    loading->nthreads);
+			offsets[j] = bgzfs[j] != NULL ?
+				     _BGZFreader_tell(bgzfs[j]) :
+				     filexp_tell(filexps[j]);
+		}
+		errmsg = parse_FASTQ_pairs(filexps, bgzfs,
+					   loading->nrec, loading->skip,
+					   loading->loaders, loading->load_seqids,
+					   &pairno, offsets, &errfile);
+		for (j = 0; j < 2; j++) {
+			if (bgzfs[j] != NULL)
+				_close_BGZFreader(filexps[j], bgzfs[j],
+						  offsets[j]);
+		}
 	}
+	if (errmsg != NULL)
+		error("reading FASTQ file %s (pair %d): %s",
+		      CHAR(STRING_ELT(GET_NAMES(errfile == 0 ?
+						loading->filexp_list :
+						loading->filexp_list2), i - 1)),
+		      pairno, errmsg);
 	PROTECT(ans = NEW_LIST(2));
-	SET_ELEMENT(ans, 0, sequences);
-	SET_ELEMENT(ans, 1, qualities);
-	UNPROTECT(4);
+	for (j = 0; j < 2; j++) {
+		ans_elt = new_XStringSets_from_FASTQloaderExts(
+				loading->loader_exts + j, 1,
+				loading->load_seqids, 1,
+				loading->elementType);
+		SET_ELEMENT(ans, j, ans_elt);
+	}
+	UNPROTECT(1);
 	return ans;
 }
 
+/* --- .Call ENTRY POINT ---
+ * Args:
+ *   filexp_list1, filexp_list2: 2 lists of "File External Pointers" of the
+ *                   same length. The i-th file of 'filexp_list1' contains
+ *                   the mates of the i-th file of 'filexp_list2'.
+ *   nrec, skip:     The maximum number of pairs to read, and the number of
+ *                   pairs to skip. Both count the pairs before filtering.
+ *   filter:         See read_fastq_files().
+ * Return a list of 2 lists of 2 parallel XStringSet objects (the reads and
+ * their qualities). The read ids of a pair must match, ignoring what follows
+ * the first white space and the /1 and /2 suffixes.
+ */
+SEXP read_fastq_pairs(SEXP filexp_list1, SEXP filexp_list2,
+		SEXP nrec, SEXP skip, SEXP use_names,
+		SEXP elementType, SEXP lkup, SEXP nthreads, SEXP filter)
+{
+	FASTQloading loading;
+	FASTQloaderExt loader_exts[2];
+	FASTQloader loaders[2];
+	FASTQfilter filter_buf;
+	const FASTQfilter *filter0;
+	int j;
+
+	loading.filexp_list = filexp_list1;
+	loading.filexp_list2 = filexp_list2;
+	loading.nrec = INTEGER(nrec)[0];
+	loading.skip = INTEGER(skip)[0];
+	loading.load_seqids = LOGICAL(use_names)[0];
+	loading.load_quals = 1;
+	loading.nthreads = _get_nthreads(nthreads);
+	loading.elementType = elementType;
+	loading.loader_exts = loader_exts;
+	loading.loaders = loaders;
+	loading.nloader = 2;
+	loading.errmsg = NULL;
+	filter0 = get_FASTQfilter(filter, lkup, &filter_buf);
+	for (j = 0; j < 2; j++) {
+		loader_exts[j] = new_FASTQloaderExt();
+		/* The read ids are always loaded so they can be compared. */
+		loaders[j] = new_FASTQloader(1, 1, lkup, filter0,
+					     loader_exts + j);
+		loaders[j].end_record_hook = NULL;
+	}
+	return run_FASTQloading(load_FASTQ_pairs, &loading);
+}
+
 
 /****************************************************************************
  * Writing FASTQ files.
  */
 
-static const char *get_FASTQ_rec_id(SEXP x_names, SEXP q_names, int i)
+/* Returns the CHARSXP containing the id of the i-th record. */
+static SEXP get_FASTQ_rec_id(SEXP x_names, SEXP q_names, int i)
 {
 	SEXP seqid, qualid;
 
@@ -603,56 +1612,46 @@ static const char *get_FASTQ_rec_id(SEXP x_names, SEXP q_names, int i)
 	}
 	if (seqid == NA_STRING)
 		error("either 'x' or 'qualities' must have names");
-	return CHAR(seqid);
+	return seqid;
 }
 
-static void write_FASTQ_id(SEXP filexp, const char *markup, const char *id)
+static void write_FASTQ_id(BGZFwriter *writer, const char *markup, SEXP id)
 {
-	filexp_puts(filexp, markup);
-	filexp_puts(filexp, id);
-	filexp_puts(filexp, "\n");
+	_BGZFwriter_puts(writer, markup);
+	_BGZFwriter_write(writer, CHAR(id), LENGTH(id));
+	_BGZFwriter_putc(writer, '\n');
 }
 
-static void write_FASTQ_seq(SEXP filexp, const char *buf)
+static void write_FASTQ_fakequal(BGZFwriter *writer, int seqlen)
 {
-	filexp_puts(filexp, buf);
-	filexp_puts(filexp, "\n");
-}
+	char buf[256];
+	int n;
 
-static void write_FASTQ_qual(SEXP filexp, int seqlen,
-		const XStringSet_holder *Q, int i)
-{
-	Chars_holder Q_elt;
-	int j;
-
-	Q_elt = _get_elt_from_XStringSet_holder(Q, i);
-	if (Q_elt.length != seqlen)
-		error("'x' and 'quality' must have the same width");
-	for (j = 0; j < seqlen; j++)
-		filexp_putc(filexp, (int) *(Q_elt.ptr++));
-	filexp_puts(filexp, "\n");
+	memset(buf, ';', sizeof(buf));
+	for ( ; seqlen > 0; seqlen -= n) {
+		n = seqlen < (int) sizeof(buf) ? seqlen : (int) sizeof(buf);
+		_BGZFwriter_write(writer, buf, n);
+	}
+	_BGZFwriter_putc(writer, '\n');
 }
 
-static void write_FASTQ_fakequal(SEXP filexp, int seqlen)
-{
-	int j;
-
-	for (j = 0; j < seqlen; j++)
-		filexp_putc(filexp, (int) ';');
-	filexp_puts(filexp, "\n");
-}
+/*
+ * Like write_XStringSet_to_fasta(), the records are formatted into the
+ * batches of a BGZFwriter. The ids and the widths of the quality strings
+ * are checked before the file is opened.
+ */
 
 /* --- .Call ENTRY POINT --- */
-SEXP write_XStringSet_to_fastq(SEXP x, SEXP filexp_list,
+SEXP write_XStringSet_to_fastq(SEXP x, SEXP filepath, SEXP append,
+		SEXP compression_level, SEXP nthreads,
 		SEXP qualities, SEXP lkup)
 {
 	XStringSet_holder X, Q;
 	int x_length, lkup_len, i;
 	const int *lkup0;
-	SEXP filexp, x_names, q_names;
-	const char *id;
-	Chars_holder X_elt;
-	char buf[IOBUF_SIZE];
+	SEXP x_names, q_names, id;
+	Chars_holder X_elt, Q_elt;
+	BGZFwriter *writer;
 
 	X = _hold_XStringSet(x);
 	x_length = _get_length_from_XStringSet_holder(&X);
@@ -664,7 +1663,6 @@ SEXP write_XStringSet_to_fastq(SEXP x, SEXP filexp_list,
 	} else {
 		q_names = R_NilValue;
 	}
-	filexp = VECTOR_ELT(filexp_list, 0);
 	if (lkup == R_NilValue) {
 		lkup0 = NULL;
 		lkup_len = 0;
@@ -673,23 +1671,32 @@ SEXP write_XStringSet_to_fastq(SEXP x, SEXP filexp_list,
 		lkup_len = LENGTH(lkup);
 	}
 	x_names = get_XVectorList_names(x);
+	for (i = 0; i < x_length; i++) {
+		get_FASTQ_rec_id(x_names, q_names, i);
+		if (qualities != R_NilValue
+		 && _get_elt_from_XStringSet_holder(&Q, i).length !=
+		    _get_elt_from_XStringSet_holder(&X, i).length)
+			error("'x' and 'quality' must have the same width");
+	}
+	writer = _open_output_BGZFwriter(filepath, append,
+					 compression_level, nthreads);
 	for (i = 0; i < x_length; i++) {
 		id = get_FASTQ_rec_id(x_names, q_names, i);
 		X_elt = _get_elt_from_XStringSet_holder(&X, i);
-		Ocopy_bytes_from_i1i2_with_lkup(0, X_elt.length - 1,
-			buf, X_elt.length,
-			X_elt.ptr, X_elt.length,
-			lkup0, lkup_len);
-		buf[X_elt.length] = 0;
-		write_FASTQ_id(filexp, FASTQ_line1_markup, id);
-		write_FASTQ_seq(filexp, buf);
-		write_FASTQ_id(filexp, FASTQ_line3_markup, id);
+		write_FASTQ_id(writer, FASTQ_line1_markup, id);
+		_BGZFwriter_write_with_lkup(writer, X_elt.ptr, X_elt.length,
+					    lkup0, lkup_len);
+		_BGZFwriter_putc(writer, '\n');
+		write_FASTQ_id(writer, FASTQ_line3_markup, id);
 		if (qualities != R_NilValue) {
-			write_FASTQ_qual(filexp, X_elt.length, &Q, i);
+			Q_elt = _get_elt_from_XStringSet_holder(&Q, i);
+			_BGZFwriter_write(writer, Q_elt.ptr, Q_elt.length);
+			_BGZFwriter_putc(writer, '\n');
 		} else {
-			write_FASTQ_fakequal(filexp, X_elt.length);
+			write_FASTQ_fakequal(writer, X_elt.length);
 		}
 	}
+	_close_output_BGZFwriter(writer, filepath, append);
 	return R_NilValue;
 }
 
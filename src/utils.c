@@ -1,5 +1,9 @@
 #include "Biostrings.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 
 void _init_ByteTrTable_with_lkup(ByteTrTable *byte_tr_table, SEXP lkup)
 {
@@ -174,3 +178,213 @@ int _get_twobit_signature_at(TwobitEncodingBuffer *teb, const Chars_holder *seq,
 	return twobit_sign;
 }
 
+
+
+/****************************************************************************
+ * Packing of whole sequences in 2-bit words.
+ *
+ * Letter k of a sequence is stored in bits 2 * r and 2 * r + 1 of word
+ * k / NLETTER_PER_TWOBIT_WORD, where r is k % NLETTER_PER_TWOBIT_WORD. The
+ * unused bits of the last word are set to 0 so 2 packed sequences of the same
+ * length can be compared word by word.
+ */
+
+#define NLETTER_PER_TWOBIT_WORD (NBIT_PER_BITWORD / 2)
+
+/* 01010101...01 i.e. the low bit of every 2-bit letter */
+#define TWOBIT_LOW_BITS (~((BitWord) 0) / 3)
+
+static int popcount_BitWord(BitWord x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_popcountl(x);
+#else
+	int n;
+
+	for (n = 0; x != 0; n++)
+		x &= x - 1;
+	return n;
+#endif
+}
+
+int _get_twobit_nword(int seq_length)
+{
+	return seq_length == 0 ? 0 :
+	       (seq_length - 1) / NLETTER_PER_TWOBIT_WORD + 1;
+}
+
+/*
+ * Returns 1 if all the letters of 'seq' are mapped by 'eightbit2twobit' (see
+ * _twobit_pack() below), and 0 otherwise.
+ */
+int _is_twobit_packable(const ByteTrTable *eightbit2twobit,
+		const Chars_holder *seq)
+{
+	int k;
+
+	for (k = 0; k < seq->length; k++)
+		if (eightbit2twobit->byte2code[(unsigned char) seq->ptr[k]]
+		    == NA_INTEGER)
+			return 0;
+	return 1;
+}
+
+/*
+ * 'eightbit2twobit' must map the 4 base codes to 0, 1, 2, 3 (e.g. the
+ * 'eightbit2twobit' member of a TwobitEncodingBuffer). Returns -1 if 'seq'
+ * contains a letter that is not mapped (the content of 'words' is then
+ * undefined), and 0 otherwise.
+ */
+int _twobit_pack(const ByteTrTable *eightbit2twobit, const Chars_holder *seq,
+		BitWord *words)
+{
+	int nword, k, twobit;
+	BitWord *word;
+
+	nword = _get_twobit_nword(seq->length);
+	memset(words, 0, sizeof(BitWord) * nword);
+	for (k = 0, word = words; k < seq->length; k++) {
+		twobit = eightbit2twobit->byte2code[(unsigned char) seq->ptr[k]];
+		if (twobit == NA_INTEGER)
+			return -1;
+		*word |= (BitWord) twobit << (2 * (k % NLETTER_PER_TWOBIT_WORD));
+		if ((k + 1) % NLETTER_PER_TWOBIT_WORD == 0)
+			word++;
+	}
+	return 0;
+}
+
+/*
+ * Hamming distance between 2 sequences of the same length packed with
+ * _twobit_pack(). When 'max_dist' is >= 0, the computation stops as soon as
+ * the distance is known to be > 'max_dist' and 'max_dist' + 1 is returned.
+ */
+int _twobit_hamming(const BitWord *x, const BitWord *y, int nword,
+		int max_dist)
+{
+	int dist, i;
+	BitWord diff;
+
+	dist = 0;
+	for (i = 0; i < nword; i++) {
+		diff = x[i] ^ y[i];
+		dist += popcount_BitWord((diff | (diff >> 1)) & TWOBIT_LOW_BITS);
+		if (max_dist >= 0 && dist > max_dist)
+			return max_dist + 1;
+	}
+	return dist;
+}
+
+
+/****************************************************************************
+ * Multithreading helpers.
+ *
+ * Biostrings is compiled with $(SHLIB_OPENMP_CFLAGS) (see src/Makevars).
+ * When the compiler doesn't support OpenMP, everything runs on 1 thread.
+ * Note that the R API is NOT thread-safe: code running on a worker thread
+ * must not call error(), R_alloc(), R_CheckUserInterrupt(), INTEGER(), etc.
+ */
+
+/* 'nthreads' must be a single positive integer (checked at the R level). */
+int _get_nthreads(SEXP nthreads)
+{
+	int nthreads0;
+
+	nthreads0 = INTEGER(nthreads)[0];
+	if (nthreads0 == NA_INTEGER || nthreads0 < 1)
+		error("'nthreads' must be a single positive integer");
+#ifdef _OPENMP
+	if (nthreads0 > omp_get_num_procs())
+		nthreads0 = omp_get_num_procs();
+	return nthreads0;
+#else
+	return 1;
+#endif
+}
+
+int _get_thread_num()
+{
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+
+/****************************************************************************
+ * Tiling of the strict upper triangle of an n x n matrix.
+ *
+ * The n * (n - 1) / 2 pairs (i, j) with 0 <= i < j < n are grouped into
+ * square tiles of 'tile_size' x 'tile_size' indices. Tile t covers rows
+ * [i1, i2) and columns [j1, j2), and only the pairs with i < j in it must be
+ * visited. Tiles are numbered row by row. All the off-diagonal tiles contain
+ * the same number of pairs, so scheduling them dynamically gives a balanced
+ * load, and each of them only touches 2 * tile_size sequences which is
+ * cache-friendly.
+ */
+
+static int get_ntile_per_side(int n, int tile_size)
+{
+	return n == 0 ? 0 : (n - 1) / tile_size + 1;
+}
+
+int _get_upper_triangle_ntile(int n, int tile_size)
+{
+	int nside;
+
+	nside = get_ntile_per_side(n, tile_size);
+	return nside * (nside + 1) / 2;
+}
+
+void _get_upper_triangle_tile(int n, int tile_size, int tile,
+		int *i1, int *i2, int *j1, int *j2)
+{
+	int nside, bi, bj;
+
+	nside = get_ntile_per_side(n, tile_size);
+	for (bi = 0; tile >= nside - bi; bi++)
+		tile -= nside - bi;
+	bj = bi + tile;
+	*i1 = bi * tile_size;
+	*i2 = *i1 + tile_size;
+	if (*i2 > n)
+		*i2 = n;
+	*j1 = bj * tile_size;
+	*j2 = *j1 + tile_size;
+	if (*j2 > n)
+		*j2 = n;
+	return;
+}
+
+/*
+ * 0-based offset of pair (i, j), i < j, in a "dist" vector of size 'n' (i.e.
+ * in the lower triangle of the distance matrix stored by column).
+ */
+R_xlen_t _get_dist_offset(int n, int i, int j)
+{
+	return (R_xlen_t) i * (2 * (R_xlen_t) n - i - 1) / 2 + (j - i - 1);
+}
+
+
+/****************************************************************************
+ * 64-bit offsets in files opened with fopen().
+ */
+
+int _seek_file(FILE *file, long long int offset)
+{
+#ifdef _WIN32
+	return _fseeki64(file, offset, SEEK_SET);
+#else
+	return fseeko(file, (off_t) offset, SEEK_SET);
+#endif
+}
+
+long long int _tell_file(FILE *file)
+{
+#ifdef _WIN32
+	return _ftelli64(file);
+#else
+	return (long long int) ftello(file);
+#endif
+}